@@ -855,6 +855,9 @@ static struct platform_device *ventana_devices[] __initdata = {
 	&pmu_device,
 	&tegra_udc_device,
 	&tegra_gart_device,
+#ifdef CONFIG_TEGRA_DMAENGINE
+	&tegra_apbdma_device,
+#endif
 	&tegra_aes_device,
 #ifdef CONFIG_KEYBOARD_GPIO
 	&ventana_keys_device,
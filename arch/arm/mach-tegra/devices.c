@@ -565,6 +565,12 @@ struct platform_device tegra_gart_device = {
 	.resource	= tegra_gart_resources
 };
 
+/* the channels themselves are set up by tegra_dma_init() */
+struct platform_device tegra_apbdma_device = {
+	.name		= "tegra-apbdma",
+	.id		= -1,
+};
+
 static struct resource pmu_resources[] = {
 	[0] = {
 		.start	= INT_CPU0_PMU_INTR,
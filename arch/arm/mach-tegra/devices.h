@@ -44,6 +44,7 @@ extern struct platform_device tegra_ehci3_device;
 extern struct platform_device tegra_i2s_device1;
 extern struct platform_device tegra_i2s_device2;
 extern struct platform_device tegra_gart_device;
+extern struct platform_device tegra_apbdma_device;
 extern struct platform_device pmu_device;
 extern struct platform_device tegra_wdt_device;
 extern struct platform_device tegra_pwfm0_device;
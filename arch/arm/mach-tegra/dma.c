@@ -478,6 +478,26 @@ void tegra_dma_free_channel(struct tegra_dma_channel *ch)
 }
 EXPORT_SYMBOL(tegra_dma_free_channel);
 
+/* changes the transfer mode of a channel which has nothing queued */
+int tegra_dma_set_mode(struct tegra_dma_channel *ch, int mode)
+{
+	unsigned long irq_flags;
+	int ret = 0;
+
+	if (ch->mode & TEGRA_DMA_SHARED)
+		return -EINVAL;
+
+	spin_lock_irqsave(&ch->lock, irq_flags);
+	if (!list_empty(&ch->list))
+		ret = -EBUSY;
+	else
+		ch->mode = mode;
+	spin_unlock_irqrestore(&ch->lock, irq_flags);
+
+	return ret;
+}
+EXPORT_SYMBOL(tegra_dma_set_mode);
+
 static void tegra_dma_update_hw_partial(struct tegra_dma_channel *ch,
 	struct tegra_dma_req *req)
 {
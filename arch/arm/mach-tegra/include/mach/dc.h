@@ -359,6 +359,7 @@ void tegra_dc_disable(struct tegra_dc *dc);
 u32 tegra_dc_get_syncpt_id(const struct tegra_dc *dc);
 u32 tegra_dc_incr_syncpt_max(struct tegra_dc *dc);
 void tegra_dc_incr_syncpt_min(struct tegra_dc *dc, u32 val);
+unsigned long tegra_dc_get_frame_period_us(const struct tegra_dc *dc);
 
 int tegra_dc_set_default_emc(struct tegra_dc *dc);
 int tegra_dc_set_dynamic_emc(struct tegra_dc_win *windows[], int n);
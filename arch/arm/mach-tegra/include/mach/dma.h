@@ -154,10 +154,27 @@ bool tegra_dma_is_stopped(struct tegra_dma_channel *ch);
 
 struct tegra_dma_channel *tegra_dma_allocate_channel(int mode);
 void tegra_dma_free_channel(struct tegra_dma_channel *ch);
+int tegra_dma_set_mode(struct tegra_dma_channel *ch, int mode);
 int tegra_dma_cancel(struct tegra_dma_channel *ch);
 
 int __init tegra_dma_init(void);
 
+#if defined(CONFIG_TEGRA_DMAENGINE)
+#include <linux/dmaengine.h>
+
+/* filter parameter for dma_request_channel(): the peripheral the
+ * dmaengine channel moves data to or from */
+struct tegra_dma_slave {
+	unsigned long req_sel;
+};
+
+bool tegra_dma_filter(struct dma_chan *chan, void *param);
+
+struct dma_async_tx_descriptor *tegra_dma_prep_cyclic(struct dma_chan *chan,
+	dma_addr_t buf_addr, size_t buf_len, size_t period_len,
+	enum dma_data_direction direction);
+#endif
+
 #else /* !defined(CONFIG_TEGRA_SYSTEM_DMA) */
 static inline int tegra_dma_init(void)
 {
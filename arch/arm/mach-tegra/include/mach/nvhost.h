@@ -120,6 +120,33 @@ struct nvhost_waitchk {
 	__u32 thresh;
 };
 
+/* one job of a NVHOST_IOCTL_CHANNEL_SUBMIT_JOBS request */
+struct nvhost_job_desc {
+	__u32 syncpt_incrs;
+	__u32 num_cmdbufs;
+	__u32 num_relocs;
+	__u32 num_waitchks;
+	__u32 waitchk_mask;
+	__u32 fence;			/* returned sync point value at which
+					 * the job has completed */
+};
+
+/*
+ * submits several jobs on one sync point at once. the cmdbufs, relocs
+ * and waitchks of all jobs are passed as three arrays, in job order;
+ * each job's fence is written back to its descriptor.
+ */
+struct nvhost_submit_jobs_args {
+	__u32 syncpt_id;
+	__u32 num_jobs;
+	unsigned long jobs;		/* struct nvhost_job_desc[num_jobs] */
+	unsigned long cmdbufs;		/* struct nvhost_cmdbuf[] */
+	unsigned long relocs;		/* struct nvhost_reloc[] */
+	unsigned long waitchks;		/* struct nvhost_waitchk[] */
+};
+
+#define NVHOST_MAX_SUBMIT_JOBS	16
+
 struct nvhost_get_param_args {
 	__u32 value;
 };
@@ -142,8 +169,10 @@ struct nvhost_set_nvmap_fd_args {
 	_IOR(NVHOST_IOCTL_MAGIC, 6, struct nvhost_get_param_args)
 #define NVHOST_IOCTL_CHANNEL_SUBMIT_EXT    	\
 	_IOW(NVHOST_IOCTL_MAGIC, 7, struct nvhost_submit_hdr_ext)
+#define NVHOST_IOCTL_CHANNEL_SUBMIT_JOBS	\
+	_IOW(NVHOST_IOCTL_MAGIC, 8, struct nvhost_submit_jobs_args)
 #define NVHOST_IOCTL_CHANNEL_LAST		\
-	_IOC_NR(NVHOST_IOCTL_CHANNEL_SUBMIT_EXT)
+	_IOC_NR(NVHOST_IOCTL_CHANNEL_SUBMIT_JOBS)
 #define NVHOST_IOCTL_CHANNEL_MAX_ARG_SIZE sizeof(struct nvhost_submit_hdr_ext)
 
 struct nvhost_ctrl_syncpt_read_args {
@@ -168,6 +197,18 @@ struct nvhost_ctrl_syncpt_waitex_args {
 	__u32 value;
 };
 
+struct nvhost_ctrl_fence_create_args {
+	__u32 id;
+	__u32 thresh;
+	__s32 fd;			/* returned fence fd */
+};
+
+struct nvhost_ctrl_fence_merge_args {
+	__s32 fd1;
+	__s32 fd2;
+	__s32 fd;			/* returned fence fd */
+};
+
 struct nvhost_ctrl_module_mutex_args {
 	__u32 id;
 	__u32 lock;
@@ -197,8 +238,16 @@ struct nvhost_ctrl_module_regrdwr_args {
 #define NVHOST_IOCTL_CTRL_SYNCPT_WAITEX		\
 	_IOWR(NVHOST_IOCTL_MAGIC, 6, struct nvhost_ctrl_syncpt_waitex_args)
 
+/* returns an fd which polls readable once the sync point has reached the
+ * threshold */
+#define NVHOST_IOCTL_CTRL_FENCE_CREATE		\
+	_IOWR(NVHOST_IOCTL_MAGIC, 7, struct nvhost_ctrl_fence_create_args)
+/* returns an fd which polls readable once both fences have signalled */
+#define NVHOST_IOCTL_CTRL_FENCE_MERGE		\
+	_IOWR(NVHOST_IOCTL_MAGIC, 8, struct nvhost_ctrl_fence_merge_args)
+
 #define NVHOST_IOCTL_CTRL_LAST			\
-	_IOC_NR(NVHOST_IOCTL_CTRL_SYNCPT_WAITEX)
+	_IOC_NR(NVHOST_IOCTL_CTRL_FENCE_MERGE)
 #define NVHOST_IOCTL_CTRL_MAX_ARG_SIZE sizeof(struct nvhost_ctrl_module_regrdwr_args)
 
 #endif
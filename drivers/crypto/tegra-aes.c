@@ -21,6 +21,7 @@
  */
 
 #include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/init.h>
 #include <linux/errno.h>
 #include <linux/kernel.h>
@@ -38,6 +39,7 @@
 #include <mach/clk.h>
 #include "../video/tegra/nvmap/nvmap.h"
 
+#include <crypto/algapi.h>
 #include <crypto/scatterwalk.h>
 #include <crypto/aes.h>
 #include <crypto/internal/rng.h>
@@ -51,6 +53,8 @@
 #define FLAGS_RNG		BIT(3)
 #define FLAGS_OFB		BIT(4)
 #define FLAGS_INIT		BIT(5)
+#define FLAGS_CTR		BIT(6)
+#define FLAGS_XTS		BIT(7)
 #define FLAGS_BUSY		1
 
 /*
@@ -140,6 +144,21 @@ struct tegra_aes_reqctx {
 
 #define TEGRA_AES_QUEUE_LENGTH	500
 
+/*
+ * An engine keeps the arbitration semaphore across up to this many queued
+ * requests, so that requests under a key already loaded in one of its
+ * slots skip the key table upload. The semaphore is dropped after the
+ * batch to let the AVP in.
+ */
+#define TEGRA_AES_BATCH_MAX	16
+
+/*
+ * Requests arriving while this many are already queued are handed to the
+ * software implementation in the caller's context instead. 0 disables it.
+ */
+static unsigned int fallback_qlen = 64;
+module_param(fallback_qlen, uint, 0644);
+
 struct tegra_aes_engine {
 	struct tegra_aes_dev *dd;
 	struct tegra_aes_ctx *ctx;
@@ -166,8 +185,15 @@ struct tegra_aes_engine {
 	int res_id;
 	unsigned long busy;
 	u8 irq;
-	bool new_key;
 	u32 status;
+	/* key loaded in each slot, only valid while the semaphore is held */
+	u32 slot_key_id[AES_NR_KEYSLOTS];
+	/* when each slot was last used, to pick the one to reload */
+	unsigned long slot_lru[AES_NR_KEYSLOTS];
+	unsigned long lru_clock;
+	int cur_slot;
+	int batch;
+	bool sema_held;
 };
 
 struct tegra_aes_dev {
@@ -180,6 +206,7 @@ struct tegra_aes_dev {
 	struct crypto_queue queue;
 	spinlock_t lock;
 	u64 ctr;
+	u32 key_seq;
 	unsigned long flags;
 	u8 dt[DEFAULT_RNG_BLK_SZ];
 };
@@ -192,8 +219,11 @@ struct tegra_aes_ctx {
 	struct tegra_aes_slot *slot;
 	int key[AES_MAX_KEY_SIZE];
 	int keylen;
+	u32 key_id;
 	bool use_ssk;
 	u8 dt[DEFAULT_RNG_BLK_SZ];
+	struct crypto_blkcipher *fallback;
+	struct crypto_cipher *tweak;	/* xts only */
 };
 
 static struct tegra_aes_ctx rng_ctx;
@@ -471,16 +501,9 @@ static struct tegra_aes_slot *aes_find_key_slot(struct tegra_aes_dev *dd)
 	return found ? slot : NULL;
 }
 
-static int aes_set_key(struct tegra_aes_engine *eng, int slot_num)
+static void aes_select_slot(struct tegra_aes_engine *eng, int slot_num)
 {
-	struct tegra_aes_dev *dd = aes_dev;
-	u32 value, cmdq[2];
-	int i, eng_busy, icq_empty, dma_busy;
-
-	if (!eng) {
-		dev_err(dd->dev, "%s: context invalid\n", __func__);
-		return -EINVAL;
-	}
+	u32 value;
 
 	/* enable key schedule generation in hardware */
 	value = aes_readl(eng, SECURE_CONFIG_EXT);
@@ -493,6 +516,22 @@ static int aes_set_key(struct tegra_aes_engine *eng, int slot_num)
 	value |= (slot_num << SECURE_KEY_INDEX_SHIFT);
 	aes_writel(eng, value, SECURE_CONFIG);
 
+	eng->cur_slot = slot_num;
+}
+
+static int aes_set_key(struct tegra_aes_engine *eng, int slot_num)
+{
+	struct tegra_aes_dev *dd = aes_dev;
+	u32 value, cmdq[2];
+	int i, eng_busy, icq_empty, dma_busy;
+
+	if (!eng) {
+		dev_err(dd->dev, "%s: context invalid\n", __func__);
+		return -EINVAL;
+	}
+
+	aes_select_slot(eng, slot_num);
+
 	if (slot_num == SSK_SLOT_NUM)
 		goto out;
 
@@ -558,74 +597,275 @@ out:
 	return 0;
 }
 
-static int tegra_aes_handle_req(struct tegra_aes_engine *eng)
+/*
+ * cipher tfms don't own a key slot: a request takes the slot of the engine
+ * that already holds its key, or else the least recently used one. slots
+ * reserved by the rng are skipped. returns -1 if there is none.
+ */
+static int aes_pick_slot(struct tegra_aes_engine *eng, u32 key_id)
+{
+	struct tegra_aes_slot *slot;
+	int slot_num = -1;
+
+	spin_lock(&list_lock);
+	list_for_each_entry(slot, &slot_list, node) {
+		if (!slot->available)
+			continue;
+		if (eng->slot_key_id[slot->slot_num] == key_id) {
+			slot_num = slot->slot_num;
+			break;
+		}
+		if (slot_num < 0 ||
+			eng->slot_lru[slot->slot_num] < eng->slot_lru[slot_num])
+			slot_num = slot->slot_num;
+	}
+	spin_unlock(&list_lock);
+
+	return slot_num;
+}
+
+/*
+ * points the engine at the key of ctx. the key table is only uploaded when
+ * the slot does not already hold it from an earlier request in this batch.
+ */
+static int aes_load_key(struct tegra_aes_engine *eng, struct tegra_aes_ctx *ctx)
+{
+	int slot_num;
+
+	if (ctx->use_ssk) {
+		aes_set_key(eng, SSK_SLOT_NUM);
+		return 0;
+	}
+
+	if (!ctx->key_id)
+		return -ENOKEY;
+
+	slot_num = aes_pick_slot(eng, ctx->key_id);
+	if (slot_num < 0)
+		return -EBUSY;
+
+	if (eng->slot_key_id[slot_num] == ctx->key_id) {
+		if (eng->cur_slot != slot_num)
+			aes_select_slot(eng, slot_num);
+	} else {
+		aes_set_key(eng, slot_num);
+		eng->slot_key_id[slot_num] = ctx->key_id;
+	}
+
+	eng->slot_lru[slot_num] = ++eng->lru_clock;
+	return 0;
+}
+
+static void aes_put_sema(struct tegra_aes_engine *eng)
+{
+	if (!eng->sema_held)
+		return;
+
+	tegra_arb_mutex_unlock(eng->res_id);
+	eng->sema_held = false;
+}
+
+static int aes_get_sema(struct tegra_aes_engine *eng)
+{
+	if (eng->sema_held)
+		return 0;
+
+	if (tegra_arb_mutex_lock_timeout(eng->res_id, ARB_SEMA_TIMEOUT) < 0)
+		return -EBUSY;
+
+	/* somebody else may have used the slots while we did not own them */
+	memset(eng->slot_key_id, 0, sizeof(eng->slot_key_id));
+	eng->cur_slot = -1;
+	eng->batch = 0;
+	eng->sema_held = true;
+	return 0;
+}
+
+static int tegra_aes_fallback(struct ablkcipher_request *req,
+	unsigned long mode)
+{
+	struct tegra_aes_ctx *ctx =
+		crypto_ablkcipher_ctx(crypto_ablkcipher_reqtfm(req));
+	struct blkcipher_desc desc;
+
+	if (!ctx->fallback || ctx->use_ssk)
+		return -EBUSY;
+
+	desc.tfm = ctx->fallback;
+	desc.info = req->info;
+	desc.flags = req->base.flags;
+
+	if (mode & FLAGS_ENCRYPT)
+		return crypto_blkcipher_encrypt_iv(&desc, req->dst, req->src,
+			req->nbytes);
+
+	return crypto_blkcipher_decrypt_iv(&desc, req->dst, req->src,
+		req->nbytes);
+}
+
+static void aes_sg_advance(struct scatterlist **sg, size_t *offset,
+	size_t count)
+{
+	size_t left;
+
+	while (*sg && count) {
+		left = (*sg)->length - *offset;
+		if (count < left) {
+			*offset += count;
+			return;
+		}
+		count -= left;
+		*sg = sg_next(*sg);
+		*offset = 0;
+	}
+}
+
+/*
+ * number of bytes the engine can take straight from the current src and
+ * dst entries, or 0 if the data has to go through the bounce buffers
+ */
+static size_t aes_direct_len(struct tegra_aes_engine *eng, size_t total)
+{
+	size_t count;
+
+	if (!eng->in_sg || !eng->out_sg)
+		return 0;
+
+	if (((eng->in_sg->offset + eng->in_offset) & 3) ||
+		((eng->out_sg->offset + eng->out_offset) & 3))
+		return 0;
+
+	count = min_t(size_t, total, AES_HW_DMA_BUFFER_SIZE_BYTES);
+	count = min_t(size_t, count, eng->in_sg->length - eng->in_offset);
+	count = min_t(size_t, count, eng->out_sg->length - eng->out_offset);
+
+	return count & ~(AES_BLOCK_SIZE - 1);
+}
+
+static int aes_crypt_direct(struct tegra_aes_engine *eng, size_t count,
+	unsigned long mode)
 {
 	struct tegra_aes_dev *dd = aes_dev;
-	struct tegra_aes_ctx *ctx;
-	struct crypto_async_request *async_req, *backlog;
-	struct tegra_aes_reqctx *rctx;
-	struct ablkcipher_request *req;
-	unsigned long irq_flags;
-	int dma_max = AES_HW_DMA_BUFFER_SIZE_BYTES;
-	int nblocks, total, ret = 0, count = 0;
 	dma_addr_t addr_in, addr_out;
-	struct scatterlist *in_sg, *out_sg;
+	int ret;
 
-	spin_lock_irqsave(&dd->lock, irq_flags);
-	backlog = crypto_get_backlog(&dd->queue);
-	async_req = crypto_dequeue_request(&dd->queue);
-	if (!async_req)
-		clear_bit(FLAGS_BUSY, &eng->busy);
-	spin_unlock_irqrestore(&dd->lock, irq_flags);
+	ret = dma_map_sg(dd->dev, eng->in_sg, 1, DMA_TO_DEVICE);
+	if (!ret) {
+		dev_err(dd->dev, "dma_map_sg() error\n");
+		return -EINVAL;
+	}
 
-	if (!async_req)
-		return -ENODATA;
+	ret = dma_map_sg(dd->dev, eng->out_sg, 1, DMA_FROM_DEVICE);
+	if (!ret) {
+		dev_err(dd->dev, "dma_map_sg() error\n");
+		dma_unmap_sg(dd->dev, eng->in_sg, 1, DMA_TO_DEVICE);
+		return -EINVAL;
+	}
 
-	if (backlog)
-		backlog->complete(backlog, -EINPROGRESS);
+	addr_in = sg_dma_address(eng->in_sg) + eng->in_offset;
+	addr_out = sg_dma_address(eng->out_sg) + eng->out_offset;
 
-	req = ablkcipher_request_cast(async_req);
-	dev_dbg(dd->dev, "%s: get new req (engine #%d)\n", __func__,
-		eng->res_id);
+	ret = aes_start_crypt(eng, addr_in, addr_out,
+		count / AES_BLOCK_SIZE, mode, true);
 
-	if (!req->src || !req->dst)
-		return -EINVAL;
+	dma_unmap_sg(dd->dev, eng->out_sg, 1, DMA_FROM_DEVICE);
+	dma_unmap_sg(dd->dev, eng->in_sg, 1, DMA_TO_DEVICE);
+	return ret;
+}
 
-	/* take the hardware semaphore */
-	if (tegra_arb_mutex_lock_timeout(eng->res_id, ARB_SEMA_TIMEOUT) < 0) {
-		dev_err(dd->dev, "aes hardware (%d) not available\n",
-		eng->res_id);
-		return -EBUSY;
+static void aes_ctr_fill(u8 *buf, u8 *ctr, int nblocks)
+{
+	int i;
+
+	for (i = 0; i < nblocks; i++) {
+		memcpy(buf + i * AES_BLOCK_SIZE, ctr, AES_BLOCK_SIZE);
+		crypto_inc(ctr, AES_BLOCK_SIZE);
 	}
+}
 
-	/* assign new request to device */
-	eng->req = req;
-	eng->total = req->nbytes;
-	eng->in_offset = 0;
-	eng->in_sg = req->src;
-	eng->out_offset = 0;
-	eng->out_sg = req->dst;
+/* multiply the tweak by x in GF(2^128), little endian as per IEEE P1619 */
+static void aes_xts_mul_x(u8 *t)
+{
+	u8 carry = 0, msb;
+	int i;
 
-	in_sg = eng->in_sg;
-	out_sg = eng->out_sg;
-	total = eng->total;
+	for (i = 0; i < AES_BLOCK_SIZE; i++) {
+		msb = t[i] >> 7;
+		t[i] = (t[i] << 1) | carry;
+		carry = msb;
+	}
 
-	rctx = ablkcipher_request_ctx(req);
-	ctx = crypto_ablkcipher_ctx(crypto_ablkcipher_reqtfm(req));
-	rctx->mode &= FLAGS_MODE_MASK;
-	dd->flags = (dd->flags & ~FLAGS_MODE_MASK) | rctx->mode;
-	eng->ctx = ctx;
+	if (carry)
+		t[0] ^= 0x87;
+}
 
-	if (eng->new_key) {
-		if (ctx->use_ssk)
-			aes_set_key(eng, SSK_SLOT_NUM);
-		else
-			aes_set_key(eng, ctx->slot->slot_num);
+/* xor each block with its tweak, leaving t at the tweak of the next one */
+static void aes_xts_xor(u8 *buf, u8 *t, int nblocks)
+{
+	int i;
 
-		eng->new_key = false;
+	for (i = 0; i < nblocks; i++) {
+		crypto_xor(buf + i * AES_BLOCK_SIZE, t, AES_BLOCK_SIZE);
+		aes_xts_mul_x(t);
 	}
+}
 
-	if (((dd->flags & FLAGS_CBC) || (dd->flags & FLAGS_OFB)) && req->info) {
+/*
+ * runs count bytes at offset done through the dma buffers. ctr and xts
+ * always come this way: the engine only does the block cipher (ecb) and
+ * the counter blocks and tweaks are applied here.
+ */
+static int aes_crypt_bounce(struct tegra_aes_engine *eng,
+	struct ablkcipher_request *req, size_t done, size_t count,
+	unsigned long mode, u8 *tweak)
+{
+	u8 *buf_in = (u8 *)eng->buf_in;
+	u8 *buf_out = (u8 *)eng->buf_out;
+	int nblocks = DIV_ROUND_UP(count, AES_BLOCK_SIZE);
+	unsigned long hw_mode = mode;
+	u8 t[AES_BLOCK_SIZE];
+	int ret;
+
+	if (mode & FLAGS_CTR) {
+		aes_ctr_fill(buf_in, req->info, nblocks);
+		hw_mode = FLAGS_ENCRYPT;
+	} else {
+		scatterwalk_map_and_copy(buf_in, req->src, done, count, 0);
+	}
+
+	if (mode & FLAGS_XTS) {
+		memcpy(t, tweak, AES_BLOCK_SIZE);
+		aes_xts_xor(buf_in, t, nblocks);
+		hw_mode = mode & FLAGS_ENCRYPT;
+	}
+
+	ret = aes_start_crypt(eng, (u32)eng->dma_buf_in, (u32)eng->dma_buf_out,
+		nblocks, hw_mode, true);
+	if (ret < 0)
+		return ret;
+
+	if (mode & FLAGS_CTR) {
+		/* buf_in is free again, xor the keystream with the data */
+		scatterwalk_map_and_copy(buf_in, req->src, done, count, 0);
+		crypto_xor(buf_out, buf_in, count);
+	} else if (mode & FLAGS_XTS) {
+		aes_xts_xor(buf_out, tweak, nblocks);
+	}
+
+	scatterwalk_map_and_copy(buf_out, req->dst, done, count, 1);
+	return 0;
+}
+
+static int tegra_aes_process(struct tegra_aes_engine *eng,
+	struct ablkcipher_request *req, unsigned long mode)
+{
+	struct tegra_aes_dev *dd = aes_dev;
+	struct tegra_aes_ctx *ctx = eng->ctx;
+	u8 iv_out[AES_BLOCK_SIZE], tweak[AES_BLOCK_SIZE];
+	size_t total = req->nbytes, done = 0, count;
+	int ret;
+
+	if ((mode & (FLAGS_CBC | FLAGS_OFB)) && req->info) {
 		/* set iv to the aes hw slot
 		 * Hw generates updated iv only after iv is set in slot.
 		 * So key and iv is passed asynchronously.
@@ -636,73 +876,135 @@ static int tegra_aes_handle_req(struct tegra_aes_engine *eng)
 			(u32)eng->dma_buf_out, 1, FLAGS_CBC, false);
 		if (ret < 0) {
 			dev_err(dd->dev, "aes_start_crypt fail(%d)\n", ret);
-			goto out;
+			return ret;
 		}
 	}
 
-	while (total) {
-		dev_dbg(dd->dev, "remain: %d\n", total);
-		ret = dma_map_sg(dd->dev, in_sg, 1, DMA_TO_DEVICE);
-		if (!ret) {
-			dev_err(dd->dev, "dma_map_sg() error\n");
-			goto out;
-		}
+	/* the iv handed back by cbc decryption is the last ciphertext block,
+	 * which an in-place request is about to overwrite */
+	if ((mode & FLAGS_CBC) && !(mode & FLAGS_ENCRYPT) && req->info)
+		scatterwalk_map_and_copy(iv_out, req->src,
+			total - AES_BLOCK_SIZE, AES_BLOCK_SIZE, 0);
 
-		ret = dma_map_sg(dd->dev, out_sg, 1, DMA_FROM_DEVICE);
-		if (!ret) {
-			dev_err(dd->dev, "dma_map_sg() error\n");
-			dma_unmap_sg(dd->dev, eng->in_sg,
-				1, DMA_TO_DEVICE);
-			goto out;
-		}
-
-		addr_in = sg_dma_address(in_sg);
-		addr_out = sg_dma_address(out_sg);
-		count = min((int)sg_dma_len(in_sg), (int)dma_max);
-		WARN_ON(sg_dma_len(in_sg) != sg_dma_len(out_sg));
-		nblocks = DIV_ROUND_UP(count, AES_BLOCK_SIZE);
+	if (mode & FLAGS_XTS)
+		crypto_cipher_encrypt_one(ctx->tweak, tweak, req->info);
 
-		ret = aes_start_crypt(eng, addr_in, addr_out, nblocks,
-			dd->flags, true);
+	eng->in_sg = req->src;
+	eng->in_offset = 0;
+	eng->out_sg = req->dst;
+	eng->out_offset = 0;
 
-		dma_unmap_sg(dd->dev, out_sg, 1, DMA_FROM_DEVICE);
-		dma_unmap_sg(dd->dev, in_sg, 1, DMA_TO_DEVICE);
+	while (total) {
+		dev_dbg(dd->dev, "remain: %zu\n", total);
+
+		count = 0;
+		if (!(mode & (FLAGS_CTR | FLAGS_XTS)))
+			count = aes_direct_len(eng, total);
+
+		if (count) {
+			ret = aes_crypt_direct(eng, count, mode);
+		} else {
+			count = min_t(size_t, total,
+				AES_HW_DMA_BUFFER_SIZE_BYTES);
+			ret = aes_crypt_bounce(eng, req, done, count, mode,
+				tweak);
+		}
 		if (ret < 0) {
 			dev_err(dd->dev, "aes_start_crypt fail(%d)\n", ret);
-			goto out;
+			return ret;
 		}
 
-		dev_dbg(dd->dev, "out: copied %d\n", count);
+		dev_dbg(dd->dev, "out: copied %zu\n", count);
+		done += count;
 		total -= count;
-		in_sg = sg_next(in_sg);
-		out_sg = sg_next(out_sg);
-		WARN_ON(((total != 0) && (!in_sg || !out_sg)));
+		aes_sg_advance(&eng->in_sg, &eng->in_offset, count);
+		aes_sg_advance(&eng->out_sg, &eng->out_offset, count);
 	}
 
-out:
-	/* release the hardware semaphore */
-	tegra_arb_mutex_unlock(eng->res_id);
-	eng->total = total;
+	/* hand the chaining value back for the next request of the stream */
+	if ((mode & FLAGS_CBC) && req->info) {
+		if (mode & FLAGS_ENCRYPT)
+			scatterwalk_map_and_copy(req->info, req->dst,
+				req->nbytes - AES_BLOCK_SIZE,
+				AES_BLOCK_SIZE, 0);
+		else
+			memcpy(req->info, iv_out, AES_BLOCK_SIZE);
+	}
+
+	return 0;
+}
+
+static int tegra_aes_handle_req(struct tegra_aes_engine *eng)
+{
+	struct tegra_aes_dev *dd = aes_dev;
+	struct tegra_aes_ctx *ctx;
+	struct crypto_async_request *async_req, *backlog;
+	struct tegra_aes_reqctx *rctx;
+	struct ablkcipher_request *req;
+	unsigned long irq_flags;
+	int ret;
+
+	spin_lock_irqsave(&dd->lock, irq_flags);
+	backlog = crypto_get_backlog(&dd->queue);
+	async_req = crypto_dequeue_request(&dd->queue);
+	if (!async_req)
+		clear_bit(FLAGS_BUSY, &eng->busy);
+	spin_unlock_irqrestore(&dd->lock, irq_flags);
 
-	if (eng->req->base.complete)
-		eng->req->base.complete(&eng->req->base, ret);
+	if (!async_req)
+		return -ENODATA;
+
+	if (backlog)
+		backlog->complete(backlog, -EINPROGRESS);
+
+	req = ablkcipher_request_cast(async_req);
+	dev_dbg(dd->dev, "%s: get new req (engine #%d)\n", __func__,
+		eng->res_id);
+
+	rctx = ablkcipher_request_ctx(req);
+	ctx = crypto_ablkcipher_ctx(crypto_ablkcipher_reqtfm(req));
+
+	if (!req->src || !req->dst) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	/* take the hardware semaphore, unless still held for this batch */
+	if (aes_get_sema(eng) < 0) {
+		dev_dbg(dd->dev, "aes hardware (%d) not available\n",
+			eng->res_id);
+		ret = tegra_aes_fallback(req, rctx->mode);
+		goto out;
+	}
+
+	/* assign new request to device */
+	eng->req = req;
+	eng->total = req->nbytes;
+	eng->ctx = ctx;
+
+	ret = aes_load_key(eng, ctx);
+	if (!ret)
+		ret = tegra_aes_process(eng, req, rctx->mode);
+	else if (ret == -EBUSY)
+		ret = tegra_aes_fallback(req, rctx->mode);
+
+	/* let the other users of the engine in every so often */
+	if (++eng->batch >= TEGRA_AES_BATCH_MAX)
+		aes_put_sema(eng);
+
+out:
+	if (req->base.complete)
+		req->base.complete(&req->base, ret);
 
 	dev_dbg(dd->dev, "%s: exit\n", __func__);
-	return ret;
+	return 0;
 }
 
-static int tegra_aes_setkey(struct crypto_ablkcipher *tfm, const u8 *key,
+static int aes_set_ctx_key(struct tegra_aes_ctx *ctx, const u8 *key,
 	unsigned int keylen)
 {
-	struct tegra_aes_ctx *ctx = crypto_ablkcipher_ctx(tfm);
 	struct tegra_aes_dev *dd = aes_dev;
-	struct tegra_aes_slot *key_slot;
-
-	if (!ctx || !dd) {
-		dev_err(dd->dev, "ctx=0x%x, dd=0x%x\n",
-			(unsigned int)ctx, (unsigned int)dd);
-		return -EINVAL;
-	}
+	unsigned long flags;
 
 	if ((keylen != AES_KEYSIZE_128) && (keylen != AES_KEYSIZE_192) &&
 		(keylen != AES_KEYSIZE_256)) {
@@ -715,16 +1017,7 @@ static int tegra_aes_setkey(struct crypto_ablkcipher *tfm, const u8 *key,
 	ctx->dd = dd;
 
 	if (key) {
-		if (!ctx->slot) {
-			key_slot = aes_find_key_slot(dd);
-			if (!key_slot) {
-				dev_err(dd->dev, "no empty slot\n");
-				return -ENOMEM;
-			}
-			ctx->slot = key_slot;
-		}
-
-		/* copy the key to the proper slot */
+		/* a slot is bound to the key when a request uses it */
 		memset(ctx->key, 0, AES_MAX_KEY_SIZE);
 		memcpy(ctx->key, key, keylen);
 		ctx->keylen = keylen;
@@ -734,12 +1027,68 @@ static int tegra_aes_setkey(struct crypto_ablkcipher *tfm, const u8 *key,
 		ctx->keylen = AES_KEYSIZE_128;
 	}
 
-	dd->bsev.new_key = true;
-	dd->bsea.new_key = true;
+	/* a new id makes every engine upload the key again */
+	spin_lock_irqsave(&dd->lock, flags);
+	if (!++dd->key_seq)
+		++dd->key_seq;
+	ctx->key_id = dd->key_seq;
+	spin_unlock_irqrestore(&dd->lock, flags);
+
 	dev_dbg(dd->dev, "done\n");
 	return 0;
 }
 
+static int tegra_aes_setkey(struct crypto_ablkcipher *tfm, const u8 *key,
+	unsigned int keylen)
+{
+	struct tegra_aes_ctx *ctx = crypto_ablkcipher_ctx(tfm);
+	struct tegra_aes_dev *dd = aes_dev;
+	int ret;
+
+	if (!ctx || !dd) {
+		pr_err("tegra-aes: ctx=0x%x, dd=0x%x\n",
+			(unsigned int)ctx, (unsigned int)dd);
+		return -EINVAL;
+	}
+
+	ret = aes_set_ctx_key(ctx, key, keylen);
+	if (ret < 0) {
+		crypto_ablkcipher_set_flags(tfm, CRYPTO_TFM_RES_BAD_KEY_LEN);
+		return ret;
+	}
+
+	if (key && ctx->fallback)
+		ret = crypto_blkcipher_setkey(ctx->fallback, key, keylen);
+
+	return ret;
+}
+
+static int tegra_aes_xts_setkey(struct crypto_ablkcipher *tfm, const u8 *key,
+	unsigned int keylen)
+{
+	struct tegra_aes_ctx *ctx = crypto_ablkcipher_ctx(tfm);
+	struct tegra_aes_dev *dd = aes_dev;
+	int ret;
+
+	if (!ctx || !dd || !key || !ctx->tweak)
+		return -EINVAL;
+
+	/* the first half keys the data, the second half the tweak */
+	ret = (keylen & 1) ? -EINVAL : aes_set_ctx_key(ctx, key, keylen / 2);
+	if (!ret)
+		ret = crypto_cipher_setkey(ctx->tweak, key + keylen / 2,
+			keylen / 2);
+	if (ret < 0) {
+		crypto_ablkcipher_set_flags(tfm, CRYPTO_TFM_RES_BAD_KEY_LEN);
+		return ret;
+	}
+
+	if (ctx->fallback)
+		ret = crypto_blkcipher_setkey(ctx->fallback, key, keylen);
+
+	return ret;
+}
+
 static void bsev_workqueue_handler(struct work_struct *work)
 {
 	struct tegra_aes_dev *dd = aes_dev;
@@ -753,6 +1102,7 @@ static void bsev_workqueue_handler(struct work_struct *work)
 		ret = tegra_aes_handle_req(engine);
 	} while (!ret);
 
+	aes_put_sema(engine);
 	aes_hw_deinit(engine);
 }
 
@@ -769,6 +1119,7 @@ static void bsea_workqueue_handler(struct work_struct *work)
 		ret = tegra_aes_handle_req(engine);
 	} while (!ret);
 
+	aes_put_sema(engine);
 	aes_hw_deinit(engine);
 }
 
@@ -820,14 +1171,34 @@ static int tegra_aes_crypt(struct ablkcipher_request *req, unsigned long mode)
 	int bsev_busy;
 	int bsea_busy;
 
-	dev_dbg(dd->dev, "nbytes: %d, enc: %d, cbc: %d, ofb: %d\n", req->nbytes,
+	dev_dbg(dd->dev, "nbytes: %d, enc: %d, cbc: %d, ofb: %d, ctr: %d, "
+		"xts: %d\n", req->nbytes,
 		!!(mode & FLAGS_ENCRYPT),
 		!!(mode & FLAGS_CBC),
-		!!(mode & FLAGS_OFB));
+		!!(mode & FLAGS_OFB),
+		!!(mode & FLAGS_CTR),
+		!!(mode & FLAGS_XTS));
+
+	if (!req->nbytes)
+		return 0;
+
+	if (!(mode & FLAGS_CTR) && !IS_ALIGNED(req->nbytes, AES_BLOCK_SIZE)) {
+		dev_err(dd->dev, "nbytes %d not block aligned\n",
+			req->nbytes);
+		return -EINVAL;
+	}
 
 	rctx->mode = mode;
 
 	spin_lock_irqsave(&dd->lock, flags);
+	/* with a long backlog ahead of it, the request is done sooner here */
+	if (fallback_qlen && dd->queue.qlen >= fallback_qlen) {
+		spin_unlock_irqrestore(&dd->lock, flags);
+		err = tegra_aes_fallback(req, mode);
+		if (err != -EBUSY)
+			return err;
+		spin_lock_irqsave(&dd->lock, flags);
+	}
 	err = ablkcipher_enqueue_request(&dd->queue, req);
 	bsev_busy = test_and_set_bit(FLAGS_BUSY, &dd->bsev.busy);
 	bsea_busy = test_and_set_bit(FLAGS_BUSY, &dd->bsea.busy);
@@ -860,6 +1231,22 @@ static int tegra_aes_cbc_decrypt(struct ablkcipher_request *req)
 {
 	return tegra_aes_crypt(req, FLAGS_CBC);
 }
+
+static int tegra_aes_ctr_crypt(struct ablkcipher_request *req)
+{
+	return tegra_aes_crypt(req, FLAGS_ENCRYPT | FLAGS_CTR);
+}
+
+static int tegra_aes_xts_encrypt(struct ablkcipher_request *req)
+{
+	return tegra_aes_crypt(req, FLAGS_ENCRYPT | FLAGS_XTS);
+}
+
+static int tegra_aes_xts_decrypt(struct ablkcipher_request *req)
+{
+	return tegra_aes_crypt(req, FLAGS_XTS);
+}
+
 static int tegra_aes_ofb_encrypt(struct ablkcipher_request *req)
 {
 	return tegra_aes_crypt(req, FLAGS_ENCRYPT | FLAGS_OFB);
@@ -1043,26 +1430,70 @@ static int tegra_aes_cra_init(struct crypto_tfm *tfm)
 	return 0;
 }
 
+static int tegra_aes_cipher_cra_init(struct crypto_tfm *tfm)
+{
+	struct tegra_aes_ctx *ctx = crypto_tfm_ctx(tfm);
+	const char *name = tfm->__crt_alg->cra_name;
+
+	/* without a software implementation requests just wait their turn */
+	ctx->fallback = crypto_alloc_blkcipher(name, 0,
+		CRYPTO_ALG_ASYNC | CRYPTO_ALG_NEED_FALLBACK);
+	if (IS_ERR(ctx->fallback)) {
+		pr_debug("tegra-aes: no fallback for %s\n", name);
+		ctx->fallback = NULL;
+	}
+
+	return tegra_aes_cra_init(tfm);
+}
+
+static int tegra_aes_xts_cra_init(struct crypto_tfm *tfm)
+{
+	struct tegra_aes_ctx *ctx = crypto_tfm_ctx(tfm);
+
+	int ret;
+
+	ctx->tweak = crypto_alloc_cipher("aes", 0, CRYPTO_ALG_NEED_FALLBACK);
+	if (IS_ERR(ctx->tweak)) {
+		pr_err("tegra-aes: error allocating the xts tweak cipher\n");
+		return PTR_ERR(ctx->tweak);
+	}
+
+	ret = tegra_aes_cipher_cra_init(tfm);
+	if (ret < 0) {
+		crypto_free_cipher(ctx->tweak);
+		ctx->tweak = NULL;
+	}
+
+	return ret;
+}
+
 void tegra_aes_cra_exit(struct crypto_tfm *tfm)
 {
-	struct tegra_aes_ctx *ctx = crypto_ablkcipher_ctx((struct crypto_ablkcipher *)tfm);
+	struct tegra_aes_ctx *ctx = crypto_tfm_ctx(tfm);
 
 	if (ctx && ctx->slot)
 		aes_release_key_slot(ctx);
+
+	if (ctx && ctx->fallback)
+		crypto_free_blkcipher(ctx->fallback);
+
+	if (ctx && ctx->tweak)
+		crypto_free_cipher(ctx->tweak);
 }
 
 static struct crypto_alg algs[] = {
 	{
-		.cra_name = "disabled_ecb(aes)",
+		.cra_name = "ecb(aes)",
 		.cra_driver_name = "ecb-aes-tegra",
-		.cra_priority = 100,
-		.cra_flags = CRYPTO_ALG_TYPE_ABLKCIPHER | CRYPTO_ALG_ASYNC,
+		.cra_priority = 300,
+		.cra_flags = CRYPTO_ALG_TYPE_ABLKCIPHER | CRYPTO_ALG_ASYNC |
+			CRYPTO_ALG_NEED_FALLBACK,
 		.cra_blocksize = AES_BLOCK_SIZE,
 		.cra_ctxsize = sizeof(struct tegra_aes_ctx),
 		.cra_alignmask = 3,
 		.cra_type = &crypto_ablkcipher_type,
 		.cra_module = THIS_MODULE,
-		.cra_init = tegra_aes_cra_init,
+		.cra_init = tegra_aes_cipher_cra_init,
 		.cra_exit = tegra_aes_cra_exit,
 		.cra_u.ablkcipher = {
 			.min_keysize = AES_MIN_KEY_SIZE,
@@ -1072,25 +1503,68 @@ static struct crypto_alg algs[] = {
 			.decrypt = tegra_aes_ecb_decrypt,
 		},
 	}, {
-		.cra_name = "disabled_cbc(aes)",
+		.cra_name = "cbc(aes)",
 		.cra_driver_name = "cbc-aes-tegra",
-		.cra_priority = 100,
-		.cra_flags = CRYPTO_ALG_TYPE_ABLKCIPHER | CRYPTO_ALG_ASYNC,
+		.cra_priority = 300,
+		.cra_flags = CRYPTO_ALG_TYPE_ABLKCIPHER | CRYPTO_ALG_ASYNC |
+			CRYPTO_ALG_NEED_FALLBACK,
 		.cra_blocksize = AES_BLOCK_SIZE,
 		.cra_ctxsize  = sizeof(struct tegra_aes_ctx),
 		.cra_alignmask = 3,
 		.cra_type = &crypto_ablkcipher_type,
 		.cra_module = THIS_MODULE,
-		.cra_init = tegra_aes_cra_init,
+		.cra_init = tegra_aes_cipher_cra_init,
 		.cra_exit = tegra_aes_cra_exit,
 		.cra_u.ablkcipher = {
 			.min_keysize = AES_MIN_KEY_SIZE,
 			.max_keysize = AES_MAX_KEY_SIZE,
-			.ivsize = AES_MIN_KEY_SIZE,
+			.ivsize = AES_BLOCK_SIZE,
 			.setkey = tegra_aes_setkey,
 			.encrypt = tegra_aes_cbc_encrypt,
 			.decrypt = tegra_aes_cbc_decrypt,
 		}
+	}, {
+		.cra_name = "ctr(aes)",
+		.cra_driver_name = "ctr-aes-tegra",
+		.cra_priority = 300,
+		.cra_flags = CRYPTO_ALG_TYPE_ABLKCIPHER | CRYPTO_ALG_ASYNC |
+			CRYPTO_ALG_NEED_FALLBACK,
+		.cra_blocksize = 1,
+		.cra_ctxsize  = sizeof(struct tegra_aes_ctx),
+		.cra_alignmask = 3,
+		.cra_type = &crypto_ablkcipher_type,
+		.cra_module = THIS_MODULE,
+		.cra_init = tegra_aes_cipher_cra_init,
+		.cra_exit = tegra_aes_cra_exit,
+		.cra_u.ablkcipher = {
+			.min_keysize = AES_MIN_KEY_SIZE,
+			.max_keysize = AES_MAX_KEY_SIZE,
+			.ivsize = AES_BLOCK_SIZE,
+			.setkey = tegra_aes_setkey,
+			.encrypt = tegra_aes_ctr_crypt,
+			.decrypt = tegra_aes_ctr_crypt,
+		}
+	}, {
+		.cra_name = "xts(aes)",
+		.cra_driver_name = "xts-aes-tegra",
+		.cra_priority = 300,
+		.cra_flags = CRYPTO_ALG_TYPE_ABLKCIPHER | CRYPTO_ALG_ASYNC |
+			CRYPTO_ALG_NEED_FALLBACK,
+		.cra_blocksize = AES_BLOCK_SIZE,
+		.cra_ctxsize  = sizeof(struct tegra_aes_ctx),
+		.cra_alignmask = 3,
+		.cra_type = &crypto_ablkcipher_type,
+		.cra_module = THIS_MODULE,
+		.cra_init = tegra_aes_xts_cra_init,
+		.cra_exit = tegra_aes_cra_exit,
+		.cra_u.ablkcipher = {
+			.min_keysize = 2 * AES_MIN_KEY_SIZE,
+			.max_keysize = 2 * AES_MAX_KEY_SIZE,
+			.ivsize = AES_BLOCK_SIZE,
+			.setkey = tegra_aes_xts_setkey,
+			.encrypt = tegra_aes_xts_encrypt,
+			.decrypt = tegra_aes_xts_decrypt,
+		}
 	}, {
 		.cra_name = "disabled_ofb(aes)",
 		.cra_driver_name = "ofb-aes-tegra",
@@ -0,0 +1,716 @@
+/*
+ * drivers/dma/tegra_dma.c
+ *
+ * dmaengine provider for the NVIDIA Tegra APB DMA controller
+ *
+ * Copyright (c) 2011, NVIDIA Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <linux/dmaengine.h>
+#include <linux/dma-mapping.h>
+#include <linux/init.h>
+#include <linux/interrupt.h>
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/module.h>
+#include <linux/platform_device.h>
+#include <linux/scatterlist.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+
+#include <mach/dma.h>
+
+/*
+ * the APB DMA channels have no hardware descriptor lists, so each
+ * descriptor is broken into one tegra_dma_req per segment up front and
+ * all of them are handed to the system DMA channel on issue_pending. the
+ * channel's interrupt handler starts each segment as soon as the previous
+ * one ends, without going back to the client. scatter-gather descriptors
+ * run the channel in one-shot mode; cyclic descriptors run it in
+ * continuous mode, where the next period is already programmed while the
+ * current one is in flight and each completed period is put back at the
+ * tail of the channel's queue.
+ *
+ * clients get one callback per descriptor (per period for cyclic ones)
+ * rather than one per hardware chunk.
+ */
+
+/* dmaengine channels offered; each holds a system DMA channel only while
+ * it is allocated to a client */
+#define TEGRA_DMAE_CHANNELS	8
+
+struct tegra_dmae_chan;
+
+struct tegra_dmae_desc {
+	struct dma_async_tx_descriptor	txd;
+	struct list_head		node;
+	struct tegra_dmae_chan		*tc;
+
+	struct tegra_dma_req		*reqs;
+	unsigned int			nr_reqs;
+
+	/* protected by the channel lock */
+	unsigned int			outstanding;	/* reqs owned by the hw */
+	size_t				len;
+	size_t				done;
+	unsigned int			periods;	/* not yet reported */
+	bool				cyclic;
+	bool				aborted;
+};
+
+struct tegra_dmae_chan {
+	struct dma_chan			chan;
+	struct tegra_dma_channel	*hw;
+	unsigned long			req_sel;
+
+	spinlock_t			lock;
+	struct list_head		queued;		/* submitted */
+	struct list_head		active;		/* issued */
+	struct list_head		completed;	/* for the tasklet */
+	struct tasklet_struct		tasklet;
+	unsigned int			inflight;	/* reqs given to the hw
+							 * and not yet through
+							 * req_complete */
+	dma_cookie_t			completed_cookie;
+	struct dma_slave_config		cfg;
+	bool				cyclic;
+};
+
+struct tegra_dmae {
+	struct dma_device		dma;
+	struct tegra_dmae_chan		chans[TEGRA_DMAE_CHANNELS];
+};
+
+static struct platform_driver tegra_dmae_driver;
+
+static inline struct tegra_dmae_chan *to_tegra_dmae_chan(struct dma_chan *chan)
+{
+	return container_of(chan, struct tegra_dmae_chan, chan);
+}
+
+static inline struct tegra_dmae_desc *
+to_tegra_dmae_desc(struct dma_async_tx_descriptor *txd)
+{
+	return container_of(txd, struct tegra_dmae_desc, txd);
+}
+
+enum tegra_dmae_seg_action {
+	TEGRA_DMAE_SEG_NONE,		/* more segments outstanding */
+	TEGRA_DMAE_SEG_REQUEUE,		/* cyclic: put the period back */
+	TEGRA_DMAE_SEG_DESC_DONE,	/* descriptor finished or aborted */
+};
+
+/*
+ * accounts for one segment of an issued descriptor coming back from the
+ * channel, and says what should happen to it. called with the channel
+ * lock held; this is the whole of the chaining policy and touches no
+ * hardware state, so it can be driven by a simulated channel.
+ */
+static enum tegra_dmae_seg_action
+tegra_dmae_segment_done(struct tegra_dmae_desc *desc, unsigned int bytes,
+			bool success)
+{
+	if (!success)
+		desc->aborted = true;
+
+	if (desc->cyclic && !desc->aborted) {
+		desc->periods++;
+		return TEGRA_DMAE_SEG_REQUEUE;
+	}
+
+	desc->done += bytes;
+	if (--desc->outstanding)
+		return TEGRA_DMAE_SEG_NONE;
+
+	return TEGRA_DMAE_SEG_DESC_DONE;
+}
+
+/* called by the system DMA driver, from its interrupt handler or from
+ * tegra_dma_dequeue_req, once for every request it was given */
+static void tegra_dmae_req_complete(struct tegra_dma_req *req)
+{
+	struct tegra_dmae_desc *desc = req->dev;
+	struct tegra_dmae_chan *tc = desc->tc;
+	enum tegra_dmae_seg_action action;
+	unsigned long flags;
+
+	spin_lock_irqsave(&tc->lock, flags);
+	action = tegra_dmae_segment_done(desc, req->bytes_transferred,
+					 req->status == TEGRA_DMA_REQ_SUCCESS);
+	switch (action) {
+	case TEGRA_DMAE_SEG_REQUEUE:
+		/* under the lock, so that terminate_all either sees the
+		 * period back on the hw queue or stops it from going back */
+		tegra_dma_enqueue_req(tc->hw, req);
+		break;
+	case TEGRA_DMAE_SEG_DESC_DONE:
+		if (!desc->aborted)
+			tc->completed_cookie = desc->txd.cookie;
+		list_move_tail(&desc->node, &tc->completed);
+		break;
+	case TEGRA_DMAE_SEG_NONE:
+		break;
+	}
+
+	/* last touch of desc and of the tasklet for this req; once
+	 * inflight drops, free_chan_resources may free both */
+	if (action != TEGRA_DMAE_SEG_NONE)
+		tasklet_schedule(&tc->tasklet);
+	if (action != TEGRA_DMAE_SEG_REQUEUE)
+		tc->inflight--;
+	spin_unlock_irqrestore(&tc->lock, flags);
+}
+
+static void tegra_dmae_free_desc(struct tegra_dmae_desc *desc)
+{
+	kfree(desc->reqs);
+	kfree(desc);
+}
+
+static void tegra_dmae_tasklet(unsigned long data)
+{
+	struct tegra_dmae_chan *tc = (struct tegra_dmae_chan *)data;
+	struct tegra_dmae_desc *desc, *tmp;
+	dma_async_tx_callback callback = NULL;
+	void *param = NULL;
+	unsigned int periods = 0;
+	unsigned long flags;
+	LIST_HEAD(list);
+
+	spin_lock_irqsave(&tc->lock, flags);
+	list_splice_init(&tc->completed, &list);
+	if (tc->cyclic && !list_empty(&tc->active)) {
+		desc = list_first_entry(&tc->active, struct tegra_dmae_desc,
+					node);
+		periods = desc->periods;
+		desc->periods = 0;
+		callback = desc->txd.callback;
+		param = desc->txd.callback_param;
+	}
+	spin_unlock_irqrestore(&tc->lock, flags);
+
+	while (callback && periods--)
+		callback(param);
+
+	list_for_each_entry_safe(desc, tmp, &list, node) {
+		list_del(&desc->node);
+		/* no callbacks for descriptors that were terminated */
+		if (!desc->aborted && desc->txd.callback)
+			desc->txd.callback(desc->txd.callback_param);
+		tegra_dmae_free_desc(desc);
+	}
+}
+
+static dma_cookie_t tegra_dmae_tx_submit(struct dma_async_tx_descriptor *txd)
+{
+	struct tegra_dmae_desc *desc = to_tegra_dmae_desc(txd);
+	struct tegra_dmae_chan *tc = desc->tc;
+	dma_cookie_t cookie;
+	unsigned long flags;
+
+	spin_lock_irqsave(&tc->lock, flags);
+	cookie = tc->chan.cookie + 1;
+	if (cookie < 0)
+		cookie = 1;
+	tc->chan.cookie = cookie;
+	txd->cookie = cookie;
+	list_add_tail(&desc->node, &tc->queued);
+	spin_unlock_irqrestore(&tc->lock, flags);
+
+	return cookie;
+}
+
+/* a channel runs either scatter-gather or cyclic descriptors; the system
+ * DMA channel's mode can only change while nothing is queued on it */
+static int tegra_dmae_set_cyclic(struct tegra_dmae_chan *tc, bool cyclic)
+{
+	unsigned long flags;
+	int err = 0;
+
+	spin_lock_irqsave(&tc->lock, flags);
+	if (!list_empty(&tc->queued) || !list_empty(&tc->active)) {
+		/* only one cyclic descriptor can own the channel */
+		if (cyclic || tc->cyclic)
+			err = -EBUSY;
+	} else if (tc->cyclic != cyclic) {
+		err = tegra_dma_set_mode(tc->hw, cyclic ?
+					 TEGRA_DMA_MODE_CONTINUOUS_SINGLE :
+					 TEGRA_DMA_MODE_ONESHOT);
+		if (!err)
+			tc->cyclic = cyclic;
+	}
+	spin_unlock_irqrestore(&tc->lock, flags);
+
+	return err;
+}
+
+static struct tegra_dmae_desc *tegra_dmae_alloc_desc(struct tegra_dmae_chan *tc,
+		unsigned int nr_reqs, unsigned long flags)
+{
+	struct tegra_dmae_desc *desc;
+
+	desc = kzalloc(sizeof(*desc), GFP_ATOMIC);
+	if (!desc)
+		return NULL;
+
+	desc->reqs = kcalloc(nr_reqs, sizeof(*desc->reqs), GFP_ATOMIC);
+	if (!desc->reqs) {
+		kfree(desc);
+		return NULL;
+	}
+
+	dma_async_tx_descriptor_init(&desc->txd, &tc->chan);
+	desc->txd.tx_submit = tegra_dmae_tx_submit;
+	desc->txd.flags = flags;
+	desc->tc = tc;
+	desc->nr_reqs = nr_reqs;
+	INIT_LIST_HEAD(&desc->node);
+
+	return desc;
+}
+
+static bool tegra_dmae_slave_ok(struct tegra_dmae_chan *tc,
+				enum dma_data_direction direction)
+{
+	enum dma_slave_buswidth width;
+	dma_addr_t addr;
+
+	if (direction == DMA_FROM_DEVICE) {
+		addr = tc->cfg.src_addr;
+		width = tc->cfg.src_addr_width;
+	} else if (direction == DMA_TO_DEVICE) {
+		addr = tc->cfg.dst_addr;
+		width = tc->cfg.dst_addr_width;
+	} else {
+		return false;
+	}
+
+	if (!addr || (addr & 0x3))
+		return false;
+
+	return width == DMA_SLAVE_BUSWIDTH_1_BYTE ||
+	       width == DMA_SLAVE_BUSWIDTH_2_BYTES ||
+	       width == DMA_SLAVE_BUSWIDTH_4_BYTES;
+}
+
+static void tegra_dmae_fill_req(struct tegra_dmae_chan *tc,
+				struct tegra_dmae_desc *desc,
+				struct tegra_dma_req *req, dma_addr_t mem,
+				unsigned int len,
+				enum dma_data_direction direction)
+{
+	req->complete = tegra_dmae_req_complete;
+	req->dev = desc;
+	req->req_sel = tc->req_sel;
+	req->size = len;
+
+	if (direction == DMA_FROM_DEVICE) {
+		req->to_memory = 1;
+		req->source_addr = tc->cfg.src_addr;
+		req->source_wrap = 4;
+		req->source_bus_width = tc->cfg.src_addr_width * 8;
+		req->dest_addr = mem;
+		req->dest_wrap = 0;
+		req->dest_bus_width = 32;
+	} else {
+		req->to_memory = 0;
+		req->dest_addr = tc->cfg.dst_addr;
+		req->dest_wrap = 4;
+		req->dest_bus_width = tc->cfg.dst_addr_width * 8;
+		req->source_addr = mem;
+		req->source_wrap = 0;
+		req->source_bus_width = 32;
+	}
+
+	desc->len += len;
+}
+
+static struct dma_async_tx_descriptor *
+tegra_dmae_prep_slave_sg(struct dma_chan *chan, struct scatterlist *sgl,
+			 unsigned int sg_len, enum dma_data_direction direction,
+			 unsigned long flags)
+{
+	struct tegra_dmae_chan *tc = to_tegra_dmae_chan(chan);
+	struct tegra_dmae_desc *desc;
+	struct scatterlist *sg;
+	unsigned int nr_reqs = 0;
+	unsigned int i, n = 0;
+
+	if (!sg_len || !tegra_dmae_slave_ok(tc, direction))
+		return NULL;
+
+	/* the channel moves whole words, at most
+	 * TEGRA_DMA_MAX_TRANSFER_SIZE bytes per request */
+	for_each_sg(sgl, sg, sg_len, i) {
+		if ((sg_dma_address(sg) | sg_dma_len(sg)) & 0x3 ||
+		    !sg_dma_len(sg))
+			return NULL;
+		nr_reqs += DIV_ROUND_UP(sg_dma_len(sg),
+					TEGRA_DMA_MAX_TRANSFER_SIZE);
+	}
+
+	if (tegra_dmae_set_cyclic(tc, false))
+		return NULL;
+
+	desc = tegra_dmae_alloc_desc(tc, nr_reqs, flags);
+	if (!desc)
+		return NULL;
+
+	for_each_sg(sgl, sg, sg_len, i) {
+		dma_addr_t addr = sg_dma_address(sg);
+		unsigned int left = sg_dma_len(sg);
+
+		while (left) {
+			unsigned int len = min_t(unsigned int, left,
+						 TEGRA_DMA_MAX_TRANSFER_SIZE);
+
+			tegra_dmae_fill_req(tc, desc, &desc->reqs[n++], addr,
+					    len, direction);
+			addr += len;
+			left -= len;
+		}
+	}
+
+	return &desc->txd;
+}
+
+/**
+ * tegra_dma_prep_cyclic - prepare a cyclic transfer over a ring buffer
+ * @chan:	channel obtained with tegra_dma_filter
+ * @buf_addr:	bus address of the ring buffer
+ * @buf_len:	ring buffer size, a whole number of periods
+ * @period_len:	bytes between callbacks
+ * @direction:	DMA_TO_DEVICE or DMA_FROM_DEVICE
+ *
+ * the descriptor runs until DMA_TERMINATE_ALL, calling its callback once
+ * per period.
+ */
+struct dma_async_tx_descriptor *
+tegra_dma_prep_cyclic(struct dma_chan *chan, dma_addr_t buf_addr,
+		      size_t buf_len, size_t period_len,
+		      enum dma_data_direction direction)
+{
+	struct tegra_dmae_chan *tc = to_tegra_dmae_chan(chan);
+	struct tegra_dmae_desc *desc;
+	unsigned int i, nr_periods;
+
+	if (!period_len || period_len > TEGRA_DMA_MAX_TRANSFER_SIZE ||
+	    (period_len & 0x3) || (buf_addr & 0x3) ||
+	    !buf_len || buf_len % period_len)
+		return NULL;
+
+	if (!tegra_dmae_slave_ok(tc, direction))
+		return NULL;
+
+	if (tegra_dmae_set_cyclic(tc, true))
+		return NULL;
+
+	nr_periods = buf_len / period_len;
+	desc = tegra_dmae_alloc_desc(tc, nr_periods,
+				     DMA_PREP_INTERRUPT | DMA_CTRL_ACK);
+	if (!desc)
+		return NULL;
+
+	desc->cyclic = true;
+	for (i = 0; i < nr_periods; i++)
+		tegra_dmae_fill_req(tc, desc, &desc->reqs[i],
+				    buf_addr + i * period_len, period_len,
+				    direction);
+
+	return &desc->txd;
+}
+EXPORT_SYMBOL(tegra_dma_prep_cyclic);
+
+static void tegra_dmae_issue_pending(struct dma_chan *chan)
+{
+	struct tegra_dmae_chan *tc = to_tegra_dmae_chan(chan);
+	struct tegra_dmae_desc *desc, *tmp;
+	unsigned long flags;
+	unsigned int i;
+
+	spin_lock_irqsave(&tc->lock, flags);
+	list_for_each_entry_safe(desc, tmp, &tc->queued, node) {
+		desc->outstanding = desc->nr_reqs;
+		tc->inflight += desc->nr_reqs;
+		list_move_tail(&desc->node, &tc->active);
+		for (i = 0; i < desc->nr_reqs; i++)
+			tegra_dma_enqueue_req(tc->hw, &desc->reqs[i]);
+	}
+	spin_unlock_irqrestore(&tc->lock, flags);
+}
+
+/* returns the last request of an issued descriptor that the system DMA
+ * channel still holds, or NULL once it holds none */
+static struct tegra_dma_req *tegra_dmae_last_inflight(struct tegra_dmae_chan *tc)
+{
+	struct tegra_dmae_desc *desc;
+	unsigned int i;
+
+	list_for_each_entry_reverse(desc, &tc->active, node) {
+		for (i = desc->nr_reqs; i-- > 0; )
+			if (tegra_dma_is_req_inflight(tc->hw, &desc->reqs[i]))
+				return &desc->reqs[i];
+	}
+
+	return NULL;
+}
+
+static void tegra_dmae_terminate_all(struct tegra_dmae_chan *tc)
+{
+	struct tegra_dmae_desc *desc, *tmp;
+	struct tegra_dma_req *req;
+	unsigned long flags;
+	LIST_HEAD(list);
+
+	spin_lock_irqsave(&tc->lock, flags);
+	list_splice_init(&tc->queued, &list);
+	list_for_each_entry(desc, &tc->active, node)
+		desc->aborted = true;
+	spin_unlock_irqrestore(&tc->lock, flags);
+
+	/*
+	 * pull the requests back from the tail, so that the running one is
+	 * stopped last. dequeueing calls tegra_dmae_req_complete, which
+	 * takes the channel lock, so it can't be held here; a request the
+	 * interrupt handler retires in the meantime is simply not found.
+	 */
+	for (;;) {
+		spin_lock_irqsave(&tc->lock, flags);
+		req = tegra_dmae_last_inflight(tc);
+		spin_unlock_irqrestore(&tc->lock, flags);
+
+		if (!req)
+			break;
+		tegra_dma_dequeue_req(tc->hw, req);
+	}
+
+	list_for_each_entry_safe(desc, tmp, &list, node) {
+		list_del(&desc->node);
+		tegra_dmae_free_desc(desc);
+	}
+}
+
+static int tegra_dmae_control(struct dma_chan *chan, enum dma_ctrl_cmd cmd,
+			      unsigned long arg)
+{
+	struct tegra_dmae_chan *tc = to_tegra_dmae_chan(chan);
+	struct dma_slave_config *cfg = (struct dma_slave_config *)arg;
+	unsigned long flags;
+
+	switch (cmd) {
+	case DMA_TERMINATE_ALL:
+		tegra_dmae_terminate_all(tc);
+		return 0;
+	case DMA_SLAVE_CONFIG:
+		spin_lock_irqsave(&tc->lock, flags);
+		tc->cfg = *cfg;
+		spin_unlock_irqrestore(&tc->lock, flags);
+		return 0;
+	default:
+		return -ENXIO;
+	}
+}
+
+static enum dma_status tegra_dmae_tx_status(struct dma_chan *chan,
+					    dma_cookie_t cookie,
+					    struct dma_tx_state *txstate)
+{
+	struct tegra_dmae_chan *tc = to_tegra_dmae_chan(chan);
+	struct tegra_dmae_desc *desc;
+	dma_cookie_t last_used, last_complete;
+	enum dma_status ret;
+	unsigned long flags;
+	u32 residue = 0;
+
+	spin_lock_irqsave(&tc->lock, flags);
+	last_complete = tc->completed_cookie;
+	last_used = chan->cookie;
+	ret = dma_async_is_complete(cookie, last_complete, last_used);
+	if (ret != DMA_SUCCESS) {
+		list_for_each_entry(desc, &tc->active, node) {
+			if (desc->txd.cookie == cookie) {
+				residue = desc->len - desc->done;
+				break;
+			}
+		}
+	}
+	spin_unlock_irqrestore(&tc->lock, flags);
+
+	dma_set_tx_state(txstate, last_complete, last_used, residue);
+
+	return ret;
+}
+
+static int tegra_dmae_alloc_chan_resources(struct dma_chan *chan)
+{
+	struct tegra_dmae_chan *tc = to_tegra_dmae_chan(chan);
+	struct tegra_dma_slave *slave = chan->private;
+
+	if (!slave)
+		return -EINVAL;
+
+	tc->hw = tegra_dma_allocate_channel(TEGRA_DMA_MODE_ONESHOT);
+	if (!tc->hw)
+		return -EBUSY;
+
+	tc->req_sel = slave->req_sel;
+	tc->cyclic = false;
+	tc->inflight = 0;
+	tc->completed_cookie = chan->cookie = 1;
+
+	return 1;
+}
+
+static bool tegra_dmae_idle(struct tegra_dmae_chan *tc)
+{
+	unsigned long flags;
+	bool idle;
+
+	spin_lock_irqsave(&tc->lock, flags);
+	idle = !tc->inflight;
+	spin_unlock_irqrestore(&tc->lock, flags);
+
+	return idle;
+}
+
+static void tegra_dmae_free_chan_resources(struct dma_chan *chan)
+{
+	struct tegra_dmae_chan *tc = to_tegra_dmae_chan(chan);
+	struct tegra_dmae_desc *desc, *tmp;
+	LIST_HEAD(list);
+
+	tegra_dmae_terminate_all(tc);
+
+	/*
+	 * a req the interrupt handler took off the channel before
+	 * terminate_all looked may still be on its way into
+	 * req_complete on another cpu; it must be done with its
+	 * descriptor, and have scheduled the tasklet, before either
+	 * goes away.
+	 */
+	while (!tegra_dmae_idle(tc))
+		cpu_relax();
+
+	tegra_dma_free_channel(tc->hw);
+	tasklet_kill(&tc->tasklet);
+
+	list_splice_init(&tc->completed, &list);
+	list_splice_init(&tc->active, &list);
+	list_for_each_entry_safe(desc, tmp, &list, node) {
+		list_del(&desc->node);
+		tegra_dmae_free_desc(desc);
+	}
+
+	tc->hw = NULL;
+	chan->private = NULL;
+}
+
+/**
+ * tegra_dma_filter - dma_request_channel filter for Tegra APB DMA
+ * @chan:	candidate channel
+ * @param:	struct tegra_dma_slave naming the peripheral
+ */
+bool tegra_dma_filter(struct dma_chan *chan, void *param)
+{
+	if (chan->device->dev->driver != &tegra_dmae_driver.driver)
+		return false;
+
+	chan->private = param;
+	return true;
+}
+EXPORT_SYMBOL(tegra_dma_filter);
+
+static int __devinit tegra_dmae_probe(struct platform_device *pdev)
+{
+	struct tegra_dmae *tdma;
+	unsigned int i;
+	int err;
+
+	tdma = kzalloc(sizeof(*tdma), GFP_KERNEL);
+	if (!tdma)
+		return -ENOMEM;
+
+	INIT_LIST_HEAD(&tdma->dma.channels);
+	for (i = 0; i < TEGRA_DMAE_CHANNELS; i++) {
+		struct tegra_dmae_chan *tc = &tdma->chans[i];
+
+		tc->chan.device = &tdma->dma;
+		spin_lock_init(&tc->lock);
+		INIT_LIST_HEAD(&tc->queued);
+		INIT_LIST_HEAD(&tc->active);
+		INIT_LIST_HEAD(&tc->completed);
+		tasklet_init(&tc->tasklet, tegra_dmae_tasklet,
+			     (unsigned long)tc);
+		list_add_tail(&tc->chan.device_node, &tdma->dma.channels);
+	}
+
+	dma_cap_set(DMA_SLAVE, tdma->dma.cap_mask);
+	dma_cap_set(DMA_PRIVATE, tdma->dma.cap_mask);
+	tdma->dma.dev = &pdev->dev;
+	tdma->dma.device_alloc_chan_resources = tegra_dmae_alloc_chan_resources;
+	tdma->dma.device_free_chan_resources = tegra_dmae_free_chan_resources;
+	tdma->dma.device_prep_slave_sg = tegra_dmae_prep_slave_sg;
+	tdma->dma.device_control = tegra_dmae_control;
+	tdma->dma.device_tx_status = tegra_dmae_tx_status;
+	tdma->dma.device_issue_pending = tegra_dmae_issue_pending;
+
+	err = dma_async_device_register(&tdma->dma);
+	if (err) {
+		dev_err(&pdev->dev, "failed to register dma device: %d\n", err);
+		kfree(tdma);
+		return err;
+	}
+
+	platform_set_drvdata(pdev, tdma);
+	dev_info(&pdev->dev, "%d dmaengine channels\n", TEGRA_DMAE_CHANNELS);
+
+	return 0;
+}
+
+static int __devexit tegra_dmae_remove(struct platform_device *pdev)
+{
+	struct tegra_dmae *tdma = platform_get_drvdata(pdev);
+
+	dma_async_device_unregister(&tdma->dma);
+	kfree(tdma);
+
+	return 0;
+}
+
+static struct platform_driver tegra_dmae_driver = {
+	.probe		= tegra_dmae_probe,
+	.remove		= __devexit_p(tegra_dmae_remove),
+	.driver		= {
+		.name	= "tegra-apbdma",
+		.owner	= THIS_MODULE,
+	},
+};
+
+static int __init tegra_dmae_init(void)
+{
+	return platform_driver_register(&tegra_dmae_driver);
+}
+subsys_initcall(tegra_dmae_init);
+
+static void __exit tegra_dmae_exit(void)
+{
+	platform_driver_unregister(&tegra_dmae_driver);
+}
+module_exit(tegra_dmae_exit);
+
+MODULE_DESCRIPTION("NVIDIA Tegra APB DMA dmaengine driver");
+MODULE_LICENSE("GPL");
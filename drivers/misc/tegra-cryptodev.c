@@ -30,18 +30,74 @@
 #include <linux/crypto.h>
 #include <linux/scatterlist.h>
 #include <linux/uaccess.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/pagemap.h>
+#include <linux/poll.h>
+#include <linux/sched.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 #include <crypto/rng.h>
 
 #include "tegra-cryptodev.h"
 
 #define NBUFS 2
 
+/*
+ * the asynchronous interface looks its transforms up by algorithm name, so
+ * it runs on whatever implementation has the highest priority: the tegra
+ * engine where there is one, software elsewhere. the ssk can only be used
+ * through the tegra driver.
+ */
+static const struct {
+	int op;
+	const char *name;
+	const char *ssk_name;
+} async_modes[] = {
+	{ TEGRA_CRYPTO_ECB, "ecb(aes)", "ecb-aes-tegra" },
+	{ TEGRA_CRYPTO_CBC, "cbc(aes)", "cbc-aes-tegra" },
+	{ TEGRA_CRYPTO_CTR, "ctr(aes)", NULL },
+	{ TEGRA_CRYPTO_XTS, "xts(aes)", NULL },
+};
+
+#define NR_ASYNC_MODES	ARRAY_SIZE(async_modes)
+
 struct tegra_crypto_ctx {
 	struct crypto_ablkcipher *ecb_tfm;
 	struct crypto_ablkcipher *cbc_tfm;
 	struct crypto_rng *rng;
 	u8 seed[TEGRA_CRYPTO_RNG_SEED_SIZE];
 	int use_ssk;
+
+	/* asynchronous requests */
+	struct mutex async_lock;	/* serializes submitters */
+	struct crypto_ablkcipher *async_tfm[NR_ASYNC_MODES];
+	char async_key[NR_ASYNC_MODES][2 * TEGRA_CRYPTO_MAX_KEY_SIZE];
+	int async_keylen[NR_ASYNC_MODES];
+	bool async_ssk[NR_ASYNC_MODES];
+
+	spinlock_t lock;		/* protects the fields below */
+	int async_busy[NR_ASYNC_MODES];	/* running per transform */
+	int nr_running;			/* submitted, not yet completed */
+	int nr_jobs;			/* submitted, not yet read back */
+	struct list_head done;
+	wait_queue_head_t wq;
+};
+
+/* an asynchronous request, working straight on the pinned user pages */
+struct tegra_crypto_job {
+	struct list_head node;
+	struct tegra_crypto_ctx *ctx;
+	struct ablkcipher_request *req;
+	struct work_struct work;
+	struct sg_table src;
+	struct sg_table dst;
+	struct page **src_pages;
+	struct page **dst_pages;
+	int nr_src;
+	int nr_dst;
+	int mode;
+	struct tegra_crypt_result res;
 };
 
 struct tegra_crypto_completion {
@@ -87,53 +143,68 @@ static int tegra_crypto_dev_open(struct inode *inode, struct file *filp)
 		return -ENOMEM;
 	}
 
+	mutex_init(&ctx->async_lock);
+	spin_lock_init(&ctx->lock);
+	INIT_LIST_HEAD(&ctx->done);
+	init_waitqueue_head(&ctx->wq);
+
+	/*
+	 * the synchronous requests and the rng need the tegra engine. without
+	 * it those ioctls fail, but the asynchronous interface still works.
+	 */
 	ctx->ecb_tfm = crypto_alloc_ablkcipher("ecb-aes-tegra",
 		CRYPTO_ALG_TYPE_ABLKCIPHER | CRYPTO_ALG_ASYNC, 0);
 	if (IS_ERR(ctx->ecb_tfm)) {
-		pr_err("Failed to load transform for ecb-aes-tegra: %ld\n",
+		pr_debug("Failed to load transform for ecb-aes-tegra: %ld\n",
 			PTR_ERR(ctx->ecb_tfm));
-		ret = PTR_ERR(ctx->ecb_tfm);
-		goto fail_ecb;
+		ctx->ecb_tfm = NULL;
 	}
 
 	ctx->cbc_tfm = crypto_alloc_ablkcipher("cbc-aes-tegra",
 		CRYPTO_ALG_TYPE_ABLKCIPHER | CRYPTO_ALG_ASYNC, 0);
 	if (IS_ERR(ctx->cbc_tfm)) {
-		pr_err("Failed to load transform for cbc-aes-tegra: %ld\n",
+		pr_debug("Failed to load transform for cbc-aes-tegra: %ld\n",
 			PTR_ERR(ctx->cbc_tfm));
-		ret = PTR_ERR(ctx->cbc_tfm);
-		goto fail_cbc;
+		ctx->cbc_tfm = NULL;
 	}
 
 	ctx->rng = crypto_alloc_rng("rng-aes-tegra", CRYPTO_ALG_TYPE_RNG, 0);
 	if (IS_ERR(ctx->rng)) {
-		pr_err("Failed to load transform for tegra rng: %ld\n",
+		pr_debug("Failed to load transform for tegra rng: %ld\n",
 			PTR_ERR(ctx->rng));
-		ret = PTR_ERR(ctx->rng);
-		goto fail_rng;
+		ctx->rng = NULL;
 	}
 
 	filp->private_data = ctx;
 	return ret;
-
-fail_rng:
-	crypto_free_ablkcipher(ctx->cbc_tfm);
-
-fail_cbc:
-	crypto_free_ablkcipher(ctx->ecb_tfm);
-
-fail_ecb:
-	kfree(ctx);
-	return ret;
 }
 
 static int tegra_crypto_dev_release(struct inode *inode, struct file *filp)
 {
 	struct tegra_crypto_ctx *ctx = filp->private_data;
+	struct tegra_crypto_job *job, *tmp;
+	int i;
+
+	/* the requests still in flight write to ctx when they complete */
+	wait_event(ctx->wq, !ctx->nr_running);
+	spin_lock(&ctx->lock);
+	spin_unlock(&ctx->lock);
 
-	crypto_free_ablkcipher(ctx->ecb_tfm);
-	crypto_free_ablkcipher(ctx->cbc_tfm);
-	crypto_free_rng(ctx->rng);
+	list_for_each_entry_safe(job, tmp, &ctx->done, node) {
+		list_del(&job->node);
+		kfree(job);
+	}
+
+	for (i = 0; i < NR_ASYNC_MODES; i++)
+		if (ctx->async_tfm[i])
+			crypto_free_ablkcipher(ctx->async_tfm[i]);
+
+	if (ctx->ecb_tfm)
+		crypto_free_ablkcipher(ctx->ecb_tfm);
+	if (ctx->cbc_tfm)
+		crypto_free_ablkcipher(ctx->cbc_tfm);
+	if (ctx->rng)
+		crypto_free_rng(ctx->rng);
 	kfree(ctx);
 	filp->private_data = NULL;
 	return 0;
@@ -161,13 +232,14 @@ static int process_crypt_req(struct tegra_crypto_ctx *ctx, struct tegra_crypt_re
 	struct tegra_crypto_completion tcrypt_complete;
 	const u8 *key = NULL;
 
-	if (crypt_req->op & TEGRA_CRYPTO_ECB) {
-		req = ablkcipher_request_alloc(ctx->ecb_tfm, GFP_KERNEL);
+	if (crypt_req->op & TEGRA_CRYPTO_ECB)
 		tfm = ctx->ecb_tfm;
-	} else {
-		req = ablkcipher_request_alloc(ctx->cbc_tfm, GFP_KERNEL);
+	else
 		tfm = ctx->cbc_tfm;
-	}
+	if (!tfm)
+		return -ENODEV;
+
+	req = ablkcipher_request_alloc(tfm, GFP_KERNEL);
 	if (!req) {
 		pr_err("%s: Failed to allocate request\n", __func__);
 		return -ENOMEM;
@@ -254,11 +326,354 @@ process_req_out:
 	return ret;
 }
 
+static void tegra_crypto_unpin(struct page **pages, int nr, bool dirty)
+{
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		if (dirty) {
+			flush_dcache_page(pages[i]);
+			set_page_dirty_lock(pages[i]);
+		}
+		page_cache_release(pages[i]);
+	}
+	kfree(pages);
+}
+
+/* pins the user buffer and describes it with one sg entry per page */
+static int tegra_crypto_pin(unsigned long uaddr, size_t len, int write,
+	struct page ***pagesp, int *nr, struct sg_table *sgt)
+{
+	struct scatterlist *sg;
+	struct page **pages;
+	unsigned long offset = uaddr & ~PAGE_MASK;
+	int nr_pages = (offset + len + PAGE_SIZE - 1) >> PAGE_SHIFT;
+	size_t size;
+	int ret, i;
+
+	pages = kcalloc(nr_pages, sizeof(*pages), GFP_KERNEL);
+	if (!pages)
+		return -ENOMEM;
+
+	down_read(&current->mm->mmap_sem);
+	ret = get_user_pages(current, current->mm, uaddr & PAGE_MASK,
+		nr_pages, write, 0, pages, NULL);
+	up_read(&current->mm->mmap_sem);
+
+	if (ret < nr_pages) {
+		tegra_crypto_unpin(pages, max(ret, 0), false);
+		return ret < 0 ? ret : -EFAULT;
+	}
+
+	ret = sg_alloc_table(sgt, nr_pages, GFP_KERNEL);
+	if (ret < 0) {
+		tegra_crypto_unpin(pages, nr_pages, false);
+		return ret;
+	}
+
+	for_each_sg(sgt->sgl, sg, nr_pages, i) {
+		size = min_t(size_t, len, PAGE_SIZE - offset);
+		sg_set_page(sg, pages[i], size, offset);
+		len -= size;
+		offset = 0;
+	}
+
+	*pagesp = pages;
+	*nr = nr_pages;
+	return 0;
+}
+
+/* releases everything but the result, which waits on ctx->done for read() */
+static void tegra_crypto_job_done(struct tegra_crypto_job *job)
+{
+	struct tegra_crypto_ctx *ctx = job->ctx;
+
+	tegra_crypto_unpin(job->dst_pages, job->nr_dst, true);
+	tegra_crypto_unpin(job->src_pages, job->nr_src, false);
+	sg_free_table(&job->dst);
+	sg_free_table(&job->src);
+	ablkcipher_request_free(job->req);
+
+	/* wake up under the lock, release() frees ctx once it can take it */
+	spin_lock(&ctx->lock);
+	list_add_tail(&job->node, &ctx->done);
+	ctx->async_busy[job->mode]--;
+	ctx->nr_running--;
+	wake_up(&ctx->wq);
+	spin_unlock(&ctx->lock);
+}
+
+static void tegra_crypto_job_work(struct work_struct *work)
+{
+	tegra_crypto_job_done(container_of(work, struct tegra_crypto_job,
+		work));
+}
+
+static void tegra_crypto_async_complete(struct crypto_async_request *req,
+	int err)
+{
+	struct tegra_crypto_job *job = req->data;
+
+	if (err == -EINPROGRESS)
+		return;
+
+	/* may be called in atomic context, unpinning the pages is not */
+	job->res.status = err;
+	schedule_work(&job->work);
+}
+
+static int tegra_crypto_async_mode(int op)
+{
+	int i;
+
+	for (i = 0; i < NR_ASYNC_MODES; i++)
+		if (op == async_modes[i].op)
+			return i;
+
+	return -EINVAL;
+}
+
+/* returns the transform for mode m, keyed for this request */
+static struct crypto_ablkcipher *tegra_crypto_async_tfm(
+	struct tegra_crypto_ctx *ctx, int m, struct tegra_crypt_async_req *areq)
+{
+	struct crypto_ablkcipher *tfm = ctx->async_tfm[m];
+	bool ssk = !!ctx->use_ssk;
+	const char *name;
+	int ret;
+
+	if (tfm && ctx->async_ssk[m] == ssk &&
+		ctx->async_keylen[m] == areq->keylen &&
+		(ssk || !memcmp(ctx->async_key[m], areq->key, areq->keylen)))
+		return tfm;
+
+	/* let the requests still running under the old key finish first */
+	ret = wait_event_interruptible(ctx->wq, !ctx->async_busy[m]);
+	if (ret < 0)
+		return ERR_PTR(ret);
+
+	if (tfm && ctx->async_ssk[m] != ssk) {
+		crypto_free_ablkcipher(tfm);
+		ctx->async_tfm[m] = tfm = NULL;
+	}
+
+	if (!tfm) {
+		name = ssk ? async_modes[m].ssk_name : async_modes[m].name;
+		if (!name)
+			return ERR_PTR(-EINVAL);
+
+		tfm = crypto_alloc_ablkcipher(name, 0, 0);
+		if (IS_ERR(tfm)) {
+			pr_debug("Failed to load transform for %s: %ld\n",
+				name, PTR_ERR(tfm));
+			return tfm;
+		}
+		ctx->async_tfm[m] = tfm;
+		ctx->async_ssk[m] = ssk;
+	}
+
+	ctx->async_keylen[m] = -1;
+	crypto_ablkcipher_clear_flags(tfm, ~0);
+	ret = crypto_ablkcipher_setkey(tfm, ssk ? NULL : areq->key,
+		areq->keylen);
+	if (ret < 0) {
+		pr_debug("setkey failed (%d)\n", ret);
+		return ERR_PTR(ret);
+	}
+
+	memcpy(ctx->async_key[m], areq->key, areq->keylen);
+	ctx->async_keylen[m] = areq->keylen;
+	return tfm;
+}
+
+static int tegra_crypto_submit(struct tegra_crypto_ctx *ctx,
+	struct tegra_crypt_async_req *areq)
+{
+	struct crypto_ablkcipher *tfm;
+	struct tegra_crypto_job *job;
+	int m, ret;
+
+	m = tegra_crypto_async_mode(areq->op);
+	if (m < 0)
+		return m;
+
+	if ((areq->plaintext_sz <= 0) ||
+		(areq->plaintext_sz > TEGRA_CRYPTO_MAX_ASYNC_SIZE) ||
+		(areq->keylen < 0) || (areq->keylen > sizeof(areq->key)) ||
+		(areq->ivlen < 0) || (areq->ivlen > TEGRA_CRYPTO_IV_SIZE))
+		return -EINVAL;
+
+	spin_lock(&ctx->lock);
+	if (ctx->nr_jobs >= TEGRA_CRYPTO_MAX_ASYNC_REQS) {
+		spin_unlock(&ctx->lock);
+		return -EAGAIN;
+	}
+	ctx->nr_jobs++;
+	spin_unlock(&ctx->lock);
+
+	job = kzalloc(sizeof(*job), GFP_KERNEL);
+	if (!job) {
+		ret = -ENOMEM;
+		goto fail_job;
+	}
+	job->ctx = ctx;
+	job->mode = m;
+	job->res.user_data = areq->user_data;
+	memcpy(job->res.iv, areq->iv, areq->ivlen);
+	INIT_WORK(&job->work, tegra_crypto_job_work);
+
+	ret = tegra_crypto_pin((unsigned long)areq->plaintext,
+		areq->plaintext_sz, 0, &job->src_pages, &job->nr_src,
+		&job->src);
+	if (ret < 0)
+		goto fail_src;
+
+	ret = tegra_crypto_pin((unsigned long)areq->result,
+		areq->plaintext_sz, 1, &job->dst_pages, &job->nr_dst,
+		&job->dst);
+	if (ret < 0)
+		goto fail_dst;
+
+	mutex_lock(&ctx->async_lock);
+
+	tfm = tegra_crypto_async_tfm(ctx, m, areq);
+	if (IS_ERR(tfm)) {
+		ret = PTR_ERR(tfm);
+		goto fail_tfm;
+	}
+
+	job->req = ablkcipher_request_alloc(tfm, GFP_KERNEL);
+	if (!job->req) {
+		ret = -ENOMEM;
+		goto fail_tfm;
+	}
+
+	ablkcipher_request_set_callback(job->req, CRYPTO_TFM_REQ_MAY_BACKLOG,
+		tegra_crypto_async_complete, job);
+	ablkcipher_request_set_crypt(job->req, job->src.sgl, job->dst.sgl,
+		areq->plaintext_sz, job->res.iv);
+
+	spin_lock(&ctx->lock);
+	ctx->async_busy[m]++;
+	ctx->nr_running++;
+	spin_unlock(&ctx->lock);
+
+	ret = areq->encrypt ?
+		crypto_ablkcipher_encrypt(job->req) :
+		crypto_ablkcipher_decrypt(job->req);
+
+	mutex_unlock(&ctx->async_lock);
+
+	/* synchronous implementations are done already, errors included */
+	if ((ret != -EINPROGRESS) && (ret != -EBUSY)) {
+		job->res.status = ret;
+		tegra_crypto_job_done(job);
+	}
+
+	return 0;
+
+fail_tfm:
+	mutex_unlock(&ctx->async_lock);
+	tegra_crypto_unpin(job->dst_pages, job->nr_dst, false);
+	sg_free_table(&job->dst);
+fail_dst:
+	tegra_crypto_unpin(job->src_pages, job->nr_src, false);
+	sg_free_table(&job->src);
+fail_src:
+	kfree(job);
+fail_job:
+	spin_lock(&ctx->lock);
+	ctx->nr_jobs--;
+	spin_unlock(&ctx->lock);
+	wake_up(&ctx->wq);
+	return ret;
+}
+
+static struct tegra_crypto_job *tegra_crypto_next_result(
+	struct tegra_crypto_ctx *ctx)
+{
+	struct tegra_crypto_job *job = NULL;
+
+	spin_lock(&ctx->lock);
+	if (!list_empty(&ctx->done)) {
+		job = list_first_entry(&ctx->done, struct tegra_crypto_job,
+			node);
+		list_del(&job->node);
+	}
+	spin_unlock(&ctx->lock);
+
+	return job;
+}
+
+static ssize_t tegra_crypto_dev_read(struct file *filp, char __user *buf,
+	size_t count, loff_t *ppos)
+{
+	struct tegra_crypto_ctx *ctx = filp->private_data;
+	struct tegra_crypto_job *job;
+	size_t copied = 0;
+	int ret;
+
+	if (count < sizeof(struct tegra_crypt_result))
+		return -EINVAL;
+
+	if (!(filp->f_flags & O_NONBLOCK)) {
+		/* nothing submitted means nothing to wait for */
+		ret = wait_event_interruptible(ctx->wq,
+			!list_empty(&ctx->done) || !ctx->nr_jobs);
+		if (ret < 0)
+			return ret;
+	}
+
+	while (count - copied >= sizeof(struct tegra_crypt_result)) {
+		job = tegra_crypto_next_result(ctx);
+		if (!job)
+			break;
+
+		if (copy_to_user(buf + copied, &job->res, sizeof(job->res))) {
+			spin_lock(&ctx->lock);
+			list_add(&job->node, &ctx->done);
+			spin_unlock(&ctx->lock);
+			return copied ? copied : -EFAULT;
+		}
+
+		kfree(job);
+		copied += sizeof(struct tegra_crypt_result);
+
+		spin_lock(&ctx->lock);
+		ctx->nr_jobs--;
+		spin_unlock(&ctx->lock);
+		wake_up(&ctx->wq);
+	}
+
+	if (copied)
+		return copied;
+
+	return (filp->f_flags & O_NONBLOCK) ? -EAGAIN : 0;
+}
+
+static unsigned int tegra_crypto_dev_poll(struct file *filp, poll_table *wait)
+{
+	struct tegra_crypto_ctx *ctx = filp->private_data;
+	unsigned int mask = 0;
+
+	poll_wait(filp, &ctx->wq, wait);
+
+	spin_lock(&ctx->lock);
+	if (!list_empty(&ctx->done))
+		mask |= POLLIN | POLLRDNORM;
+	if (ctx->nr_jobs < TEGRA_CRYPTO_MAX_ASYNC_REQS)
+		mask |= POLLOUT | POLLWRNORM;
+	spin_unlock(&ctx->lock);
+
+	return mask;
+}
+
 static long tegra_crypto_dev_ioctl(struct file *filp,
 	unsigned int ioctl_num, unsigned long arg)
 {
 	struct tegra_crypto_ctx *ctx = filp->private_data;
 	struct tegra_crypt_req crypt_req;
+	struct tegra_crypt_async_req async_req;
 	struct tegra_rng_req rng_req;
 	char *rng;
 	int ret = 0;
@@ -277,7 +692,18 @@ static long tegra_crypto_dev_ioctl(struct file *filp,
 		ret = process_crypt_req(ctx, &crypt_req);
 		break;
 
+	case TEGRA_CRYPTO_IOCTL_SUBMIT_REQ:
+		if (copy_from_user(&async_req, (void __user *)arg,
+			sizeof(async_req)))
+			return -EFAULT;
+
+		ret = tegra_crypto_submit(ctx, &async_req);
+		break;
+
 	case TEGRA_CRYPTO_IOCTL_SET_SEED:
+		if (!ctx->rng)
+			return -ENODEV;
+
 		if (copy_from_user(&rng_req, (void __user *)arg, sizeof(rng_req)))
 			return -EFAULT;
 
@@ -287,6 +713,9 @@ static long tegra_crypto_dev_ioctl(struct file *filp,
 			crypto_rng_seedsize(ctx->rng));
 		break;
 	case TEGRA_CRYPTO_IOCTL_GET_RANDOM:
+		if (!ctx->rng)
+			return -ENODEV;
+
 		if (copy_from_user(&rng_req, (void __user *)arg, sizeof(rng_req)))
 			return -EFAULT;
 
@@ -327,6 +756,8 @@ struct file_operations tegra_crypto_fops = {
 	.owner = THIS_MODULE,
 	.open = tegra_crypto_dev_open,
 	.release = tegra_crypto_dev_release,
+	.read = tegra_crypto_dev_read,
+	.poll = tegra_crypto_dev_poll,
 	.unlocked_ioctl = tegra_crypto_dev_ioctl,
 };
 
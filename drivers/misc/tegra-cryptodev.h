@@ -28,6 +28,7 @@
 #define TEGRA_CRYPTO_IOCTL_PROCESS_REQ	_IOWR(0x98, 101, int*)
 #define TEGRA_CRYPTO_IOCTL_SET_SEED	_IOWR(0x98, 102, int*)
 #define TEGRA_CRYPTO_IOCTL_GET_RANDOM	_IOWR(0x98, 103, int*)
+#define TEGRA_CRYPTO_IOCTL_SUBMIT_REQ	_IOWR(0x98, 104, int*)
 
 #define TEGRA_CRYPTO_MAX_KEY_SIZE	AES_MAX_KEY_SIZE
 #define TEGRA_CRYPTO_IV_SIZE	AES_BLOCK_SIZE
@@ -41,6 +42,12 @@
 #define TEGRA_CRYPTO_ECB	BIT(0)
 #define TEGRA_CRYPTO_CBC	BIT(1)
 #define TEGRA_CRYPTO_RNG	BIT(2)
+#define TEGRA_CRYPTO_CTR	BIT(3)	/* TEGRA_CRYPTO_IOCTL_SUBMIT_REQ only */
+#define TEGRA_CRYPTO_XTS	BIT(4)	/* TEGRA_CRYPTO_IOCTL_SUBMIT_REQ only */
+
+/* requests submitted and not yet read back, per open file */
+#define TEGRA_CRYPTO_MAX_ASYNC_REQS	8
+#define TEGRA_CRYPTO_MAX_ASYNC_SIZE	(1 << 20)
 
 /* a pointer to this struct needs to be passed to:
  * TEGRA_CRYPTO_IOCTL_PROCESS_REQ
@@ -57,6 +64,36 @@ struct tegra_crypt_req {
 	u8 *result;
 };
 
+/* a pointer to this struct needs to be passed to:
+ * TEGRA_CRYPTO_IOCTL_SUBMIT_REQ
+ *
+ * the request is queued and the ioctl returns at once. plaintext and
+ * result are used in place, so they must stay untouched until the
+ * matching tegra_crypt_result has been read from the fd. poll reports
+ * POLLIN when results can be read and POLLOUT when another request can
+ * be submitted; the ioctl fails with EAGAIN while
+ * TEGRA_CRYPTO_MAX_ASYNC_REQS are outstanding.
+ */
+struct tegra_crypt_async_req {
+	int op; /* e.g. TEGRA_CRYPTO_CBC */
+	bool encrypt;
+	char key[2 * TEGRA_CRYPTO_MAX_KEY_SIZE]; /* xts takes two keys */
+	int keylen;
+	char iv[TEGRA_CRYPTO_IV_SIZE];
+	int ivlen;
+	u8 *plaintext;
+	int plaintext_sz;
+	u8 *result;
+	u64 user_data; /* handed back in tegra_crypt_result */
+};
+
+/* read() on the fd returns an array of these, one per finished request */
+struct tegra_crypt_result {
+	u64 user_data;
+	int status; /* 0 or a negative errno */
+	char iv[TEGRA_CRYPTO_IV_SIZE]; /* iv to continue the stream with */
+};
+
 /* pointer to this struct should be passed to:
  * TEGRA_CRYPTO_IOCTL_SET_SEED
  * TEGRA_CRYPTO_IOCTL_GET_RANDOM
@@ -17,6 +17,11 @@
 
 #include <linux/scatterlist.h>
 #include <linux/swap.h>		/* For nr_free_buffer_pages() */
+#include <linux/list.h>
+#include <linux/random.h>
+
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
 #define RESULT_OK		0
 #define RESULT_FAIL		1
@@ -32,6 +37,25 @@
  */
 #define TEST_AREA_MAX_SIZE (128 * 1024 * 1024)
 
+/*
+ * The transfer size profiles go up to 4MiB, so the test area is never made
+ * smaller than that even if the card reports a smaller erase size.
+ */
+#define TEST_PROFILE_MAX_SIZE (4 * 1024 * 1024)
+
+/*
+ * Per-command latencies are kept as a log2 histogram in microseconds:
+ * bucket 0 counts commands under 1us, bucket n those in [2^(n-1), 2^n) us
+ * and the last bucket everything slower.
+ */
+#define TEST_LAT_BUCKETS	20
+
+/* how long each random I/O measurement runs for */
+static unsigned int rnd_perf_secs = 10;
+module_param(rnd_perf_secs, uint, 0644);
+MODULE_PARM_DESC(rnd_perf_secs, "duration in seconds of each random I/O "
+		 "measurement");
+
 /**
  * struct mmc_test_pages - pages allocated by 'alloc_pages()'.
  * @page: first page in the allocation
@@ -56,7 +80,9 @@ struct mmc_test_mem {
  * struct mmc_test_area - information for performance tests.
  * @max_sz: test area size (in bytes)
  * @dev_addr: address on card at which to do performance tests
- * @max_segs: maximum segments in scatterlist @sg
+ * @max_tfr: maximum transfer size allowed by driver (in bytes)
+ * @max_segs: maximum segments allowed by driver in scatterlist @sg
+ * @max_seg_sz: maximum segment size allowed by driver
  * @blocks: number of (512 byte) blocks currently mapped by @sg
  * @sg_len: length of currently mapped scatterlist @sg
  * @mem: allocated memory
@@ -65,13 +91,79 @@ struct mmc_test_mem {
 struct mmc_test_area {
 	unsigned long max_sz;
 	unsigned int dev_addr;
+	unsigned int max_tfr;
 	unsigned int max_segs;
+	unsigned int max_seg_sz;
 	unsigned int blocks;
 	unsigned int sg_len;
 	struct mmc_test_mem *mem;
 	struct scatterlist *sg;
 };
 
+/**
+ * struct mmc_test_lat - per-command latency statistics.
+ * @cnt: number of commands measured
+ * @total_ns: sum of all latencies
+ * @min_ns: lowest latency
+ * @max_ns: highest latency
+ * @hist: log2 histogram in microseconds, see TEST_LAT_BUCKETS
+ */
+struct mmc_test_lat {
+	unsigned int cnt;
+	u64 total_ns;
+	u32 min_ns;
+	u32 max_ns;
+	unsigned int hist[TEST_LAT_BUCKETS];
+};
+
+/**
+ * struct mmc_test_transfer_result - transfer results for performance tests.
+ * @link: double-linked list
+ * @count: amount of group of sectors to check
+ * @sectors: amount of sectors to check in one group
+ * @ts: time values of transfer
+ * @rate: calculated transfer rate
+ * @iops: I/O operations per second (times 100)
+ * @lat: latency of the individual commands
+ */
+struct mmc_test_transfer_result {
+	struct list_head link;
+	unsigned int count;
+	unsigned int sectors;
+	struct timespec ts;
+	unsigned int rate;
+	unsigned int iops;
+	struct mmc_test_lat lat;
+};
+
+/**
+ * struct mmc_test_general_result - results for tests.
+ * @link: double-linked list
+ * @card: card under test
+ * @testcase: number of test case
+ * @result: result of test run
+ * @tr_lst: transfer measurements if any as mmc_test_transfer_result
+ */
+struct mmc_test_general_result {
+	struct list_head link;
+	struct mmc_card *card;
+	int testcase;
+	int result;
+	struct list_head tr_lst;
+};
+
+/**
+ * struct mmc_test_dbgfs_file - debugfs related file.
+ * @link: double-linked list
+ * @card: card under test
+ * @file: file created under debugfs
+ */
+struct mmc_test_dbgfs_file {
+	struct list_head link;
+	struct mmc_card *card;
+	struct dentry *file;
+};
+
 /**
  * struct mmc_test_card - test information.
  * @card: card under test
@@ -79,6 +171,8 @@ struct mmc_test_area {
  * @buffer: transfer buffer
  * @highmem: buffer for highmem tests
  * @area: information for performance tests
+ * @gr: pointer to results of current testcase
+ * @lat: latencies collected since the last reported measurement
  */
 struct mmc_test_card {
 	struct mmc_card	*card;
@@ -89,6 +183,8 @@ struct mmc_test_card {
 	struct page	*highmem;
 #endif
 	struct mmc_test_area area;
+	struct mmc_test_general_result	*gr;
+	struct mmc_test_lat lat;
 };
 
 /*******************************************************************/
@@ -103,9 +199,10 @@ static int mmc_test_set_blksize(struct mmc_test_card *test, unsigned size)
 	struct mmc_command cmd;
 	int ret;
 
+	memset(&cmd, 0, sizeof(struct mmc_command));
 	cmd.opcode = MMC_SET_BLOCKLEN;
 	cmd.arg = size;
-	cmd.flags = MMC_RSP_R1 | MMC_CMD_AC;
+	cmd.flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_AC;
 	ret = mmc_wait_for_cmd(test->card->host, &cmd, 0);
 	if (ret)
 		return ret;
@@ -134,14 +231,18 @@ static void mmc_test_prepare_mrq(struct mmc_test_card *test,
 	if (!mmc_card_blockaddr(test->card))
 		mrq->cmd->arg <<= 9;
 
-	mrq->cmd->flags = MMC_RSP_R1 | MMC_CMD_ADTC;
+	mrq->cmd->flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_ADTC;
 
-	if (blocks == 1)
+	/*
+	 * SPI multiblock writes terminate using a special token, not a
+	 * STOP_TRANSMISSION request.
+	 */
+	if (blocks == 1 || (write && mmc_host_is_spi(test->card->host)))
 		mrq->stop = NULL;
 	else {
 		mrq->stop->opcode = MMC_STOP_TRANSMISSION;
 		mrq->stop->arg = 0;
-		mrq->stop->flags = MMC_RSP_R1B | MMC_CMD_AC;
+		mrq->stop->flags = MMC_RSP_SPI_R1B | MMC_RSP_R1B | MMC_CMD_AC;
 	}
 
 	mrq->data->blksz = blksz;
@@ -167,6 +268,10 @@ static int mmc_test_wait_busy(struct mmc_test_card *test)
 	int ret, busy;
 	struct mmc_command cmd;
 
+	/* SPI hosts wait for the busy token themselves */
+	if (mmc_host_is_spi(test->card->host))
+		return 0;
+
 	busy = 0;
 	do {
 		memset(&cmd, 0, sizeof(struct mmc_command));
@@ -310,7 +415,8 @@ out_free:
  */
 static int mmc_test_map_sg(struct mmc_test_mem *mem, unsigned long sz,
 			   struct scatterlist *sglist, int repeat,
-			   unsigned int max_segs, unsigned int *sg_len)
+			   unsigned int max_segs, unsigned int max_seg_sz,
+			   unsigned int *sg_len)
 {
 	struct scatterlist *sg = NULL;
 	unsigned int i;
@@ -324,6 +430,8 @@ static int mmc_test_map_sg(struct mmc_test_mem *mem, unsigned long sz,
 
 			if (sz < len)
 				len = sz;
+			if (len > max_seg_sz)
+				len = max_seg_sz;
 			if (sg)
 				sg = sg_next(sg);
 			else
@@ -355,38 +463,44 @@ static int mmc_test_map_sg_max_scatter(struct mmc_test_mem *mem,
 				       unsigned long sz,
 				       struct scatterlist *sglist,
 				       unsigned int max_segs,
+				       unsigned int max_seg_sz,
 				       unsigned int *sg_len)
 {
 	struct scatterlist *sg = NULL;
-	unsigned int i = mem->cnt, cnt;
+	unsigned int i, cnt;
 	unsigned long len;
 	void *base, *addr, *last_addr = NULL;
 
 	sg_init_table(sglist, max_segs);
 
 	*sg_len = 0;
-	while (sz && i) {
-		base = page_address(mem->arr[--i].page);
-		cnt = 1 << mem->arr[i].order;
-		while (sz && cnt) {
-			addr = base + PAGE_SIZE * --cnt;
-			if (last_addr && last_addr + PAGE_SIZE == addr)
-				continue;
-			last_addr = addr;
-			len = PAGE_SIZE;
-			if (sz < len)
-				len = sz;
-			if (sg)
-				sg = sg_next(sg);
-			else
-				sg = sglist;
-			if (!sg)
-				return -EINVAL;
-			sg_set_page(sg, virt_to_page(addr), len, 0);
-			sz -= len;
-			*sg_len += 1;
+	do {
+		i = mem->cnt;
+		while (sz && i) {
+			base = page_address(mem->arr[--i].page);
+			cnt = 1 << mem->arr[i].order;
+			while (sz && cnt) {
+				addr = base + PAGE_SIZE * --cnt;
+				if (last_addr && last_addr + PAGE_SIZE == addr)
+					continue;
+				last_addr = addr;
+				len = PAGE_SIZE;
+				if (len > max_seg_sz)
+					len = max_seg_sz;
+				if (sz < len)
+					len = sz;
+				if (sg)
+					sg = sg_next(sg);
+				else
+					sg = sglist;
+				if (!sg)
+					return -EINVAL;
+				sg_set_page(sg, virt_to_page(addr), len, 0);
+				sz -= len;
+				*sg_len += 1;
+			}
 		}
-	}
+	} while (sz);
 
 	if (sg)
 		sg_mark_end(sg);
@@ -420,24 +534,91 @@ static unsigned int mmc_test_rate(uint64_t bytes, struct timespec *ts)
 	return bytes;
 }
 
+/*
+ * Forget the command latencies collected so far.
+ */
+static void mmc_test_lat_reset(struct mmc_test_card *test)
+{
+	memset(&test->lat, 0, sizeof(struct mmc_test_lat));
+}
+
+/*
+ * Account the latency of one command.
+ */
+static void mmc_test_lat_add(struct mmc_test_card *test, struct timespec *ts1,
+			     struct timespec *ts2)
+{
+	struct mmc_test_lat *lat = &test->lat;
+	struct timespec ts = timespec_sub(*ts2, *ts1);
+	u64 ns = timespec_to_ns(&ts);
+	u32 us, ns32;
+	int bucket;
+
+	ns32 = ns > UINT_MAX ? UINT_MAX : ns;
+	us = ns32 / 1000;
+
+	bucket = fls(us);
+	if (bucket >= TEST_LAT_BUCKETS)
+		bucket = TEST_LAT_BUCKETS - 1;
+
+	if (!lat->cnt || ns32 < lat->min_ns)
+		lat->min_ns = ns32;
+	if (ns32 > lat->max_ns)
+		lat->max_ns = ns32;
+	lat->total_ns += ns;
+	lat->hist[bucket]++;
+	lat->cnt++;
+}
+
+/*
+ * Save transfer results for future usage
+ */
+static void mmc_test_save_transfer_result(struct mmc_test_card *test,
+	unsigned int count, unsigned int sectors, struct timespec ts,
+	unsigned int rate, unsigned int iops)
+{
+	struct mmc_test_transfer_result *tr;
+
+	if (!test->gr)
+		return;
+
+	tr = kmalloc(sizeof(struct mmc_test_transfer_result), GFP_KERNEL);
+	if (!tr)
+		return;
+
+	tr->count = count;
+	tr->sectors = sectors;
+	tr->ts = ts;
+	tr->rate = rate;
+	tr->iops = iops;
+	tr->lat = test->lat;
+
+	list_add_tail(&tr->link, &test->gr->tr_lst);
+}
+
 /*
  * Print the transfer rate.
  */
 static void mmc_test_print_rate(struct mmc_test_card *test, uint64_t bytes,
 				struct timespec *ts1, struct timespec *ts2)
 {
-	unsigned int rate, sectors = bytes >> 9;
+	unsigned int rate, iops, sectors = bytes >> 9;
 	struct timespec ts;
 
 	ts = timespec_sub(*ts2, *ts1);
 
 	rate = mmc_test_rate(bytes, &ts);
+	iops = mmc_test_rate(100, &ts); /* I/O ops per sec x 100 */
 
 	printk(KERN_INFO "%s: Transfer of %u sectors (%u%s KiB) took %lu.%09lu "
-			 "seconds (%u kB/s, %u KiB/s)\n",
+			 "seconds (%u kB/s, %u KiB/s, %u.%02u IOPS)\n",
 			 mmc_hostname(test->card->host), sectors, sectors >> 1,
 			 (sectors == 1 ? ".5" : ""), (unsigned long)ts.tv_sec,
-			 (unsigned long)ts.tv_nsec, rate / 1000, rate / 1024);
+			 (unsigned long)ts.tv_nsec, rate / 1000, rate / 1024,
+			 iops / 100, iops % 100);
+
+	mmc_test_save_transfer_result(test, 1, sectors, ts, rate, iops);
+	mmc_test_lat_reset(test);
 }
 
 /*
@@ -447,20 +628,25 @@ static void mmc_test_print_avg_rate(struct mmc_test_card *test, uint64_t bytes,
 				    unsigned int count, struct timespec *ts1,
 				    struct timespec *ts2)
 {
-	unsigned int rate, sectors = bytes >> 9;
+	unsigned int rate, iops, sectors = bytes >> 9;
 	uint64_t tot = bytes * count;
 	struct timespec ts;
 
 	ts = timespec_sub(*ts2, *ts1);
 
 	rate = mmc_test_rate(tot, &ts);
+	iops = mmc_test_rate(count * 100, &ts); /* I/O ops per sec x 100 */
 
 	printk(KERN_INFO "%s: Transfer of %u x %u sectors (%u x %u%s KiB) took "
-			 "%lu.%09lu seconds (%u kB/s, %u KiB/s)\n",
+			 "%lu.%09lu seconds (%u kB/s, %u KiB/s, "
+			 "%u.%02u IOPS)\n",
 			 mmc_hostname(test->card->host), count, sectors, count,
 			 sectors >> 1, (sectors == 1 ? ".5" : ""),
 			 (unsigned long)ts.tv_sec, (unsigned long)ts.tv_nsec,
-			 rate / 1000, rate / 1024);
+			 rate / 1000, rate / 1024, iops / 100, iops % 100);
+
+	mmc_test_save_transfer_result(test, count, sectors, ts, rate, iops);
+	mmc_test_lat_reset(test);
 }
 
 /*
@@ -1220,51 +1406,78 @@ static int mmc_test_area_map(struct mmc_test_card *test, unsigned long sz,
 
 	if (max_scatter) {
 		return mmc_test_map_sg_max_scatter(t->mem, sz, t->sg,
-						   t->max_segs, &t->sg_len);
+						   t->max_segs, t->max_seg_sz,
+						   &t->sg_len);
 	} else {
 		return mmc_test_map_sg(t->mem, sz, t->sg, 1, t->max_segs,
-				       &t->sg_len);
+				       t->max_seg_sz, &t->sg_len);
 	}
 }
 
 /*
- * Transfer bytes mapped by mmc_test_area_map().
+ * Transfer bytes mapped by mmc_test_area_map().  The time taken by the
+ * command, including waiting for the card to leave the busy state, is
+ * accounted in the latency statistics.
  */
 static int mmc_test_area_transfer(struct mmc_test_card *test,
 				  unsigned int dev_addr, int write)
 {
 	struct mmc_test_area *t = &test->area;
+	struct timespec ts1, ts2;
+	int ret;
+
+	getnstimeofday(&ts1);
+	ret = mmc_test_simple_transfer(test, t->sg, t->sg_len, dev_addr,
+				       t->blocks, 512, write);
+	getnstimeofday(&ts2);
+
+	mmc_test_lat_add(test, &ts1, &ts2);
 
-	return mmc_test_simple_transfer(test, t->sg, t->sg_len, dev_addr,
-					t->blocks, 512, write);
+	return ret;
 }
 
 /*
- * Map and transfer bytes.
+ * Map and transfer bytes.  Transfers larger than the host allows in one
+ * request are done as back-to-back requests of the maximum size.
  */
 static int mmc_test_area_io(struct mmc_test_card *test, unsigned long sz,
 			    unsigned int dev_addr, int write, int max_scatter,
 			    int timed)
 {
 	struct timespec ts1, ts2;
+	unsigned long tfr, bytes = sz;
 	int ret;
 
-	ret = mmc_test_area_map(test, sz, max_scatter);
+	tfr = min_t(unsigned long, sz, test->area.max_tfr);
+
+	ret = mmc_test_area_map(test, tfr, max_scatter);
 	if (ret)
 		return ret;
 
-	if (timed)
+	if (timed) {
+		mmc_test_lat_reset(test);
 		getnstimeofday(&ts1);
+	}
 
-	ret = mmc_test_area_transfer(test, dev_addr, write);
-	if (ret)
-		return ret;
+	while (sz) {
+		if (sz < tfr) {
+			tfr = sz;
+			ret = mmc_test_area_map(test, tfr, max_scatter);
+			if (ret)
+				return ret;
+		}
+		ret = mmc_test_area_transfer(test, dev_addr, write);
+		if (ret)
+			return ret;
+		dev_addr += tfr >> 9;
+		sz -= tfr;
+	}
 
 	if (timed)
 		getnstimeofday(&ts2);
 
 	if (timed)
-		mmc_test_print_rate(test, sz, &ts1, &ts2);
+		mmc_test_print_rate(test, bytes, &ts1, &ts2);
 
 	return 0;
 }
@@ -1317,7 +1530,9 @@ static int mmc_test_area_cleanup(struct mmc_test_card *test)
 static int mmc_test_area_init(struct mmc_test_card *test, int erase, int fill)
 {
 	struct mmc_test_area *t = &test->area;
+	struct mmc_host *host = test->card->host;
 	unsigned long min_sz = 64 * 1024;
+	unsigned int seg_sz;
 	int ret;
 
 	ret = mmc_test_set_blksize(test, 512);
@@ -1328,6 +1543,31 @@ static int mmc_test_area_init(struct mmc_test_card *test, int erase, int fill)
 		t->max_sz = TEST_AREA_MAX_SIZE;
 	else
 		t->max_sz = (unsigned long)test->card->pref_erase << 9;
+	if (t->max_sz < TEST_PROFILE_MAX_SIZE)
+		t->max_sz = TEST_PROFILE_MAX_SIZE;
+
+	/*
+	 * Segments are whole sectors, and in the worst case (maximally
+	 * scattered pages) no segment is larger than a page.
+	 */
+	t->max_segs = min(host->max_hw_segs, host->max_phys_segs);
+	if (!t->max_segs)
+		t->max_segs = 1;
+	t->max_seg_sz = host->max_seg_size;
+	t->max_seg_sz -= t->max_seg_sz % 512;
+	seg_sz = min_t(unsigned int, t->max_seg_sz, PAGE_SIZE);
+	if (!seg_sz)
+		return -EINVAL;
+
+	t->max_tfr = t->max_sz;
+	if (t->max_tfr >> 9 > host->max_blk_count)
+		t->max_tfr = host->max_blk_count << 9;
+	if (t->max_tfr > host->max_req_size)
+		t->max_tfr = host->max_req_size;
+	if (t->max_tfr / seg_sz > t->max_segs)
+		t->max_tfr = t->max_segs * seg_sz;
+	t->max_tfr -= t->max_tfr % 512;
+
 	/*
 	 * Try to allocate enough memory for the whole area.  Less is OK
 	 * because the same memory can be mapped into the scatterlist more than
@@ -1337,7 +1577,6 @@ static int mmc_test_area_init(struct mmc_test_card *test, int erase, int fill)
 	if (!t->mem)
 		return -ENOMEM;
 
-	t->max_segs = DIV_ROUND_UP(t->max_sz, PAGE_SIZE);
 	t->sg = kmalloc(sizeof(struct scatterlist) * t->max_segs, GFP_KERNEL);
 	if (!t->sg) {
 		ret = -ENOMEM;
@@ -1499,19 +1738,23 @@ static int mmc_test_profile_trim_perf(struct mmc_test_card *test)
 
 	for (sz = 512; sz < test->area.max_sz; sz <<= 1) {
 		dev_addr = test->area.dev_addr + (sz >> 9);
+		mmc_test_lat_reset(test);
 		getnstimeofday(&ts1);
 		ret = mmc_erase(test->card, dev_addr, sz >> 9, MMC_TRIM_ARG);
 		if (ret)
 			return ret;
 		getnstimeofday(&ts2);
+		mmc_test_lat_add(test, &ts1, &ts2);
 		mmc_test_print_rate(test, sz, &ts1, &ts2);
 	}
 	dev_addr = test->area.dev_addr;
+	mmc_test_lat_reset(test);
 	getnstimeofday(&ts1);
 	ret = mmc_erase(test->card, dev_addr, sz >> 9, MMC_TRIM_ARG);
 	if (ret)
 		return ret;
 	getnstimeofday(&ts2);
+	mmc_test_lat_add(test, &ts1, &ts2);
 	mmc_test_print_rate(test, sz, &ts1, &ts2);
 	return 0;
 }
@@ -1529,6 +1772,7 @@ static int mmc_test_profile_seq_read_perf(struct mmc_test_card *test)
 	for (sz = 512; sz <= test->area.max_sz; sz <<= 1) {
 		cnt = test->area.max_sz / sz;
 		dev_addr = test->area.dev_addr;
+		mmc_test_lat_reset(test);
 		getnstimeofday(&ts1);
 		for (i = 0; i < cnt; i++) {
 			ret = mmc_test_area_io(test, sz, dev_addr, 0, 0, 0);
@@ -1558,6 +1802,7 @@ static int mmc_test_profile_seq_write_perf(struct mmc_test_card *test)
 			return ret;
 		cnt = test->area.max_sz / sz;
 		dev_addr = test->area.dev_addr;
+		mmc_test_lat_reset(test);
 		getnstimeofday(&ts1);
 		for (i = 0; i < cnt; i++) {
 			ret = mmc_test_area_io(test, sz, dev_addr, 1, 0, 0);
@@ -1596,12 +1841,18 @@ static int mmc_test_profile_seq_trim_perf(struct mmc_test_card *test)
 			return ret;
 		cnt = test->area.max_sz / sz;
 		dev_addr = test->area.dev_addr;
+		mmc_test_lat_reset(test);
 		getnstimeofday(&ts1);
 		for (i = 0; i < cnt; i++) {
+			struct timespec tc1, tc2;
+
+			getnstimeofday(&tc1);
 			ret = mmc_erase(test->card, dev_addr, sz >> 9,
 					MMC_TRIM_ARG);
 			if (ret)
 				return ret;
+			getnstimeofday(&tc2);
+			mmc_test_lat_add(test, &tc1, &tc2);
 			dev_addr += (sz >> 9);
 		}
 		getnstimeofday(&ts2);
@@ -1610,6 +1861,250 @@ static int mmc_test_profile_seq_trim_perf(struct mmc_test_card *test)
 	return 0;
 }
 
+/*
+ * Return a random number in the range [0, rnd_cnt).
+ */
+static unsigned int mmc_test_rnd_num(unsigned int rnd_cnt)
+{
+	uint64_t r;
+
+	r = random32();
+	r *= rnd_cnt;
+	return r >> 32;
+}
+
+/*
+ * Random transfers of sz bytes for rnd_perf_secs seconds.  Transfers are
+ * aligned to their size and spread over the second quarter of the card, so
+ * that they land in many different erase blocks.
+ */
+static int mmc_test_rnd_perf(struct mmc_test_card *test, int write,
+			     unsigned long sz)
+{
+	unsigned int dev_addr, cnt, base, range, ssz = sz >> 9;
+	struct timespec ts1, ts2, ts;
+	int ret;
+
+	range = mmc_test_capacity(test->card) / 4 / ssz;
+	if (!range)
+		return RESULT_UNSUP_CARD;
+	base = range * ssz;
+
+	mmc_test_lat_reset(test);
+	getnstimeofday(&ts1);
+	for (cnt = 0; cnt < UINT_MAX; cnt++) {
+		getnstimeofday(&ts2);
+		ts = timespec_sub(ts2, ts1);
+		if (ts.tv_sec >= (long)rnd_perf_secs)
+			break;
+		dev_addr = base + ssz * mmc_test_rnd_num(range);
+		ret = mmc_test_area_io(test, sz, dev_addr, write, 0, 0);
+		if (ret)
+			return ret;
+	}
+	mmc_test_print_avg_rate(test, sz, cnt, &ts1, &ts2);
+	return 0;
+}
+
+static int mmc_test_random_perf(struct mmc_test_card *test, int write)
+{
+	unsigned long sz;
+	int ret;
+
+	for (sz = 512; sz <= TEST_PROFILE_MAX_SIZE; sz <<= 1) {
+		ret = mmc_test_rnd_perf(test, write, sz);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/*
+ * Random read performance by transfer size.
+ */
+static int mmc_test_random_read_perf(struct mmc_test_card *test)
+{
+	return mmc_test_random_perf(test, 0);
+}
+
+/*
+ * Random write performance by transfer size.
+ */
+static int mmc_test_random_write_perf(struct mmc_test_card *test)
+{
+	return mmc_test_random_perf(test, 1);
+}
+
+/*
+ * Random 4KiB read IOPS.
+ */
+static int mmc_test_random_read_iops(struct mmc_test_card *test)
+{
+	return mmc_test_rnd_perf(test, 0, 4096);
+}
+
+/*
+ * Random 4KiB write IOPS.
+ */
+static int mmc_test_random_write_iops(struct mmc_test_card *test)
+{
+	return mmc_test_rnd_perf(test, 1, 4096);
+}
+
+/**
+ * struct mmc_test_async_req - a request issued with mmc_start_req().
+ * @areq: handle for the core
+ * @test: test information
+ * @mrq: the request
+ * @cmd: read or write command
+ * @stop: stop command
+ * @data: data phase
+ * @sg: scatterlist of the data phase
+ * @sg_len: length of @sg
+ */
+struct mmc_test_async_req {
+	struct mmc_async_req areq;
+	struct mmc_test_card *test;
+	struct mmc_request mrq;
+	struct mmc_command cmd;
+	struct mmc_command stop;
+	struct mmc_data data;
+	struct scatterlist *sg;
+	unsigned int sg_len;
+};
+
+static int mmc_test_check_result_async(struct mmc_card *card,
+				       struct mmc_async_req *areq)
+{
+	struct mmc_test_async_req *rq =
+		container_of(areq, struct mmc_test_async_req, areq);
+
+	mmc_test_wait_busy(rq->test);
+
+	return mmc_test_check_result(rq->test, areq->mrq);
+}
+
+/*
+ * Do cnt consecutive transfers of sz bytes starting at dev_addr, using the
+ * two requests in rq alternately so that one is prepared while the other
+ * is in progress.  This is how the block driver drives the host.
+ */
+static int mmc_test_nonblock_transfer(struct mmc_test_card *test,
+				      struct mmc_test_async_req *rq,
+				      unsigned long sz, unsigned int dev_addr,
+				      unsigned int cnt, int write)
+{
+	struct mmc_test_async_req *cur;
+	unsigned int i;
+	int ret = 0;
+
+	for (i = 0; i < cnt; i++) {
+		cur = &rq[i & 1];
+
+		memset(&cur->mrq, 0, sizeof(struct mmc_request));
+		memset(&cur->cmd, 0, sizeof(struct mmc_command));
+		memset(&cur->data, 0, sizeof(struct mmc_data));
+		memset(&cur->stop, 0, sizeof(struct mmc_command));
+
+		cur->mrq.cmd = &cur->cmd;
+		cur->mrq.data = &cur->data;
+		cur->mrq.stop = &cur->stop;
+
+		mmc_test_prepare_mrq(test, &cur->mrq, cur->sg, cur->sg_len,
+				     dev_addr, sz >> 9, 512, write);
+
+		cur->areq.mrq = &cur->mrq;
+		cur->areq.err_check = mmc_test_check_result_async;
+
+		/* waits for the request started in the previous iteration */
+		mmc_start_req(test->card->host, &cur->areq, &ret);
+		if (ret)
+			return ret;
+
+		dev_addr += sz >> 9;
+	}
+
+	mmc_start_req(test->card->host, NULL, &ret);
+
+	return ret;
+}
+
+/*
+ * Consecutive transfers by transfer size, keeping two requests in flight
+ * through mmc_start_req() as the block driver does.  Transfer sizes are
+ * limited to what the host accepts in one request.
+ */
+static int mmc_test_nonblock_perf(struct mmc_test_card *test, int write)
+{
+	struct mmc_test_area *t = &test->area;
+	struct mmc_test_async_req *rq;
+	struct timespec ts1, ts2;
+	unsigned long sz;
+	unsigned int i, cnt;
+	int ret = 0;
+
+	rq = kzalloc(2 * sizeof(struct mmc_test_async_req), GFP_KERNEL);
+	if (!rq)
+		return -ENOMEM;
+
+	for (i = 0; i < 2; i++) {
+		rq[i].test = test;
+		rq[i].sg = kmalloc(sizeof(struct scatterlist) * t->max_segs,
+				   GFP_KERNEL);
+		if (!rq[i].sg) {
+			ret = -ENOMEM;
+			goto out_free;
+		}
+	}
+
+	for (sz = 512; sz <= t->max_tfr && sz <= TEST_PROFILE_MAX_SIZE;
+	     sz <<= 1) {
+		for (i = 0; i < 2; i++) {
+			ret = mmc_test_map_sg(t->mem, sz, rq[i].sg, 1,
+					      t->max_segs, t->max_seg_sz,
+					      &rq[i].sg_len);
+			if (ret)
+				goto out_free;
+		}
+		if (write) {
+			ret = mmc_test_area_erase(test);
+			if (ret)
+				goto out_free;
+		}
+		cnt = t->max_sz / sz;
+		mmc_test_lat_reset(test);
+		getnstimeofday(&ts1);
+		ret = mmc_test_nonblock_transfer(test, rq, sz, t->dev_addr,
+						 cnt, write);
+		if (ret)
+			goto out_free;
+		getnstimeofday(&ts2);
+		mmc_test_print_avg_rate(test, sz, cnt, &ts1, &ts2);
+	}
+
+out_free:
+	for (i = 0; i < 2; i++)
+		kfree(rq[i].sg);
+	kfree(rq);
+	return ret;
+}
+
+/*
+ * Pipelined read performance by transfer size.
+ */
+static int mmc_test_nonblock_read_perf(struct mmc_test_card *test)
+{
+	return mmc_test_nonblock_perf(test, 0);
+}
+
+/*
+ * Pipelined write performance by transfer size.
+ */
+static int mmc_test_nonblock_write_perf(struct mmc_test_card *test)
+{
+	return mmc_test_nonblock_perf(test, 1);
+}
+
 static const struct mmc_test_case mmc_test_cases[] = {
 	{
 		.name = "Basic write (no data verification)",
@@ -1849,10 +2344,74 @@ static const struct mmc_test_case mmc_test_cases[] = {
 		.cleanup = mmc_test_area_cleanup,
 	},
 
+	{
+		.name = "Random read performance by transfer size",
+		.prepare = mmc_test_area_prepare,
+		.run = mmc_test_random_read_perf,
+		.cleanup = mmc_test_area_cleanup,
+	},
+
+	{
+		.name = "Random write performance by transfer size",
+		.prepare = mmc_test_area_prepare,
+		.run = mmc_test_random_write_perf,
+		.cleanup = mmc_test_area_cleanup,
+	},
+
+	{
+		.name = "Random 4KiB read IOPS",
+		.prepare = mmc_test_area_prepare,
+		.run = mmc_test_random_read_iops,
+		.cleanup = mmc_test_area_cleanup,
+	},
+
+	{
+		.name = "Random 4KiB write IOPS",
+		.prepare = mmc_test_area_prepare,
+		.run = mmc_test_random_write_iops,
+		.cleanup = mmc_test_area_cleanup,
+	},
+
+	{
+		.name = "Pipelined read performance by transfer size",
+		.prepare = mmc_test_area_prepare_fill,
+		.run = mmc_test_nonblock_read_perf,
+		.cleanup = mmc_test_area_cleanup,
+	},
+
+	{
+		.name = "Pipelined write performance by transfer size",
+		.prepare = mmc_test_area_prepare,
+		.run = mmc_test_nonblock_write_perf,
+		.cleanup = mmc_test_area_cleanup,
+	},
+
 };
 
 static DEFINE_MUTEX(mmc_test_lock);
 
+static LIST_HEAD(mmc_test_result);
+
+static void mmc_test_free_result(struct mmc_card *card)
+{
+	struct mmc_test_general_result *gr, *grs;
+
+	list_for_each_entry_safe(gr, grs, &mmc_test_result, link) {
+		struct mmc_test_transfer_result *tr, *trs;
+
+		if (card && gr->card != card)
+			continue;
+
+		list_for_each_entry_safe(tr, trs, &gr->tr_lst, link) {
+			list_del(&tr->link);
+			kfree(tr);
+		}
+
+		list_del(&gr->link);
+		kfree(gr);
+	}
+}
+
 static void mmc_test_run(struct mmc_test_card *test, int testcase)
 {
 	int i, ret;
@@ -1860,9 +2419,14 @@ static void mmc_test_run(struct mmc_test_card *test, int testcase)
 	printk(KERN_INFO "%s: Starting tests of card %s...\n",
 		mmc_hostname(test->card->host), mmc_card_id(test->card));
 
+	/* only the results of the latest run are kept */
+	mmc_test_free_result(test->card);
+
 	mmc_claim_host(test->card->host);
 
 	for (i = 0;i < ARRAY_SIZE(mmc_test_cases);i++) {
+		struct mmc_test_general_result *gr;
+
 		if (testcase && ((i + 1) != testcase))
 			continue;
 
@@ -1870,6 +2434,17 @@ static void mmc_test_run(struct mmc_test_card *test, int testcase)
 			mmc_hostname(test->card->host), i + 1,
 			mmc_test_cases[i].name);
 
+		gr = kzalloc(sizeof(struct mmc_test_general_result),
+			GFP_KERNEL);
+		if (gr) {
+			INIT_LIST_HEAD(&gr->tr_lst);
+			gr->card = test->card;
+			gr->testcase = i + 1;
+			list_add_tail(&gr->link, &mmc_test_result);
+		}
+		test->gr = gr;
+		mmc_test_lat_reset(test);
+
 		if (mmc_test_cases[i].prepare) {
 			ret = mmc_test_cases[i].prepare(test);
 			if (ret) {
@@ -1877,6 +2452,8 @@ static void mmc_test_run(struct mmc_test_card *test, int testcase)
 					"stage failed! (%d)\n",
 					mmc_hostname(test->card->host),
 					ret);
+				if (gr)
+					gr->result = ret;
 				continue;
 			}
 		}
@@ -1906,6 +2483,9 @@ static void mmc_test_run(struct mmc_test_card *test, int testcase)
 				mmc_hostname(test->card->host), ret);
 		}
 
+		if (gr)
+			gr->result = ret;
+
 		if (mmc_test_cases[i].cleanup) {
 			ret = mmc_test_cases[i].cleanup(test);
 			if (ret) {
@@ -1919,6 +2499,8 @@ static void mmc_test_run(struct mmc_test_card *test, int testcase)
 
 	mmc_release_host(test->card->host);
 
+	test->gr = NULL;
+
 	printk(KERN_INFO "%s: Tests completed.\n",
 		mmc_hostname(test->card->host));
 }
@@ -1975,6 +2557,124 @@ static ssize_t mmc_test_store(struct device *dev,
 
 static DEVICE_ATTR(test, S_IWUSR | S_IRUGO, mmc_test_show, mmc_test_store);
 
+static LIST_HEAD(mmc_test_file_test);
+
+/*
+ * Results of the last run, one block per test case:
+ *
+ *   Test <case>: <result>
+ *   <count> <sectors> <seconds>.<nanoseconds> <bytes/s> <IOPS>.<hundredths>
+ *   lat <commands> <min ns> <avg ns> <max ns> <histogram>
+ *
+ * with a pair of measurement lines for every transfer size of a
+ * performance test.  The histogram has TEST_LAT_BUCKETS counts of
+ * commands, the first for those under 1us and then one per power of two
+ * microseconds.
+ */
+static int mtf_results_show(struct seq_file *sf, void *data)
+{
+	struct mmc_card *card = (struct mmc_card *)sf->private;
+	struct mmc_test_general_result *gr;
+	int i;
+
+	mutex_lock(&mmc_test_lock);
+
+	list_for_each_entry(gr, &mmc_test_result, link) {
+		struct mmc_test_transfer_result *tr;
+
+		if (gr->card != card)
+			continue;
+
+		seq_printf(sf, "Test %d: %d\n", gr->testcase, gr->result);
+
+		list_for_each_entry(tr, &gr->tr_lst, link) {
+			u64 avg = tr->lat.total_ns;
+
+			if (tr->lat.cnt)
+				do_div(avg, tr->lat.cnt);
+
+			seq_printf(sf, "%u %d %lu.%09lu %u %u.%02u\n",
+				tr->count, tr->sectors,
+				(unsigned long)tr->ts.tv_sec,
+				(unsigned long)tr->ts.tv_nsec,
+				tr->rate, tr->iops / 100, tr->iops % 100);
+
+			seq_printf(sf, "lat %u %u %llu %u", tr->lat.cnt,
+				tr->lat.min_ns, (unsigned long long)avg,
+				tr->lat.max_ns);
+			for (i = 0; i < TEST_LAT_BUCKETS; i++)
+				seq_printf(sf, " %u", tr->lat.hist[i]);
+			seq_putc(sf, '\n');
+		}
+	}
+
+	mutex_unlock(&mmc_test_lock);
+
+	return 0;
+}
+
+static int mtf_results_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, mtf_results_show, inode->i_private);
+}
+
+static const struct file_operations mmc_test_fops_results = {
+	.open		= mtf_results_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/*
+ * The card's own debugfs directory is only created once the card has been
+ * probed, so the results file lives in the directory of its host.
+ */
+static void mmc_test_register_file(struct mmc_card *card)
+{
+	struct mmc_test_dbgfs_file *df;
+	struct dentry *file;
+
+	if (!card->host->debugfs_root)
+		return;
+
+	file = debugfs_create_file("mmc_test_results", S_IRUGO,
+		card->host->debugfs_root, card, &mmc_test_fops_results);
+	if (IS_ERR_OR_NULL(file)) {
+		dev_err(&card->dev, "Can't create results file in debugfs\n");
+		return;
+	}
+
+	df = kmalloc(sizeof(struct mmc_test_dbgfs_file), GFP_KERNEL);
+	if (!df) {
+		debugfs_remove(file);
+		return;
+	}
+
+	df->card = card;
+	df->file = file;
+
+	mutex_lock(&mmc_test_lock);
+	list_add(&df->link, &mmc_test_file_test);
+	mutex_unlock(&mmc_test_lock);
+}
+
+static void mmc_test_free_dbgfs_file(struct mmc_card *card)
+{
+	struct mmc_test_dbgfs_file *df, *dfs;
+
+	mutex_lock(&mmc_test_lock);
+
+	list_for_each_entry_safe(df, dfs, &mmc_test_file_test, link) {
+		if (card && df->card != card)
+			continue;
+		debugfs_remove(df->file);
+		list_del(&df->link);
+		kfree(df);
+	}
+
+	mutex_unlock(&mmc_test_lock);
+}
+
 static int mmc_test_probe(struct mmc_card *card)
 {
 	int ret;
@@ -1986,6 +2686,8 @@ static int mmc_test_probe(struct mmc_card *card)
 	if (ret)
 		return ret;
 
+	mmc_test_register_file(card);
+
 	dev_info(&card->dev, "Card claimed for testing.\n");
 
 	return 0;
@@ -1993,6 +2695,13 @@ static int mmc_test_probe(struct mmc_card *card)
 
 static void mmc_test_remove(struct mmc_card *card)
 {
+	/* the results file takes mmc_test_lock, so remove it first */
+	mmc_test_free_dbgfs_file(card);
+
+	mutex_lock(&mmc_test_lock);
+	mmc_test_free_result(card);
+	mutex_unlock(&mmc_test_lock);
+
 	device_remove_file(&card->dev, &dev_attr_test);
 }
 
@@ -2011,6 +2720,10 @@ static int __init mmc_test_init(void)
 
 static void __exit mmc_test_exit(void)
 {
+	/* Clear stalled data if card is still plugged */
+	mmc_test_free_result(NULL);
+	mmc_test_free_dbgfs_file(NULL);
+
 	mmc_unregister_driver(&mmc_driver);
 }
 
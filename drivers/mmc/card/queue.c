@@ -22,6 +22,19 @@
 
 #define MMC_QUEUE_BOUNCESZ	65536
 
+/*
+ * Hosts that take a single segment per command get requests of up to
+ * this many segments, sent as back-to-back commands.
+ */
+#define MMC_QUEUE_DIRECT_SEGS	128
+
+/*
+ * A request that maps to at most this many segments is sent straight
+ * from its scatterlist, one command per segment.  Beyond that the copy
+ * through the bounce buffer costs less than the extra commands.
+ */
+#define MMC_QUEUE_SPLIT_SEGS	4
+
 #define MMC_QUEUE_SUSPENDED	(1 << 0)
 
 /*
@@ -52,15 +65,21 @@ static int mmc_queue_thread(void *d)
 	down(&mq->thread_sem);
 	do {
 		struct request *req = NULL;
+		struct mmc_queue_req *tmp;
 
 		spin_lock_irq(q->queue_lock);
 		set_current_state(TASK_INTERRUPTIBLE);
 		if (!blk_queue_plugged(q))
 			req = blk_fetch_request(q);
-		mq->req = req;
+		mq->mqrq_cur->req = req;
 		spin_unlock_irq(q->queue_lock);
 
-		if (!req) {
+		/*
+		 * With a request still in flight, issue_fn is also called
+		 * with a NULL request so that the previous one is completed
+		 * before the thread goes to sleep.
+		 */
+		if (!req && !mq->mqrq_prev->req) {
 			if (kthread_should_stop()) {
 				set_current_state(TASK_RUNNING);
 				break;
@@ -73,6 +92,13 @@ static int mmc_queue_thread(void *d)
 		set_current_state(TASK_RUNNING);
 
 		mq->issue_fn(mq, req);
+
+		/* the current request becomes the previous one */
+		mq->mqrq_prev->brq.mrq.data = NULL;
+		mq->mqrq_prev->req = NULL;
+		tmp = mq->mqrq_prev;
+		mq->mqrq_prev = mq->mqrq_cur;
+		mq->mqrq_cur = tmp;
 	} while (1);
 	up(&mq->thread_sem);
 
@@ -98,10 +124,28 @@ static void mmc_request(struct request_queue *q)
 		return;
 	}
 
-	if (!mq->req)
+	if (!mq->mqrq_cur->req && !mq->mqrq_prev->req)
 		wake_up_process(mq->thread);
 }
 
+static void mmc_queue_free_reqs(struct mmc_queue *mq)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(mq->mqrq); i++) {
+		struct mmc_queue_req *mqrq = &mq->mqrq[i];
+
+		kfree(mqrq->bounce_sg);
+		mqrq->bounce_sg = NULL;
+
+		kfree(mqrq->sg);
+		mqrq->sg = NULL;
+
+		kfree(mqrq->bounce_buf);
+		mqrq->bounce_buf = NULL;
+	}
+}
+
 /**
  * mmc_init_queue - initialise a queue structure.
  * @mq: mmc queue
@@ -114,7 +158,8 @@ int mmc_init_queue(struct mmc_queue *mq, struct mmc_card *card, spinlock_t *lock
 {
 	struct mmc_host *host = card->host;
 	u64 limit = BLK_BOUNCE_HIGH;
-	int ret;
+	unsigned int segs;
+	int ret, i;
 
 	if (mmc_dev(host)->dma_mask && *mmc_dev(host)->dma_mask)
 		limit = *mmc_dev(host)->dma_mask;
@@ -124,8 +169,11 @@ int mmc_init_queue(struct mmc_queue *mq, struct mmc_card *card, spinlock_t *lock
 	if (!mq->queue)
 		return -ENOMEM;
 
+	memset(mq->mqrq, 0, sizeof(mq->mqrq));
+	mq->mqrq_cur = &mq->mqrq[0];
+	mq->mqrq_prev = &mq->mqrq[1];
+	mq->bounce_limit = limit;
 	mq->queue->queuedata = mq;
-	mq->req = NULL;
 
 	blk_queue_prep_rq(mq->queue, mmc_prep_request);
 	blk_queue_ordered(mq->queue, QUEUE_ORDERED_DRAIN);
@@ -159,54 +207,86 @@ int mmc_init_queue(struct mmc_queue *mq, struct mmc_card *card, spinlock_t *lock
 		if (bouncesz > (host->max_blk_count * 512))
 			bouncesz = host->max_blk_count * 512;
 
+		/* both request slots need a buffer, or neither uses one */
 		if (bouncesz > 512) {
-			mq->bounce_buf = kmalloc(bouncesz, GFP_KERNEL);
-			if (!mq->bounce_buf) {
+			for (i = 0; i < ARRAY_SIZE(mq->mqrq); i++) {
+				mq->mqrq[i].bounce_buf =
+					kmalloc(bouncesz, GFP_KERNEL);
+				if (!mq->mqrq[i].bounce_buf)
+					break;
+			}
+			if (i < ARRAY_SIZE(mq->mqrq)) {
 				printk(KERN_WARNING "%s: unable to "
 					"allocate bounce buffer\n",
 					mmc_card_name(card));
+				while (i--) {
+					kfree(mq->mqrq[i].bounce_buf);
+					mq->mqrq[i].bounce_buf = NULL;
+				}
 			}
 		}
 
-		if (mq->bounce_buf) {
+		if (mq->mqrq_cur->bounce_buf) {
 			blk_queue_bounce_limit(mq->queue, BLK_BOUNCE_ANY);
 			blk_queue_max_hw_sectors(mq->queue, bouncesz / 512);
 			blk_queue_max_segments(mq->queue, bouncesz / 512);
 			blk_queue_max_segment_size(mq->queue, bouncesz);
 
-			mq->sg = kmalloc(sizeof(struct scatterlist),
-				GFP_KERNEL);
-			if (!mq->sg) {
-				ret = -ENOMEM;
-				goto cleanup_queue;
-			}
-			sg_init_table(mq->sg, 1);
-
-			mq->bounce_sg = kmalloc(sizeof(struct scatterlist) *
-				bouncesz / 512, GFP_KERNEL);
-			if (!mq->bounce_sg) {
-				ret = -ENOMEM;
-				goto cleanup_queue;
+			/*
+			 * Requests with few segments are sent without
+			 * copying, so sg is as large as bounce_sg; the two
+			 * are swapped when a request is bounced.
+			 */
+			for (i = 0; i < ARRAY_SIZE(mq->mqrq); i++) {
+				struct mmc_queue_req *mqrq = &mq->mqrq[i];
+
+				mqrq->sg = kmalloc(sizeof(struct scatterlist) *
+					bouncesz / 512, GFP_KERNEL);
+				if (!mqrq->sg) {
+					ret = -ENOMEM;
+					goto cleanup_queue;
+				}
+				sg_init_table(mqrq->sg, bouncesz / 512);
+
+				mqrq->bounce_sg = kmalloc(
+					sizeof(struct scatterlist) *
+					bouncesz / 512, GFP_KERNEL);
+				if (!mqrq->bounce_sg) {
+					ret = -ENOMEM;
+					goto cleanup_queue;
+				}
+				sg_init_table(mqrq->bounce_sg, bouncesz / 512);
 			}
-			sg_init_table(mq->bounce_sg, bouncesz / 512);
 		}
 	}
 #endif
 
-	if (!mq->bounce_buf) {
+	if (!mq->mqrq_cur->bounce_buf) {
+		/*
+		 * Requests may have more segments than the host takes in
+		 * one command; the block driver splits them.
+		 */
+		segs = max(host->max_phys_segs, host->max_hw_segs);
+		if (host->max_hw_segs == 1 && segs < MMC_QUEUE_DIRECT_SEGS)
+			segs = MMC_QUEUE_DIRECT_SEGS;
+
 		blk_queue_bounce_limit(mq->queue, limit);
 		blk_queue_max_hw_sectors(mq->queue,
 			min(host->max_blk_count, host->max_req_size / 512));
-		blk_queue_max_segments(mq->queue, host->max_hw_segs);
+		blk_queue_max_segments(mq->queue, segs);
 		blk_queue_max_segment_size(mq->queue, host->max_seg_size);
 
-		mq->sg = kmalloc(sizeof(struct scatterlist) *
-			host->max_phys_segs, GFP_KERNEL);
-		if (!mq->sg) {
-			ret = -ENOMEM;
-			goto cleanup_queue;
+		for (i = 0; i < ARRAY_SIZE(mq->mqrq); i++) {
+			struct mmc_queue_req *mqrq = &mq->mqrq[i];
+
+			mqrq->sg = kmalloc(sizeof(struct scatterlist) *
+				segs, GFP_KERNEL);
+			if (!mqrq->sg) {
+				ret = -ENOMEM;
+				goto cleanup_queue;
+			}
+			sg_init_table(mqrq->sg, segs);
 		}
-		sg_init_table(mq->sg, host->max_phys_segs);
 	}
 
 	init_MUTEX(&mq->thread_sem);
@@ -214,21 +294,12 @@ int mmc_init_queue(struct mmc_queue *mq, struct mmc_card *card, spinlock_t *lock
 	mq->thread = kthread_run(mmc_queue_thread, mq, "mmcqd");
 	if (IS_ERR(mq->thread)) {
 		ret = PTR_ERR(mq->thread);
-		goto free_bounce_sg;
+		goto cleanup_queue;
 	}
 
 	return 0;
- free_bounce_sg:
- 	if (mq->bounce_sg)
- 		kfree(mq->bounce_sg);
- 	mq->bounce_sg = NULL;
  cleanup_queue:
- 	if (mq->sg)
-		kfree(mq->sg);
-	mq->sg = NULL;
-	if (mq->bounce_buf)
-		kfree(mq->bounce_buf);
-	mq->bounce_buf = NULL;
+	mmc_queue_free_reqs(mq);
 	blk_cleanup_queue(mq->queue);
 	return ret;
 }
@@ -250,16 +321,7 @@ void mmc_cleanup_queue(struct mmc_queue *mq)
 	blk_start_queue(q);
 	spin_unlock_irqrestore(q->queue_lock, flags);
 
- 	if (mq->bounce_sg)
- 		kfree(mq->bounce_sg);
- 	mq->bounce_sg = NULL;
-
-	kfree(mq->sg);
-	mq->sg = NULL;
-
-	if (mq->bounce_buf)
-		kfree(mq->bounce_buf);
-	mq->bounce_buf = NULL;
+	mmc_queue_free_reqs(mq);
 
 	mq->card = NULL;
 }
@@ -310,29 +372,61 @@ void mmc_queue_resume(struct mmc_queue *mq)
 }
 
 /*
- * Prepare the sg list(s) to be handed of to the host driver
+ * Prepare the sg list(s) to be handed of to the host driver.
+ *
+ * Requests are mapped straight from their pages whenever the block
+ * driver can send them as a few back-to-back commands; the bounce buffer
+ * is only used for requests scattered over many segments, with
+ * segments that are not whole sectors, or with pages the host cannot
+ * reach (the queue itself does not bounce them).
  */
-unsigned int mmc_queue_map_sg(struct mmc_queue *mq)
+unsigned int mmc_queue_map_sg(struct mmc_queue *mq, struct mmc_queue_req *mqrq)
 {
 	unsigned int sg_len;
 	size_t buflen;
-	struct scatterlist *sg;
-	int i;
+	struct scatterlist *sg, *tmp;
+	int i, direct;
 
-	if (!mq->bounce_buf)
-		return blk_rq_map_sg(mq->queue, mq->req, mq->sg);
+	mqrq->bounce_sg_len = 0;
 
-	BUG_ON(!mq->bounce_sg);
+	sg_len = blk_rq_map_sg(mq->queue, mqrq->req, mqrq->sg);
 
-	sg_len = blk_rq_map_sg(mq->queue, mq->req, mq->bounce_sg);
+	if (!mqrq->bounce_buf)
+		return sg_len;
 
-	mq->bounce_sg_len = sg_len;
+	BUG_ON(!mqrq->bounce_sg);
 
 	buflen = 0;
-	for_each_sg(mq->bounce_sg, sg, sg_len, i)
+	direct = 1;
+	for_each_sg(mqrq->sg, sg, sg_len, i) {
+		if (sg->length & 511)
+			direct = 0;
+		if (PageHighMem(sg_page(sg)) ||
+		    page_to_phys(sg_page(sg)) + sg->offset + sg->length - 1 >
+		    mq->bounce_limit)
+			direct = 0;
 		buflen += sg->length;
+	}
+
+	if (direct && sg_len <= MMC_QUEUE_SPLIT_SEGS) {
+		if (!mqrq->counted)
+			mq->direct++;
+		mqrq->counted = 1;
+		return sg_len;
+	}
 
-	sg_init_one(mq->sg, mq->bounce_buf, buflen);
+	/* what is left of a reissued request counts as the same request */
+	if (!mqrq->counted)
+		mq->copies++;
+	mqrq->counted = 1;
+
+	/* keep the request's pages in bounce_sg for the copy */
+	tmp = mqrq->bounce_sg;
+	mqrq->bounce_sg = mqrq->sg;
+	mqrq->sg = tmp;
+	mqrq->bounce_sg_len = sg_len;
+
+	sg_init_one(mqrq->sg, mqrq->bounce_buf, buflen);
 
 	return 1;
 }
@@ -341,39 +435,42 @@ unsigned int mmc_queue_map_sg(struct mmc_queue *mq)
  * If writing, bounce the data to the buffer before the request
  * is sent to the host driver
  */
-void mmc_queue_bounce_pre(struct mmc_queue *mq)
+void mmc_queue_bounce_pre(struct mmc_queue *mq, struct mmc_queue_req *mqrq)
 {
 	unsigned long flags;
 
-	if (!mq->bounce_buf)
+	if (!mqrq->bounce_sg_len)
 		return;
 
-	if (rq_data_dir(mq->req) != WRITE)
+	if (rq_data_dir(mqrq->req) != WRITE)
 		return;
 
 	local_irq_save(flags);
-	sg_copy_to_buffer(mq->bounce_sg, mq->bounce_sg_len,
-		mq->bounce_buf, mq->sg[0].length);
+	sg_copy_to_buffer(mqrq->bounce_sg, mqrq->bounce_sg_len,
+		mqrq->bounce_buf, mqrq->sg[0].length);
 	local_irq_restore(flags);
+
+	mq->copied_bytes += mqrq->sg[0].length;
 }
 
 /*
  * If reading, bounce the data from the buffer after the request
  * has been handled by the host driver
  */
-void mmc_queue_bounce_post(struct mmc_queue *mq)
+void mmc_queue_bounce_post(struct mmc_queue *mq, struct mmc_queue_req *mqrq)
 {
 	unsigned long flags;
 
-	if (!mq->bounce_buf)
+	if (!mqrq->bounce_sg_len)
 		return;
 
-	if (rq_data_dir(mq->req) != READ)
+	if (rq_data_dir(mqrq->req) != READ)
 		return;
 
 	local_irq_save(flags);
-	sg_copy_from_buffer(mq->bounce_sg, mq->bounce_sg_len,
-		mq->bounce_buf, mq->sg[0].length);
+	sg_copy_from_buffer(mqrq->bounce_sg, mqrq->bounce_sg_len,
+		mqrq->bounce_buf, mqrq->sg[0].length);
 	local_irq_restore(flags);
-}
 
+	mq->copied_bytes += mqrq->sg[0].length;
+}
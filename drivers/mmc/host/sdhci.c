@@ -441,8 +441,12 @@ static int sdhci_adma_table_pre(struct sdhci_host *host,
 		goto fail;
 	BUG_ON(host->align_addr & 0x3);
 
-	host->sg_count = dma_map_sg(mmc_dev(host->mmc),
-		data->sg, data->sg_len, direction);
+	/* mapped ahead of time by sdhci_pre_req() */
+	if (data->host_cookie)
+		host->sg_count = data->host_cookie;
+	else
+		host->sg_count = dma_map_sg(mmc_dev(host->mmc),
+			data->sg, data->sg_len, direction);
 	if (host->sg_count == 0)
 		goto unmap_align;
 
@@ -534,6 +538,7 @@ static int sdhci_adma_table_pre(struct sdhci_host *host,
 unmap_entries:
 	dma_unmap_sg(mmc_dev(host->mmc), data->sg,
 		data->sg_len, direction);
+	data->host_cookie = 0;
 unmap_align:
 	dma_unmap_single(mmc_dev(host->mmc), host->align_addr,
 		128 * 4, direction);
@@ -583,8 +588,9 @@ static void sdhci_adma_table_post(struct sdhci_host *host,
 		}
 	}
 
-	dma_unmap_sg(mmc_dev(host->mmc), data->sg,
-		data->sg_len, direction);
+	if (!data->host_cookie)
+		dma_unmap_sg(mmc_dev(host->mmc), data->sg,
+			data->sg_len, direction);
 }
 
 static u8 sdhci_calc_timeout(struct sdhci_host *host, struct mmc_data *data)
@@ -753,7 +759,10 @@ static void sdhci_prepare_data(struct sdhci_host *host, struct mmc_data *data)
 		} else {
 			int sg_cnt;
 
-			sg_cnt = dma_map_sg(mmc_dev(host->mmc),
+			if (data->host_cookie)
+				sg_cnt = data->host_cookie;
+			else
+				sg_cnt = dma_map_sg(mmc_dev(host->mmc),
 					data->sg, data->sg_len,
 					(data->flags & MMC_DATA_READ) ?
 						DMA_FROM_DEVICE :
@@ -773,6 +782,17 @@ static void sdhci_prepare_data(struct sdhci_host *host, struct mmc_data *data)
 		}
 	}
 
+	/*
+	 * A request that was mapped by sdhci_pre_req() but ends up
+	 * using PIO must be handed back to the CPU before it is touched.
+	 */
+	if (!(host->flags & SDHCI_REQ_USE_DMA) && data->host_cookie) {
+		dma_unmap_sg(mmc_dev(host->mmc), data->sg, data->sg_len,
+			(data->flags & MMC_DATA_READ) ?
+				DMA_FROM_DEVICE : DMA_TO_DEVICE);
+		data->host_cookie = 0;
+	}
+
 	/*
 	 * Always adjust the DMA selection as some controllers
 	 * (e.g. JMicron) can't do PIO properly when the selection
@@ -845,7 +865,7 @@ static void sdhci_finish_data(struct sdhci_host *host)
 	if (host->flags & SDHCI_REQ_USE_DMA) {
 		if (host->flags & SDHCI_USE_ADMA)
 			sdhci_adma_table_post(host, data);
-		else {
+		else if (!data->host_cookie) {
 			dma_unmap_sg(mmc_dev(host->mmc), data->sg,
 				data->sg_len, (data->flags & MMC_DATA_READ) ?
 					DMA_FROM_DEVICE : DMA_TO_DEVICE);
@@ -1145,6 +1165,44 @@ static void sdhci_request(struct mmc_host *mmc, struct mmc_request *mrq)
 	spin_unlock_irqrestore(&host->lock, flags);
 }
 
+/*
+ * Map the scatterlist of a request while the previous request is still
+ * transferring, so that only the register setup is left for
+ * sdhci_request(). The mapping is kept until sdhci_post_req().
+ */
+static void sdhci_pre_req(struct mmc_host *mmc, struct mmc_request *mrq,
+			  bool is_first_req)
+{
+	struct sdhci_host *host = mmc_priv(mmc);
+	struct mmc_data *data = mrq->data;
+	int sg_count;
+
+	if (!data || data->host_cookie)
+		return;
+
+	if (!(host->flags & (SDHCI_USE_SDMA | SDHCI_USE_ADMA)))
+		return;
+
+	sg_count = dma_map_sg(mmc_dev(mmc), data->sg, data->sg_len,
+			      (data->flags & MMC_DATA_READ) ?
+				DMA_FROM_DEVICE : DMA_TO_DEVICE);
+	data->host_cookie = sg_count;
+}
+
+static void sdhci_post_req(struct mmc_host *mmc, struct mmc_request *mrq,
+			   int err)
+{
+	struct mmc_data *data = mrq->data;
+
+	if (!data || !data->host_cookie)
+		return;
+
+	dma_unmap_sg(mmc_dev(mmc), data->sg, data->sg_len,
+		     (data->flags & MMC_DATA_READ) ?
+			DMA_FROM_DEVICE : DMA_TO_DEVICE);
+	data->host_cookie = 0;
+}
+
 static void sdhci_set_ios(struct mmc_host *mmc, struct mmc_ios *ios)
 {
 	struct sdhci_host *host;
@@ -1291,6 +1349,8 @@ int sdhci_disable(struct mmc_host *mmc, int lazy)
 }
 
 static const struct mmc_host_ops sdhci_ops = {
+	.pre_req	= sdhci_pre_req,
+	.post_req	= sdhci_post_req,
 	.request	= sdhci_request,
 	.set_ios	= sdhci_set_ios,
 	.get_ro		= sdhci_get_ro,
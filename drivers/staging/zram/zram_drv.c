@@ -19,6 +19,7 @@
 #include <linux/kernel.h>
 #include <linux/bio.h>
 #include <linux/bitops.h>
+#include <linux/bit_spinlock.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
 #include <linux/device.h>
@@ -26,6 +27,7 @@
 #include <linux/highmem.h>
 #include <linux/slab.h>
 #include <linux/lzo.h>
+#include <linux/math64.h>
 #include <linux/string.h>
 #include <linux/vmalloc.h>
 
@@ -41,19 +43,34 @@ static unsigned int num_devices;
 static int zram_test_flag(struct zram *zram, u32 index,
 			enum zram_pageflags flag)
 {
-	return zram->table[index].flags & BIT(flag);
+	return test_bit(flag, &zram->table[index].flags);
 }
 
 static void zram_set_flag(struct zram *zram, u32 index,
 			enum zram_pageflags flag)
 {
-	zram->table[index].flags |= BIT(flag);
+	set_bit(flag, &zram->table[index].flags);
 }
 
 static void zram_clear_flag(struct zram *zram, u32 index,
 			enum zram_pageflags flag)
 {
-	zram->table[index].flags &= ~BIT(flag);
+	clear_bit(flag, &zram->table[index].flags);
+}
+
+/*
+ * Table entries are read and changed by reads, writes, writeback and
+ * swap free notify, the latter in atomic context. Each entry is
+ * guarded by a bit spinlock in its flags word.
+ */
+static void zram_slot_lock(struct zram *zram, u32 index)
+{
+	bit_spin_lock(ZRAM_ACCESS, &zram->table[index].flags);
+}
+
+static void zram_slot_unlock(struct zram *zram, u32 index)
+{
+	bit_spin_unlock(ZRAM_ACCESS, &zram->table[index].flags);
 }
 
 static int page_zero_filled(void *ptr)
@@ -111,7 +128,7 @@ static void zram_ioctl_get_stats(struct zram *zram,
 	size_t succ_writes, mem_used;
 	unsigned int good_compress_perc = 0, no_compress_perc = 0;
 
-	mem_used = xv_get_total_size_bytes(zram->mem_pool)
+	mem_used = zs_get_total_size_bytes(zram->mem_pool)
 			+ (rs->pages_expand << PAGE_SHIFT);
 	succ_writes = zram_stat64_read(zram, &rs->num_writes) -
 			zram_stat64_read(zram, &rs->failed_writes);
@@ -143,15 +160,233 @@ static void zram_ioctl_get_stats(struct zram *zram,
 #endif /* CONFIG_ZRAM_STATS */
 }
 
+static void zram_ioctl_get_alloc_stats(struct zram *zram,
+			struct zram_ioctl_alloc_stats *s)
+{
+	struct zs_pool_stats ps;
+	u64 pool_bytes;
+
+	zs_get_pool_stats(zram->mem_pool, &ps);
+	pool_bytes = ps.pages_used << PAGE_SHIFT;
+
+	s->pages_used = ps.pages_used;
+	s->objs_allocated = ps.objs_allocated;
+	s->objs_used = ps.objs_used;
+	s->bytes_used = ps.bytes_used;
+	s->frag_pct = 0;
+	if (pool_bytes)
+		s->frag_pct = div64_u64((pool_bytes - ps.bytes_used) * 100,
+					pool_bytes);
+	s->compactable_pages = zs_compactable_pages(zram->mem_pool);
+	s->compact_runs = ps.compact_runs;
+	s->pages_compacted = ps.pages_compacted;
+	s->bytes_compacted = ps.pages_compacted << PAGE_SHIFT;
+	s->objs_migrated = ps.objs_migrated;
+}
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+static int zram_read(struct zram *zram, struct bio *bio, int can_sleep);
+
+/*
+ * Block 0 of the backing device is never handed out so that a
+ * written back slot can never be mistaken for an empty one.
+ */
+static unsigned long zram_bd_alloc_block(struct zram *zram)
+{
+	unsigned long blk;
+
+	spin_lock(&zram->bitmap_lock);
+	blk = find_next_zero_bit(zram->bitmap, zram->nr_bd_pages, 1);
+	if (blk >= zram->nr_bd_pages)
+		blk = 0;
+	else
+		set_bit(blk, zram->bitmap);
+	spin_unlock(&zram->bitmap_lock);
+
+	return blk;
+}
+
+static void zram_bd_free_block(struct zram *zram, unsigned long blk)
+{
+	spin_lock(&zram->bitmap_lock);
+	WARN_ON_ONCE(!test_bit(blk, zram->bitmap));
+	clear_bit(blk, zram->bitmap);
+	spin_unlock(&zram->bitmap_lock);
+}
+
+static void zram_bd_end_io(struct bio *bio, int err)
+{
+	complete(bio->bi_private);
+}
+
+/*
+ * Synchronous single page I/O to the backing device. Must not be
+ * called from zram_make_request() context: the bio would only be
+ * submitted once we return.
+ */
+static int zram_bd_rw_page(struct zram *zram, int rw, unsigned long blk,
+			struct page *page)
+{
+	int ret = 0;
+	struct bio *bio;
+	DECLARE_COMPLETION_ONSTACK(done);
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio)
+		return -ENOMEM;
+
+	bio->bi_bdev = zram->backing_dev;
+	bio->bi_sector = blk << SECTORS_PER_PAGE_SHIFT;
+	bio->bi_end_io = zram_bd_end_io;
+	bio->bi_private = &done;
+	if (!bio_add_page(bio, page, PAGE_SIZE, 0)) {
+		bio_put(bio);
+		return -EIO;
+	}
+
+	submit_bio(rw, bio);
+	wait_for_completion(&done);
+
+	if (!test_bit(BIO_UPTODATE, &bio->bi_flags))
+		ret = -EIO;
+	bio_put(bio);
+
+	return ret;
+}
+
+struct zram_bd_work {
+	struct work_struct work;
+	struct zram *zram;
+	struct bio *bio;
+};
+
+static void zram_bd_read_work(struct work_struct *work)
+{
+	struct zram_bd_work *bd_work;
+
+	bd_work = container_of(work, struct zram_bd_work, work);
+	zram_read(bd_work->zram, bd_work->bio, 1);
+	kfree(bd_work);
+}
+
+/*
+ * Some page of this bio lives on the backing device. Hand the whole
+ * bio over to zram_bd_wq where we are allowed to wait for the read.
+ */
+static int zram_bd_defer_read(struct zram *zram, struct bio *bio)
+{
+	struct zram_bd_work *bd_work;
+
+	bd_work = kmalloc(sizeof(*bd_work), GFP_NOIO);
+	if (!bd_work) {
+		zram_stat64_inc(zram, &zram->stats.failed_reads);
+		bio_io_error(bio);
+		return 0;
+	}
+
+	INIT_WORK(&bd_work->work, zram_bd_read_work);
+	bd_work->zram = zram;
+	bd_work->bio = bio;
+	queue_work(zram->bd_wq, &bd_work->work);
+
+	return 0;
+}
+
+static void zram_bd_reset(struct zram *zram)
+{
+	if (!zram->backing_dev)
+		return;
+
+	destroy_workqueue(zram->bd_wq);
+	close_bdev_exclusive(zram->backing_dev, FMODE_READ | FMODE_WRITE);
+	vfree(zram->bitmap);
+
+	zram->bd_wq = NULL;
+	zram->backing_dev = NULL;
+	zram->bitmap = NULL;
+	zram->nr_bd_pages = 0;
+}
+
+static int zram_bd_set_backing_dev(struct zram *zram,
+			const char __user *upath)
+{
+	int ret = 0;
+	char *path;
+	size_t bitmap_sz;
+	unsigned long nr_pages;
+	struct block_device *bdev;
+
+	path = strndup_user(upath, PATH_MAX);
+	if (IS_ERR(path))
+		return PTR_ERR(path);
+
+	bdev = open_bdev_exclusive(path, FMODE_READ | FMODE_WRITE, zram);
+	if (IS_ERR(bdev)) {
+		pr_info("Error opening backing device %s\n", path);
+		ret = PTR_ERR(bdev);
+		goto out;
+	}
+
+	nr_pages = i_size_read(bdev->bd_inode) >> PAGE_SHIFT;
+	if (nr_pages < 2) {
+		close_bdev_exclusive(bdev, FMODE_READ | FMODE_WRITE);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	bitmap_sz = BITS_TO_LONGS(nr_pages) * sizeof(long);
+	zram_bd_reset(zram);
+	zram->bitmap = vmalloc(bitmap_sz);
+	zram->bd_wq = create_singlethread_workqueue(zram->disk->disk_name);
+	if (!zram->bitmap || !zram->bd_wq) {
+		if (zram->bd_wq)
+			destroy_workqueue(zram->bd_wq);
+		vfree(zram->bitmap);
+		zram->bd_wq = NULL;
+		zram->bitmap = NULL;
+		close_bdev_exclusive(bdev, FMODE_READ | FMODE_WRITE);
+		ret = -ENOMEM;
+		goto out;
+	}
+	memset(zram->bitmap, 0, bitmap_sz);
+
+	zram->backing_dev = bdev;
+	zram->nr_bd_pages = nr_pages;
+	pr_info("Backing device set to %s (%lu pages)\n", path, nr_pages);
+
+out:
+	kfree(path);
+	return ret;
+}
+#else
+static void zram_bd_free_block(struct zram *zram, unsigned long blk)
+{
+}
+
+static void zram_bd_reset(struct zram *zram)
+{
+}
+#endif /* CONFIG_ZRAM_WRITEBACK */
+
+/* Called with the slot lock held */
 static void zram_free_page(struct zram *zram, size_t index)
 {
 	u32 clen;
-	void *obj;
+	unsigned long handle = zram->table[index].handle;
 
-	struct page *page = zram->table[index].page;
-	u32 offset = zram->table[index].offset;
+	zram_clear_flag(zram, index, ZRAM_IDLE);
+	/* Tells a writeback in progress that the slot has changed */
+	zram_clear_flag(zram, index, ZRAM_UNDER_WB);
 
-	if (unlikely(!page)) {
+	if (unlikely(zram_test_flag(zram, index, ZRAM_WB))) {
+		zram_bd_free_block(zram, zram->table[index].bdev_index);
+		zram_clear_flag(zram, index, ZRAM_WB);
+		zram_stat_dec(&zram->stats.pages_wb);
+		zram->table[index].bdev_index = 0;
+		return;
+	}
+
+	if (unlikely(!handle)) {
 		/*
 		 * No memory is allocated for zero filled pages.
 		 * Simply clear zero page flag.
@@ -163,19 +398,16 @@ static void zram_free_page(struct zram *zram, size_t index)
 		return;
 	}
 
+	clen = zram->table[index].size;
+
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
-		clen = PAGE_SIZE;
-		__free_page(page);
+		__free_page(zram->table[index].page);
 		zram_clear_flag(zram, index, ZRAM_UNCOMPRESSED);
 		zram_stat_dec(&zram->stats.pages_expand);
 		goto out;
 	}
 
-	obj = kmap_atomic(page, KM_USER0) + offset;
-	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
-	kunmap_atomic(obj, KM_USER0);
-
-	xv_free(zram->mem_pool, page, offset);
+	zs_free(zram->mem_pool, handle);
 	if (clen <= PAGE_SIZE / 2)
 		zram_stat_dec(&zram->stats.good_compress);
 
@@ -183,8 +415,8 @@ out:
 	zram->stats.compr_size -= clen;
 	zram_stat_dec(&zram->stats.pages_stored);
 
-	zram->table[index].page = NULL;
-	zram->table[index].offset = 0;
+	zram->table[index].handle = 0;
+	zram->table[index].size = 0;
 }
 
 static void handle_zero_page(struct page *page)
@@ -204,8 +436,7 @@ static void handle_uncompressed_page(struct zram *zram,
 	unsigned char *user_mem, *cmem;
 
 	user_mem = kmap_atomic(page, KM_USER0);
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-			zram->table[index].offset;
+	cmem = kmap_atomic(zram->table[index].page, KM_USER1);
 
 	memcpy(user_mem, cmem, PAGE_SIZE);
 	kunmap_atomic(user_mem, KM_USER0);
@@ -214,57 +445,100 @@ static void handle_uncompressed_page(struct zram *zram,
 	flush_dcache_page(page);
 }
 
-static int zram_read(struct zram *zram, struct bio *bio)
+static int zram_decompress_page(struct zram *zram, struct page *page,
+				u32 index)
+{
+	int ret;
+	size_t clen = PAGE_SIZE;
+	unsigned char *user_mem, *cmem;
+
+	user_mem = kmap_atomic(page, KM_USER0);
+	cmem = zs_map_object(zram->mem_pool, zram->table[index].handle,
+				ZS_MM_RO);
+
+	ret = lzo1x_decompress_safe(cmem, zram->table[index].size,
+				user_mem, &clen);
+
+	zs_unmap_object(zram->mem_pool, zram->table[index].handle);
+	kunmap_atomic(user_mem, KM_USER0);
+
+	return ret;
+}
+
+/*
+ * @can_sleep is set when called from process context outside of
+ * zram_make_request(), where pages can be read from backing device.
+ */
+static int zram_read(struct zram *zram, struct bio *bio, int can_sleep)
 {
 
 	int i;
 	u32 index;
 	struct bio_vec *bvec;
 
-	zram_stat64_inc(zram, &zram->stats.num_reads);
+	if (!can_sleep)
+		zram_stat64_inc(zram, &zram->stats.num_reads);
 
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 	bio_for_each_segment(bvec, bio, i) {
 		int ret;
-		size_t clen;
 		struct page *page;
-		struct zobj_header *zheader;
-		unsigned char *user_mem, *cmem;
 
 		page = bvec->bv_page;
 
+		zram_slot_lock(zram, index);
+
 		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
+			zram_slot_unlock(zram, index);
 			handle_zero_page(page);
 			continue;
 		}
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+		/* Page was written back to backing device */
+		if (unlikely(zram_test_flag(zram, index, ZRAM_WB))) {
+			unsigned long blk = zram->table[index].bdev_index;
+
+			zram_slot_unlock(zram, index);
+			if (!can_sleep)
+				return zram_bd_defer_read(zram, bio);
+
+			ret = zram_bd_rw_page(zram, READ_SYNC, blk, page);
+			zram_stat64_inc(zram, &zram->stats.bd_reads);
+			if (unlikely(ret)) {
+				pr_err("Backing device read failed! "
+					"err=%d, page=%u\n", ret, index);
+				zram_stat64_inc(zram,
+					&zram->stats.failed_reads);
+				goto out;
+			}
+
+			flush_dcache_page(page);
+			index++;
+			continue;
+		}
+#endif
+
 		/* Requested page is not present in compressed area */
-		if (unlikely(!zram->table[index].page)) {
+		if (unlikely(!zram->table[index].handle)) {
+			zram_slot_unlock(zram, index);
 			pr_debug("Read before write: sector=%lu, size=%u",
 				(ulong)(bio->bi_sector), bio->bi_size);
 			/* Do nothing */
 			continue;
 		}
 
+		zram_clear_flag(zram, index, ZRAM_IDLE);
+
 		/* Page is stored uncompressed since it's incompressible */
 		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
 			handle_uncompressed_page(zram, page, index);
+			zram_slot_unlock(zram, index);
 			continue;
 		}
 
-		user_mem = kmap_atomic(page, KM_USER0);
-		clen = PAGE_SIZE;
-
-		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-				zram->table[index].offset;
-
-		ret = lzo1x_decompress_safe(
-			cmem + sizeof(*zheader),
-			xv_get_object_size(cmem) - sizeof(*zheader),
-			user_mem, &clen);
-
-		kunmap_atomic(user_mem, KM_USER0);
-		kunmap_atomic(cmem, KM_USER1);
+		ret = zram_decompress_page(zram, page, index);
+		zram_slot_unlock(zram, index);
 
 		/* Should NEVER happen. Return bio error if it does. */
 		if (unlikely(ret != LZO_E_OK)) {
@@ -299,31 +573,30 @@ static int zram_write(struct zram *zram, struct bio *bio)
 
 	bio_for_each_segment(bvec, bio, i) {
 		int ret;
-		u32 offset;
 		size_t clen;
-		struct zobj_header *zheader;
-		struct page *page, *page_store;
+		unsigned long handle = 0;
+		struct page *page, *page_store = NULL;
 		unsigned char *user_mem, *cmem, *src;
 
 		page = bvec->bv_page;
 		src = zram->compress_buffer;
 
-		/*
-		 * System overwrites unused sectors. Free memory associated
-		 * with this sector now.
-		 */
-		if (zram->table[index].page ||
-				zram_test_flag(zram, index, ZRAM_ZERO))
-			zram_free_page(zram, index);
-
 		mutex_lock(&zram->lock);
 
 		user_mem = kmap_atomic(page, KM_USER0);
 		if (page_zero_filled(user_mem)) {
 			kunmap_atomic(user_mem, KM_USER0);
 			mutex_unlock(&zram->lock);
+
+			/*
+			 * System overwrites unused sectors. Free memory
+			 * associated with this sector now.
+			 */
+			zram_slot_lock(zram, index);
+			zram_free_page(zram, index);
 			zram_stat_inc(&zram->stats.pages_zero);
 			zram_set_flag(zram, index, ZRAM_ZERO);
+			zram_slot_unlock(zram, index);
 			continue;
 		}
 
@@ -356,44 +629,45 @@ static int zram_write(struct zram *zram, struct bio *bio)
 				goto out;
 			}
 
-			offset = 0;
-			zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
-			zram_stat_inc(&zram->stats.pages_expand);
-			zram->table[index].page = page_store;
 			src = kmap_atomic(page, KM_USER0);
-			goto memstore;
-		}
+			cmem = kmap_atomic(page_store, KM_USER1);
+			memcpy(cmem, src, clen);
+			kunmap_atomic(cmem, KM_USER1);
+			kunmap_atomic(src, KM_USER0);
+		} else {
+			handle = zs_malloc(zram->mem_pool, clen,
+					GFP_NOIO | __GFP_HIGHMEM);
+			if (unlikely(!handle)) {
+				mutex_unlock(&zram->lock);
+				pr_info("Error allocating memory for "
+					"compressed page: %u, size=%zu\n",
+					index, clen);
+				zram_stat64_inc(zram,
+					&zram->stats.failed_writes);
+				goto out;
+			}
 
-		if (xv_malloc(zram->mem_pool, clen + sizeof(*zheader),
-				&zram->table[index].page, &offset,
-				GFP_NOIO | __GFP_HIGHMEM)) {
-			mutex_unlock(&zram->lock);
-			pr_info("Error allocating memory for compressed "
-				"page: %u, size=%zu\n", index, clen);
-			zram_stat64_inc(zram, &zram->stats.failed_writes);
-			goto out;
+			cmem = zs_map_object(zram->mem_pool, handle,
+						ZS_MM_WO);
+			memcpy(cmem, src, clen);
+			zs_unmap_object(zram->mem_pool, handle);
 		}
 
-memstore:
-		zram->table[index].offset = offset;
-
-		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-				zram->table[index].offset;
+		/*
+		 * The new data is stored; swap it in for whatever the
+		 * slot held before.
+		 */
+		zram_slot_lock(zram, index);
+		zram_free_page(zram, index);
 
-#if 0
-		/* Back-reference needed for memory defragmentation */
-		if (!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
-			zheader = (struct zobj_header *)cmem;
-			zheader->table_idx = index;
-			cmem += sizeof(*zheader);
+		if (page_store) {
+			zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
+			zram_stat_inc(&zram->stats.pages_expand);
+			zram->table[index].page = page_store;
+		} else {
+			zram->table[index].handle = handle;
 		}
-#endif
-
-		memcpy(cmem, src, clen);
-
-		kunmap_atomic(cmem, KM_USER1);
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			kunmap_atomic(src, KM_USER0);
+		zram->table[index].size = clen;
 
 		/* Update stats */
 		zram->stats.compr_size += clen;
@@ -401,6 +675,7 @@ memstore:
 		if (clen <= PAGE_SIZE / 2)
 			zram_stat_inc(&zram->stats.good_compress);
 
+		zram_slot_unlock(zram, index);
 		mutex_unlock(&zram->lock);
 		index++;
 	}
@@ -414,6 +689,140 @@ out:
 	return 0;
 }
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+/*
+ * Mark every page currently held in memory as idle. Pages that are
+ * not read or rewritten until the next ZRAMIO_WRITEBACK with
+ * ZRAM_WB_IDLE set are then moved to the backing device.
+ */
+static void zram_mark_idle(struct zram *zram)
+{
+	size_t index;
+
+	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
+		zram_slot_lock(zram, index);
+		if (zram->table[index].handle &&
+				!zram_test_flag(zram, index, ZRAM_WB))
+			zram_set_flag(zram, index, ZRAM_IDLE);
+		zram_slot_unlock(zram, index);
+	}
+}
+
+/* Called with the slot lock held */
+static int zram_wb_wanted(struct zram *zram, size_t index, u32 mode)
+{
+	if (!zram->table[index].handle ||
+			zram_test_flag(zram, index, ZRAM_WB) ||
+			zram_test_flag(zram, index, ZRAM_UNDER_WB))
+		return 0;
+
+	if ((mode & ZRAM_WB_HUGE) &&
+			zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))
+		return 1;
+
+	if ((mode & ZRAM_WB_IDLE) && zram_test_flag(zram, index, ZRAM_IDLE))
+		return 1;
+
+	return 0;
+}
+
+/*
+ * Move incompressible (ZRAM_WB_HUGE) and/or idle (ZRAM_WB_IDLE)
+ * pages to the backing device and free their memory.
+ *
+ * A page is copied out under its slot lock and marked ZRAM_UNDER_WB,
+ * then written without holding any lock. Writes and swap notify that
+ * free the slot meanwhile clear ZRAM_UNDER_WB, and the copy on the
+ * backing device is then dropped instead of replacing the slot.
+ */
+static int zram_writeback(struct zram *zram, u32 mode)
+{
+	int ret = 0;
+	size_t index;
+	struct page *page;
+	unsigned long blk = 0;
+
+	if (!zram->backing_dev)
+		return -ENODEV;
+
+	if (!mode || (mode & ~(ZRAM_WB_HUGE | ZRAM_WB_IDLE)))
+		return -EINVAL;
+
+	page = alloc_page(GFP_KERNEL);
+	if (!page)
+		return -ENOMEM;
+
+	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
+		if (!blk) {
+			blk = zram_bd_alloc_block(zram);
+			if (!blk) {
+				ret = -ENOSPC;
+				break;
+			}
+		}
+
+		zram_slot_lock(zram, index);
+
+		if (!zram_wb_wanted(zram, index, mode)) {
+			zram_slot_unlock(zram, index);
+			continue;
+		}
+
+		if (zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
+			handle_uncompressed_page(zram, page, index);
+		} else if (zram_decompress_page(zram, page,
+						index) != LZO_E_OK) {
+			zram_slot_unlock(zram, index);
+			ret = -EIO;
+			break;
+		}
+
+		zram_set_flag(zram, index, ZRAM_UNDER_WB);
+		zram_slot_unlock(zram, index);
+
+		ret = zram_bd_rw_page(zram, WRITE, blk, page);
+
+		zram_slot_lock(zram, index);
+
+		/* Slot may have been freed or rewritten meanwhile */
+		if (ret || !zram_test_flag(zram, index, ZRAM_UNDER_WB)) {
+			zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+			zram_slot_unlock(zram, index);
+			if (ret)
+				break;
+			continue;
+		}
+
+		zram_free_page(zram, index);
+		zram->table[index].bdev_index = blk;
+		zram_set_flag(zram, index, ZRAM_WB);
+		zram_stat_inc(&zram->stats.pages_wb);
+		zram_stat64_inc(zram, &zram->stats.bd_writes);
+
+		zram_slot_unlock(zram, index);
+		blk = 0;
+		cond_resched();
+	}
+
+	if (blk)
+		zram_bd_free_block(zram, blk);
+	__free_page(page);
+	return ret;
+}
+
+static void zram_ioctl_get_bd_stats(struct zram *zram,
+			struct zram_ioctl_bd_stats *s)
+{
+	s->backing_size = (u64)zram->nr_bd_pages << PAGE_SHIFT;
+
+#if defined(CONFIG_ZRAM_STATS)
+	s->pages_wb = zram->stats.pages_wb;
+	s->bd_reads = zram_stat64_read(zram, &zram->stats.bd_reads);
+	s->bd_writes = zram_stat64_read(zram, &zram->stats.bd_writes);
+#endif
+}
+#endif /* CONFIG_ZRAM_WRITEBACK */
+
 /*
  * Check if request is within bounds and page aligned.
  */
@@ -452,7 +861,7 @@ static int zram_make_request(struct request_queue *queue, struct bio *bio)
 
 	switch (bio_data_dir(bio)) {
 	case READ:
-		ret = zram_read(zram, bio);
+		ret = zram_read(zram, bio, 0);
 		break;
 
 	case WRITE:
@@ -463,6 +872,25 @@ static int zram_make_request(struct request_queue *queue, struct bio *bio)
 	return ret;
 }
 
+/*
+ * Compact the allocator under memory pressure. Reports the no. of
+ * pages compaction could release so that the VM scales its requests.
+ */
+static int zram_shrink(struct shrinker *shrinker, int nr_to_scan,
+			gfp_t gfp_mask)
+{
+	struct zram *zram = container_of(shrinker, struct zram, shrinker);
+	unsigned long pages;
+
+	pages = zs_compactable_pages(zram->mem_pool);
+	if (!nr_to_scan || !pages)
+		return pages;
+
+	zs_compact(zram->mem_pool);
+
+	return zs_compactable_pages(zram->mem_pool);
+}
+
 static void reset_device(struct zram *zram)
 {
 	size_t index;
@@ -470,6 +898,9 @@ static void reset_device(struct zram *zram)
 	/* Do not accept any new I/O request */
 	zram->init_done = 0;
 
+	if (zram->mem_pool)
+		unregister_shrinker(&zram->shrinker);
+
 	/* Free various per-device buffers */
 	kfree(zram->compress_workmem);
 	free_pages((unsigned long)zram->compress_buffer, 1);
@@ -479,27 +910,26 @@ static void reset_device(struct zram *zram)
 
 	/* Free all pages that are still in this zram device */
 	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
-		struct page *page;
-		u16 offset;
-
-		page = zram->table[index].page;
-		offset = zram->table[index].offset;
+		unsigned long handle = zram->table[index].handle;
 
-		if (!page)
+		if (!handle || zram_test_flag(zram, index, ZRAM_WB))
 			continue;
 
 		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			__free_page(page);
+			__free_page(zram->table[index].page);
 		else
-			xv_free(zram->mem_pool, page, offset);
+			zs_free(zram->mem_pool, handle);
 	}
 
 	vfree(zram->table);
 	zram->table = NULL;
 
-	xv_destroy_pool(zram->mem_pool);
+	if (zram->mem_pool)
+		zs_destroy_pool(zram->mem_pool);
 	zram->mem_pool = NULL;
 
+	zram_bd_reset(zram);
+
 	/* Reset stats */
 	memset(&zram->stats, 0, sizeof(zram->stats));
 
@@ -548,13 +978,15 @@ static int zram_ioctl_init_device(struct zram *zram)
 	/* zram devices sort of resembles non-rotational disks */
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, zram->disk->queue);
 
-	zram->mem_pool = xv_create_pool();
+	zram->mem_pool = zs_create_pool(zram->disk->disk_name);
 	if (!zram->mem_pool) {
 		pr_err("Error creating memory pool\n");
 		ret = -ENOMEM;
 		goto fail;
 	}
 
+	register_shrinker(&zram->shrinker);
+
 	zram->init_done = 1;
 
 	pr_debug("Initialization done!\n");
@@ -583,6 +1015,13 @@ static int zram_ioctl(struct block_device *bdev, fmode_t mode,
 
 	struct zram *zram = bdev->bd_disk->private_data;
 
+	/*
+	 * Writeback and mark-idle walk the table and the backing device;
+	 * they must not see them freed by a concurrent reset or replaced
+	 * by init, so init_done is only checked under init_lock.
+	 */
+	mutex_lock(&zram->init_lock);
+
 	switch (cmd) {
 	case ZRAMIO_SET_DISKSIZE_KB:
 		if (zram->init_done) {
@@ -619,6 +1058,78 @@ static int zram_ioctl(struct block_device *bdev, fmode_t mode,
 		kfree(stats);
 		break;
 	}
+	case ZRAMIO_GET_ALLOC_STATS:
+	{
+		struct zram_ioctl_alloc_stats *stats;
+		if (!zram->init_done) {
+			ret = -ENOTTY;
+			goto out;
+		}
+		stats = kzalloc(sizeof(*stats), GFP_KERNEL);
+		if (!stats) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		zram_ioctl_get_alloc_stats(zram, stats);
+		if (copy_to_user((void *)arg, stats, sizeof(*stats))) {
+			kfree(stats);
+			ret = -EFAULT;
+			goto out;
+		}
+		kfree(stats);
+		break;
+	}
+	case ZRAMIO_COMPACT:
+		if (!zram->init_done) {
+			ret = -ENOTTY;
+			goto out;
+		}
+		zs_compact(zram->mem_pool);
+		break;
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+	case ZRAMIO_SET_BACKING_DEV:
+		if (zram->init_done) {
+			ret = -EBUSY;
+			goto out;
+		}
+		ret = zram_bd_set_backing_dev(zram, (const char __user *)arg);
+		break;
+
+	case ZRAMIO_MARK_IDLE:
+		if (!zram->init_done) {
+			ret = -ENOTTY;
+			goto out;
+		}
+		zram_mark_idle(zram);
+		break;
+
+	case ZRAMIO_WRITEBACK:
+	{
+		u32 mode;
+		if (!zram->init_done) {
+			ret = -ENOTTY;
+			goto out;
+		}
+		if (copy_from_user(&mode, (void *)arg, sizeof(mode))) {
+			ret = -EFAULT;
+			goto out;
+		}
+		ret = zram_writeback(zram, mode);
+		break;
+	}
+	case ZRAMIO_GET_BD_STATS:
+	{
+		struct zram_ioctl_bd_stats stats;
+		memset(&stats, 0, sizeof(stats));
+		zram_ioctl_get_bd_stats(zram, &stats);
+		if (copy_to_user((void *)arg, &stats, sizeof(stats))) {
+			ret = -EFAULT;
+			goto out;
+		}
+		break;
+	}
+#endif
 	case ZRAMIO_INIT:
 		ret = zram_ioctl_init_device(zram);
 		break;
@@ -643,6 +1154,7 @@ static int zram_ioctl(struct block_device *bdev, fmode_t mode,
 	}
 
 out:
+	mutex_unlock(&zram->init_lock);
 	return ret;
 }
 
@@ -651,7 +1163,9 @@ void zram_slot_free_notify(struct block_device *bdev, unsigned long index)
 	struct zram *zram;
 
 	zram = bdev->bd_disk->private_data;
+	zram_slot_lock(zram, index);
 	zram_free_page(zram, index);
+	zram_slot_unlock(zram, index);
 	zram_stat64_inc(zram, &zram->stats.notify_free);
 }
 
@@ -666,7 +1180,14 @@ static int create_device(struct zram *zram, int device_id)
 	int ret = 0;
 
 	mutex_init(&zram->lock);
+	mutex_init(&zram->init_lock);
 	spin_lock_init(&zram->stat64_lock);
+#ifdef CONFIG_ZRAM_WRITEBACK
+	spin_lock_init(&zram->bitmap_lock);
+#endif
+
+	zram->shrinker.shrink = zram_shrink;
+	zram->shrinker.seeks = DEFAULT_SEEKS;
 
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!zram->queue) {
@@ -787,6 +1308,7 @@ static void __exit zram_exit(void)
 		destroy_device(zram);
 		if (zram->init_done)
 			reset_device(zram);
+		zram_bd_reset(zram);
 	}
 
 	unregister_blkdev(zram_major, "zram");
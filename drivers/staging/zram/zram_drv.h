@@ -17,9 +17,10 @@
 
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/mm.h>
 
 #include "zram_ioctl.h"
-#include "xvmalloc.h"
+#include "zsmalloc.h"
 
 /*
  * Some arbitrary value. This is just to catch
@@ -27,18 +28,6 @@
  */
 static const unsigned max_num_devices = 32;
 
-/*
- * Stored at beginning of each compressed object.
- *
- * It stores back-reference to table entry which points to this
- * object. This is required to support memory defragmentation.
- */
-struct zobj_header {
-#if 0
-	u32 table_idx;
-#endif
-};
-
 /*-- Configurable parameters */
 
 /* Default zram disk size: 25% of total RAM */
@@ -52,8 +41,8 @@ static const unsigned max_zpage_size = PAGE_SIZE / 4 * 3;
 
 /*
  * NOTE: max_zpage_size must be less than or equal to:
- *   XV_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
- * otherwise, xv_malloc() would always return failure.
+ *   ZS_MAX_ALLOC_SIZE - ZS_HANDLE_SIZE
+ * otherwise, zs_malloc() would always return failure.
  */
 
 /*-- End of configurable params */
@@ -71,6 +60,18 @@ enum zram_pageflags {
 	/* Page consists entirely of zeros */
 	ZRAM_ZERO,
 
+	/* Page not accessed since last ZRAMIO_MARK_IDLE */
+	ZRAM_IDLE,
+
+	/* Page is stored on backing device */
+	ZRAM_WB,
+
+	/* Page is being copied to backing device */
+	ZRAM_UNDER_WB,
+
+	/* Slot lock: held while the table entry is read or changed */
+	ZRAM_ACCESS,
+
 	__NR_ZRAM_PAGEFLAGS,
 };
 
@@ -78,10 +79,14 @@ enum zram_pageflags {
 
 /* Allocated for each disk page */
 struct table {
-	struct page *page;
-	u16 offset;
+	union {
+		unsigned long handle;	/* zsmalloc handle */
+		struct page *page;	/* if ZRAM_UNCOMPRESSED */
+		unsigned long bdev_index; /* if ZRAM_WB */
+	};
+	u16 size;	/* object size in bytes */
 	u8 count;	/* object ref count (not yet used) */
-	u8 flags;
+	unsigned long flags;	/* zram_pageflags, atomic bitops */
 } __attribute__((aligned(4)));
 
 struct zram_stats {
@@ -100,26 +105,44 @@ struct zram_stats {
 	u32 pages_stored;	/* no. of pages currently stored */
 	u32 good_compress;	/* % of pages with compression ratio<=50% */
 	u32 pages_expand;	/* % of incompressible pages */
+	u32 pages_wb;		/* no. of pages on backing device */
+	u64 bd_reads;		/* reads from backing device */
+	u64 bd_writes;		/* writes to backing device */
 #endif
 };
 
 struct zram {
-	struct xv_pool *mem_pool;
+	struct zs_pool *mem_pool;
 	void *compress_workmem;
 	void *compress_buffer;
 	struct table *table;
 	spinlock_t stat64_lock;	/* protect 64-bit stats */
 	struct mutex lock;	/* protect compression buffers against
-				 * concurrent writes */
+				 * concurrent writes; table entries are
+				 * guarded by their ZRAM_ACCESS bit */
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
+	/* serialize ioctls against device init and reset */
+	struct mutex init_lock;
 	/*
 	 * This is the limit on amount of *uncompressed* worth of data
 	 * we can store in a disk.
 	 */
 	size_t disksize;	/* bytes */
 
+	/* Compacts mem_pool under memory pressure */
+	struct shrinker shrinker;
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+	struct block_device *backing_dev;
+	unsigned long *bitmap;		/* blocks in use on backing_dev */
+	unsigned long nr_bd_pages;	/* backing_dev size in pages */
+	spinlock_t bitmap_lock;
+	/* Reads of written back pages are completed from here */
+	struct workqueue_struct *bd_wq;
+#endif
+
 	struct zram_stats stats;
 };
 
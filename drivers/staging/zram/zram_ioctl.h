@@ -33,9 +33,39 @@ struct zram_ioctl_stats {
 	u64 mem_used_total;
 } __attribute__ ((packed, aligned(4)));
 
+struct zram_ioctl_alloc_stats {
+	u64 pages_used;		/* pages held by the allocator */
+	u64 objs_allocated;	/* object slots in those pages */
+	u64 objs_used;		/* slots holding compressed pages */
+	u64 bytes_used;		/* bytes of slots in use */
+	u32 frag_pct;		/* % of allocator memory not in use */
+	u32 compactable_pages;	/* pages compaction could release */
+	u64 compact_runs;	/* no. of compaction passes */
+	u64 pages_compacted;	/* pages released by compaction */
+	u64 bytes_compacted;	/* --do-- in bytes */
+	u64 objs_migrated;	/* objects moved by compaction */
+} __attribute__ ((packed, aligned(4)));
+
+struct zram_ioctl_bd_stats {
+	u64 backing_size;	/* backing device size in bytes */
+	u64 pages_wb;		/* no. of pages on backing device */
+	u64 bd_reads;		/* reads from backing device */
+	u64 bd_writes;		/* writes to backing device */
+} __attribute__ ((packed, aligned(4)));
+
+/* ZRAMIO_WRITEBACK modes */
+#define ZRAM_WB_HUGE	(1 << 0)	/* incompressible pages */
+#define ZRAM_WB_IDLE	(1 << 1)	/* pages idle since ZRAMIO_MARK_IDLE */
+
 #define ZRAMIO_SET_DISKSIZE_KB	_IOW('z', 0, size_t)
 #define ZRAMIO_GET_STATS	_IOR('z', 1, struct zram_ioctl_stats)
 #define ZRAMIO_INIT		_IO('z', 2)
 #define ZRAMIO_RESET		_IO('z', 3)
+#define ZRAMIO_GET_ALLOC_STATS	_IOR('z', 4, struct zram_ioctl_alloc_stats)
+#define ZRAMIO_COMPACT		_IO('z', 5)
+#define ZRAMIO_SET_BACKING_DEV	_IOW('z', 6, char *)
+#define ZRAMIO_MARK_IDLE	_IO('z', 7)
+#define ZRAMIO_WRITEBACK	_IOW('z', 8, u32)
+#define ZRAMIO_GET_BD_STATS	_IOR('z', 9, struct zram_ioctl_bd_stats)
 
 #endif
@@ -0,0 +1,757 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+/*
+ * Objects are grouped by size into size classes. Each class owns a
+ * set of zspages: a few order-0 pages (see ZS_MAX_PAGES_PER_ZSPAGE)
+ * carved into equal sized slots. Slots may straddle page boundaries,
+ * so very little space is lost to rounding for any object size.
+ *
+ * Users never see object addresses, only handles. This lets
+ * zs_compact() migrate objects out of sparsely used zspages into
+ * denser ones of the same class and give the emptied pages back.
+ */
+
+#include <linux/bitops.h>
+#include <linux/errno.h>
+#include <linux/highmem.h>
+#include <linux/init.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/bit_spinlock.h>
+#include <asm/div64.h>
+
+#include "zsmalloc.h"
+#include "zsmalloc_int.h"
+
+static void pin_handle(struct zs_handle *handle)
+{
+	bit_spin_lock(HANDLE_PIN_BIT, &handle->flags);
+}
+
+static int trypin_handle(struct zs_handle *handle)
+{
+	return bit_spin_trylock(HANDLE_PIN_BIT, &handle->flags);
+}
+
+static void unpin_handle(struct zs_handle *handle)
+{
+	bit_spin_unlock(HANDLE_PIN_BIT, &handle->flags);
+}
+
+static u32 get_size_class_index(u32 size)
+{
+	u32 idx = 0;
+
+	if (likely(size > ZS_MIN_ALLOC_SIZE))
+		idx = DIV_ROUND_UP(size - ZS_MIN_ALLOC_SIZE,
+				ZS_SIZE_CLASS_DELTA);
+
+	return idx;
+}
+
+/*
+ * Pick the zspage size (in pages) that wastes the least space
+ * at the end for objects of the given class size.
+ */
+static u32 get_pages_per_zspage(u32 class_size)
+{
+	u32 i, max_usedpc = 0, max_usedpc_pages = 1;
+
+	for (i = 1; i <= ZS_MAX_PAGES_PER_ZSPAGE; i++) {
+		u32 zspage_size = i * PAGE_SIZE;
+		u32 waste = zspage_size % class_size;
+		u32 usedpc = (zspage_size - waste) * 100 / zspage_size;
+
+		if (usedpc > max_usedpc) {
+			max_usedpc = usedpc;
+			max_usedpc_pages = i;
+		}
+	}
+
+	return max_usedpc_pages;
+}
+
+/*
+ * Given <zspage, obj_idx> pair, find the page holding the start of
+ * the object and its offset within that page. Since class sizes are
+ * multiples of ZS_SIZE_CLASS_DELTA, the object header never crosses
+ * a page boundary; the object payload may.
+ */
+static void obj_location(struct size_class *class, struct zspage *zspage,
+			u32 obj_idx, struct page **page, u32 *offset)
+{
+	unsigned long linear = (unsigned long)obj_idx * class->size;
+
+	*page = zspage->pages[linear >> PAGE_SHIFT];
+	*offset = linear & ~PAGE_MASK;
+}
+
+static unsigned long read_obj_header(struct size_class *class,
+			struct zspage *zspage, u32 obj_idx)
+{
+	struct page *page;
+	u32 offset;
+	unsigned char *vaddr;
+	unsigned long val;
+
+	obj_location(class, zspage, obj_idx, &page, &offset);
+	vaddr = kmap_atomic(page, KM_USER0);
+	val = *(unsigned long *)(vaddr + offset);
+	kunmap_atomic(vaddr, KM_USER0);
+
+	return val;
+}
+
+static void write_obj_header(struct size_class *class,
+			struct zspage *zspage, u32 obj_idx, unsigned long val)
+{
+	struct page *page;
+	u32 offset;
+	unsigned char *vaddr;
+
+	obj_location(class, zspage, obj_idx, &page, &offset);
+	vaddr = kmap_atomic(page, KM_USER0);
+	*(unsigned long *)(vaddr + offset) = val;
+	kunmap_atomic(vaddr, KM_USER0);
+}
+
+/*
+ * Copy @len bytes between @buf and the linear zspage area starting
+ * at byte @linear, splitting at page boundaries as needed.
+ */
+static void zspage_copy(struct zspage *zspage, unsigned long linear,
+			void *buf, size_t len, int to_zspage)
+{
+	unsigned char *vaddr;
+
+	while (len) {
+		struct page *page = zspage->pages[linear >> PAGE_SHIFT];
+		u32 offset = linear & ~PAGE_MASK;
+		size_t sz = min_t(size_t, len, PAGE_SIZE - offset);
+
+		vaddr = kmap_atomic(page, KM_USER1);
+		if (to_zspage)
+			memcpy(vaddr + offset, buf, sz);
+		else
+			memcpy(buf, vaddr + offset, sz);
+		kunmap_atomic(vaddr, KM_USER1);
+
+		buf += sz;
+		linear += sz;
+		len -= sz;
+	}
+}
+
+static unsigned long obj_payload(struct size_class *class, u32 obj_idx)
+{
+	return (unsigned long)obj_idx * class->size + ZS_HANDLE_SIZE;
+}
+
+static enum fullness_group get_fullness_group(struct size_class *class,
+			struct zspage *zspage)
+{
+	if (zspage->inuse == class->objs_per_zspage)
+		return ZS_FULL;
+
+	if (zspage->inuse * 4 <= class->objs_per_zspage * 3)
+		return ZS_ALMOST_EMPTY;
+
+	return ZS_ALMOST_FULL;
+}
+
+static void insert_zspage(struct size_class *class, struct zspage *zspage,
+			enum fullness_group group)
+{
+	zspage->fullness = group;
+	list_add(&zspage->list, &class->fullness_list[group]);
+}
+
+static void fix_fullness_group(struct size_class *class,
+			struct zspage *zspage)
+{
+	enum fullness_group group;
+
+	group = get_fullness_group(class, zspage);
+	if (group == zspage->fullness)
+		return;
+
+	list_del(&zspage->list);
+	insert_zspage(class, zspage, group);
+}
+
+/*
+ * Prefer the fullest zspages so that sparse ones drain and can
+ * eventually be released.
+ */
+static struct zspage *find_get_zspage(struct size_class *class)
+{
+	struct list_head *list;
+
+	list = &class->fullness_list[ZS_ALMOST_FULL];
+	if (!list_empty(list))
+		return list_first_entry(list, struct zspage, list);
+
+	list = &class->fullness_list[ZS_ALMOST_EMPTY];
+	if (!list_empty(list))
+		return list_first_entry(list, struct zspage, list);
+
+	return NULL;
+}
+
+/*
+ * Link all objects of a fresh zspage into its free list.
+ */
+static void init_zspage(struct size_class *class, struct zspage *zspage)
+{
+	u32 i, next;
+
+	for (i = 0; i < class->objs_per_zspage; i++) {
+		next = i + 1;
+		if (next == class->objs_per_zspage)
+			next = ZS_OBJ_NONE;
+		write_obj_header(class, zspage, i,
+				(unsigned long)next << OBJ_TAG_BITS);
+	}
+
+	zspage->inuse = 0;
+	zspage->freeobj = 0;
+}
+
+static void free_zspage(struct size_class *class, struct zspage *zspage)
+{
+	u32 i;
+
+	for (i = 0; i < class->pages_per_zspage; i++)
+		if (zspage->pages[i])
+			__free_page(zspage->pages[i]);
+
+	kfree(zspage);
+}
+
+static struct zspage *alloc_zspage(struct size_class *class, gfp_t flags)
+{
+	u32 i;
+	struct zspage *zspage;
+
+	zspage = kzalloc(sizeof(*zspage), flags & ~__GFP_HIGHMEM);
+	if (unlikely(!zspage))
+		return NULL;
+
+	for (i = 0; i < class->pages_per_zspage; i++) {
+		zspage->pages[i] = alloc_page(flags);
+		if (unlikely(!zspage->pages[i])) {
+			free_zspage(class, zspage);
+			return NULL;
+		}
+	}
+
+	INIT_LIST_HEAD(&zspage->list);
+	init_zspage(class, zspage);
+
+	return zspage;
+}
+
+/*
+ * Take the first free object of @zspage and tag it as owned by
+ * @handle. Caller must hold class->lock and ensure a free object
+ * exists.
+ */
+static u32 obj_malloc(struct size_class *class, struct zspage *zspage,
+			unsigned long handle)
+{
+	u32 obj_idx = zspage->freeobj;
+	unsigned long next;
+
+	BUG_ON(obj_idx == ZS_OBJ_NONE);
+
+	next = read_obj_header(class, zspage, obj_idx);
+	zspage->freeobj = next >> OBJ_TAG_BITS;
+	write_obj_header(class, zspage, obj_idx, handle | OBJ_ALLOCATED_TAG);
+
+	zspage->inuse++;
+	class->objs_inuse++;
+
+	return obj_idx;
+}
+
+static void obj_free(struct size_class *class, struct zspage *zspage,
+			u32 obj_idx)
+{
+	/* Catch double free bugs */
+	BUG_ON(!(read_obj_header(class, zspage, obj_idx) &
+			OBJ_ALLOCATED_TAG));
+
+	write_obj_header(class, zspage, obj_idx,
+			(unsigned long)zspage->freeobj << OBJ_TAG_BITS);
+	zspage->freeobj = obj_idx;
+
+	zspage->inuse--;
+	class->objs_inuse--;
+}
+
+/*
+ * Create a memory pool. Sets up all size classes and the per-cpu
+ * buffers used to map objects that cross page boundaries.
+ */
+struct zs_pool *zs_create_pool(const char *name)
+{
+	u32 i, j;
+	struct zs_pool *pool;
+
+	pool = vmalloc(sizeof(*pool));
+	if (!pool)
+		return NULL;
+	memset(pool, 0, sizeof(*pool));
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+
+		spin_lock_init(&class->lock);
+		for (j = 0; j < _ZS_NR_FULLNESS_GROUPS; j++)
+			INIT_LIST_HEAD(&class->fullness_list[j]);
+
+		class->index = i;
+		class->size = ZS_MIN_ALLOC_SIZE + i * ZS_SIZE_CLASS_DELTA;
+		class->pages_per_zspage = get_pages_per_zspage(class->size);
+		class->objs_per_zspage = class->pages_per_zspage *
+					PAGE_SIZE / class->size;
+	}
+
+	mutex_init(&pool->compact_lock);
+
+	snprintf(pool->name, sizeof(pool->name), "zs_handle_%s", name);
+	pool->handle_cachep = kmem_cache_create(pool->name,
+				sizeof(struct zs_handle), 0, 0, NULL);
+	if (!pool->handle_cachep)
+		goto fail;
+
+	pool->map_area = alloc_percpu(struct mapping_area);
+	if (!pool->map_area)
+		goto fail;
+
+	return pool;
+
+fail:
+	if (pool->handle_cachep)
+		kmem_cache_destroy(pool->handle_cachep);
+	vfree(pool);
+	return NULL;
+}
+
+void zs_destroy_pool(struct zs_pool *pool)
+{
+	u32 i, j;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+
+		for (j = 0; j < _ZS_NR_FULLNESS_GROUPS; j++) {
+			struct zspage *zspage, *tmp;
+
+			list_for_each_entry_safe(zspage, tmp,
+					&class->fullness_list[j], list) {
+				WARN_ON_ONCE(zspage->inuse);
+				list_del(&zspage->list);
+				free_zspage(class, zspage);
+			}
+		}
+	}
+
+	free_percpu(pool->map_area);
+	kmem_cache_destroy(pool->handle_cachep);
+	vfree(pool);
+}
+
+/**
+ * zs_malloc - Allocate object of given size from pool.
+ * @pool: pool to allocate from
+ * @size: size of object to allocate
+ * @flags: allocation flags for backing pages
+ *
+ * On success, returns a handle that identifies the object;
+ * use zs_map_object() to access it. Returns 0 on failure.
+ *
+ * Allocation requests with size > ZS_MAX_ALLOC_SIZE - ZS_HANDLE_SIZE
+ * will fail.
+ */
+unsigned long zs_malloc(struct zs_pool *pool, size_t size, gfp_t flags)
+{
+	struct zs_handle *handle;
+	struct size_class *class;
+	struct zspage *zspage;
+
+	if (unlikely(!size || size > ZS_MAX_ALLOC_SIZE - ZS_HANDLE_SIZE))
+		return 0;
+
+	handle = kmem_cache_alloc(pool->handle_cachep,
+				flags & ~__GFP_HIGHMEM);
+	if (unlikely(!handle))
+		return 0;
+
+	class = &pool->size_class[get_size_class_index(size +
+							ZS_HANDLE_SIZE)];
+	handle->flags = 0;
+	handle->class_idx = class->index;
+
+	spin_lock(&class->lock);
+	zspage = find_get_zspage(class);
+
+	if (!zspage) {
+		/* Never allocate pages with a class lock held */
+		spin_unlock(&class->lock);
+		zspage = alloc_zspage(class, flags);
+		if (unlikely(!zspage)) {
+			kmem_cache_free(pool->handle_cachep, handle);
+			return 0;
+		}
+
+		spin_lock(&class->lock);
+		class->zspages++;
+		insert_zspage(class, zspage, ZS_ALMOST_EMPTY);
+	}
+
+	handle->obj_idx = obj_malloc(class, zspage, (unsigned long)handle);
+	handle->zspage = zspage;
+	fix_fullness_group(class, zspage);
+
+	spin_unlock(&class->lock);
+
+	return (unsigned long)handle;
+}
+
+void zs_free(struct zs_pool *pool, unsigned long handle)
+{
+	struct zs_handle *h = (struct zs_handle *)handle;
+	struct size_class *class;
+	struct zspage *zspage;
+
+	class = &pool->size_class[h->class_idx];
+
+	spin_lock(&class->lock);
+
+	pin_handle(h);
+	zspage = h->zspage;
+	obj_free(class, zspage, h->obj_idx);
+	unpin_handle(h);
+
+	/* No used objects in this zspage. Free it. */
+	if (!zspage->inuse) {
+		list_del(&zspage->list);
+		class->zspages--;
+		spin_unlock(&class->lock);
+
+		free_zspage(class, zspage);
+	} else {
+		fix_fullness_group(class, zspage);
+		spin_unlock(&class->lock);
+	}
+
+	kmem_cache_free(pool->handle_cachep, h);
+}
+
+/**
+ * zs_map_object - Get a pointer to the object behind a handle.
+ * @pool: pool the object was allocated from
+ * @handle: handle returned by zs_malloc()
+ * @mm: intended access, see enum zs_mapmode
+ *
+ * The object is pinned (cannot be migrated) and preemption is
+ * disabled until the matching zs_unmap_object(). Uses KM_USER1,
+ * so callers may hold a KM_USER0 mapping across this call.
+ */
+void *zs_map_object(struct zs_pool *pool, unsigned long handle,
+			enum zs_mapmode mm)
+{
+	struct zs_handle *h = (struct zs_handle *)handle;
+	struct size_class *class;
+	struct mapping_area *area;
+	struct page *page;
+	u32 offset;
+
+	class = &pool->size_class[h->class_idx];
+
+	pin_handle(h);
+
+	area = this_cpu_ptr(pool->map_area);
+	area->mm = mm;
+
+	obj_location(class, h->zspage, h->obj_idx, &page, &offset);
+	if (offset + class->size <= PAGE_SIZE) {
+		area->vaddr = kmap_atomic(page, KM_USER1);
+		return area->vaddr + offset + ZS_HANDLE_SIZE;
+	}
+
+	/* Object spans two pages: bounce it */
+	area->vaddr = NULL;
+	if (mm != ZS_MM_WO)
+		zspage_copy(h->zspage, obj_payload(class, h->obj_idx),
+				area->buf, class->size - ZS_HANDLE_SIZE, 0);
+
+	return area->buf;
+}
+
+void zs_unmap_object(struct zs_pool *pool, unsigned long handle)
+{
+	struct zs_handle *h = (struct zs_handle *)handle;
+	struct size_class *class;
+	struct mapping_area *area;
+
+	class = &pool->size_class[h->class_idx];
+	area = this_cpu_ptr(pool->map_area);
+
+	if (area->vaddr)
+		kunmap_atomic(area->vaddr, KM_USER1);
+	else if (area->mm != ZS_MM_RO)
+		zspage_copy(h->zspage, obj_payload(class, h->obj_idx),
+				area->buf, class->size - ZS_HANDLE_SIZE, 1);
+
+	unpin_handle(h);
+}
+
+/*
+ * Compaction source: the least used zspage of the class.
+ */
+static struct zspage *find_compact_source(struct size_class *class)
+{
+	struct zspage *zspage, *src = NULL;
+
+	list_for_each_entry(zspage, &class->fullness_list[ZS_ALMOST_EMPTY],
+				list) {
+		if (!src || zspage->inuse < src->inuse)
+			src = zspage;
+	}
+
+	return src;
+}
+
+/*
+ * Compaction destination: a zspage with room that is at least as
+ * used as @src, so objects only ever move towards denser zspages.
+ */
+static struct zspage *find_compact_dest(struct size_class *class,
+			struct zspage *src)
+{
+	struct zspage *zspage, *dst = NULL;
+	struct list_head *list;
+
+	list = &class->fullness_list[ZS_ALMOST_FULL];
+	if (!list_empty(list))
+		return list_first_entry(list, struct zspage, list);
+
+	list_for_each_entry(zspage, &class->fullness_list[ZS_ALMOST_EMPTY],
+				list) {
+		if (zspage == src || zspage->inuse < src->inuse)
+			continue;
+		if (!dst || zspage->inuse > dst->inuse)
+			dst = zspage;
+	}
+
+	return dst;
+}
+
+/*
+ * Move every live object of @src into denser zspages of the same
+ * class. Returns 0 once @src is empty, or -EAGAIN if an object is
+ * currently mapped or no destination has room left.
+ * Caller must hold class->lock.
+ */
+static int evacuate_zspage(struct zs_pool *pool, struct size_class *class,
+			struct zspage *src)
+{
+	u32 obj_idx, new_idx;
+	unsigned long hdr;
+	struct zs_handle *h;
+	struct zspage *dst;
+	char *buf = this_cpu_ptr(pool->map_area)->buf;
+
+	for (obj_idx = 0; src->inuse &&
+			obj_idx < class->objs_per_zspage; obj_idx++) {
+		hdr = read_obj_header(class, src, obj_idx);
+		if (!(hdr & OBJ_ALLOCATED_TAG))
+			continue;
+
+		dst = find_compact_dest(class, src);
+		if (!dst)
+			return -EAGAIN;
+
+		h = (struct zs_handle *)(hdr & ~OBJ_ALLOCATED_TAG);
+		if (!trypin_handle(h))
+			return -EAGAIN;
+
+		new_idx = obj_malloc(class, dst, (unsigned long)h);
+		zspage_copy(src, obj_payload(class, obj_idx), buf,
+				class->size - ZS_HANDLE_SIZE, 0);
+		zspage_copy(dst, obj_payload(class, new_idx), buf,
+				class->size - ZS_HANDLE_SIZE, 1);
+
+		h->zspage = dst;
+		h->obj_idx = new_idx;
+		obj_free(class, src, obj_idx);
+
+		unpin_handle(h);
+
+		fix_fullness_group(class, dst);
+		pool->objs_migrated++;
+	}
+
+	return src->inuse ? -EAGAIN : 0;
+}
+
+/*
+ * Returns the no. of zspages @class would release if packed tight, or 0
+ * when that is below ZS_COMPACT_MIN_ZSPAGES. Called with class->lock held.
+ */
+static unsigned long class_compactable(struct size_class *class)
+{
+	u64 free_objs;
+
+	free_objs = class->zspages * class->objs_per_zspage -
+			class->objs_inuse;
+	do_div(free_objs, class->objs_per_zspage);
+
+	if (free_objs < ZS_COMPACT_MIN_ZSPAGES)
+		return 0;
+
+	return (unsigned long)free_objs;
+}
+
+static unsigned long compact_class(struct zs_pool *pool,
+			struct size_class *class)
+{
+	unsigned long freed = 0;
+	struct zspage *src;
+
+	spin_lock(&class->lock);
+
+	if (!class_compactable(class)) {
+		spin_unlock(&class->lock);
+		return 0;
+	}
+
+	while ((src = find_compact_source(class))) {
+		if (evacuate_zspage(pool, class, src))
+			break;
+
+		list_del(&src->list);
+		class->zspages--;
+		free_zspage(class, src);
+		freed += class->pages_per_zspage;
+
+		if (need_resched()) {
+			spin_unlock(&class->lock);
+			cond_resched();
+			spin_lock(&class->lock);
+		}
+	}
+
+	spin_unlock(&class->lock);
+
+	return freed;
+}
+
+/*
+ * Returns an estimate of the no. of pages zs_compact() could release
+ * if every partially used zspage were packed tight. Classes that are
+ * barely fragmented are not counted, nor compacted.
+ */
+unsigned long zs_compactable_pages(struct zs_pool *pool)
+{
+	u32 i;
+	unsigned long pages = 0;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+
+		spin_lock(&class->lock);
+		pages += class_compactable(class) * class->pages_per_zspage;
+		spin_unlock(&class->lock);
+	}
+
+	return pages;
+}
+
+/**
+ * zs_compact - Migrate objects to release sparsely used zspages.
+ * @pool: pool to compact
+ *
+ * Objects that are mapped at the time are skipped. Returns the
+ * no. of pages released. If another compaction pass is already
+ * running on @pool, returns 0 immediately.
+ */
+unsigned long zs_compact(struct zs_pool *pool)
+{
+	u32 i;
+	unsigned long freed = 0;
+
+	if (!mutex_trylock(&pool->compact_lock))
+		return 0;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		freed += compact_class(pool, &pool->size_class[i]);
+		cond_resched();
+	}
+
+	pool->compact_runs++;
+	pool->pages_compacted += freed;
+
+	mutex_unlock(&pool->compact_lock);
+
+	return freed;
+}
+
+/*
+ * Returns total memory used by allocator (userdata + metadata)
+ */
+u64 zs_get_total_size_bytes(struct zs_pool *pool)
+{
+	u32 i;
+	u64 npages = 0;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+
+		spin_lock(&class->lock);
+		npages += class->zspages * class->pages_per_zspage;
+		spin_unlock(&class->lock);
+	}
+
+	return npages << PAGE_SHIFT;
+}
+
+void zs_get_pool_stats(struct zs_pool *pool, struct zs_pool_stats *stats)
+{
+	u32 i;
+
+	memset(stats, 0, sizeof(*stats));
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+
+		spin_lock(&class->lock);
+		stats->pages_used += class->zspages * class->pages_per_zspage;
+		stats->objs_allocated += class->zspages *
+					class->objs_per_zspage;
+		stats->objs_used += class->objs_inuse;
+		stats->bytes_used += class->objs_inuse * class->size;
+		spin_unlock(&class->lock);
+	}
+
+	mutex_lock(&pool->compact_lock);
+	stats->compact_runs = pool->compact_runs;
+	stats->pages_compacted = pool->pages_compacted;
+	stats->objs_migrated = pool->objs_migrated;
+	mutex_unlock(&pool->compact_lock);
+}
@@ -0,0 +1,58 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZS_MALLOC_H_
+#define _ZS_MALLOC_H_
+
+#include <linux/types.h>
+
+/*
+ * How an object is going to be accessed between zs_map_object()
+ * and zs_unmap_object(). Objects that straddle a page boundary are
+ * bounced through a per-cpu buffer; the mode lets us skip the copy
+ * in (write-only) or the copy out (read-only).
+ */
+enum zs_mapmode {
+	ZS_MM_RW,
+	ZS_MM_RO,
+	ZS_MM_WO,
+};
+
+struct zs_pool_stats {
+	u64 pages_used;		/* pages backing all zspages */
+	u64 objs_allocated;	/* object slots in all zspages */
+	u64 objs_used;		/* slots holding live objects */
+	u64 bytes_used;		/* slot bytes held by live objects */
+	u64 compact_runs;	/* no. of completed compaction passes */
+	u64 pages_compacted;	/* pages released by compaction */
+	u64 objs_migrated;	/* objects moved by compaction */
+};
+
+struct zs_pool;
+
+struct zs_pool *zs_create_pool(const char *name);
+void zs_destroy_pool(struct zs_pool *pool);
+
+unsigned long zs_malloc(struct zs_pool *pool, size_t size, gfp_t flags);
+void zs_free(struct zs_pool *pool, unsigned long handle);
+
+void *zs_map_object(struct zs_pool *pool, unsigned long handle,
+			enum zs_mapmode mm);
+void zs_unmap_object(struct zs_pool *pool, unsigned long handle);
+
+unsigned long zs_compactable_pages(struct zs_pool *pool);
+unsigned long zs_compact(struct zs_pool *pool);
+
+u64 zs_get_total_size_bytes(struct zs_pool *pool);
+void zs_get_pool_stats(struct zs_pool *pool, struct zs_pool_stats *stats);
+
+#endif
@@ -0,0 +1,130 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZS_MALLOC_INT_H_
+#define _ZS_MALLOC_INT_H_
+
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+/* User configurable params */
+
+/*
+ * A zspage is a group of up to this many order-0 pages that are
+ * treated as one linear area. Objects are laid out back to back
+ * and may cross the boundary between two component pages.
+ */
+#define ZS_MAX_PAGES_PER_ZSPAGE	4
+
+/*
+ * Every object is preceded by one word: the handle that owns it
+ * (with OBJ_ALLOCATED_TAG set) or, for free objects, the index of
+ * the next free object. The back-reference is what allows
+ * compaction to find and update the owner of a moved object.
+ */
+#define ZS_HANDLE_SIZE		(sizeof(unsigned long))
+
+/* Sizes below include ZS_HANDLE_SIZE */
+#define ZS_MIN_ALLOC_SIZE	32
+#define ZS_MAX_ALLOC_SIZE	PAGE_SIZE
+
+/* Size classes are separated by ZS_SIZE_CLASS_DELTA bytes */
+#define ZS_SIZE_CLASS_DELTA	(PAGE_SIZE >> 8)
+#define ZS_SIZE_CLASSES		((ZS_MAX_ALLOC_SIZE - ZS_MIN_ALLOC_SIZE) \
+					/ ZS_SIZE_CLASS_DELTA + 1)
+
+/*
+ * A class is only worth compacting once at least this many of its
+ * zspages' worth of objects are free, so that the shrinker does not
+ * walk the pool for the odd zspage.
+ */
+#define ZS_COMPACT_MIN_ZSPAGES	2
+
+/* End of user params */
+
+#define OBJ_ALLOCATED_TAG	1UL
+#define OBJ_TAG_BITS		1
+#define ZS_OBJ_NONE		0xffff
+
+enum fullness_group {
+	ZS_ALMOST_EMPTY,	/* at most 3/4 of the objects in use */
+	ZS_ALMOST_FULL,
+	ZS_FULL,
+	_ZS_NR_FULLNESS_GROUPS,
+};
+
+enum handle_bits {
+	/* Object is mapped or being migrated */
+	HANDLE_PIN_BIT,
+};
+
+struct zspage {
+	struct list_head list;		/* link in class fullness list */
+	struct page *pages[ZS_MAX_PAGES_PER_ZSPAGE];
+	u16 inuse;			/* no. of live objects */
+	u16 freeobj;			/* first free object or ZS_OBJ_NONE */
+	u8 fullness;
+};
+
+/*
+ * What zs_malloc() hands out. The location of an object is only
+ * reachable through its handle, so compaction can move the object
+ * and update <zspage, obj_idx> without the user noticing.
+ */
+struct zs_handle {
+	unsigned long flags;
+	struct zspage *zspage;
+	u16 obj_idx;
+	u16 class_idx;
+};
+
+struct size_class {
+	spinlock_t lock;
+	struct list_head fullness_list[_ZS_NR_FULLNESS_GROUPS];
+
+	u32 index;
+	u32 size;		/* object size incl. ZS_HANDLE_SIZE */
+	u32 pages_per_zspage;
+	u32 objs_per_zspage;
+
+	/* stats, protected by lock */
+	u64 zspages;
+	u64 objs_inuse;
+};
+
+/* Per-cpu bounce buffer for objects that span two pages */
+struct mapping_area {
+	char buf[ZS_MAX_ALLOC_SIZE];
+	void *vaddr;		/* kmap address, NULL if bounced */
+	enum zs_mapmode mm;
+};
+
+struct zs_pool {
+	struct size_class size_class[ZS_SIZE_CLASSES];
+
+	struct kmem_cache *handle_cachep;
+	struct mapping_area __percpu *map_area;
+	char name[32];
+
+	/* Serializes compaction passes; protects the stats below */
+	struct mutex compact_lock;
+
+	/* stats */
+	u64 compact_runs;
+	u64 pages_compacted;
+	u64 objs_migrated;
+};
+
+#endif
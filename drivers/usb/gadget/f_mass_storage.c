@@ -283,11 +283,13 @@
 #include <linux/kref.h>
 #include <linux/kthread.h>
 #include <linux/limits.h>
+#include <linux/mm.h>
 #include <linux/rwsem.h>
 #include <linux/slab.h>
 #include <linux/spinlock.h>
 #include <linux/string.h>
 #include <linux/freezer.h>
+#include <linux/uio.h>
 #include <linux/utsname.h>
 
 #include <linux/usb/ch9.h>
@@ -318,6 +320,17 @@ static const char fsg_string_interface[] = "Mass Storage";
 #include "storage_common.c"
 
 
+/*
+ * Number of buffers in the pipeline.  With more than two, the host can
+ * keep sending (or receiving) data while the backing file is busy, and
+ * consecutive buffers received from the host are written to the file
+ * with a single call.
+ */
+static unsigned int fsg_num_buffers = CONFIG_USB_GADGET_STORAGE_NUM_BUFFERS;
+module_param_named(num_buffers, fsg_num_buffers, uint, S_IRUGO);
+MODULE_PARM_DESC(num_buffers, "Number of pipeline buffers");
+
+
 /*-------------------------------------------------------------------------*/
 
 struct fsg_dev;
@@ -362,7 +375,10 @@ struct fsg_common {
 
 	struct fsg_buffhd	*next_buffhd_to_fill;
 	struct fsg_buffhd	*next_buffhd_to_drain;
-	struct fsg_buffhd	buffhds[FSG_NUM_BUFFERS];
+	struct fsg_buffhd	*buffhds;
+	unsigned int		num_buffers;
+	/* For writing consecutive buffers to the backing file at once */
+	struct iovec		*write_iov;
 
 	int			cmnd_size;
 	u8			cmnd[MAX_COMMAND_SIZE];
@@ -731,6 +747,35 @@ static int sleep_thread(struct fsg_common *common)
 
 /*-------------------------------------------------------------------------*/
 
+/*
+ * Start reading the whole transfer from the backing file, so that the
+ * media is busy with the rest of it while the first buffers are being
+ * sent to the host.  The vfs_read() calls in do_read() then find the
+ * pages in the cache or already under I/O.
+ */
+static void fsg_lun_readahead(struct fsg_lun *curlun, loff_t file_offset,
+			      u32 amount)
+{
+	struct address_space	*mapping = curlun->filp->f_mapping;
+	pgoff_t			index, end;
+
+	if (file_offset >= curlun->file_length)
+		return;
+	amount = min((loff_t) amount, curlun->file_length - file_offset);
+	if (amount <= PAGE_CACHE_SIZE)
+		return;
+
+	index = file_offset >> PAGE_CACHE_SHIFT;
+	end = (file_offset + amount - 1) >> PAGE_CACHE_SHIFT;
+
+	/* Size the readahead window to the SCSI transfer */
+	if (curlun->ra.ra_pages < end - index + 1)
+		curlun->ra.ra_pages = end - index + 1;
+
+	page_cache_sync_readahead(mapping, &curlun->ra, curlun->filp,
+				  index, end - index + 1);
+}
+
 static int do_read(struct fsg_common *common)
 {
 	struct fsg_lun		*curlun = common->curlun;
@@ -769,6 +814,8 @@ static int do_read(struct fsg_common *common)
 	if (unlikely(amount_left == 0))
 		return -EIO;		/* No default reply */
 
+	fsg_lun_readahead(curlun, file_offset, amount_left);
+
 	for (;;) {
 
 		/* Figure out how much we need to read:
@@ -865,11 +912,14 @@ static int do_write(struct fsg_common *common)
 	struct fsg_lun		*curlun = common->curlun;
 	u32			lba;
 	struct fsg_buffhd	*bh;
+	struct iovec		*iov = common->write_iov;
 	int			get_some_more;
 	u32			amount_left_to_req, amount_left_to_write;
 	loff_t			usb_offset, file_offset, file_offset_tmp;
-	unsigned int		amount;
+	unsigned int		amount, len;
 	unsigned int		partial_page;
+	unsigned int		nr_iov, i;
+	int			short_packet;
 	ssize_t			nwritten;
 	int			rc;
 
@@ -980,31 +1030,69 @@ static int do_write(struct fsg_common *common)
 			break;			/* We stopped early */
 		if (bh->state == BUF_STATE_FULL) {
 			smp_rmb();
-			common->next_buffhd_to_drain = bh->next;
-			bh->state = BUF_STATE_EMPTY;
 
 			/* Did something go wrong with the transfer? */
 			if (bh->outreq->status != 0) {
+				common->next_buffhd_to_drain = bh->next;
+				bh->state = BUF_STATE_EMPTY;
 				curlun->sense_data = SS_COMMUNICATION_FAILURE;
 				curlun->sense_data_info = file_offset >> 9;
 				curlun->info_valid = 1;
 				break;
 			}
 
-			amount = bh->outreq->actual;
+			/* Gather all the buffers that have arrived in
+			 * order, up to a failed or short transfer, and
+			 * write them with a single call. */
+			amount = 0;
+			nr_iov = 0;
+			short_packet = 0;
+			for (;;) {
+				common->next_buffhd_to_drain = bh->next;
+				bh->state = BUF_STATE_EMPTY;
+				iov[nr_iov].iov_base = bh->buf;
+				iov[nr_iov].iov_len = bh->outreq->actual;
+				amount += bh->outreq->actual;
+				++nr_iov;
+
+				/* Did the host decide to stop early? */
+				if (bh->outreq->actual != bh->outreq->length) {
+					short_packet = 1;
+					break;
+				}
+
+				bh = bh->next;
+				if (bh->state != BUF_STATE_FULL)
+					break;
+				smp_rmb();
+				if (bh->outreq->status != 0)
+					break;
+			}
+
 			if (curlun->file_length - file_offset < amount) {
 				LERROR(curlun,
 	"write %u @ %llu beyond end %llu\n",
 	amount, (unsigned long long) file_offset,
 	(unsigned long long) curlun->file_length);
 				amount = curlun->file_length - file_offset;
+
+				/* Trim the vector to match */
+				len = amount;
+				for (i = 0; i < nr_iov; ++i) {
+					if (iov[i].iov_len >= len) {
+						iov[i].iov_len = len;
+						nr_iov = i + 1;
+						break;
+					}
+					len -= iov[i].iov_len;
+				}
 			}
 
 			/* Perform the write */
 			file_offset_tmp = file_offset;
-			nwritten = vfs_write(curlun->filp,
-					(char __user *) bh->buf,
-					amount, &file_offset_tmp);
+			nwritten = vfs_writev(curlun->filp,
+					(struct iovec __user *) iov,
+					nr_iov, &file_offset_tmp);
 			VLDBG(curlun, "file write %u @ %llu -> %d\n", amount,
 					(unsigned long long) file_offset,
 					(int) nwritten);
@@ -1033,8 +1121,7 @@ static int do_write(struct fsg_common *common)
 				break;
 			}
 
-			/* Did the host decide to stop early? */
-			if (bh->outreq->actual != bh->outreq->length) {
+			if (short_packet) {
 				common->short_packet_received = 1;
 				break;
 			}
@@ -2353,7 +2440,7 @@ reset:
 	if (common->fsg) {
 		fsg = common->fsg;
 
-		for (i = 0; i < FSG_NUM_BUFFERS; ++i) {
+		for (i = 0; i < common->num_buffers; ++i) {
 			struct fsg_buffhd *bh = &common->buffhds[i];
 
 			if (bh->inreq) {
@@ -2405,7 +2492,7 @@ reset:
 	clear_bit(IGNORE_BULK_OUT, &fsg->atomic_bitflags);
 
 	/* Allocate the requests */
-	for (i = 0; i < FSG_NUM_BUFFERS; ++i) {
+	for (i = 0; i < common->num_buffers; ++i) {
 		struct fsg_buffhd	*bh = &common->buffhds[i];
 
 		rc = alloc_request(common, fsg->bulk_in, &bh->inreq);
@@ -2473,7 +2560,7 @@ static void handle_exception(struct fsg_common *common)
 
 	/* Cancel all the pending transfers */
 	if (likely(common->fsg)) {
-		for (i = 0; i < FSG_NUM_BUFFERS; ++i) {
+		for (i = 0; i < common->num_buffers; ++i) {
 			bh = &common->buffhds[i];
 			if (bh->inreq_busy)
 				usb_ep_dequeue(common->fsg->bulk_in, bh->inreq);
@@ -2485,7 +2572,7 @@ static void handle_exception(struct fsg_common *common)
 		/* Wait until everything is idle */
 		for (;;) {
 			int num_active = 0;
-			for (i = 0; i < FSG_NUM_BUFFERS; ++i) {
+			for (i = 0; i < common->num_buffers; ++i) {
 				bh = &common->buffhds[i];
 				num_active += bh->inreq_busy + bh->outreq_busy;
 			}
@@ -2506,7 +2593,7 @@ static void handle_exception(struct fsg_common *common)
 	 * state, and the exception.  Then invoke the handler. */
 	spin_lock_irq(&common->lock);
 
-	for (i = 0; i < FSG_NUM_BUFFERS; ++i) {
+	for (i = 0; i < common->num_buffers; ++i) {
 		bh = &common->buffhds[i];
 		bh->state = BUF_STATE_EMPTY;
 	}
@@ -2719,7 +2806,7 @@ static struct fsg_common *fsg_common_init(struct fsg_common *common,
 			return ERR_PTR(-ENOMEM);
 		common->free_storage_on_release = 1;
 	} else {
-		memset(common, 0, sizeof common);
+		memset(common, 0, sizeof *common);
 		common->free_storage_on_release = 0;
 	}
 
@@ -2798,8 +2885,19 @@ static struct fsg_common *fsg_common_init(struct fsg_common *common,
 
 
 	/* Data buffers cyclic list */
+	common->num_buffers = clamp_t(unsigned int, fsg_num_buffers,
+				      2, FSG_MAX_NUM_BUFFERS);
+	common->buffhds = kcalloc(common->num_buffers,
+				  sizeof *common->buffhds, GFP_KERNEL);
+	common->write_iov = kcalloc(common->num_buffers,
+				    sizeof *common->write_iov, GFP_KERNEL);
+	if (unlikely(!common->buffhds || !common->write_iov)) {
+		rc = -ENOMEM;
+		goto error_release;
+	}
+
 	bh = common->buffhds;
-	i = FSG_NUM_BUFFERS;
+	i = common->num_buffers;
 	goto buffhds_first_it;
 	do {
 		bh->next = bh + 1;
@@ -2935,13 +3033,15 @@ static void fsg_common_release(struct kref *ref)
 		kfree(common->luns);
 	}
 
-	{
+	if (likely(common->buffhds)) {
 		struct fsg_buffhd *bh = common->buffhds;
-		unsigned i = FSG_NUM_BUFFERS;
+		unsigned i = common->num_buffers;
 		do {
 			kfree(bh->buf);
 		} while (++bh, --i);
+		kfree(common->buffhds);
 	}
+	kfree(common->write_iov);
 
 	if (common->free_storage_on_release)
 		kfree(common);
@@ -28,6 +28,8 @@
 
 #include <linux/types.h>
 #include <linux/file.h>
+#include <linux/fs.h>
+#include <linux/backing-dev.h>
 #include <linux/device.h>
 #include <linux/miscdevice.h>
 
@@ -50,9 +52,31 @@
 #define STATE_CANCELED              3   /* transaction canceled by host */
 #define STATE_ERROR                 4   /* error from completion routine */
 
-/* number of tx and rx requests to allocate */
-#define TX_REQ_MAX 4
-#define RX_REQ_MAX 2
+/* upper bounds for the number of tx and rx requests to allocate */
+#define TX_REQ_MAX 16
+#define RX_REQ_MAX 8
+
+/* the request size and queue depth used for MTP_SEND_FILE and
+ * MTP_RECEIVE_FILE. file I/O for one request overlaps the USB transfer
+ * of the others, so deeper queues and larger requests keep the bus busy
+ * while the storage is slow to respond. if the larger buffers can't be
+ * allocated we fall back to BULK_BUFFER_SIZE.
+ */
+static unsigned int tx_req_len = 65536;
+module_param(tx_req_len, uint, S_IRUGO);
+MODULE_PARM_DESC(tx_req_len, "IN request buffer size");
+
+static unsigned int rx_req_len = 65536;
+module_param(rx_req_len, uint, S_IRUGO);
+MODULE_PARM_DESC(rx_req_len, "OUT request buffer size");
+
+static unsigned int tx_reqs = 8;
+module_param(tx_reqs, uint, S_IRUGO);
+MODULE_PARM_DESC(tx_reqs, "number of IN requests (at most 16)");
+
+static unsigned int rx_reqs = 4;
+module_param(rx_reqs, uint, S_IRUGO);
+MODULE_PARM_DESC(rx_reqs, "number of OUT requests (at most 8)");
 
 /* ID for Microsoft MTP OS String */
 #define MTP_OS_STRING_ID   0xEE
@@ -94,7 +118,14 @@ struct mtp_dev {
 	wait_queue_head_t write_wq;
 	struct usb_request *rx_req[RX_REQ_MAX];
 	struct usb_request *intr_req;
+	/* number of rx requests completed since it was last cleared */
 	int rx_done;
+
+	/* size and number of the bulk requests actually allocated */
+	unsigned tx_req_len;
+	unsigned rx_req_len;
+	int tx_reqs;
+	int rx_reqs;
 	/* true if interrupt endpoint is busy */
 	int intr_busy;
 
@@ -361,7 +392,8 @@ static void mtp_complete_out(struct usb_ep *ep, struct usb_request *req)
 {
 	struct mtp_dev *dev = _mtp_dev;
 
-	dev->rx_done = 1;
+	/* requests on an endpoint complete in the order they were queued */
+	dev->rx_done++;
 	if (req->status != 0)
 		dev->state = STATE_ERROR;
 
@@ -428,17 +460,40 @@ static int __init create_bulk_endpoints(struct mtp_dev *dev,
 	dev->ep_intr = ep;
 
 	/* now allocate requests for our endpoints */
-	for (i = 0; i < TX_REQ_MAX; i++) {
-		req = mtp_request_new(dev->ep_in, BULK_BUFFER_SIZE);
-		if (!req)
-			goto fail;
+	dev->tx_req_len = max_t(unsigned, tx_req_len & ~511,
+					BULK_BUFFER_SIZE);
+	dev->tx_reqs = clamp_t(int, tx_reqs, 1, TX_REQ_MAX);
+retry_tx_alloc:
+	for (i = 0; i < dev->tx_reqs; i++) {
+		req = mtp_request_new(dev->ep_in, dev->tx_req_len);
+		if (!req) {
+			if (dev->tx_req_len == BULK_BUFFER_SIZE)
+				goto fail;
+			while ((req = req_get(dev, &dev->tx_idle)))
+				mtp_request_free(req, dev->ep_in);
+			dev->tx_req_len = BULK_BUFFER_SIZE;
+			goto retry_tx_alloc;
+		}
 		req->complete = mtp_complete_in;
 		req_put(dev, &dev->tx_idle, req);
 	}
-	for (i = 0; i < RX_REQ_MAX; i++) {
-		req = mtp_request_new(dev->ep_out, BULK_BUFFER_SIZE);
-		if (!req)
-			goto fail;
+
+	dev->rx_req_len = max_t(unsigned, rx_req_len & ~511,
+					BULK_BUFFER_SIZE);
+	dev->rx_reqs = clamp_t(int, rx_reqs, 1, RX_REQ_MAX);
+retry_rx_alloc:
+	for (i = 0; i < dev->rx_reqs; i++) {
+		req = mtp_request_new(dev->ep_out, dev->rx_req_len);
+		if (!req) {
+			if (dev->rx_req_len == BULK_BUFFER_SIZE)
+				goto fail;
+			while (i--) {
+				mtp_request_free(dev->rx_req[i], dev->ep_out);
+				dev->rx_req[i] = NULL;
+			}
+			dev->rx_req_len = BULK_BUFFER_SIZE;
+			goto retry_rx_alloc;
+		}
 		req->complete = mtp_complete_out;
 		dev->rx_req[i] = req;
 	}
@@ -466,7 +521,7 @@ static ssize_t mtp_read(struct file *fp, char __user *buf,
 
 	DBG(cdev, "mtp_read(%d)\n", count);
 
-	if (count > BULK_BUFFER_SIZE)
+	if (count > dev->rx_req_len)
 		return -EINVAL;
 
 	/* we will block until we're online */
@@ -586,8 +641,8 @@ static ssize_t mtp_write(struct file *fp, const char __user *buf,
 			break;
 		}
 
-		if (count > BULK_BUFFER_SIZE)
-			xfer = BULK_BUFFER_SIZE;
+		if (count > dev->tx_req_len)
+			xfer = dev->tx_req_len;
 		else
 			xfer = count;
 		if (xfer && copy_from_user(req->buf, buf, xfer)) {
@@ -624,7 +679,26 @@ static ssize_t mtp_write(struct file *fp, const char __user *buf,
 	return r;
 }
 
-/* read from a local file and write to USB */
+/* the file is read front to back, so ask for a larger readahead window
+ * the way POSIX_FADV_SEQUENTIAL does. this keeps the storage busy while
+ * the queued IN requests drain.
+ */
+static void mtp_hint_sequential(struct file *filp)
+{
+	struct address_space *mapping = filp->f_mapping;
+
+	if (!mapping || !mapping->backing_dev_info)
+		return;
+
+	filp->f_ra.ra_pages = mapping->backing_dev_info->ra_pages * 2;
+	spin_lock(&filp->f_lock);
+	filp->f_mode &= ~FMODE_RANDOM;
+	spin_unlock(&filp->f_lock);
+}
+
+/* read from a local file and write to USB. while vfs_read fills one
+ * request, up to tx_reqs - 1 others are being sent by the controller.
+ */
 static void send_file_work(struct work_struct *data) {
 	struct mtp_dev	*dev = container_of(data, struct mtp_dev, send_file_work);
 	struct usb_composite_dev *cdev = dev->cdev;
@@ -644,6 +718,8 @@ static void send_file_work(struct work_struct *data) {
 
 	DBG(cdev, "send_file_work(%lld %lld)\n", offset, count);
 
+	mtp_hint_sequential(filp);
+
 	/* we need to send a zero length packet to signal the end of transfer
 	 * if the transfer size is aligned to a packet boundary.
 	 */
@@ -670,8 +746,8 @@ static void send_file_work(struct work_struct *data) {
 			break;
 		}
 
-		if (count > BULK_BUFFER_SIZE)
-			xfer = BULK_BUFFER_SIZE;
+		if (count > dev->tx_req_len)
+			xfer = dev->tx_req_len;
 		else
 			xfer = count;
 		ret = vfs_read(filp, req->buf, xfer, &offset);
@@ -705,16 +781,28 @@ static void send_file_work(struct work_struct *data) {
 	smp_wmb();
 }
 
-/* read from USB and write to a local file */
+/* dequeue the rx requests that were queued but not yet consumed */
+static void mtp_rx_dequeue(struct mtp_dev *dev, int consumed, int queued)
+{
+	while (consumed < queued)
+		usb_ep_dequeue(dev->ep_out,
+			dev->rx_req[consumed++ % dev->rx_reqs]);
+}
+
+/* read from USB and write to a local file. up to rx_reqs requests are
+ * kept queued on the OUT endpoint, so the host keeps sending while
+ * vfs_write stores the oldest completed one.
+ */
 static void receive_file_work(struct work_struct *data)
 {
 	struct mtp_dev	*dev = container_of(data, struct mtp_dev, receive_file_work);
 	struct usb_composite_dev *cdev = dev->cdev;
-	struct usb_request *read_req = NULL, *write_req = NULL;
+	struct usb_request *req;
 	struct file *filp;
 	loff_t offset;
-	int64_t count;
-	int ret, cur_buf = 0;
+	int64_t count, to_queue;
+	int ret, queued = 0, consumed = 0;
+	int unknown_length, eof = 0;
 	int r = 0;
 
 	/* read our parameters */
@@ -725,62 +813,74 @@ static void receive_file_work(struct work_struct *data)
 
 	DBG(cdev, "receive_file_work(%lld)\n", count);
 
-	while (count > 0 || write_req) {
-		if (count > 0) {
-			/* queue a request */
-			read_req = dev->rx_req[cur_buf];
-			cur_buf = (cur_buf + 1) % RX_REQ_MAX;
+	/* if xfer_file_length is 0xFFFFFFFF, then we read until we get a
+	 * short packet. we can't tell where the data ends in that case, so
+	 * only one request is queued at a time: any request queued past the
+	 * end would swallow the next command from the host.
+	 */
+	unknown_length = (count == 0xFFFFFFFF);
+	to_queue = count;
+	dev->rx_done = 0;
 
-			read_req->length = (count > BULK_BUFFER_SIZE
-					? BULK_BUFFER_SIZE : count);
-			dev->rx_done = 0;
-			ret = usb_ep_queue(dev->ep_out, read_req, GFP_KERNEL);
+	while (1) {
+		/* keep the OUT endpoint busy */
+		while (!eof && queued - consumed < dev->rx_reqs &&
+			(unknown_length ? queued == consumed : to_queue > 0)) {
+			req = dev->rx_req[queued % dev->rx_reqs];
+			req->length = dev->rx_req_len;
+			if (!unknown_length && to_queue < req->length)
+				req->length = to_queue;
+			ret = usb_ep_queue(dev->ep_out, req, GFP_KERNEL);
 			if (ret < 0) {
 				r = -EIO;
 				dev->state = STATE_ERROR;
-				break;
+				goto out;
 			}
+			if (!unknown_length)
+				to_queue -= req->length;
+			queued++;
 		}
 
-		if (write_req) {
-			DBG(cdev, "rx %p %d\n", write_req, write_req->actual);
-			ret = vfs_write(filp, write_req->buf, write_req->actual,
-				&offset);
-			DBG(cdev, "vfs_write %d\n", ret);
-			if (ret != write_req->actual) {
-				r = -EIO;
-				dev->state = STATE_ERROR;
-				break;
-			}
-			write_req = NULL;
+		if (queued == consumed)
+			break;
+
+		/* wait for the oldest request to complete */
+		ret = wait_event_interruptible(dev->read_wq,
+			dev->rx_done > consumed || dev->state != STATE_BUSY);
+		if (dev->state == STATE_CANCELED) {
+			r = -ECANCELED;
+			goto out;
+		}
+		if (dev->rx_done <= consumed || dev->state != STATE_BUSY) {
+			r = ret < 0 ? ret : -EIO;
+			goto out;
 		}
 
-		if (read_req) {
-			/* wait for our last read to complete */
-			ret = wait_event_interruptible(dev->read_wq,
-				dev->rx_done || dev->state != STATE_BUSY);
-			if (dev->state == STATE_CANCELED) {
-				r = -ECANCELED;
-				if (!dev->rx_done)
-					usb_ep_dequeue(dev->ep_out, read_req);
-				break;
-			}
-			/* if xfer_file_length is 0xFFFFFFFF, then we read until
-			 * we get a zero length packet
-			 */
-			if (count != 0xFFFFFFFF)
-				count -= read_req->actual;
-			if (read_req->actual < read_req->length) {
-				/* short packet is used to signal EOF for sizes > 4 gig */
-				DBG(cdev, "got short packet\n");
-				count = 0;
-			}
+		req = dev->rx_req[consumed++ % dev->rx_reqs];
+		DBG(cdev, "rx %p %d\n", req, req->actual);
+
+		if (req->actual < req->length) {
+			/* short packet is used to signal EOF for sizes > 4 gig */
+			DBG(cdev, "got short packet\n");
+			eof = 1;
+			/* the host is done, don't wait for the rest */
+			mtp_rx_dequeue(dev, consumed, queued);
+			queued = consumed;
+		}
 
-			write_req = read_req;
-			read_req = NULL;
+		ret = vfs_write(filp, req->buf, req->actual, &offset);
+		DBG(cdev, "vfs_write %d\n", ret);
+		if (ret != req->actual) {
+			r = -EIO;
+			dev->state = STATE_ERROR;
+			goto out;
 		}
 	}
 
+out:
+	/* nothing may be left on the endpoint pointing at our buffers */
+	mtp_rx_dequeue(dev, consumed, queued);
+
 	DBG(cdev, "receive_file_work returning %d\n", r);
 	/* write the result */
 	dev->xfer_result = r;
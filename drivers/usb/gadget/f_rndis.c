@@ -323,6 +323,25 @@ static struct usb_gadget_strings *rndis_strings[] = {
 static struct usb_ether_platform_data *rndis_pdata;
 #endif
 
+/* RNDIS lets several packets share one transfer:  how many the host may
+ * send us in one, and how many we gather into one for the host (which
+ * also bounds those by the MaxTransferSize it sent with its INIT).
+ */
+#define RNDIS_UL_MAX_PKT_PER_XFER	4	/* keeps RX skbs to an order-1 page */
+#define RNDIS_DL_MAX_PKT_PER_XFER	(TX_AGG_BUF_SIZE / \
+	ALIGN(sizeof(struct rndis_packet_msg_type) + ETH_FRAME_LEN, \
+		RNDIS_PACKET_ALIGN))
+
+static unsigned int rndis_ul_max_pkt_per_xfer = 3;
+module_param(rndis_ul_max_pkt_per_xfer, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(rndis_ul_max_pkt_per_xfer,
+		"max packets per transfer from the host (1-4)");
+
+static unsigned int rndis_dl_max_pkt_per_xfer = 10;
+module_param(rndis_dl_max_pkt_per_xfer, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(rndis_dl_max_pkt_per_xfer,
+		"max packets per transfer to the host (1-10)");
+
 /*-------------------------------------------------------------------------*/
 
 static struct sk_buff *rndis_add_header(struct gether *port,
@@ -338,6 +357,12 @@ static struct sk_buff *rndis_add_header(struct gether *port,
 	return skb2;
 }
 
+static unsigned rndis_add_header_buf(struct gether *port,
+					void *buf, unsigned len)
+{
+	return rndis_add_hdr_buf(buf, len);
+}
+
 static void rndis_response_available(void *_rndis)
 {
 	struct f_rndis			*rndis = _rndis;
@@ -415,6 +440,10 @@ static void rndis_command_complete(struct usb_ep *ep, struct usb_request *req)
 	if (status < 0)
 		ERROR(cdev, "RNDIS command error %d, %d/%d\n",
 			status, req->actual, req->length);
+
+	/* INIT tells us how large a transfer the host accepts */
+	rndis->port.dl_max_xfer_size =
+			rndis_get_dl_max_xfer_size(rndis->config);
 //	spin_unlock(&dev->lock);
 }
 
@@ -723,6 +752,13 @@ rndis_bind(struct usb_configuration *c, struct usb_function *f)
 		goto fail;
 	rndis->config = status;
 
+	rndis->port.ul_max_pkts_per_xfer = clamp_t(unsigned int,
+			rndis_ul_max_pkt_per_xfer, 1, RNDIS_UL_MAX_PKT_PER_XFER);
+	rndis->port.dl_max_pkts_per_xfer = clamp_t(unsigned int,
+			rndis_dl_max_pkt_per_xfer, 1, RNDIS_DL_MAX_PKT_PER_XFER);
+	rndis_set_max_pkt_xfer(rndis->config,
+			rndis->port.ul_max_pkts_per_xfer);
+
 	rndis_set_param_medium(rndis->config, NDIS_MEDIUM_802_3, 0);
 	rndis_set_host_mac(rndis->config, rndis->ethaddr);
 
@@ -860,6 +896,7 @@ rndis_bind_config(struct usb_configuration *c, u8 ethaddr[ETH_ALEN])
 	rndis->port.header_len = sizeof(struct rndis_packet_msg_type);
 	rndis->port.wrap = rndis_add_header;
 	rndis->port.unwrap = rndis_rm_hdr;
+	rndis->port.wrap_buf = rndis_add_header_buf;
 
 	rndis->port.func.name = "rndis";
 	rndis->port.func.strings = rndis_strings;
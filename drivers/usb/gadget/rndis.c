@@ -596,6 +596,9 @@ static int rndis_init_response (int configNr, rndis_init_msg_type *buf)
 		return -ENOMEM;
 	resp = (rndis_init_cmplt_type *) r->buf;
 
+	/* largest transfer the host will take from us */
+	params->dl_max_xfer_size = le32_to_cpu (buf->MaxTransferSize);
+
 	resp->MessageType = cpu_to_le32 (
 			REMOTE_NDIS_INITIALIZE_CMPLT);
 	resp->MessageLength = cpu_to_le32 (52);
@@ -605,12 +608,12 @@ static int rndis_init_response (int configNr, rndis_init_msg_type *buf)
 	resp->MinorVersion = cpu_to_le32 (RNDIS_MINOR_VERSION);
 	resp->DeviceFlags = cpu_to_le32 (RNDIS_DF_CONNECTIONLESS);
 	resp->Medium = cpu_to_le32 (RNDIS_MEDIUM_802_3);
-	resp->MaxPacketsPerTransfer = cpu_to_le32 (1);
-	resp->MaxTransferSize = cpu_to_le32 (
+	resp->MaxPacketsPerTransfer = cpu_to_le32 (params->ul_max_pkt_per_xfer);
+	resp->MaxTransferSize = cpu_to_le32 (params->ul_max_pkt_per_xfer * (
 		  params->dev->mtu
 		+ sizeof (struct ethhdr)
 		+ sizeof (struct rndis_packet_msg_type)
-		+ 22);
+		+ 22));
 	resp->PacketAlignmentFactor = cpu_to_le32 (0);
 	resp->AFListOffset = cpu_to_le32 (0);
 	resp->AFListSize = cpu_to_le32 (0);
@@ -924,6 +927,8 @@ int rndis_register(void (*resp_avail)(void *v), void *v)
 			rndis_per_dev_params [i].used = 1;
 			rndis_per_dev_params [i].resp_avail = resp_avail;
 			rndis_per_dev_params [i].v = v;
+			rndis_per_dev_params [i].ul_max_pkt_per_xfer = 1;
+			rndis_per_dev_params [i].dl_max_xfer_size = 0;
 			pr_debug("%s: configNr = %d\n", __func__, i);
 			return i;
 		}
@@ -979,6 +984,24 @@ int rndis_set_param_medium (u8 configNr, u32 medium, u32 speed)
 	return 0;
 }
 
+int rndis_set_max_pkt_xfer (u8 configNr, u32 max_pkt_per_xfer)
+{
+	pr_debug("%s: %u\n", __func__, max_pkt_per_xfer);
+	if (!max_pkt_per_xfer) return -EINVAL;
+	if (configNr >= RNDIS_MAX_CONFIGS) return -1;
+
+	rndis_per_dev_params [configNr].ul_max_pkt_per_xfer = max_pkt_per_xfer;
+
+	return 0;
+}
+
+u32 rndis_get_dl_max_xfer_size (u8 configNr)
+{
+	if (configNr >= RNDIS_MAX_CONFIGS) return 0;
+
+	return rndis_per_dev_params [configNr].dl_max_xfer_size;
+}
+
 void rndis_add_hdr (struct sk_buff *skb)
 {
 	struct rndis_packet_msg_type	*header;
@@ -993,6 +1016,30 @@ void rndis_add_hdr (struct sk_buff *skb)
 	header->DataLength = cpu_to_le32(skb->len - sizeof *header);
 }
 
+/* Frame len bytes of data that follow the header at buf, for one of
+ * several packet messages in a single transfer.  The message is padded
+ * so the next one starts aligned; returns the length of the message.
+ */
+unsigned rndis_add_hdr_buf (void *buf, unsigned len)
+{
+	struct rndis_packet_msg_type	*header = buf;
+	unsigned			msg_len;
+
+	msg_len = ALIGN (sizeof *header + len, RNDIS_PACKET_ALIGN);
+
+	memset (header, 0, sizeof *header);
+	header->MessageType = cpu_to_le32(REMOTE_NDIS_PACKET_MSG);
+	header->MessageLength = cpu_to_le32(msg_len);
+	header->DataOffset = cpu_to_le32 (36);
+	header->DataLength = cpu_to_le32(len);
+
+	/* the alignment padding goes on the wire too */
+	memset (buf + sizeof *header + len, 0,
+		msg_len - sizeof *header - len);
+
+	return msg_len;
+}
+
 void rndis_free_response (int configNr, u8 *buf)
 {
 	rndis_resp_t		*r;
@@ -1051,23 +1098,54 @@ int rndis_rm_hdr(struct gether *port,
 			struct sk_buff *skb,
 			struct sk_buff_head *list)
 {
-	/* tmp points to a struct rndis_packet_msg_type */
-	__le32		*tmp = (void *) skb->data;
+	struct sk_buff	*skb2;
+	u32		msg_len, data_offset, data_len;
 
-	/* MessageType, MessageLength */
-	if (cpu_to_le32(REMOTE_NDIS_PACKET_MSG)
-			!= get_unaligned(tmp++)) {
-		dev_kfree_skb_any(skb);
-		return -EINVAL;
+	/* The host may pack up to MaxPacketsPerTransfer messages into
+	 * one transfer.  Each but the last is cloned, so the frames all
+	 * share the one receive buffer; whatever follows the last
+	 * message is padding.
+	 */
+	for (;;) {
+		/* tmp points to a struct rndis_packet_msg_type */
+		__le32		*tmp = (void *) skb->data;
+
+		/* MessageType, MessageLength */
+		if (skb->len < 16 || cpu_to_le32(REMOTE_NDIS_PACKET_MSG)
+				!= get_unaligned(tmp++)) {
+			dev_kfree_skb_any(skb);
+			return -EINVAL;
+		}
+		msg_len = get_unaligned_le32(tmp++);
+
+		/* DataOffset, DataLength */
+		data_offset = get_unaligned_le32(tmp++) + 8;
+		data_len = get_unaligned_le32(tmp++);
+
+		if (msg_len >= skb->len
+				|| skb->len - msg_len
+					< sizeof(struct rndis_packet_msg_type)
+				|| data_offset > msg_len
+				|| data_len > msg_len - data_offset)
+			break;
+
+		skb2 = skb_clone(skb, GFP_ATOMIC);
+		if (!skb2) {
+			dev_kfree_skb_any(skb);
+			return -ENOMEM;
+		}
+		skb_pull(skb2, data_offset);
+		skb_trim(skb2, data_len);
+		skb_queue_tail(list, skb2);
+
+		skb_pull(skb, msg_len);
 	}
-	tmp++;
 
-	/* DataOffset, DataLength */
-	if (!skb_pull(skb, get_unaligned_le32(tmp++) + 8)) {
+	if (!skb_pull(skb, data_offset)) {
 		dev_kfree_skb_any(skb);
 		return -EOVERFLOW;
 	}
-	skb_trim(skb, get_unaligned_le32(tmp++));
+	skb_trim(skb, data_len);
 
 	skb_queue_tail(list, skb);
 	return 0;
@@ -20,6 +20,9 @@
 #define RNDIS_MAXIMUM_FRAME_SIZE	1518
 #define RNDIS_MAX_TOTAL_SIZE		1558
 
+/* Alignment of each packet message in a multi-packet transfer */
+#define RNDIS_PACKET_ALIGN		8
+
 /* Remote NDIS Versions */
 #define RNDIS_MAJOR_VERSION		1
 #define RNDIS_MINOR_VERSION		0
@@ -234,6 +237,10 @@ typedef struct rndis_params
 	u16			*filter;
 	struct net_device	*dev;
 
+	/* multi-packet transfers */
+	u32			ul_max_pkt_per_xfer;	/* host to device */
+	u32			dl_max_xfer_size;	/* device to host */
+
 	u32			vendorID;
 	const char		*vendorDescr;
 	void			(*resp_avail)(void *v);
@@ -250,7 +257,10 @@ int  rndis_set_param_dev (u8 configNr, struct net_device *dev,
 int  rndis_set_param_vendor (u8 configNr, u32 vendorID,
 			    const char *vendorDescr);
 int  rndis_set_param_medium (u8 configNr, u32 medium, u32 speed);
+int  rndis_set_max_pkt_xfer (u8 configNr, u32 max_pkt_per_xfer);
+u32  rndis_get_dl_max_xfer_size (u8 configNr);
 void rndis_add_hdr (struct sk_buff *skb);
+unsigned rndis_add_hdr_buf (void *buf, unsigned len);
 int rndis_rm_hdr(struct gether *port, struct sk_buff *skb,
 			struct sk_buff_head *list);
 u8   *rndis_get_next_response (int configNr, u32 *length);
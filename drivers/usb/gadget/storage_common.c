@@ -290,6 +290,9 @@ struct fsg_lun {
 	u32		sense_data_info;
 	u32		unit_attention_data;
 
+	/* Readahead state for whole-transfer readahead of READ commands */
+	struct file_ra_state	ra;
+
 	struct device	dev;
 };
 
@@ -308,6 +311,9 @@ static struct fsg_lun *fsg_lun_from_dev(struct device *dev)
 /* Number of buffers we will use.  2 is enough for double-buffering */
 #define FSG_NUM_BUFFERS	2
 
+/* Upper bound for a configurable number of buffers */
+#define FSG_MAX_NUM_BUFFERS	32
+
 /* Default size of buffer length. */
 #define FSG_BUFLEN	((u32)16384)
 
@@ -649,6 +655,7 @@ static int fsg_lun_open(struct fsg_lun *curlun, const char *filename)
 	curlun->filp = filp;
 	curlun->file_length = size;
 	curlun->num_sectors = num_sectors;
+	file_ra_state_init(&curlun->ra, filp->f_mapping);
 	LDBG(curlun, "open backing file: %s\n", filename);
 	rc = 0;
 
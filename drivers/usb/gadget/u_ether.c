@@ -24,7 +24,9 @@
 
 #include <linux/kernel.h>
 #include <linux/gfp.h>
+#include <linux/slab.h>
 #include <linux/device.h>
+#include <linux/hrtimer.h>
 #include <linux/ctype.h>
 #include <linux/etherdevice.h>
 #include <linux/ethtool.h>
@@ -77,6 +79,20 @@ struct eth_dev {
 						struct sk_buff *skb,
 						struct sk_buff_head *list);
 
+	unsigned		ul_max_pkts;
+	unsigned		(*wrap_buf)(struct gether *,
+						void *buf, unsigned len);
+
+	/* multi-packet TX:  frames are copied into tx_agg_req until it's
+	 * full, the IN queue drains, or tx_agg_timer expires.  guarded
+	 * by req_lock.
+	 */
+	bool			tx_agg;
+	struct usb_ep		*tx_agg_ep;
+	struct usb_request	*tx_agg_req;
+	unsigned		tx_agg_pkts;
+	struct hrtimer		tx_agg_timer;
+
 	struct work_struct	work;
 
 	unsigned long		todo;
@@ -92,6 +108,13 @@ struct eth_dev {
 
 #define DEFAULT_QLEN	2	/* double buffering by default */
 
+#define TX_AGG_SLACK	8	/* padding wrap_buf() may add per frame */
+
+static unsigned tx_agg_window = 200;
+module_param(tx_agg_window, uint, S_IRUGO|S_IWUSR);
+MODULE_PARM_DESC(tx_agg_window,
+		"longest wait (usecs) to gather TX frames into one transfer");
+
 
 #ifdef CONFIG_USB_GADGET_DUALSPEED
 
@@ -233,10 +256,12 @@ rx_submit(struct eth_dev *dev, struct usb_request *req, gfp_t gfp_flags)
 	 * RNDIS uses internal framing, and explicitly allows senders to
 	 * pad to end-of-packet.  That's potentially nice for speed, but
 	 * means receivers can't recover lost synch on their own (because
-	 * new packets don't only start after a short RX).
+	 * new packets don't only start after a short RX).  It also lets
+	 * the host pack several packets into one transfer.
 	 */
 	size += sizeof(struct ethhdr) + dev->net->mtu + RX_EXTRA;
 	size += dev->port_usb->header_len;
+	size *= dev->ul_max_pkts;
 	size += out->maxpacket - 1;
 	size -= size % out->maxpacket;
 
@@ -422,6 +447,31 @@ done:
 	return status;
 }
 
+/* multi-packet TX copies frames into a buffer owned by each request */
+static int tx_agg_alloc(struct eth_dev *dev)
+{
+	struct usb_request	*req;
+
+	spin_lock(&dev->req_lock);
+	list_for_each_entry(req, &dev->tx_reqs, list)
+		req->buf = NULL;
+	list_for_each_entry(req, &dev->tx_reqs, list) {
+		req->buf = kmalloc(TX_AGG_BUF_SIZE, GFP_ATOMIC);
+		if (!req->buf)
+			goto fail;
+	}
+	spin_unlock(&dev->req_lock);
+	return 0;
+fail:
+	list_for_each_entry(req, &dev->tx_reqs, list) {
+		kfree(req->buf);
+		req->buf = NULL;
+	}
+	spin_unlock(&dev->req_lock);
+	DBG(dev, "can't alloc tx buffers, one frame per transfer\n");
+	return -ENOMEM;
+}
+
 static void rx_fill(struct eth_dev *dev, gfp_t gfp_flags)
 {
 	struct usb_request	*req;
@@ -458,10 +508,87 @@ static void eth_work(struct work_struct *work)
 		DBG(dev, "work done, flags = 0x%lx\n", dev->todo);
 }
 
+static void tx_complete(struct usb_ep *ep, struct usb_request *req);
+
+/* caller holds req_lock; takes the request frames are being gathered in,
+ * if any, so it can be queued.  it's counted in tx_qlen from here on, so
+ * nothing sent meanwhile can overtake it.
+ */
+static struct usb_request *tx_agg_detach(struct eth_dev *dev, unsigned *pkts)
+{
+	struct usb_request	*req = dev->tx_agg_req;
+
+	if (!req)
+		return NULL;
+
+	hrtimer_try_to_cancel(&dev->tx_agg_timer);
+	dev->tx_agg_req = NULL;
+	*pkts = dev->tx_agg_pkts;
+	atomic_inc(&dev->tx_qlen);
+
+	/* temporarily stop TX queue when the freelist empties */
+	if (list_empty(&dev->tx_reqs))
+		netif_stop_queue(dev->net);
+	return req;
+}
+
+static void tx_agg_submit(struct eth_dev *dev, struct usb_ep *in,
+		struct usb_request *req, unsigned pkts)
+{
+	unsigned long	flags;
+	int		retval;
+
+	req->context = NULL;
+	req->complete = tx_complete;
+
+	/* same zlp framing as single frames, see eth_start_xmit() */
+	req->zero = 1;
+	if (!dev->zlp && (req->length % in->maxpacket) == 0)
+		((u8 *)req->buf)[req->length++] = 0;
+
+	/* each of these carries several frames; always want its irq */
+	req->no_interrupt = 0;
+
+	retval = usb_ep_queue(in, req, GFP_ATOMIC);
+	if (retval) {
+		DBG(dev, "tx queue err %d\n", retval);
+		atomic_dec(&dev->tx_qlen);
+		dev->net->stats.tx_dropped += pkts;
+		spin_lock_irqsave(&dev->req_lock, flags);
+		if (list_empty(&dev->tx_reqs))
+			netif_start_queue(dev->net);
+		list_add(&req->list, &dev->tx_reqs);
+		spin_unlock_irqrestore(&dev->req_lock, flags);
+	} else
+		dev->net->trans_start = jiffies;
+}
+
+static enum hrtimer_restart tx_agg_timeout(struct hrtimer *timer)
+{
+	struct eth_dev		*dev;
+	struct usb_request	*req;
+	struct usb_ep		*in;
+	unsigned		pkts;
+	unsigned long		flags;
+
+	dev = container_of(timer, struct eth_dev, tx_agg_timer);
+
+	spin_lock_irqsave(&dev->req_lock, flags);
+	in = dev->tx_agg_ep;
+	req = tx_agg_detach(dev, &pkts);
+	spin_unlock_irqrestore(&dev->req_lock, flags);
+
+	if (req)
+		tx_agg_submit(dev, in, req, pkts);
+	return HRTIMER_NORESTART;
+}
+
 static void tx_complete(struct usb_ep *ep, struct usb_request *req)
 {
-	struct sk_buff	*skb = req->context;
-	struct eth_dev	*dev = ep->driver_data;
+	struct sk_buff		*skb = req->context;
+	struct eth_dev		*dev = ep->driver_data;
+	struct usb_request	*agg = NULL;
+	unsigned		pkts;
 
 	switch (req->status) {
 	default:
@@ -472,16 +599,27 @@ static void tx_complete(struct usb_ep *ep, struct usb_request *req)
 	case -ESHUTDOWN:		/* disconnect etc */
 		break;
 	case 0:
-		dev->net->stats.tx_bytes += skb->len;
+		if (skb)
+			dev->net->stats.tx_bytes += skb->len;
 	}
-	dev->net->stats.tx_packets++;
+
+	/* multi-packet transfers were counted as their frames were added */
+	if (skb)
+		dev->net->stats.tx_packets++;
 
 	spin_lock(&dev->req_lock);
 	list_add(&req->list, &dev->tx_reqs);
+
+	/* once the IN queue drains, don't keep gathered frames waiting */
+	if (atomic_dec_and_test(&dev->tx_qlen) && req->status == 0)
+		agg = tx_agg_detach(dev, &pkts);
 	spin_unlock(&dev->req_lock);
-	dev_kfree_skb_any(skb);
+	if (skb)
+		dev_kfree_skb_any(skb);
+
+	if (agg)
+		tx_agg_submit(dev, ep, agg, pkts);
 
-	atomic_dec(&dev->tx_qlen);
 	if (netif_carrier_ok(dev->net))
 		netif_wake_queue(dev->net);
 }
@@ -491,6 +629,89 @@ static inline int is_promisc(u16 cdc_filter)
 	return cdc_filter & USB_CDC_PACKET_TYPE_PROMISCUOUS;
 }
 
+/*
+ * Copy the frame into the transfer being gathered, then queue that
+ * transfer if it's full or nothing else is in flight.  Otherwise it
+ * goes out with the next frames, when the IN queue drains, or after
+ * tx_agg_window usecs, whichever comes first.
+ */
+static netdev_tx_t tx_agg_xmit(struct eth_dev *dev, struct sk_buff *skb)
+{
+	struct net_device	*net = dev->net;
+	struct usb_request	*req, *full = NULL, *ready = NULL;
+	struct usb_ep		*in;
+	unsigned		full_pkts, ready_pkts;
+	unsigned		limit, max_pkts, frame_max;
+	unsigned long		flags;
+	netdev_tx_t		status = NETDEV_TX_OK;
+	void			*buf;
+
+	spin_lock_irqsave(&dev->lock, flags);
+	if (!dev->port_usb) {
+		spin_unlock_irqrestore(&dev->lock, flags);
+		dev_kfree_skb_any(skb);
+		return NETDEV_TX_OK;
+	}
+
+	/* the host says how much it takes per transfer; a lone frame
+	 * is always sent, whatever that limit is
+	 */
+	in = dev->port_usb->in_ep;
+	limit = min_t(u32, dev->port_usb->dl_max_xfer_size, TX_AGG_BUF_SIZE);
+	if (!dev->zlp && limit)
+		limit--;
+	max_pkts = dev->port_usb->dl_max_pkts_per_xfer;
+	frame_max = dev->header_len + ETH_HLEN + net->mtu + TX_AGG_SLACK;
+
+	spin_lock(&dev->req_lock);
+	req = dev->tx_agg_req;
+	if (req && req->length + dev->header_len + skb->len + TX_AGG_SLACK
+			> limit) {
+		full = tx_agg_detach(dev, &full_pkts);
+		req = NULL;
+	}
+	if (!req) {
+		/* as in eth_start_xmit(), this can race disconnect() */
+		if (list_empty(&dev->tx_reqs)) {
+			status = NETDEV_TX_BUSY;
+			goto unlock;
+		}
+		req = container_of(dev->tx_reqs.next,
+				struct usb_request, list);
+		list_del(&req->list);
+		req->length = 0;
+		dev->tx_agg_req = req;
+		dev->tx_agg_pkts = 0;
+	}
+
+	buf = req->buf + req->length;
+	skb_copy_bits(skb, 0, buf + dev->header_len, skb->len);
+	req->length += dev->wrap_buf(dev->port_usb, buf, skb->len);
+	dev->tx_agg_pkts++;
+	net->stats.tx_packets++;
+	net->stats.tx_bytes += skb->len;
+
+	if (dev->tx_agg_pkts >= max_pkts
+			|| req->length + frame_max > limit
+			|| atomic_read(&dev->tx_qlen) == 0)
+		ready = tx_agg_detach(dev, &ready_pkts);
+	else if (dev->tx_agg_pkts == 1)
+		hrtimer_start(&dev->tx_agg_timer,
+				ns_to_ktime(tx_agg_window * NSEC_PER_USEC),
+				HRTIMER_MODE_REL);
+unlock:
+	spin_unlock(&dev->req_lock);
+	spin_unlock_irqrestore(&dev->lock, flags);
+
+	if (status == NETDEV_TX_OK)
+		dev_kfree_skb_any(skb);
+	if (full)
+		tx_agg_submit(dev, in, full, full_pkts);
+	if (ready)
+		tx_agg_submit(dev, in, ready, ready_pkts);
+	return status;
+}
+
 static netdev_tx_t eth_start_xmit(struct sk_buff *skb,
 					struct net_device *net)
 {
@@ -539,6 +760,9 @@ static netdev_tx_t eth_start_xmit(struct sk_buff *skb,
 		/* ignores USB_CDC_PACKET_TYPE_DIRECTED */
 	}
 
+	if (dev->tx_agg)
+		return tx_agg_xmit(dev, skb);
+
 	spin_lock_irqsave(&dev->req_lock, flags);
 	/*
 	 * this freelist can be empty if an interrupt triggered disconnect()
@@ -772,6 +996,8 @@ int gether_setup(struct usb_gadget *g, u8 ethaddr[ETH_ALEN])
 	INIT_WORK(&dev->work, eth_work);
 	INIT_LIST_HEAD(&dev->tx_reqs);
 	INIT_LIST_HEAD(&dev->rx_reqs);
+	hrtimer_init(&dev->tx_agg_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	dev->tx_agg_timer.function = tx_agg_timeout;
 
 	skb_queue_head_init(&dev->rx_frames);
 
@@ -829,6 +1055,7 @@ void gether_cleanup(void)
 	if (!the_dev)
 		return;
 
+	hrtimer_cancel(&the_dev->tx_agg_timer);
 	unregister_netdev(the_dev->net);
 	free_netdev(the_dev->net);
 
@@ -890,6 +1117,15 @@ struct net_device *gether_connect(struct gether *link)
 		dev->unwrap = link->unwrap;
 		dev->wrap = link->wrap;
 
+		dev->ul_max_pkts = link->ul_max_pkts_per_xfer ? : 1;
+		dev->wrap_buf = link->wrap_buf;
+		dev->tx_agg_ep = link->in_ep;
+		dev->tx_agg = link->wrap_buf
+			&& link->dl_max_pkts_per_xfer > 1
+			&& tx_agg_alloc(dev) == 0;
+		DBG(dev, "rx %u tx %u frames per transfer\n", dev->ul_max_pkts,
+			dev->tx_agg ? link->dl_max_pkts_per_xfer : 1);
+
 		spin_lock(&dev->lock);
 		dev->port_usb = link;
 		link->ioport = dev;
@@ -948,17 +1184,26 @@ void gether_disconnect(struct gether *link)
 	 * of all pending i/o.  then free the request objects
 	 * and forget about the endpoints.
 	 */
+	hrtimer_cancel(&dev->tx_agg_timer);
 	usb_ep_disable(link->in_ep);
 	spin_lock(&dev->req_lock);
+	if (dev->tx_agg_req) {
+		list_add(&dev->tx_agg_req->list, &dev->tx_reqs);
+		dev->tx_agg_req = NULL;
+	}
+	dev->tx_agg_ep = NULL;
 	while (!list_empty(&dev->tx_reqs)) {
 		req = container_of(dev->tx_reqs.next,
 					struct usb_request, list);
 		list_del(&req->list);
 
 		spin_unlock(&dev->req_lock);
+		if (dev->tx_agg)
+			kfree(req->buf);
 		usb_ep_free_request(link->in_ep, req);
 		spin_lock(&dev->req_lock);
 	}
+	dev->tx_agg = false;
 	spin_unlock(&dev->req_lock);
 	link->in_ep->driver_data = NULL;
 	link->in = NULL;
@@ -982,6 +1227,7 @@ void gether_disconnect(struct gether *link)
 	dev->header_len = 0;
 	dev->unwrap = NULL;
 	dev->wrap = NULL;
+	dev->wrap_buf = NULL;
 
 	spin_lock(&dev->lock);
 	dev->port_usb = NULL;
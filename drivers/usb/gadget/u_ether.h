@@ -68,11 +68,27 @@ struct gether {
 						struct sk_buff *skb,
 						struct sk_buff_head *list);
 
+	/* multi-packet transfers, for framings that allow them (RNDIS).
+	 * received transfers may hold up to ul_max_pkts_per_xfer frames.
+	 * with wrap_buf(), which frames len bytes already copied after
+	 * the header at buf and returns the message length, frames sent
+	 * to the host are gathered up to dl_max_pkts_per_xfer frames or
+	 * dl_max_xfer_size bytes per transfer.
+	 */
+	unsigned			ul_max_pkts_per_xfer;
+	unsigned			dl_max_pkts_per_xfer;
+	u32				dl_max_xfer_size;
+	unsigned			(*wrap_buf)(struct gether *port,
+						void *buf, unsigned len);
+
 	/* called on network open/close */
 	void				(*open)(struct gether *);
 	void				(*close)(struct gether *);
 };
 
+/* per-request buffer that multi-packet TX gathers frames in */
+#define TX_AGG_BUF_SIZE	16384
+
 #define	DEFAULT_FILTER	(USB_CDC_PACKET_TYPE_BROADCAST \
 			|USB_CDC_PACKET_TYPE_ALL_MULTICAST \
 			|USB_CDC_PACKET_TYPE_PROMISCUOUS \
@@ -878,6 +878,24 @@ void tegra_dc_incr_syncpt_min(struct tegra_dc *dc, u32 val)
 	mutex_unlock(&dc->lock);
 }
 
+/* length of one refresh of the current mode, in microseconds */
+unsigned long tegra_dc_get_frame_period_us(const struct tegra_dc *dc)
+{
+	const struct tegra_dc_mode *mode = &dc->mode;
+	u64 pixels;
+
+	if (!mode->pclk)
+		return 0;
+
+	pixels = (u64)(mode->h_sync_width + mode->h_back_porch +
+		       mode->h_active + mode->h_front_porch) *
+		 (mode->v_sync_width + mode->v_back_porch +
+		  mode->v_active + mode->v_front_porch);
+
+	return (unsigned long)div_u64(pixels * USEC_PER_SEC, mode->pclk);
+}
+EXPORT_SYMBOL(tegra_dc_get_frame_period_us);
+
 static bool tegra_dc_windows_are_clean(struct tegra_dc_win *windows[],
 					     int n)
 {
@@ -18,15 +18,19 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  */
 
+#include <linux/debugfs.h>
 #include <linux/kernel.h>
+#include <linux/ktime.h>
 #include <linux/list.h>
 #include <linux/miscdevice.h>
 #include <linux/mm.h>
 #include <linux/mutex.h>
 #include <linux/sched.h>
+#include <linux/seq_file.h>
 #include <linux/spinlock.h>
 #include <linux/tegra_overlay.h>
 #include <linux/uaccess.h>
+#include <linux/wait.h>
 
 #include <asm/atomic.h>
 
@@ -40,8 +44,23 @@
 
 DEFINE_MUTEX(tegra_flip_lock);
 
+/* flips a client may have queued before TEGRA_OVERLAY_IOCTL_FLIP blocks */
+#define TEGRA_OVERLAY_FLIP_QUEUE_DEPTH	3
+/* flips whose timestamps are kept for the debugfs flip log */
+#define TEGRA_OVERLAY_FLIP_HISTORY	64
+/* longest a flip waits for its buffers when nothing is queued behind it */
+#define TEGRA_OVERLAY_FLIP_TIMEOUT_MS	500
+
 struct overlay_client;
 
+struct tegra_overlay_flip_stamp {
+	ktime_t	queued;		/* flip ioctl returned */
+	ktime_t	ready;		/* pre-syncpoints of all windows reached */
+	ktime_t	scanout;	/* windows latched at frame end */
+	u32	syncpt_val;	/* post-syncpoint value returned to the client */
+	bool	skipped;
+};
+
 struct overlay {
 	struct overlay_client	*owner;
 };
@@ -65,6 +84,19 @@ struct tegra_overlay_info {
 
 	struct workqueue_struct	*flip_wq;
 
+	/* flips handed to flip_wq and not yet retired, oldest first */
+	struct list_head	flip_queue;
+	spinlock_t		flip_lock;
+	wait_queue_head_t	flip_retired;
+
+	/* protected by flip_lock */
+	struct tegra_overlay_flip_stamp	flip_log[TEGRA_OVERLAY_FLIP_HISTORY];
+	unsigned int		flip_log_next;
+	unsigned long		flips_retired;
+	unsigned long		flips_skipped;
+
+	struct dentry		*debugfs;
+
 	/* Big enough for tegra_dc%u when %u < 10 */
 	char			name[10];
 };
@@ -74,6 +106,7 @@ struct overlay_client {
 	struct list_head		list;
 	struct task_struct		*task;
 	struct nvmap_client		*user_nvmap;
+	atomic_t			flips_pending;
 };
 
 struct tegra_overlay_flip_win {
@@ -84,10 +117,13 @@ struct tegra_overlay_flip_win {
 
 struct tegra_overlay_flip_data {
 	struct work_struct		work;
+	struct list_head		list;
 	struct tegra_overlay_info	*overlay;
+	struct overlay_client		*client;
 	struct tegra_overlay_flip_win	win[TEGRA_FB_FLIP_N_WINDOWS];
 	u32				syncpt_max;
 	u32				flags;
+	struct tegra_overlay_flip_stamp	stamp;
 };
 
 /* Overlay window manipulation */
@@ -197,14 +233,6 @@ static int tegra_overlay_set_windowattr(struct tegra_overlay_info *overlay,
 	if (flip_win->attr.tiled)
 		win->flags |= TEGRA_WIN_FLAG_TILED;
 
-	if ((s32)flip_win->attr.pre_syncpt_id >= 0) {
-		nvhost_syncpt_wait_timeout(&overlay->ndev->host->syncpt,
-					   flip_win->attr.pre_syncpt_id,
-					   flip_win->attr.pre_syncpt_val,
-					   msecs_to_jiffies(500),
-					   NULL);
-	}
-
 	/* Store the blend state incase we need to reorder later */
 	overlay->blend.z[win->idx] = win->z;
 	overlay->blend.flags[win->idx] = win->flags & TEGRA_WIN_BLEND_FLAGS_MASK;
@@ -253,6 +281,103 @@ static void tegra_overlay_blend_reorder(struct tegra_dc_blend *blend,
 	windows[below]->flags |= blend->flags[idx];
 }
 
+/*
+ * a queued flip is superseded once every window it updates is also
+ * updated by a flip queued behind it; showing it would only delay the
+ * newer content by a frame.
+ */
+static bool tegra_overlay_flip_superseded(struct tegra_overlay_info *overlay,
+					  struct tegra_overlay_flip_data *data)
+{
+	struct tegra_overlay_flip_data *next;
+	bool superseded = true;
+	int i, j;
+
+	spin_lock(&overlay->flip_lock);
+	for (i = 0; i < TEGRA_FB_FLIP_N_WINDOWS && superseded; i++) {
+		int idx = data->win[i].attr.index;
+		bool found = false;
+
+		if (idx == -1)
+			continue;
+
+		next = data;
+		list_for_each_entry_continue(next, &overlay->flip_queue, list) {
+			for (j = 0; j < TEGRA_FB_FLIP_N_WINDOWS; j++)
+				if (next->win[j].attr.index == idx)
+					found = true;
+		}
+		superseded = found;
+	}
+	spin_unlock(&overlay->flip_lock);
+
+	return superseded;
+}
+
+/*
+ * waits for the pre-syncpoints of all windows of a flip. the wait is done
+ * a frame at a time so that a late buffer can be dropped as soon as a newer
+ * flip for the same windows is queued; returns false if the flip should be
+ * skipped. if nothing newer arrives, the flip is shown after at most
+ * TEGRA_OVERLAY_FLIP_TIMEOUT_MS, ready or not, as before.
+ */
+static bool tegra_overlay_flip_wait(struct tegra_overlay_info *overlay,
+				    struct tegra_overlay_flip_data *data)
+{
+	struct nvhost_syncpt *sp = &overlay->ndev->host->syncpt;
+	unsigned long deadline = jiffies +
+		msecs_to_jiffies(TEGRA_OVERLAY_FLIP_TIMEOUT_MS);
+	unsigned long frame = max(usecs_to_jiffies(
+		tegra_dc_get_frame_period_us(overlay->dc)), 1UL);
+	int i, err;
+
+	for (i = 0; i < TEGRA_FB_FLIP_N_WINDOWS; i++) {
+		struct tegra_overlay_windowattr *attr = &data->win[i].attr;
+		long left;
+
+		if (attr->index == -1 || (s32)attr->pre_syncpt_id < 0)
+			continue;
+
+		for (;;) {
+			left = (long)(deadline - jiffies);
+			err = nvhost_syncpt_wait_timeout(sp,
+					attr->pre_syncpt_id,
+					attr->pre_syncpt_val,
+					clamp_t(long, left, 0, frame), NULL);
+			if (err != -EAGAIN || left <= 0)
+				break;
+			if (tegra_overlay_flip_superseded(overlay, data))
+				return false;
+		}
+	}
+
+	return true;
+}
+
+/* called once the flip is shown or skipped: signals its post-syncpoint,
+ * logs its timestamps and frees its slot in the client's queue */
+static void tegra_overlay_flip_retire(struct tegra_overlay_flip_data *data)
+{
+	struct tegra_overlay_info *overlay = data->overlay;
+
+	tegra_dc_incr_syncpt_min(overlay->dc, data->syncpt_max);
+
+	spin_lock(&overlay->flip_lock);
+	list_del(&data->list);
+	overlay->flip_log[overlay->flip_log_next] = data->stamp;
+	overlay->flip_log_next = (overlay->flip_log_next + 1) %
+		TEGRA_OVERLAY_FLIP_HISTORY;
+	overlay->flips_retired++;
+	if (data->stamp.skipped)
+		overlay->flips_skipped++;
+	spin_unlock(&overlay->flip_lock);
+
+	atomic_dec(&data->client->flips_pending);
+	wake_up(&overlay->flip_retired);
+
+	kfree(data);
+}
+
 static void tegra_overlay_flip_worker(struct work_struct *work)
 {
 	struct tegra_overlay_flip_data *data =
@@ -263,7 +388,19 @@ static void tegra_overlay_flip_worker(struct work_struct *work)
 	struct nvmap_handle_ref *unpin_handles[TEGRA_FB_FLIP_N_WINDOWS];
 	int i, nr_win = 0, nr_unpin = 0;
 
-	data = container_of(work, struct tegra_overlay_flip_data, work);
+	if (!tegra_overlay_flip_wait(overlay, data)) {
+		/* never shown, so its buffers can go straight back */
+		for (i = 0; i < TEGRA_FB_FLIP_N_WINDOWS; i++) {
+			if (!data->win[i].handle)
+				continue;
+			nvmap_unpin(overlay->overlay_nvmap, data->win[i].handle);
+			nvmap_free(overlay->overlay_nvmap, data->win[i].handle);
+		}
+		data->stamp.skipped = true;
+		tegra_overlay_flip_retire(data);
+		return;
+	}
+	data->stamp.ready = ktime_get();
 
 	for (i = 0; i < TEGRA_FB_FLIP_N_WINDOWS; i++) {
 		struct tegra_overlay_flip_win *flip_win = &data->win[i];
@@ -283,19 +420,6 @@ static void tegra_overlay_flip_worker(struct work_struct *work)
 		tegra_overlay_set_windowattr(overlay, win, &data->win[i]);
 
 		wins[nr_win++] = win;
-
-#if 0
-		if (flip_win->attr.pre_syncpt_id < 0)
-			continue;
-		printk("%08x %08x\n",
-		       flip_win->attr.pre_syncpt_id,
-		       flip_win->attr.pre_syncpt_val);
-
-		nvhost_syncpt_wait_timeout(&overlay->ndev->host->syncpt,
-					   flip_win->attr.pre_syncpt_id,
-					   flip_win->attr.pre_syncpt_val,
-					   msecs_to_jiffies(500));
-#endif
 	}
 
 	if (data->flags & TEGRA_OVERLAY_FLIP_FLAG_BLEND_REORDER) {
@@ -314,8 +438,7 @@ static void tegra_overlay_flip_worker(struct work_struct *work)
 		/* TODO: implement swapinterval here */
 		tegra_dc_sync_windows(wins, nr_win);
 	}
-
-		tegra_dc_incr_syncpt_min(overlay->dc, data->syncpt_max);
+	data->stamp.scanout = ktime_get();
 
 	/* unpin and deref previous front buffers */
 	for (i = 0; i < nr_unpin; i++) {
@@ -323,37 +446,42 @@ static void tegra_overlay_flip_worker(struct work_struct *work)
 		nvmap_free(overlay->overlay_nvmap, unpin_handles[i]);
 	}
 
-	kfree(data);
+	tegra_overlay_flip_retire(data);
 }
 
-static int tegra_overlay_flip(struct tegra_overlay_info *overlay,
-			      struct tegra_overlay_flip_args *args,
-			      struct nvmap_client *user_nvmap)
+/* the caller must already hold one of the client's flips_pending slots;
+ * it is given back here if the flip can't be queued */
+static int tegra_overlay_flip(struct overlay_client *client,
+			      struct tegra_overlay_flip_args *args)
 {
+	struct tegra_overlay_info *overlay = client->dev;
 	struct tegra_overlay_flip_data *data;
 	struct tegra_overlay_flip_win *flip_win;
 	u32 syncpt_max;
 	int i, err;
 
-	if (WARN_ON(!overlay->ndev))
-		return -EFAULT;
+	if (WARN_ON(!overlay->ndev)) {
+		err = -EFAULT;
+		goto release_slot;
+	}
 
 	mutex_lock(&tegra_flip_lock);
 	if (!overlay->dc->enabled) {
-		mutex_unlock(&tegra_flip_lock);
-		return -EFAULT;
+		err = -EFAULT;
+		goto unlock;
 	}
 
 	data = kzalloc(sizeof(*data), GFP_KERNEL);
 	if (data == NULL) {
 		dev_err(&overlay->ndev->dev,
 			"can't allocate memory for flip\n");
-		mutex_unlock(&tegra_flip_lock);
-		return -ENOMEM;
+		err = -ENOMEM;
+		goto unlock;
 	}
 
 	INIT_WORK(&data->work, tegra_overlay_flip_worker);
 	data->overlay = overlay;
+	data->client = client;
 	data->flags = args->flags;
 
 	for (i = 0; i < TEGRA_FB_FLIP_N_WINDOWS; i++) {
@@ -364,7 +492,8 @@ static int tegra_overlay_flip(struct tegra_overlay_info *overlay,
 		if (flip_win->attr.index == -1)
 			continue;
 
-		err = tegra_overlay_pin_window(overlay, flip_win, user_nvmap);
+		err = tegra_overlay_pin_window(overlay, flip_win,
+					       client->user_nvmap);
 		if (err < 0) {
 			dev_err(&overlay->ndev->dev,
 				"error setting window attributes\n");
@@ -374,6 +503,12 @@ static int tegra_overlay_flip(struct tegra_overlay_info *overlay,
 
 	syncpt_max = tegra_dc_incr_syncpt_max(overlay->dc);
 	data->syncpt_max = syncpt_max;
+	data->stamp.syncpt_val = syncpt_max;
+	data->stamp.queued = ktime_get();
+
+	spin_lock(&overlay->flip_lock);
+	list_add_tail(&data->list, &overlay->flip_queue);
+	spin_unlock(&overlay->flip_lock);
 
 	queue_work(overlay->flip_wq, &data->work);
 
@@ -399,9 +534,14 @@ surf_err:
 		}
 	}
 	kfree(data);
+unlock:
 	mutex_unlock(&tegra_flip_lock);
+release_slot:
+	atomic_dec(&client->flips_pending);
+	wake_up(&overlay->flip_retired);
 	return err;
 }
+
 static void tegra_overlay_set_emc_freq(struct tegra_overlay_info *dev)
 {
 	unsigned long emc_freq = 0;
@@ -448,13 +588,17 @@ static void tegra_overlay_put_locked(struct overlay_client *client, int idx)
 
 	dev->overlays[idx].owner = NULL;
 
+	memset(&flip_args, 0, sizeof(flip_args));
 	flip_args.win[0].index = idx;
 	flip_args.win[0].buff_id = 0;
+	flip_args.win[0].pre_syncpt_id = -1;
 	flip_args.win[1].index = -1;
 	flip_args.win[2].index = -1;
 	flip_args.flags = 0;
 
-	tegra_overlay_flip(dev, &flip_args, NULL);
+	/* disabling a window must not wait for a slot in the flip queue */
+	atomic_inc(&client->flips_pending);
+	tegra_overlay_flip(client, &flip_args);
 	if (dev->dc->mode.pclk != 0)
 		tegra_overlay_set_emc_freq(dev);
 }
@@ -551,7 +695,14 @@ static int tegra_overlay_ioctl_flip(struct overlay_client *client,
 	if (!found_one)
 		return -EFAULT;
 
-	tegra_overlay_flip(client->dev, &flip_args, client->user_nvmap);
+	/* bound the number of flips in flight; the oldest one retires at
+	 * the next frame end or is skipped if it is superseded */
+	if (wait_event_interruptible(client->dev->flip_retired,
+			atomic_add_unless(&client->flips_pending, 1,
+					  TEGRA_OVERLAY_FLIP_QUEUE_DEPTH)))
+		return -ERESTARTSYS;
+
+	tegra_overlay_flip(client, &flip_args);
 
 	if (copy_to_user(arg, &flip_args, sizeof(flip_args)))
 		return -EFAULT;
@@ -627,6 +778,10 @@ static int tegra_overlay_release(struct inode *inode, struct file *filp)
 			tegra_overlay_put_locked(client, i);
 	mutex_unlock(&client->dev->overlays_lock);
 
+	/* queued flips point back at the client */
+	wait_event(client->dev->flip_retired,
+		   !atomic_read(&client->flips_pending));
+
 	spin_lock_irqsave(&client->dev->clients_lock, flags);
 	list_del(&client->list);
 	spin_unlock_irqrestore(&client->dev->clients_lock, flags);
@@ -687,6 +842,67 @@ static const struct file_operations overlay_fops = {
 	.unlocked_ioctl = tegra_overlay_ioctl,
 };
 
+#ifdef CONFIG_DEBUG_FS
+/* the last TEGRA_OVERLAY_FLIP_HISTORY flips, oldest first, with the time
+ * each spent waiting for its buffers and until it was scanned out */
+static int tegra_overlay_flips_show(struct seq_file *s, void *unused)
+{
+	struct tegra_overlay_info *overlay = s->private;
+	struct tegra_overlay_flip_stamp *stamp;
+	unsigned int i, n;
+
+	spin_lock(&overlay->flip_lock);
+	seq_printf(s, "retired %lu skipped %lu\n",
+		   overlay->flips_retired, overlay->flips_skipped);
+	seq_printf(s, "%10s %16s %10s %10s\n",
+		   "syncpt", "queued_us", "ready_us", "scanout_us");
+
+	n = min_t(unsigned long, overlay->flips_retired,
+		  TEGRA_OVERLAY_FLIP_HISTORY);
+	for (i = 0; i < n; i++) {
+		stamp = &overlay->flip_log[(overlay->flip_log_next +
+					    TEGRA_OVERLAY_FLIP_HISTORY - n + i) %
+					   TEGRA_OVERLAY_FLIP_HISTORY];
+		if (stamp->skipped) {
+			seq_printf(s, "%10u %16lld %10s %10s\n",
+				   stamp->syncpt_val,
+				   ktime_to_us(stamp->queued), "-", "skipped");
+			continue;
+		}
+		seq_printf(s, "%10u %16lld %10lld %10lld\n", stamp->syncpt_val,
+			   ktime_to_us(stamp->queued),
+			   ktime_us_delta(stamp->ready, stamp->queued),
+			   ktime_us_delta(stamp->scanout, stamp->queued));
+	}
+	spin_unlock(&overlay->flip_lock);
+
+	return 0;
+}
+
+static int tegra_overlay_flips_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, tegra_overlay_flips_show, inode->i_private);
+}
+
+static const struct file_operations tegra_overlay_flips_fops = {
+	.open		= tegra_overlay_flips_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static void tegra_overlay_debugfs_add(struct tegra_overlay_info *overlay)
+{
+	char name[32];
+
+	snprintf(name, sizeof(name), "%s_flips", overlay->name);
+	overlay->debugfs = debugfs_create_file(name, S_IRUGO, NULL, overlay,
+					       &tegra_overlay_flips_fops);
+}
+#else
+static void tegra_overlay_debugfs_add(struct tegra_overlay_info *overlay) {}
+#endif
+
 /* Registration */
 struct tegra_overlay_info *tegra_overlay_register(struct nvhost_device *ndev,
 						  struct tegra_dc *dc)
@@ -713,6 +929,10 @@ struct tegra_overlay_info *tegra_overlay_register(struct nvhost_device *ndev,
 
 	mutex_init(&dev->overlays_lock);
 
+	INIT_LIST_HEAD(&dev->flip_queue);
+	spin_lock_init(&dev->flip_lock);
+	init_waitqueue_head(&dev->flip_retired);
+
 	e = misc_register(&dev->dev);
 	if (e) {
 		dev_err(&ndev->dev, "unable to register miscdevice %s\n",
@@ -736,6 +956,8 @@ struct tegra_overlay_info *tegra_overlay_register(struct nvhost_device *ndev,
 
 	dev->dc = dc;
 
+	tegra_overlay_debugfs_add(dev);
+
 	dev_info(&ndev->dev, "registered overlay\n");
 
 	return dev;
@@ -753,6 +975,7 @@ void tegra_overlay_unregister(struct tegra_overlay_info *info)
 {
 	misc_deregister(&info->dev);
 
+	debugfs_remove(info->debugfs);
 	kfree(info);
 }
 
@@ -26,6 +26,9 @@
 #include <linux/uaccess.h>
 #include <linux/slab.h>
 #include <linux/file.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
 #include <linux/workqueue.h>
 
 #include <asm/atomic.h>
@@ -58,8 +61,19 @@ struct tegra_fb_info {
 	struct nvmap_client	*fb_nvmap;
 
 	struct workqueue_struct	*flip_wq;
+
+	/* flips handed to flip_wq and not yet retired, oldest first */
+	struct list_head	flip_queue;
+	spinlock_t		flip_lock;
+	wait_queue_head_t	flip_retired;
+	atomic_t		flips_pending;
 };
 
+/* flips that may be queued before FBIO_TEGRA_FLIP blocks */
+#define TEGRA_FB_FLIP_QUEUE_DEPTH	3
+/* longest a flip waits for its buffers when nothing is queued behind it */
+#define TEGRA_FB_FLIP_TIMEOUT_MS	500
+
 struct tegra_fb_flip_win {
 	struct tegra_fb_windowattr	attr;
 	struct nvmap_handle_ref		*handle;
@@ -68,6 +82,7 @@ struct tegra_fb_flip_win {
 
 struct tegra_fb_flip_data {
 	struct work_struct		work;
+	struct list_head		list;
 	struct tegra_fb_info		*fb;
 	struct tegra_fb_flip_win	win[TEGRA_FB_FLIP_N_WINDOWS];
 	u32				syncpt_max;
@@ -470,16 +485,89 @@ static int tegra_fb_set_windowattr(struct tegra_fb_info *tegra_fb,
 	win->stride = flip_win->attr.stride;
 	win->stride_uv = flip_win->attr.stride_uv;
 
-	if ((s32)flip_win->attr.pre_syncpt_id >= 0) {
-		nvhost_syncpt_wait_timeout(&tegra_fb->ndev->host->syncpt,
-					   flip_win->attr.pre_syncpt_id,
-					   flip_win->attr.pre_syncpt_val,
-					   msecs_to_jiffies(500),
-					   NULL);
+	return 0;
+}
+
+/* a queued flip is superseded once every window it updates is also updated
+ * by a flip queued behind it */
+static bool tegra_fb_flip_superseded(struct tegra_fb_info *tegra_fb,
+				     struct tegra_fb_flip_data *data)
+{
+	struct tegra_fb_flip_data *next;
+	bool superseded = true;
+	int i, j;
+
+	spin_lock(&tegra_fb->flip_lock);
+	for (i = 0; i < TEGRA_FB_FLIP_N_WINDOWS && superseded; i++) {
+		int idx = data->win[i].attr.index;
+		bool found = false;
+
+		if (idx == -1)
+			continue;
+
+		next = data;
+		list_for_each_entry_continue(next, &tegra_fb->flip_queue, list) {
+			for (j = 0; j < TEGRA_FB_FLIP_N_WINDOWS; j++)
+				if (next->win[j].attr.index == idx)
+					found = true;
+		}
+		superseded = found;
 	}
+	spin_unlock(&tegra_fb->flip_lock);
 
+	return superseded;
+}
 
-	return 0;
+/* waits a frame at a time for the pre-syncpoints of a flip, giving up early
+ * if a newer flip for the same windows arrives; returns false if the flip
+ * should be skipped */
+static bool tegra_fb_flip_wait(struct tegra_fb_info *tegra_fb,
+			       struct tegra_fb_flip_data *data)
+{
+	struct nvhost_syncpt *sp = &tegra_fb->ndev->host->syncpt;
+	unsigned long deadline = jiffies +
+		msecs_to_jiffies(TEGRA_FB_FLIP_TIMEOUT_MS);
+	unsigned long frame = max(usecs_to_jiffies(
+		tegra_dc_get_frame_period_us(tegra_fb->win->dc)), 1UL);
+	int i, err;
+
+	for (i = 0; i < TEGRA_FB_FLIP_N_WINDOWS; i++) {
+		struct tegra_fb_windowattr *attr = &data->win[i].attr;
+		long left;
+
+		if (attr->index == -1 || (s32)attr->pre_syncpt_id < 0)
+			continue;
+
+		for (;;) {
+			left = (long)(deadline - jiffies);
+			err = nvhost_syncpt_wait_timeout(sp,
+					attr->pre_syncpt_id,
+					attr->pre_syncpt_val,
+					clamp_t(long, left, 0, frame), NULL);
+			if (err != -EAGAIN || left <= 0)
+				break;
+			if (tegra_fb_flip_superseded(tegra_fb, data))
+				return false;
+		}
+	}
+
+	return true;
+}
+
+static void tegra_fb_flip_retire(struct tegra_fb_flip_data *data)
+{
+	struct tegra_fb_info *tegra_fb = data->fb;
+
+	tegra_dc_incr_syncpt_min(tegra_fb->win->dc, data->syncpt_max);
+
+	spin_lock(&tegra_fb->flip_lock);
+	list_del(&data->list);
+	spin_unlock(&tegra_fb->flip_lock);
+
+	atomic_dec(&tegra_fb->flips_pending);
+	wake_up(&tegra_fb->flip_retired);
+
+	kfree(data);
 }
 
 static void tegra_fb_flip_worker(struct work_struct *work)
@@ -492,7 +580,17 @@ static void tegra_fb_flip_worker(struct work_struct *work)
 	struct nvmap_handle_ref *unpin_handles[TEGRA_FB_FLIP_N_WINDOWS];
 	int i, nr_win = 0, nr_unpin = 0;
 
-	data = container_of(work, struct tegra_fb_flip_data, work);
+	if (!tegra_fb_flip_wait(tegra_fb, data)) {
+		/* never shown, so its buffers can go straight back */
+		for (i = 0; i < TEGRA_FB_FLIP_N_WINDOWS; i++) {
+			if (!data->win[i].handle)
+				continue;
+			nvmap_unpin(tegra_fb->fb_nvmap, data->win[i].handle);
+			nvmap_free(tegra_fb->fb_nvmap, data->win[i].handle);
+		}
+		tegra_fb_flip_retire(data);
+		return;
+	}
 
 	for (i = 0; i < TEGRA_FB_FLIP_N_WINDOWS; i++) {
 		struct tegra_fb_flip_win *flip_win = &data->win[i];
@@ -508,19 +606,6 @@ static void tegra_fb_flip_worker(struct work_struct *work)
 		tegra_fb_set_windowattr(tegra_fb, win, &data->win[i]);
 
 		wins[nr_win++] = win;
-
-#if 0
-		if (flip_win->attr.pre_syncpt_id < 0)
-			continue;
-		printk("%08x %08x\n",
-		       flip_win->attr.pre_syncpt_id,
-		       flip_win->attr.pre_syncpt_val);
-
-		nvhost_syncpt_wait_timeout(&tegra_fb->ndev->host->syncpt,
-					   flip_win->attr.pre_syncpt_id,
-					   flip_win->attr.pre_syncpt_val,
-					   msecs_to_jiffies(500));
-#endif
 	}
 
 	tegra_dc_set_dynamic_emc(wins, nr_win);
@@ -528,15 +613,13 @@ static void tegra_fb_flip_worker(struct work_struct *work)
 	/* TODO: implement swapinterval here */
 	tegra_dc_sync_windows(wins, nr_win);
 
-	tegra_dc_incr_syncpt_min(tegra_fb->win->dc, data->syncpt_max);
-
 	/* unpin and deref previous front buffers */
 	for (i = 0; i < nr_unpin; i++) {
 		nvmap_unpin(tegra_fb->fb_nvmap, unpin_handles[i]);
 		nvmap_free(tegra_fb->fb_nvmap, unpin_handles[i]);
 	}
 
-	kfree(data);
+	tegra_fb_flip_retire(data);
 }
 
 static int tegra_fb_flip(struct tegra_fb_info *tegra_fb,
@@ -553,11 +636,19 @@ static int tegra_fb_flip(struct tegra_fb_info *tegra_fb,
 	if (WARN_ON(!tegra_fb->ndev))
 		return -EFAULT;
 
+	/* bound the number of flips in flight; the oldest one retires at
+	 * the next frame end or is skipped if it is superseded */
+	if (wait_event_interruptible(tegra_fb->flip_retired,
+			atomic_add_unless(&tegra_fb->flips_pending, 1,
+					  TEGRA_FB_FLIP_QUEUE_DEPTH)))
+		return -ERESTARTSYS;
+
 	data = kzalloc(sizeof(*data), GFP_KERNEL);
 	if (data == NULL) {
 		dev_err(&tegra_fb->ndev->dev,
 			"can't allocate memory for flip\n");
-		return -ENOMEM;
+		err = -ENOMEM;
+		goto release_slot;
 	}
 
 	INIT_WORK(&data->work, tegra_fb_flip_worker);
@@ -579,6 +670,10 @@ static int tegra_fb_flip(struct tegra_fb_info *tegra_fb,
 	syncpt_max = tegra_dc_incr_syncpt_max(tegra_fb->win->dc);
 	data->syncpt_max = syncpt_max;
 
+	spin_lock(&tegra_fb->flip_lock);
+	list_add_tail(&data->list, &tegra_fb->flip_queue);
+	spin_unlock(&tegra_fb->flip_lock);
+
 	queue_work(tegra_fb->flip_wq, &data->work);
 
 	/*
@@ -602,6 +697,9 @@ surf_err:
 		}
 	}
 	kfree(data);
+release_slot:
+	atomic_dec(&tegra_fb->flips_pending);
+	wake_up(&tegra_fb->flip_retired);
 	return err;
 }
 
@@ -798,6 +896,11 @@ struct tegra_fb_info *tegra_fb_register(struct nvhost_device *ndev,
 	}
 	atomic_set(&tegra_fb->in_use, 0);
 
+	INIT_LIST_HEAD(&tegra_fb->flip_queue);
+	spin_lock_init(&tegra_fb->flip_lock);
+	init_waitqueue_head(&tegra_fb->flip_retired);
+	atomic_set(&tegra_fb->flips_pending, 0);
+
 	tegra_fb->flip_wq = create_singlethread_workqueue(dev_name(&ndev->dev));
 	if (!tegra_fb->flip_wq) {
 		dev_err(&ndev->dev, "couldn't create flip work-queue\n");
@@ -21,6 +21,7 @@
  */
 
 #include "dev.h"
+#include "nvhost_fence.h"
 
 #include <linux/slab.h>
 #include <linux/string.h>
@@ -366,6 +367,113 @@ static int nvhost_ioctl_channel_flush(struct nvhost_channel_userctx *ctx,
 	return 0;
 }
 
+/*
+ * submits several jobs with a single flush: the gathers of all jobs are
+ * laid out back to back in the gather buffer, the handles of all jobs are
+ * pinned by one nvmap_pin_array, and everything is pushed in one cdma
+ * submit with one submit-complete interrupt. since the jobs run in order
+ * on one sync point, each job's fence is the final sync point value less
+ * the increments of the jobs after it.
+ */
+static int nvhost_ioctl_channel_submit_jobs(struct nvhost_channel_userctx *ctx,
+		struct nvhost_submit_jobs_args *args)
+{
+	struct nvhost_job_desc jobs[NVHOST_MAX_SUBMIT_JOBS];
+	struct nvhost_job_desc __user *ujobs = (void __user *)args->jobs;
+	const struct nvhost_cmdbuf __user *ucmdbufs = (void __user *)args->cmdbufs;
+	struct nvhost_get_param_args flush;
+	u32 num_cmdbufs = 0, num_relocs = 0, num_waitchks = 0;
+	u32 waitchk_mask = 0;
+	u32 incrs = 0;
+	u32 i;
+	int err;
+
+	if (ctx->hdr.num_relocs || ctx->hdr.num_cmdbufs || ctx->hdr.num_waitchks) {
+		reset_submit(ctx);
+		dev_err(&ctx->ch->dev->pdev->dev, "channel submit out of sync\n");
+		return -EFAULT;
+	}
+	if (!ctx->nvmap) {
+		dev_err(&ctx->ch->dev->pdev->dev, "no nvmap context set\n");
+		return -EFAULT;
+	}
+
+	if (!args->num_jobs || args->num_jobs > NVHOST_MAX_SUBMIT_JOBS ||
+	    args->syncpt_id >= NV_HOST1X_SYNCPT_NB_PTS)
+		return -EINVAL;
+
+	if (copy_from_user(jobs, ujobs, args->num_jobs * sizeof(*jobs)))
+		return -EFAULT;
+
+	/* the counts come from userspace: bound each one before adding it,
+	 * and each total as it grows, so none of the sums can wrap. the
+	 * first two gathers are reserved for the context switch */
+	for (i = 0; i < args->num_jobs; i++) {
+		if (!jobs[i].num_cmdbufs)
+			return -EINVAL;
+		if (jobs[i].num_cmdbufs > NVHOST_MAX_GATHERS - 2 ||
+		    jobs[i].num_relocs > NVHOST_MAX_HANDLES ||
+		    jobs[i].num_waitchks > NVHOST_MAX_WAIT_CHECKS)
+			return -E2BIG;
+		num_cmdbufs += jobs[i].num_cmdbufs;
+		num_relocs += jobs[i].num_relocs;
+		num_waitchks += jobs[i].num_waitchks;
+		if (num_cmdbufs > NVHOST_MAX_GATHERS - 2 ||
+		    num_relocs > NVHOST_MAX_HANDLES ||
+		    num_cmdbufs + num_relocs > NVHOST_MAX_HANDLES ||
+		    num_waitchks > NVHOST_MAX_WAIT_CHECKS)
+			return -E2BIG;
+		waitchk_mask |= jobs[i].waitchk_mask;
+		incrs += jobs[i].syncpt_incrs;
+	}
+
+	ctx->num_gathers = 2;
+	ctx->pinarray_size = 0;
+
+	for (i = 0; i < num_cmdbufs; i++) {
+		struct nvhost_cmdbuf cmdbuf;
+
+		if (copy_from_user(&cmdbuf, &ucmdbufs[i], sizeof(cmdbuf)))
+			goto fault;
+		add_gather(ctx, ctx->num_gathers++,
+			   cmdbuf.mem, cmdbuf.words, cmdbuf.offset);
+	}
+
+	if (copy_from_user(&ctx->pinarray[ctx->pinarray_size],
+			   (void __user *)args->relocs,
+			   num_relocs * sizeof(struct nvhost_reloc)))
+		goto fault;
+	ctx->pinarray_size += num_relocs;
+
+	if (copy_from_user(ctx->waitchks, (void __user *)args->waitchks,
+			   num_waitchks * sizeof(struct nvhost_waitchk)))
+		goto fault;
+	ctx->num_waitchks = num_waitchks;
+
+	ctx->hdr.syncpt_id = args->syncpt_id;
+	ctx->hdr.syncpt_incrs = incrs;
+	ctx->hdr.waitchk_mask = waitchk_mask;
+
+	err = nvhost_ioctl_channel_flush(ctx, &flush, 0);
+	if (err)
+		return err;
+
+	for (i = args->num_jobs; i-- > 0; ) {
+		if (put_user(flush.value, &ujobs[i].fence))
+			return -EFAULT;
+		flush.value -= jobs[i].syncpt_incrs;
+	}
+
+	return 0;
+
+fault:
+	/* drop the half-copied jobs so a later flush has nothing to submit */
+	ctx->num_gathers = 2;
+	ctx->pinarray_size = 0;
+	ctx->num_waitchks = 0;
+	return -EFAULT;
+}
+
 static long nvhost_channelctl(struct file *filp,
 	unsigned int cmd, unsigned long arg)
 {
@@ -412,6 +520,9 @@ static long nvhost_channelctl(struct file *filp,
 		err = set_submit(priv);
 		break;
 	}
+	case NVHOST_IOCTL_CHANNEL_SUBMIT_JOBS:
+		err = nvhost_ioctl_channel_submit_jobs(priv, (void *)buf);
+		break;
 	case NVHOST_IOCTL_CHANNEL_GET_SYNCPOINTS:
 		/* host syncpt ID is used by the RM (and never be given out) */
 		BUG_ON(priv->ch->desc->syncpts & (1 << NVSYNCPT_GRAPHICS_HOST));
@@ -526,6 +637,40 @@ static int nvhost_ioctl_ctrl_syncpt_waitex(
 					args->thresh, timeout, &args->value);
 }
 
+static int nvhost_ioctl_ctrl_fence_create(
+	struct nvhost_ctrl_userctx *ctx,
+	struct nvhost_ctrl_fence_create_args *args)
+{
+	struct nvhost_fence_pt pt;
+	int fd;
+
+	if (args->id >= NV_HOST1X_SYNCPT_NB_PTS)
+		return -EINVAL;
+
+	pt.id = args->id;
+	pt.thresh = args->thresh;
+	fd = nvhost_fence_create_fd(ctx->dev, &pt, 1);
+	if (fd < 0)
+		return fd;
+
+	args->fd = fd;
+	return 0;
+}
+
+static int nvhost_ioctl_ctrl_fence_merge(
+	struct nvhost_ctrl_userctx *ctx,
+	struct nvhost_ctrl_fence_merge_args *args)
+{
+	int fd;
+
+	fd = nvhost_fence_merge_fd(ctx->dev, args->fd1, args->fd2);
+	if (fd < 0)
+		return fd;
+
+	args->fd = fd;
+	return 0;
+}
+
 static int nvhost_ioctl_ctrl_module_mutex(
 	struct nvhost_ctrl_userctx *ctx,
 	struct nvhost_ctrl_module_mutex_args *args)
@@ -632,6 +777,12 @@ static long nvhost_ctrlctl(struct file *filp,
 	case NVHOST_IOCTL_CTRL_SYNCPT_WAITEX:
 		err = nvhost_ioctl_ctrl_syncpt_waitex(priv, (void *)buf);
 		break;
+	case NVHOST_IOCTL_CTRL_FENCE_CREATE:
+		err = nvhost_ioctl_ctrl_fence_create(priv, (void *)buf);
+		break;
+	case NVHOST_IOCTL_CTRL_FENCE_MERGE:
+		err = nvhost_ioctl_ctrl_fence_merge(priv, (void *)buf);
+		break;
 	default:
 		err = -ENOTTY;
 		break;
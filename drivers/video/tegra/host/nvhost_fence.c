@@ -0,0 +1,254 @@
+/*
+ * drivers/video/tegra/host/nvhost_fence.c
+ *
+ * Tegra Graphics Host Syncpoint Fences
+ *
+ * Copyright (c) 2011, NVIDIA Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include "nvhost_fence.h"
+#include "dev.h"
+#include <linux/anon_inodes.h>
+#include <linux/file.h>
+#include <linux/fs.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+
+/*
+ * a fence fd wraps one or more (sync point, threshold) pairs. each pair
+ * gets a NVHOST_INTR_ACTION_WAKEUP_INTERRUPTIBLE action on the fence's
+ * wait queue, so the threshold interrupt wakes up anyone polling the fd;
+ * the fd is readable once every sync point has reached its threshold.
+ *
+ * the host module is kept busy while the fence is pending, so that the
+ * threshold interrupts keep being delivered. a waiter of our own on the
+ * wait queue releases it as soon as the fence signals, whether or not
+ * anyone polls the fd; closing the fd releases it too.
+ */
+
+struct nvhost_fence {
+	struct nvhost_master *host;
+	wait_queue_head_t wq;
+	wait_queue_t idle_wait;
+	struct work_struct idle_work;
+	atomic_t busy;
+	int num_pts;
+	struct nvhost_fence_pt pts[NV_HOST1X_SYNCPT_NB_PTS];
+	void *refs[NV_HOST1X_SYNCPT_NB_PTS];
+};
+
+static const struct file_operations nvhost_fence_fops;
+
+static bool fence_signalled(struct nvhost_fence *fence)
+{
+	struct nvhost_syncpt *sp = &fence->host->syncpt;
+	int i;
+
+	for (i = 0; i < fence->num_pts; i++)
+		if (!nvhost_syncpt_min_cmp(sp, fence->pts[i].id,
+					fence->pts[i].thresh))
+			return false;
+	return true;
+}
+
+static void fence_idle(struct nvhost_fence *fence)
+{
+	if (atomic_xchg(&fence->busy, 0))
+		nvhost_module_idle(&fence->host->mod);
+}
+
+/* nvhost_module_idle sleeps, so the wakeup only queues this */
+static void fence_idle_work(struct work_struct *work)
+{
+	struct nvhost_fence *fence = container_of(work, struct nvhost_fence,
+						idle_work);
+
+	if (fence_signalled(fence))
+		fence_idle(fence);
+}
+
+static int fence_idle_wake(wait_queue_t *wait, unsigned mode, int sync,
+			void *key)
+{
+	struct nvhost_fence *fence = container_of(wait, struct nvhost_fence,
+						idle_wait);
+
+	schedule_work(&fence->idle_work);
+	return 0;
+}
+
+static void fence_free(struct nvhost_fence *fence)
+{
+	int i;
+
+	for (i = 0; i < fence->num_pts; i++)
+		if (fence->refs[i])
+			nvhost_intr_put_ref(&fence->host->intr, fence->refs[i]);
+
+	/* no more wakeups once the actions are gone */
+	remove_wait_queue(&fence->wq, &fence->idle_wait);
+	cancel_work_sync(&fence->idle_work);
+
+	fence_idle(fence);
+	kfree(fence);
+}
+
+static unsigned int nvhost_fence_poll(struct file *filp, poll_table *wait)
+{
+	struct nvhost_fence *fence = filp->private_data;
+
+	poll_wait(filp, &fence->wq, wait);
+
+	if (!fence_signalled(fence))
+		return 0;
+
+	fence_idle(fence);
+	return POLLIN | POLLRDNORM;
+}
+
+static int nvhost_fence_release(struct inode *inode, struct file *filp)
+{
+	fence_free(filp->private_data);
+	return 0;
+}
+
+static const struct file_operations nvhost_fence_fops = {
+	.owner = THIS_MODULE,
+	.poll = nvhost_fence_poll,
+	.release = nvhost_fence_release,
+};
+
+int nvhost_fence_create_fd(struct nvhost_master *host,
+			struct nvhost_fence_pt *pts, int num_pts)
+{
+	struct nvhost_syncpt *sp = &host->syncpt;
+	struct nvhost_fence *fence;
+	int err = 0;
+	int fd;
+	int i;
+
+	if (num_pts <= 0 || num_pts > NV_HOST1X_SYNCPT_NB_PTS)
+		return -EINVAL;
+
+	for (i = 0; i < num_pts; i++)
+		if (pts[i].id >= NV_HOST1X_SYNCPT_NB_PTS ||
+		    !nvhost_syncpt_check_max(sp, pts[i].id, pts[i].thresh))
+			return -EINVAL;
+
+	fence = kzalloc(sizeof(*fence), GFP_KERNEL);
+	if (!fence)
+		return -ENOMEM;
+
+	fence->host = host;
+	init_waitqueue_head(&fence->wq);
+	INIT_WORK(&fence->idle_work, fence_idle_work);
+	init_waitqueue_func_entry(&fence->idle_wait, fence_idle_wake);
+	add_wait_queue(&fence->wq, &fence->idle_wait);
+	fence->num_pts = num_pts;
+	memcpy(fence->pts, pts, num_pts * sizeof(*pts));
+
+	/* refresh the cached values once; thresholds which have already
+	 * been reached need no interrupt */
+	nvhost_module_busy(&host->mod);
+	atomic_set(&fence->busy, 1);
+
+	for (i = 0; i < num_pts && !err; i++) {
+		if (nvhost_syncpt_min_cmp(sp, pts[i].id, pts[i].thresh))
+			continue;
+		if ((s32)(nvhost_syncpt_update_min(sp, pts[i].id) -
+			  pts[i].thresh) >= 0)
+			continue;
+		err = nvhost_intr_add_action(&host->intr, pts[i].id,
+				pts[i].thresh,
+				NVHOST_INTR_ACTION_WAKEUP_INTERRUPTIBLE,
+				&fence->wq, &fence->refs[i]);
+	}
+
+	if (!err && fence_signalled(fence))
+		fence_idle(fence);
+
+	if (err) {
+		fence_free(fence);
+		return err;
+	}
+
+	fd = anon_inode_getfd("nvhost-fence", &nvhost_fence_fops, fence,
+			O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		fence_free(fence);
+
+	return fd;
+}
+
+/* adds the points of src to pts, keeping only the later threshold of
+ * points on the same sync point */
+static int merge_pts(struct nvhost_fence_pt *pts, int num_pts,
+		struct nvhost_fence *src)
+{
+	int i, j;
+
+	for (i = 0; i < src->num_pts; i++) {
+		struct nvhost_fence_pt *pt = &src->pts[i];
+
+		for (j = 0; j < num_pts; j++)
+			if (pts[j].id == pt->id)
+				break;
+
+		if (j == num_pts)
+			pts[num_pts++] = *pt;
+		else if ((s32)(pt->thresh - pts[j].thresh) > 0)
+			pts[j].thresh = pt->thresh;
+	}
+
+	return num_pts;
+}
+
+int nvhost_fence_merge_fd(struct nvhost_master *host, int fd1, int fd2)
+{
+	struct nvhost_fence_pt pts[NV_HOST1X_SYNCPT_NB_PTS];
+	struct file *f1, *f2 = NULL;
+	int num_pts = 0;
+	int err = -EINVAL;
+
+	f1 = fget(fd1);
+	if (!f1)
+		return -EBADF;
+
+	f2 = fget(fd2);
+	if (!f2) {
+		err = -EBADF;
+		goto out;
+	}
+
+	if (f1->f_op != &nvhost_fence_fops || f2->f_op != &nvhost_fence_fops)
+		goto out;
+
+	/* points on the same sync point are folded together, so the
+	 * merged fence can not have more than NV_HOST1X_SYNCPT_NB_PTS */
+	num_pts = merge_pts(pts, num_pts, f1->private_data);
+	num_pts = merge_pts(pts, num_pts, f2->private_data);
+
+	err = nvhost_fence_create_fd(host, pts, num_pts);
+
+out:
+	if (f2)
+		fput(f2);
+	fput(f1);
+	return err;
+}
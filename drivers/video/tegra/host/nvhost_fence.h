@@ -0,0 +1,59 @@
+/*
+ * drivers/video/tegra/host/nvhost_fence.h
+ *
+ * Tegra Graphics Host Syncpoint Fences
+ *
+ * Copyright (c) 2011, NVIDIA Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef __NVHOST_FENCE_H
+#define __NVHOST_FENCE_H
+
+#include <linux/types.h>
+
+struct nvhost_master;
+
+/**
+ * A point on a sync point's timeline.
+ */
+struct nvhost_fence_pt {
+	u32 id;
+	u32 thresh;
+};
+
+/**
+ * Create a fence file descriptor which becomes readable (POLLIN) once
+ * every sync point in pts has reached its threshold.
+ *
+ * @host the host the sync points belong to
+ * @pts the sync point thresholds to wait for
+ * @num_pts number of entries in pts, at most NV_HOST1X_SYNCPT_NB_PTS
+ *
+ * Returns the new file descriptor, or a negative error code.
+ */
+int nvhost_fence_create_fd(struct nvhost_master *host,
+			struct nvhost_fence_pt *pts, int num_pts);
+
+/**
+ * Create a fence file descriptor which becomes readable once both of the
+ * fences fd1 and fd2 are signalled.
+ *
+ * Returns the new file descriptor, or a negative error code.
+ */
+int nvhost_fence_merge_fd(struct nvhost_master *host, int fd1, int fd2);
+
+#endif
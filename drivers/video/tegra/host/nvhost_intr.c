@@ -46,7 +46,8 @@ static void enable_syncpt_interrupt(void __iomem *sync_regs, u32 id)
 /*** Wait list management ***/
 
 struct nvhost_waitlist {
-	struct list_head list;
+	struct rb_node node;		/* in the sync point's wait_tree */
+	struct list_head list;		/* in a completed list */
 	struct kref refcount;
 	u32 thresh;
 	enum nvhost_intr_action action;
@@ -69,39 +70,75 @@ static void waiter_release(struct kref *kref)
 }
 
 /*
- * add a waiter to a waiter queue, sorted by threshold
+ * waiter queues are red-black trees ordered by threshold. thresholds
+ * are compared modulo 2^32 ((s32)(a - b)), which gives a consistent order
+ * as long as all outstanding thresholds of a sync point lie within 2^31
+ * of each other; the lowest waiter is cached, so finding it and walking
+ * the completed waiters is O(1) per waiter, while insertion is O(log n).
+ */
+
+static inline struct nvhost_waitlist *waiter_of(struct rb_node *n)
+{
+	return rb_entry(n, struct nvhost_waitlist, node);
+}
+
+/*
+ * add a waiter to a waiter queue, sorted by threshold; waiters with
+ * the same threshold are kept in the order they were added.
  * returns true if it was added at the head of the queue
  */
 static bool add_waiter_to_queue(struct nvhost_waitlist *waiter,
-				struct list_head *queue)
+				struct nvhost_intr_syncpt *syncpt)
 {
-	struct nvhost_waitlist *pos;
+	struct rb_node **p = &syncpt->wait_tree.rb_node;
+	struct rb_node *parent = NULL;
 	u32 thresh = waiter->thresh;
+	bool leftmost = true;
 
-	list_for_each_entry_reverse(pos, queue, list)
-		if ((s32)(pos->thresh - thresh) <= 0) {
-			list_add(&waiter->list, &pos->list);
-			return false;
+	while (*p) {
+		parent = *p;
+		if ((s32)(waiter_of(parent)->thresh - thresh) <= 0) {
+			p = &parent->rb_right;
+			leftmost = false;
+		} else {
+			p = &parent->rb_left;
 		}
+	}
+
+	rb_link_node(&waiter->node, parent, p);
+	rb_insert_color(&waiter->node, &syncpt->wait_tree);
 
-	list_add(&waiter->list, queue);
-	return true;
+	if (leftmost)
+		syncpt->wait_first = &waiter->node;
+	return leftmost;
+}
+
+static void remove_waiter_from_queue(struct nvhost_waitlist *waiter,
+				     struct nvhost_intr_syncpt *syncpt)
+{
+	if (syncpt->wait_first == &waiter->node)
+		syncpt->wait_first = rb_next(&waiter->node);
+	rb_erase(&waiter->node, &syncpt->wait_tree);
 }
 
 /*
  * run through a waiter queue for a single sync point ID
  * and gather all completed waiters into lists by actions
  */
-static void remove_completed_waiters(struct list_head *head, u32 sync,
+static void remove_completed_waiters(struct nvhost_intr_syncpt *syncpt,
+			u32 sync,
 			struct list_head completed[NVHOST_INTR_ACTION_COUNT])
 {
 	struct list_head *dest;
-	struct nvhost_waitlist *waiter, *next, *prev;
+	struct nvhost_waitlist *waiter, *prev;
 
-	list_for_each_entry_safe(waiter, next, head, list) {
+	while (syncpt->wait_first) {
+		waiter = waiter_of(syncpt->wait_first);
 		if ((s32)(waiter->thresh - sync) > 0)
 			break;
 
+		remove_waiter_from_queue(waiter, syncpt);
+
 		dest = completed + waiter->action;
 
 		/* consolidate submit cleanups */
@@ -116,12 +153,10 @@ static void remove_completed_waiters(struct list_head *head, u32 sync,
 		}
 
 		/* PENDING->REMOVED or CANCELLED->HANDLED */
-		if (atomic_inc_return(&waiter->state) == WLS_HANDLED || !dest) {
-			list_del(&waiter->list);
+		if (atomic_inc_return(&waiter->state) == WLS_HANDLED || !dest)
 			kref_put(&waiter->refcount, waiter_release);
-		} else {
-			list_move_tail(&waiter->list, dest);
-		}
+		else
+			list_add_tail(&waiter->list, dest);
 	}
 }
 
@@ -263,11 +298,10 @@ static irqreturn_t syncpt_thresh_fn(int irq, void *dev_id)
 
 	spin_lock(&syncpt->lock);
 
-	remove_completed_waiters(&syncpt->wait_head, sync, completed);
+	remove_completed_waiters(syncpt, sync, completed);
 
-	if (!list_empty(&syncpt->wait_head)) {
-		u32 thresh = list_first_entry(&syncpt->wait_head,
-					struct nvhost_waitlist, list)->thresh;
+	if (syncpt->wait_first) {
+		u32 thresh = waiter_of(syncpt->wait_first)->thresh;
 
 		set_syncpt_threshold(sync_regs, id, thresh);
 		enable_syncpt_interrupt(sync_regs, id);
@@ -346,9 +380,9 @@ int nvhost_intr_add_action(struct nvhost_intr *intr, u32 id, u32 thresh,
 		spin_lock(&syncpt->lock);
 	}
 
-	queue_was_empty = list_empty(&syncpt->wait_head);
+	queue_was_empty = RB_EMPTY_ROOT(&syncpt->wait_tree);
 
-	if (add_waiter_to_queue(waiter, &syncpt->wait_head)) {
+	if (add_waiter_to_queue(waiter, syncpt)) {
 		/* added at head of list - new threshold value */
 		set_syncpt_threshold(sync_regs, id, thresh);
 
@@ -397,7 +431,8 @@ int nvhost_intr_init(struct nvhost_intr *intr, u32 irq_gen, u32 irq_sync)
 		syncpt->irq = irq_sync + id;
 		syncpt->irq_requested = 0;
 		spin_lock_init(&syncpt->lock);
-		INIT_LIST_HEAD(&syncpt->wait_head);
+		syncpt->wait_tree = RB_ROOT;
+		syncpt->wait_first = NULL;
 		snprintf(syncpt->thresh_irq_name,
 			 sizeof(syncpt->thresh_irq_name),
 			 "%s", nvhost_syncpt_name(id));
@@ -418,16 +453,19 @@ void nvhost_intr_deinit(struct nvhost_intr *intr)
 	for (id = 0, syncpt = intr->syncpt;
 	     id < NV_HOST1X_SYNCPT_NB_PTS;
 	     ++id, ++syncpt) {
-		struct nvhost_waitlist *waiter, *next;
-		list_for_each_entry_safe(waiter, next, &syncpt->wait_head, list) {
+		struct nvhost_waitlist *waiter;
+		struct rb_node *n, *next;
+		for (n = syncpt->wait_first; n; n = next) {
+			next = rb_next(n);
+			waiter = waiter_of(n);
 			if (atomic_cmpxchg(&waiter->state, WLS_CANCELLED, WLS_HANDLED)
 				== WLS_CANCELLED) {
-				list_del(&waiter->list);
+				remove_waiter_from_queue(waiter, syncpt);
 				kref_put(&waiter->refcount, waiter_release);
 			}
 		}
 
-		if(!list_empty(&syncpt->wait_head)) {  // output diagnostics
+		if(!RB_EMPTY_ROOT(&syncpt->wait_tree)) {  // output diagnostics
 			printk("%s id=%d\n",__func__,id);
 			BUG_ON(1);
 		}
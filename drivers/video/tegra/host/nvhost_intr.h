@@ -24,6 +24,7 @@
 #define __NVHOST_INTR_H
 
 #include <linux/kthread.h>
+#include <linux/rbtree.h>
 #include <linux/semaphore.h>
 
 #include "nvhost_hardware.h"
@@ -63,7 +64,8 @@ struct nvhost_intr_syncpt {
 	u8 irq_requested;
 	u16 irq;
 	spinlock_t lock;
-	struct list_head wait_head;
+	struct rb_root wait_tree;	/* pending waiters, by threshold */
+	struct rb_node *wait_first;	/* waiter with the lowest threshold */
 	char thresh_irq_name[12];
 };
 
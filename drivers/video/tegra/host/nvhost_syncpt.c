@@ -37,6 +37,11 @@ static bool check_max(struct nvhost_syncpt *sp, u32 id, u32 real)
 	return ((s32)(max - real) >= 0);
 }
 
+bool nvhost_syncpt_check_max(struct nvhost_syncpt *sp, u32 id, u32 thresh)
+{
+	return check_max(sp, id, thresh);
+}
+
 /**
  * Write the current syncpoint value back to hw.
  */
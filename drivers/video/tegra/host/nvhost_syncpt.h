@@ -146,6 +146,12 @@ void nvhost_syncpt_incr(struct nvhost_syncpt *sp, u32 id);
 int nvhost_syncpt_wait_timeout(struct nvhost_syncpt *sp, u32 id, u32 thresh,
 			u32 timeout, u32 *value);
 
+/**
+ * Returns true if thresh can ever be reached, i.e. it does not lie beyond
+ * the last increment queued to the sync point
+ */
+bool nvhost_syncpt_check_max(struct nvhost_syncpt *sp, u32 id, u32 thresh);
+
 static inline int nvhost_syncpt_wait(struct nvhost_syncpt *sp, u32 id, u32 thresh)
 {
 	return nvhost_syncpt_wait_timeout(sp, id, thresh,
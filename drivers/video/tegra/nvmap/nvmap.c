@@ -62,22 +62,20 @@ static void map_iovmm_area(struct nvmap_handle *h)
 }
 
 /* must be called inside nvmap_pin_lock, to ensure that an entire stream
- * of pins will complete without racing with a second stream. handle should
- * have nvmap_handle_get (or nvmap_validate_get) called before calling
- * this function. */
+ * of pins will complete without racing with a second stream, and with the
+ * MRU lock held. handle should have nvmap_handle_get (or
+ * nvmap_validate_get) called before calling this function. */
 static int pin_locked(struct nvmap_client *client, struct nvmap_handle *h)
 {
 	struct tegra_iovmm_area *area;
 	BUG_ON(!h->alloc);
 
-	nvmap_mru_lock(client->share);
 	if (atomic_inc_return(&h->pin) == 1) {
 		if (h->heap_pgalloc && !h->pgalloc.contig) {
 			area = nvmap_handle_iovmm_locked(client, h);
 			if (!area) {
 				/* no race here, inside the pin mutex */
 				atomic_dec(&h->pin);
-				nvmap_mru_unlock(client->share);
 				return -ENOMEM;
 			}
 			if (area != h->pgalloc.area)
@@ -85,10 +83,29 @@ static int pin_locked(struct nvmap_client *client, struct nvmap_handle *h)
 			h->pgalloc.area = area;
 		}
 	}
-	nvmap_mru_unlock(client->share);
 	return 0;
 }
 
+/* pins the first count handles of h, taking the MRU lock once for the
+ * whole array rather than once per handle; returns the number of handles
+ * pinned, which is less than count on failure */
+static int pin_handles_locked(struct nvmap_client *client,
+		struct nvmap_handle **h, int count, int *err)
+{
+	int pinned;
+
+	*err = 0;
+	nvmap_mru_lock(client->share);
+	for (pinned = 0; pinned < count; pinned++) {
+		*err = pin_locked(client, h[pinned]);
+		if (*err)
+			break;
+	}
+	nvmap_mru_unlock(client->share);
+
+	return pinned;
+}
+
 /* doesn't need to be called inside nvmap_pin_lock, since this will only
  * expand the available VM area */
 static int handle_unpin(struct nvmap_client *client,
@@ -135,11 +152,7 @@ static int pin_array_locked(struct nvmap_client *client,
 	int i;
 	int err = 0;
 
-	for (pinned = 0; pinned < count; pinned++) {
-		err = pin_locked(client, h[pinned]);
-		if (err)
-			break;
-	}
+	pinned = pin_handles_locked(client, h, count, &err);
 
 	if (err) {
 		/* unpin pinned handles */
@@ -162,11 +175,7 @@ static int pin_array_locked(struct nvmap_client *client,
 		 * We have to do pinning again here since there might be is
 		 * no more incoming pin_wait wakeup calls from unpin
 		 * operations */
-		for (pinned = 0; pinned < count; pinned++) {
-			err = pin_locked(client, h[pinned]);
-			if (err)
-				break;
-		}
+		pin_handles_locked(client, h, count, &err);
 		if (err) {
 			pr_err("Pinning in empty iovmm failed!!!\n");
 			BUG_ON(1);
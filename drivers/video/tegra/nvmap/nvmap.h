@@ -49,6 +49,12 @@
 
 #define nvmap_ref_to_id(_ref)		((unsigned long)(_ref)->handle)
 
+#ifdef CONFIG_NVMAP_HIGHMEM_ONLY
+#define GFP_NVMAP		(__GFP_HIGHMEM | __GFP_NOWARN)
+#else
+#define GFP_NVMAP		(GFP_KERNEL | __GFP_HIGHMEM | __GFP_NOWARN)
+#endif
+
 struct nvmap_device;
 struct page;
 struct tegra_iovmm_area;
@@ -58,7 +64,9 @@ struct tegra_iovmm_area;
 struct nvmap_pgalloc {
 	struct page **pages;
 	struct tegra_iovmm_area *area;
-	struct list_head mru_list;	/* MRU entry for IOVMM reclamation */
+	struct list_head mru_list;	/* LRU entry for IOVMM reclamation */
+	unsigned int reuse;		/* re-pins which found the area intact */
+	unsigned int lru_stamp;		/* LRU clock when last unpinned */
 	bool contig;			/* contiguous system memory */
 	bool dirty;			/* area is invalid and needs mapping */
 };
@@ -90,8 +98,14 @@ struct nvmap_share {
 	struct mutex pin_lock;
 #ifdef CONFIG_NVMAP_RECLAIM_UNPINNED_VM
 	struct mutex mru_lock;
-	struct list_head *mru_lists;
-	int nr_mru;
+	struct list_head lru_list;	/* unpinned handles, oldest first */
+	unsigned int lru_clock;		/* advanced on every unpin */
+	/* statistics, protected by mru_lock */
+	unsigned long lru_hits;
+	unsigned long lru_remaps;
+	unsigned long lru_steals;
+	unsigned long lru_evictions;
+	u64 lru_evicted_bytes;
 #endif
 };
 
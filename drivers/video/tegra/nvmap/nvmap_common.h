@@ -22,6 +22,7 @@
 
 extern void v7_flush_kern_cache_all(void *);
 extern void v7_clean_kern_cache_all(void *);
+extern void __flush_dcache_page(struct address_space *, struct page *);
 
 #define FLUSH_CLEAN_BY_SET_WAY_THRESHOLD (8 * PAGE_SIZE)
 
@@ -44,6 +44,7 @@
 #include "nvmap.h"
 #include "nvmap_ioctl.h"
 #include "nvmap_mru.h"
+#include "nvmap_pp.h"
 #include "nvmap_common.h"
 
 #define NVMAP_NUM_PTES		64
@@ -863,6 +864,10 @@ static long nvmap_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		err = nvmap_ioctl_cache_maint(filp, uarg);
 		break;
 
+	case NVMAP_IOC_CACHE_LIST:
+		err = nvmap_ioctl_cache_maint_list(filp, uarg);
+		break;
+
 	default:
 		return -ENOTTY;
 	}
@@ -1172,6 +1177,8 @@ static int nvmap_probe(struct platform_device *pdev)
 	nvmap_debug_root = debugfs_create_dir("nvmap", NULL);
 	if (IS_ERR_OR_NULL(nvmap_debug_root))
 		dev_err(&pdev->dev, "couldn't create debug files\n");
+	nvmap_page_pool_debugfs_init(nvmap_debug_root);
+	nvmap_mru_debugfs_init(&dev->iovmm_master, nvmap_debug_root);
 
 	for (i = 0; i < plat->nr_carveouts; i++) {
 		struct nvmap_carveout_node *node = &dev->heaps[i];
@@ -1299,8 +1306,15 @@ static int __init nvmap_init_driver(void)
 	if (e)
 		goto fail;
 
+	e = nvmap_page_pool_init();
+	if (e) {
+		nvmap_heap_deinit();
+		goto fail;
+	}
+
 	e = platform_driver_register(&nvmap_driver);
 	if (e) {
+		nvmap_page_pool_deinit();
 		nvmap_heap_deinit();
 		goto fail;
 	}
@@ -1313,6 +1327,7 @@ fs_initcall(nvmap_init_driver);
 static void __exit nvmap_exit_driver(void)
 {
 	platform_driver_unregister(&nvmap_driver);
+	nvmap_page_pool_deinit();
 	nvmap_heap_deinit();
 	nvmap_dev = NULL;
 }
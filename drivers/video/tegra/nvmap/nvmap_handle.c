@@ -41,13 +41,9 @@
 #include "nvmap.h"
 #include "nvmap_mru.h"
 #include "nvmap_common.h"
+#include "nvmap_pp.h"
 
 #define NVMAP_SECURE_HEAPS	(NVMAP_HEAP_CARVEOUT_IRAM | NVMAP_HEAP_IOVMM)
-#ifdef CONFIG_NVMAP_HIGHMEM_ONLY
-#define GFP_NVMAP		(__GFP_HIGHMEM | __GFP_NOWARN)
-#else
-#define GFP_NVMAP		(GFP_KERNEL | __GFP_HIGHMEM | __GFP_NOWARN)
-#endif
 /* handles may be arbitrarily large (16+MiB), and any handle allocated from
  * the kernel (i.e., not a carveout handle) includes its array of pages. to
  * preserve kmalloc space, if the array of pages exceeds PAGELIST_VMALLOC_MIN,
@@ -109,8 +105,6 @@ out:
 	kfree(h);
 }
 
-extern void __flush_dcache_page(struct address_space *, struct page *);
-
 static struct page *nvmap_alloc_pages_exact(gfp_t gfp,
 	size_t size, bool flush_inner)
 {
@@ -149,6 +143,7 @@ static int handle_page_alloc(struct nvmap_client *client,
 	unsigned int nr_page = size >> PAGE_SHIFT;
 	pgprot_t prot;
 	unsigned int i = 0;
+	unsigned int pooled = 0;
 	struct page **pages;
 	bool flush_inner = true;
 
@@ -163,22 +158,38 @@ static int handle_page_alloc(struct nvmap_client *client,
 		contiguous = true;
 #endif
 
-	if (size >= FLUSH_CLEAN_BY_SET_WAY_THRESHOLD) {
+	/* pages taken from the page pools are already zeroed and clean, so
+	 * only the remainder needs to go through the cache maintenance */
+	if (!contiguous || nr_page == 1) {
+		while (pooled < nr_page) {
+			pages[pooled] = nvmap_page_pool_alloc(h->flags);
+			if (!pages[pooled])
+				break;
+			pooled++;
+		}
+	}
+	i = pooled;
+
+	if ((nr_page - pooled) << PAGE_SHIFT >= FLUSH_CLEAN_BY_SET_WAY_THRESHOLD) {
 		inner_flush_cache_all();
 		flush_inner = false;
 	}
 	h->pgalloc.area = NULL;
 	if (contiguous) {
 		struct page *page;
-		page = nvmap_alloc_pages_exact(GFP_NVMAP, size, flush_inner);
-		if (!page)
-			goto fail;
 
-		for (i = 0; i < nr_page; i++)
-			pages[i] = nth_page(page, i);
+		if (!pooled) {
+			page = nvmap_alloc_pages_exact(GFP_NVMAP, size,
+						       flush_inner);
+			if (!page)
+				goto fail;
+
+			for (i = 0; i < nr_page; i++)
+				pages[i] = nth_page(page, i);
+		}
 
 	} else {
-		for (i = 0; i < nr_page; i++) {
+		for (; i < nr_page; i++) {
 			pages[i] = nvmap_alloc_pages_exact(GFP_NVMAP, PAGE_SIZE,
 				flush_inner);
 			if (!pages[i])
@@ -199,6 +210,7 @@ static int handle_page_alloc(struct nvmap_client *client,
 	h->size = size;
 	h->pgalloc.pages = pages;
 	h->pgalloc.contig = contiguous;
+	h->pgalloc.reuse = 0;
 	INIT_LIST_HEAD(&h->pgalloc.mru_list);
 	return 0;
 
@@ -25,8 +25,10 @@
 #include <linux/list.h>
 #include <linux/mm.h>
 #include <linux/mutex.h>
+#include <linux/rbtree.h>
 #include <linux/slab.h>
 #include <linux/err.h>
+#include <linux/workqueue.h>
 
 #include <mach/nvmap.h>
 #include "nvmap.h"
@@ -68,10 +70,30 @@
  * and to ensure that the minimum free block size in the carveout (i.e., the
  * "small" threshold) is still a meaningful size.
  *
+ * free blocks are kept in a red-black tree ordered by address, where each
+ * node also records the largest free block in its subtree. first-fit and
+ * last-fit searches skip every subtree that cannot hold the request, so
+ * they cost O(log n) in the number of free fragments rather than O(n).
+ * all blocks, free or not, are also on the address-ordered all_list, so
+ * the neighbours to coalesce with on free are found directly.
+ *
+ * with CONFIG_NVMAP_CARVEOUT_COMPACTOR, a heap whose largest free block
+ * falls well short of its total free space is compacted in the background.
+ * each pass moves at most NVMAP_COMPACT_MOVES blocks (and at most
+ * NVMAP_COMPACT_BYTES bytes) down into the free space below them, so an
+ * allocating client never waits for more than one bounded pass.
+ *
  */
 
 #define MAX_BUDDY_NR	128	/* maximum buddies in a buddy allocator */
 
+#define NVMAP_COMPACT_FRAG_PCT	25	/* compact when free_max < 75% free */
+#define NVMAP_COMPACT_MIN_FREE	(16 * PAGE_SIZE)
+#define NVMAP_COMPACT_MOVES	8	/* blocks relocated per pass */
+#define NVMAP_COMPACT_BYTES	(4 << 20)	/* bytes copied per pass */
+#define NVMAP_COMPACT_DELAY	(HZ / 10)
+#define NVMAP_COMPACT_INTERVAL	HZ	/* between kicks from alloc/free */
+
 enum direction {
 	TOP_DOWN,
 	BOTTOM_UP
@@ -90,10 +112,8 @@ struct heap_stat {
 	size_t total;		/* total size */
 	size_t largest;		/* largest unique block */
 	size_t count;		/* total number of blocks */
-	/* fast compaction attempt counter */
-	unsigned int compaction_count_fast;
-	/* full compaction attempt counter */
-	unsigned int compaction_count_full;
+	unsigned long compact_passes;	/* compaction passes run */
+	unsigned long compact_moved;	/* blocks relocated by compaction */
 };
 
 struct buddy_heap;
@@ -111,7 +131,8 @@ struct list_block {
 	size_t size;
 	size_t align;
 	struct nvmap_heap *heap;
-	struct list_head free_list;
+	struct rb_node free_node;	/* in heap->free_tree while free */
+	size_t free_max;		/* largest free block in subtree */
 };
 
 struct combo_block {
@@ -135,7 +156,8 @@ struct buddy_heap {
 
 struct nvmap_heap {
 	struct list_head all_list;
-	struct list_head free_list;
+	struct rb_root free_tree;
+	size_t free_size;		/* bytes in free_tree */
 	struct mutex lock;
 	struct list_head buddy_list;
 	unsigned int min_buddy_shift;
@@ -144,6 +166,13 @@ struct nvmap_heap {
 	const char *name;
 	void *arg;
 	struct device dev;
+#ifdef CONFIG_NVMAP_CARVEOUT_COMPACTOR
+	struct delayed_work compact_work;
+	unsigned long compact_next;	/* jiffies, protected by lock */
+#endif
+	/* statistics, protected by lock */
+	unsigned long compact_passes;
+	unsigned long compact_moved;
 };
 
 static struct kmem_cache *buddy_heap_cache;
@@ -210,11 +239,15 @@ static unsigned long heap_stat(struct nvmap_heap *heap, struct heap_stat *stat)
 		stat->count--;
 	}
 
-	list_for_each_entry(l, &heap->free_list, free_list) {
+	list_for_each_entry(l, &heap->all_list, all_list) {
+		if (l->block.type != BLOCK_EMPTY)
+			continue;
 		stat->free += l->size;
 		stat->free_count++;
 		stat->free_largest = max(l->size, stat->free_largest);
 	}
+	stat->compact_passes = heap->compact_passes;
+	stat->compact_moved = heap->compact_moved;
 	mutex_unlock(&heap->lock);
 
 	return base;
@@ -247,6 +280,12 @@ static struct device_attribute heap_stat_free_size =
 static struct device_attribute heap_stat_base =
 	__ATTR(base, S_IRUGO, heap_stat_show, NULL);
 
+static struct device_attribute heap_stat_compact_passes =
+	__ATTR(compact_passes, S_IRUGO, heap_stat_show, NULL);
+
+static struct device_attribute heap_stat_compact_moved =
+	__ATTR(compact_moved, S_IRUGO, heap_stat_show, NULL);
+
 static struct device_attribute heap_attr_name =
 	__ATTR(name, S_IRUGO, heap_name_show, NULL);
 
@@ -258,6 +297,8 @@ static struct attribute *heap_stat_attrs[] = {
 	&heap_stat_free_count.attr,
 	&heap_stat_free_size.attr,
 	&heap_stat_base.attr,
+	&heap_stat_compact_passes.attr,
+	&heap_stat_compact_moved.attr,
 	&heap_attr_name.attr,
 	NULL,
 };
@@ -297,6 +338,10 @@ static ssize_t heap_stat_show(struct device *dev,
 		return sprintf(buf, "%u\n", stat.free);
 	else if (attr == &heap_stat_base)
 		return sprintf(buf, "%08lx\n", base);
+	else if (attr == &heap_stat_compact_passes)
+		return sprintf(buf, "%lu\n", stat.compact_passes);
+	else if (attr == &heap_stat_compact_moved)
+		return sprintf(buf, "%lu\n", stat.compact_moved);
 	else
 		return -EINVAL;
 }
@@ -384,6 +429,134 @@ static struct buddy_heap *do_buddy_free(struct nvmap_heap_block *block)
 }
 
 
+static inline size_t free_max_of(struct rb_node *n)
+{
+	return n ? rb_entry(n, struct list_block, free_node)->free_max : 0;
+}
+
+static void free_tree_augment_cb(struct rb_node *n, void *data)
+{
+	struct list_block *b = rb_entry(n, struct list_block, free_node);
+	size_t m = max(free_max_of(n->rb_left), free_max_of(n->rb_right));
+
+	b->free_max = max(b->size, m);
+}
+
+static void free_tree_insert(struct nvmap_heap *heap, struct list_block *b)
+{
+	struct rb_node **p = &heap->free_tree.rb_node;
+	struct rb_node *parent = NULL;
+	struct list_block *n;
+
+	while (*p) {
+		parent = *p;
+		n = rb_entry(parent, struct list_block, free_node);
+		if (b->block.base < n->block.base)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+
+	b->free_max = b->size;
+	heap->free_size += b->size;
+	rb_link_node(&b->free_node, parent, p);
+	rb_insert_color(&b->free_node, &heap->free_tree);
+	rb_augment_insert(&b->free_node, free_tree_augment_cb, NULL);
+}
+
+static void free_tree_erase(struct nvmap_heap *heap, struct list_block *b)
+{
+	struct rb_node *deepest;
+
+	heap->free_size -= b->size;
+	deepest = rb_augment_erase_begin(&b->free_node);
+	rb_erase(&b->free_node, &heap->free_tree);
+	if (deepest)
+		rb_augment_erase_end(deepest, free_tree_augment_cb, NULL);
+}
+
+/* a free block grew in place; its address (and so its position) is
+ * unchanged, only the subtree maxima above it need fixing up */
+static void free_tree_grow(struct nvmap_heap *heap, struct list_block *b,
+			   size_t size)
+{
+	struct rb_node *n = &b->free_node;
+
+	heap->free_size += size - b->size;
+	b->size = size;
+	for (; n; n = rb_parent(n)) {
+		struct list_block *i = rb_entry(n, struct list_block, free_node);
+		if (i->free_max >= size)
+			break;
+		i->free_max = size;
+	}
+}
+
+/*
+ * lowest-addressed free block in the subtree at n which can hold len bytes
+ * at the given alignment without the aligned base going above base_max
+ * (if set). the recursion depth is bounded by the tree height.
+ */
+static struct list_block *free_first_fit(struct rb_node *n, size_t len,
+					 size_t align, unsigned long base_max,
+					 unsigned long *fix_base)
+{
+	struct list_block *b;
+	struct list_block *r;
+	unsigned long base;
+
+	if (!n || free_max_of(n) < len)
+		return NULL;
+
+	r = free_first_fit(n->rb_left, len, align, base_max, fix_base);
+	if (r)
+		return r;
+
+	b = rb_entry(n, struct list_block, free_node);
+	base = ALIGN(b->block.base, align);
+
+	/* needed for compaction. relocated chunk should never go up; and
+	 * everything to the right is higher still */
+	if (base_max && base > base_max)
+		return NULL;
+
+	if (b->size >= len && b->size - len >= base - b->block.base) {
+		*fix_base = base;
+		return b;
+	}
+
+	return free_first_fit(n->rb_right, len, align, base_max, fix_base);
+}
+
+/* highest-addressed free block in the subtree at n which can hold len bytes
+ * placed at its top end, aligned down to align */
+static struct list_block *free_last_fit(struct rb_node *n, size_t len,
+					size_t align, unsigned long *fix_base)
+{
+	struct list_block *b;
+	struct list_block *r;
+	unsigned long base;
+
+	if (!n || free_max_of(n) < len)
+		return NULL;
+
+	r = free_last_fit(n->rb_right, len, align, fix_base);
+	if (r)
+		return r;
+
+	b = rb_entry(n, struct list_block, free_node);
+	if (b->size >= len) {
+		base = b->block.base + b->size - len;
+		base &= ~(align-1);
+		if (base >= b->block.base) {
+			*fix_base = base;
+			return b;
+		}
+	}
+
+	return free_last_fit(n->rb_left, len, align, fix_base);
+}
+
 /*
  * base_max limits position of allocated chunk in memory.
  * if base_max is 0 then there is no such limitation.
@@ -394,7 +567,6 @@ static struct nvmap_heap_block *do_heap_alloc(struct nvmap_heap *heap,
 					      unsigned long base_max)
 {
 	struct list_block *b = NULL;
-	struct list_block *i = NULL;
 	struct list_block *rem = NULL;
 	unsigned long fix_base;
 	enum direction dir;
@@ -416,41 +588,18 @@ static struct nvmap_heap_block *do_heap_alloc(struct nvmap_heap *heap,
 	dir = (len <= heap->small_alloc) ? BOTTOM_UP : TOP_DOWN;
 #endif
 
-	if (dir == BOTTOM_UP) {
-		list_for_each_entry(i, &heap->free_list, free_list) {
-			size_t fix_size;
-			fix_base = ALIGN(i->block.base, align);
-			fix_size = i->size - (fix_base - i->block.base);
-
-			/* needed for compaction. relocated chunk
-			 * should never go up */
-			if (base_max && fix_base > base_max) {
-				break;
-			}
-
-			if (fix_size >= len) {
-				b = i;
-				break;
-			}
-		}
-	} else {
-		list_for_each_entry_reverse(i, &heap->free_list, free_list) {
-			if (i->size >= len) {
-				fix_base = i->block.base + i->size - len;
-				fix_base &= ~(align-1);
-				if (fix_base >= i->block.base) {
-					b = i;
-					break;
-				}
-			}
-		}
-	}
+	if (dir == BOTTOM_UP)
+		b = free_first_fit(heap->free_tree.rb_node, len, align,
+				   base_max, &fix_base);
+	else
+		b = free_last_fit(heap->free_tree.rb_node, len, align,
+				  &fix_base);
 
 	if (!b)
 		return NULL;
 
-	if (dir == BOTTOM_UP)
-		b->block.type = BLOCK_FIRST_FIT;
+	free_tree_erase(heap, b);
+	b->block.type = BLOCK_FIRST_FIT;
 
 	/* split free block */
 	if (b->block.base != fix_base) {
@@ -471,7 +620,7 @@ static struct nvmap_heap_block *do_heap_alloc(struct nvmap_heap *heap,
 		b->orig_addr = fix_base;
 		b->size -= rem->size;
 		list_add_tail(&rem->all_list,  &b->all_list);
-		list_add_tail(&rem->free_list, &b->free_list);
+		free_tree_insert(heap, rem);
 	}
 
 	b->orig_addr = b->block.base;
@@ -489,11 +638,10 @@ static struct nvmap_heap_block *do_heap_alloc(struct nvmap_heap *heap,
 		rem->orig_addr = rem->block.base;
 		b->size = len;
 		list_add(&rem->all_list,  &b->all_list);
-		list_add(&rem->free_list, &b->free_list);
+		free_tree_insert(heap, rem);
 	}
 
 out:
-	list_del(&b->free_list);
 	b->heap = heap;
 	b->mem_prot = mem_prot;
 	b->align = align;
@@ -506,10 +654,12 @@ static void freelist_debug(struct nvmap_heap *heap, const char *title,
 {
 	int i;
 	struct list_block *n;
+	struct rb_node *node;
 
 	dev_debug(&heap->dev, "%s\n", title);
 	i = 0;
-	list_for_each_entry(n, &heap->free_list, free_list) {
+	for (node = rb_first(&heap->free_tree); node; node = rb_next(node)) {
+		n = rb_entry(node, struct list_block, free_node);
 		dev_debug(&heap->dev,"\t%d [%p..%p]%s\n", i, (void *)n->orig_addr,
 			  (void *)(n->orig_addr + n->size),
 			  (n == token) ? "<--" : "");
@@ -529,28 +679,18 @@ static struct list_block *do_heap_free(struct nvmap_heap_block *block)
 	BUG_ON(b->block.base > b->orig_addr);
 	b->size += (b->block.base - b->orig_addr);
 	b->block.base = b->orig_addr;
-
-	freelist_debug(heap, "free list before", b);
-
-	/* Find position of first free block to the right of freed one */
-	list_for_each_entry(n, &heap->free_list, free_list) {
-		if (n->block.base > b->block.base)
-			break;
-	}
-
-	/* Add freed block before found free one */
-	list_add_tail(&b->free_list, &n->free_list);
 	BUG_ON(list_empty(&b->all_list));
 
-	freelist_debug(heap, "free list pre-merge", b);
+	freelist_debug(heap, "free list before", b);
 
 	/* merge freed block with next if they connect
 	 * freed block becomes bigger, next one is destroyed */
-	if (!list_is_last(&b->free_list, &heap->free_list)) {
-		n = list_first_entry(&b->free_list, struct list_block, free_list);
-		if (n->block.base == b->block.base + b->size) {
+	if (!list_is_last(&b->all_list, &heap->all_list)) {
+		n = list_first_entry(&b->all_list, struct list_block, all_list);
+		if (n->block.type == BLOCK_EMPTY &&
+		    n->block.base == b->block.base + b->size) {
+			free_tree_erase(heap, n);
 			list_del(&n->all_list);
-			list_del(&n->free_list);
 			BUG_ON(b->orig_addr >= n->orig_addr);
 			b->size += n->size;
 			kmem_cache_free(block_cache, n);
@@ -559,20 +699,22 @@ static struct list_block *do_heap_free(struct nvmap_heap_block *block)
 
 	/* merge freed block with prev if they connect
 	 * previous free block becomes bigger, freed one is destroyed */
-	if (b->free_list.prev != &heap->free_list) {
-		n = list_entry(b->free_list.prev, struct list_block, free_list);
-		if (n->block.base + n->size == b->block.base) {
+	if (b->all_list.prev != &heap->all_list) {
+		n = list_entry(b->all_list.prev, struct list_block, all_list);
+		if (n->block.type == BLOCK_EMPTY &&
+		    n->block.base + n->size == b->block.base) {
 			list_del(&b->all_list);
-			list_del(&b->free_list);
 			BUG_ON(n->orig_addr >= b->orig_addr);
-			n->size += b->size;
+			free_tree_grow(heap, n, n->size + b->size);
 			kmem_cache_free(block_cache, b);
-			b = n;
+			freelist_debug(heap, "free list after", n);
+			return n;
 		}
 	}
 
-	freelist_debug(heap, "free list after", b);
 	b->block.type = BLOCK_EMPTY;
+	free_tree_insert(heap, b);
+	freelist_debug(heap, "free list after", b);
 	return b;
 }
 
@@ -684,8 +826,12 @@ fail:
 }
 
 
+/* moves an unpinned, unmapped block to the lowest free space below it
+ * which can hold it, and copies its contents; the destination is
+ * allocated before the source is freed, so the block is left untouched
+ * if there is no room below it. must be called with the heap lock held */
 static struct nvmap_heap_block *do_heap_relocate_listblock(
-		struct list_block *block, bool fast)
+		struct list_block *block)
 {
 	struct nvmap_heap_block *heap_block = &block->block;
 	struct nvmap_heap_block *heap_block_new = NULL;
@@ -721,23 +867,11 @@ static struct nvmap_heap_block *do_heap_relocate_listblock(
 	if (handle->usecount)
 		goto fail;
 
-	if (fast) {
-		/* Fast compaction path - first allocate, then free. */
-		heap_block_new = do_heap_alloc(heap, src_size, src_align,
-				src_prot, src_base);
-		if (heap_block_new)
-			do_heap_free(heap_block);
-		else
-			goto fail;
-	} else {
-		/* Full compaction path, first free, then allocate
-		 * It is slower but provide best compaction results */
-		do_heap_free(heap_block);
-		heap_block_new = do_heap_alloc(heap, src_size, src_align,
-				src_prot, src_base);
-		/* Allocation should always succeed*/
-		BUG_ON(!heap_block_new);
-	}
+	heap_block_new = do_heap_alloc(heap, src_size, src_align,
+			src_prot, src_base);
+	if (!heap_block_new)
+		goto fail;
+	do_heap_free(heap_block);
 
 	/* update handle */
 	handle->carveout = heap_block_new;
@@ -759,70 +893,108 @@ fail:
 	return heap_block_new;
 }
 
-static void nvmap_heap_compact(struct nvmap_heap *heap,
-				size_t requested_size, bool fast)
+/* true if the largest free block is much smaller than the free space in
+ * the heap, i.e. if compaction could produce a larger free block. must be
+ * called with the heap lock held */
+static bool heap_fragmented(struct nvmap_heap *heap)
 {
-	struct list_block *block_current = NULL;
-	struct list_block *block_prev = NULL;
-	struct list_block *block_next = NULL;
+	size_t free_max = free_max_of(heap->free_tree.rb_node);
+
+	if (heap->free_size < NVMAP_COMPACT_MIN_FREE)
+		return false;
 
+	return (u64)free_max * 100 <
+		(u64)heap->free_size * (100 - NVMAP_COMPACT_FRAG_PCT);
+}
+
+/* one bounded compaction pass: walks the heap from the bottom and moves
+ * the block above each free block down into it, until NVMAP_COMPACT_MOVES
+ * blocks or NVMAP_COMPACT_BYTES bytes have been moved, or until there is a
+ * free block of want bytes (if want is non-zero) or the heap is no longer
+ * fragmented (otherwise). pinned and mapped blocks are skipped. returns
+ * the number of blocks moved; must be called with the heap lock held */
+static int nvmap_heap_compact_pass(struct nvmap_heap *heap, size_t want)
+{
+	struct list_block *block_current;
+	struct list_block *block_next;
 	struct list_head *ptr, *ptr_prev, *ptr_next;
-	int relocation_count = 0;
+	size_t moved_bytes = 0;
+	size_t size;
+	int moved = 0;
 
 	ptr = heap->all_list.next;
 
-	/* walk through all blocks */
-	while (ptr != &heap->all_list) {
+	while (ptr != &heap->all_list && moved < NVMAP_COMPACT_MOVES &&
+	       moved_bytes < NVMAP_COMPACT_BYTES) {
+		if (want ? free_max_of(heap->free_tree.rb_node) >= want :
+		    !heap_fragmented(heap))
+			break;
+
 		block_current = list_entry(ptr, struct list_block, all_list);
 
 		ptr_prev = ptr->prev;
 		ptr_next = ptr->next;
 
-		if (block_current->block.type != BLOCK_EMPTY) {
+		if (block_current->block.type != BLOCK_EMPTY ||
+		    ptr_next == &heap->all_list) {
 			ptr = ptr_next;
 			continue;
 		}
 
-		if (fast && block_current->size >= requested_size)
-			break;
+		block_next = list_entry(ptr_next, struct list_block, all_list);
+		size = block_next->size;
 
-		/* relocate prev block */
-		if (ptr_prev != &heap->all_list) {
+		BUG_ON(block_next->block.type != BLOCK_FIRST_FIT);
 
-			block_prev = list_entry(ptr_prev,
-					struct list_block, all_list);
-
-			BUG_ON(block_prev->block.type != BLOCK_FIRST_FIT);
+		if (do_heap_relocate_listblock(block_next)) {
+			/* the moved block may have landed at the start of
+			 * the current free block, and the free block may
+			 * have been merged with the space it left behind;
+			 * restart from whatever now follows ptr_prev */
+			moved++;
+			moved_bytes += size;
+			ptr = ptr_prev->next;
+			continue;
+		}
+		ptr = ptr_next;
+	}
 
-			if (do_heap_relocate_listblock(block_prev, true)) {
+	heap->compact_passes++;
+	heap->compact_moved += moved;
+	return moved;
+}
 
-				/* After relocation current free block can be
-				 * destroyed when it is merged with previous
-				 * free block. Updated pointer to new free
-				 * block can be obtained from the next block */
-				relocation_count++;
-				ptr = ptr_next->prev;
-				continue;
-			}
-		}
+static void nvmap_heap_compact_work(struct work_struct *work)
+{
+	struct nvmap_heap *heap = container_of(to_delayed_work(work),
+					       struct nvmap_heap, compact_work);
+	bool again;
 
-		if (ptr_next != &heap->all_list) {
+	mutex_lock(&heap->lock);
+	again = nvmap_heap_compact_pass(heap, 0) && heap_fragmented(heap);
+	mutex_unlock(&heap->lock);
 
-			block_next = list_entry(ptr_next,
-					struct list_block, all_list);
+	if (again)
+		schedule_delayed_work(&heap->compact_work,
+				      NVMAP_COMPACT_DELAY);
+}
 
-			BUG_ON(block_next->block.type != BLOCK_FIRST_FIT);
+/* at most once per NVMAP_COMPACT_INTERVAL, so that a heap which stays
+ * fragmented (e.g. around pinned blocks) does not get a pass on every
+ * free. must be called with the heap lock held */
+static void nvmap_heap_compact_kick(struct nvmap_heap *heap)
+{
+	if (time_before(jiffies, heap->compact_next))
+		return;
 
-			if (do_heap_relocate_listblock(block_next, fast)) {
-				ptr = ptr_prev->next;
-				relocation_count++;
-				continue;
-			}
-		}
-		ptr = ptr_next;
+	if (heap_fragmented(heap)) {
+		heap->compact_next = jiffies + NVMAP_COMPACT_INTERVAL;
+		schedule_delayed_work(&heap->compact_work,
+				      NVMAP_COMPACT_DELAY);
 	}
-	pr_err("Relocated %d chunks\n", relocation_count);
 }
+#else
+#define nvmap_heap_compact_kick(_heap)	do { } while (0)
 #endif
 
 void nvmap_usecount_inc(struct nvmap_handle *h)
@@ -849,6 +1021,9 @@ struct nvmap_heap_block *nvmap_heap_alloc(struct nvmap_heap *h, size_t len,
 					  struct nvmap_handle *handle)
 {
 	struct nvmap_heap_block *b;
+#ifdef CONFIG_NVMAP_CARVEOUT_COMPACTOR
+	size_t want;
+#endif
 
 	mutex_lock(&h->lock);
 
@@ -857,15 +1032,16 @@ struct nvmap_heap_block *nvmap_heap_alloc(struct nvmap_heap *h, size_t len,
 	align = ALIGN(align, PAGE_SIZE);
 	len = ALIGN(len, PAGE_SIZE);
 	b = do_heap_alloc(h, len, align, prot, 0);
-	if (!b) {
-		pr_err("Compaction triggered!\n");
-		nvmap_heap_compact(h, len, true);
-		b = do_heap_alloc(h, len, align, prot, 0);
-		if (!b) {
-			pr_err("Full compaction triggered!\n");
-			nvmap_heap_compact(h, len, false);
+	/* free blocks start on a page boundary, so a free block of want
+	 * bytes holds len bytes at any page-multiple alignment */
+	want = len + (align > PAGE_SIZE ? align - PAGE_SIZE : 0);
+	if (!b && want <= h->free_size) {
+		/* run one bounded pass rather than making the caller wait
+		 * for a full compaction; the background work carries on
+		 * with the rest */
+		if (nvmap_heap_compact_pass(h, want))
 			b = do_heap_alloc(h, len, align, prot, 0);
-		}
+		nvmap_heap_compact_kick(h);
 	}
 #else
 	if (len <= h->buddy_heap_size / 2) {
@@ -919,6 +1095,7 @@ void nvmap_heap_free(struct nvmap_heap_block *b)
 		lb = container_of(b, struct list_block, block);
 		nvmap_flush_heap_block(NULL, b, lb->size, lb->mem_prot);
 		do_heap_free(b);
+		nvmap_heap_compact_kick(h);
 	}
 
 	if (bh) {
@@ -1009,16 +1186,20 @@ struct nvmap_heap *nvmap_heap_create(struct device *parent, const char *name,
 	h->buddy_heap_size = buddy_size;
 	if (buddy_size)
 		h->min_buddy_shift = ilog2(buddy_size / MAX_BUDDY_NR);
-	INIT_LIST_HEAD(&h->free_list);
+	h->free_tree = RB_ROOT;
 	INIT_LIST_HEAD(&h->buddy_list);
 	INIT_LIST_HEAD(&h->all_list);
 	mutex_init(&h->lock);
+#ifdef CONFIG_NVMAP_CARVEOUT_COMPACTOR
+	INIT_DELAYED_WORK(&h->compact_work, nvmap_heap_compact_work);
+	h->compact_next = jiffies;
+#endif
 	l->block.base = base;
 	l->block.type = BLOCK_EMPTY;
 	l->size = len;
 	l->orig_addr = base;
-	list_add_tail(&l->free_list, &h->free_list);
 	list_add_tail(&l->all_list, &h->all_list);
+	free_tree_insert(h, l);
 
 	inner_flush_cache_all();
 	outer_flush_range(base, base + len);
@@ -1050,6 +1231,9 @@ void nvmap_heap_destroy(struct nvmap_heap *heap)
 {
 	WARN_ON(!list_empty(&heap->buddy_list));
 
+#ifdef CONFIG_NVMAP_CARVEOUT_COMPACTOR
+	cancel_delayed_work_sync(&heap->compact_work);
+#endif
 	sysfs_remove_group(&heap->dev.kobj, &heap_stat_attr_group);
 	device_unregister(&heap->dev);
 
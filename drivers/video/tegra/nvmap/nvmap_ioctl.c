@@ -46,13 +46,21 @@ static ssize_t rw_handle(struct nvmap_client *client, struct nvmap_handle *h,
 static int cache_maint(struct nvmap_client *client, struct nvmap_handle *h,
 		       unsigned long start, unsigned long end, unsigned int op);
 
+static void outer_handle_cache_maint(struct nvmap_client *client,
+	struct nvmap_handle *h, unsigned long start, unsigned long end,
+	unsigned int op);
+
+/* upper bound on the number of entries in a vectored pin or cache
+ * maintenance request, to keep the kernel copy of the array sane */
+#define NVMAP_MAX_VEC_OPS	4096
 
 int nvmap_ioctl_pinop(struct file *filp, bool is_pin, void __user *arg)
 {
 	struct nvmap_pin_handle op;
 	struct nvmap_handle *h;
-	unsigned long on_stack[16];
+	unsigned long on_stack[32];
 	unsigned long *refs;
+	unsigned long *addrs;
 	unsigned long __user *output;
 	unsigned int i;
 	int err = 0;
@@ -60,27 +68,31 @@ int nvmap_ioctl_pinop(struct file *filp, bool is_pin, void __user *arg)
 	if (copy_from_user(&op, arg, sizeof(op)))
 		return -EFAULT;
 
-	if (!op.count)
+	if (!op.count || op.count > NVMAP_MAX_VEC_OPS)
 		return -EINVAL;
 
-	if (op.count > 1) {
-		size_t bytes = op.count * sizeof(unsigned long *);
+	/* the first half of the buffer holds the handles, the second half
+	 * collects the pinned addresses so they are returned with a single
+	 * copy rather than one put_user per handle */
+	if (op.count * 2 > ARRAY_SIZE(on_stack))
+		refs = kmalloc(op.count * 2 * sizeof(*refs), GFP_KERNEL);
+	else
+		refs = on_stack;
 
-		if (op.count > ARRAY_SIZE(on_stack))
-			refs = kmalloc(op.count * sizeof(*refs), GFP_KERNEL);
-		else
-			refs = on_stack;
+	if (!refs)
+		return -ENOMEM;
+
+	addrs = refs + op.count;
 
-		if (!refs)
-			return -ENOMEM;
+	if (op.count > 1) {
+		size_t bytes = op.count * sizeof(*refs);
 
 		if (copy_from_user(refs, (void *)op.handles, bytes)) {
 			err = -EFAULT;
 			goto out;
 		}
 	} else {
-		refs = on_stack;
-		on_stack[0] = (unsigned long)op.handles;
+		refs[0] = (unsigned long)op.handles;
 	}
 
 	if (is_pin)
@@ -105,23 +117,21 @@ int nvmap_ioctl_pinop(struct file *filp, bool is_pin, void __user *arg)
 	if (!output)
 		goto out;
 
-	for (i = 0; i < op.count && !err; i++) {
-		unsigned long addr;
-
+	for (i = 0; i < op.count; i++) {
 		h = (struct nvmap_handle *)refs[i];
 
 		if (h->heap_pgalloc && h->pgalloc.contig)
-			addr = page_to_phys(h->pgalloc.pages[0]);
+			addrs[i] = page_to_phys(h->pgalloc.pages[0]);
 		else if (h->heap_pgalloc)
-			addr = h->pgalloc.area->iovm_start;
+			addrs[i] = h->pgalloc.area->iovm_start;
 		else
-			addr = h->carveout->base;
-
-		err = put_user(addr, &output[i]);
+			addrs[i] = h->carveout->base;
 	}
 
-	if (err)
+	if (copy_to_user(output, addrs, op.count * sizeof(*addrs))) {
+		err = -EFAULT;
 		nvmap_unpin_ids(filp->private_data, op.count, refs);
+	}
 
 out:
 	if (refs != on_stack)
@@ -467,6 +477,115 @@ out:
 	return err;
 }
 
+int nvmap_ioctl_cache_maint_list(struct file *filp, void __user *arg)
+{
+	struct nvmap_client *client = filp->private_data;
+	struct nvmap_cache_op_list list;
+	struct nvmap_cache_op_elem on_stack[8];
+	struct nvmap_cache_op_elem *ops;
+	struct nvmap_handle **handles;
+	struct nvmap_handle *h;
+	size_t inner_bytes = 0;
+	bool flush = false;
+	bool set_way = false;
+	unsigned int nr = 0;
+	unsigned int i;
+	int err = 0;
+
+	if (copy_from_user(&list, arg, sizeof(list)))
+		return -EFAULT;
+
+	if (!list.count || list.count > NVMAP_MAX_VEC_OPS)
+		return -EINVAL;
+
+	/* handle pointers are kept after the ops in the same buffer */
+	if (list.count * (sizeof(*ops) + sizeof(*handles)) > sizeof(on_stack))
+		ops = kmalloc(list.count * (sizeof(*ops) + sizeof(*handles)),
+			      GFP_KERNEL);
+	else
+		ops = on_stack;
+
+	if (!ops)
+		return -ENOMEM;
+
+	handles = (struct nvmap_handle **)(ops + list.count);
+
+	if (copy_from_user(ops, (void __user *)list.ops,
+			   list.count * sizeof(*ops))) {
+		err = -EFAULT;
+		goto out;
+	}
+
+	/* validate the whole list before touching the caches, and total up
+	 * the inner cache write-backs; invalidates can never be done by
+	 * set/way, since that would discard dirty lines of other buffers */
+	for (nr = 0; nr < list.count; nr++) {
+		struct nvmap_cache_op_elem *e = &ops[nr];
+
+		if (e->op < NVMAP_CACHE_OP_WB || e->op > NVMAP_CACHE_OP_WB_INV) {
+			err = -EINVAL;
+			goto out;
+		}
+
+		h = nvmap_get_handle_id(client, e->handle);
+		if (!h) {
+			err = -EPERM;
+			goto out;
+		}
+		handles[nr] = h;
+
+		if (!h->alloc || e->offset > h->size ||
+		    e->len > h->size - e->offset) {
+			nvmap_warn(client, "cache maintenance outside handle\n");
+			nr++;
+			err = -EINVAL;
+			goto out;
+		}
+
+		if (h->flags == NVMAP_HANDLE_UNCACHEABLE ||
+		    h->flags == NVMAP_HANDLE_WRITE_COMBINE ||
+		    e->op == NVMAP_CACHE_OP_INV)
+			continue;
+
+		inner_bytes += e->len;
+		if (e->op == NVMAP_CACHE_OP_WB_INV)
+			flush = true;
+	}
+
+	if (inner_bytes >= FLUSH_CLEAN_BY_SET_WAY_THRESHOLD) {
+		if (flush)
+			inner_flush_cache_all();
+		else
+			inner_clean_cache_all();
+		set_way = true;
+	}
+
+	for (i = 0; i < nr && !err; i++) {
+		struct nvmap_cache_op_elem *e = &ops[i];
+		unsigned long start = e->offset;
+		unsigned long end = start + e->len;
+
+		h = handles[i];
+		if (h->flags == NVMAP_HANDLE_UNCACHEABLE ||
+		    h->flags == NVMAP_HANDLE_WRITE_COMBINE || start == end)
+			continue;
+
+		if (set_way && e->op != NVMAP_CACHE_OP_INV)
+			outer_handle_cache_maint(client, h, start, end, e->op);
+		else
+			err = cache_maint(client, h, start, end, e->op);
+	}
+
+out:
+	while (nr--)
+		nvmap_handle_put(handles[nr]);
+
+	if (ops != on_stack)
+		kfree(ops);
+
+	return err;
+}
+
 int nvmap_ioctl_free(struct file *filp, unsigned long arg)
 {
 	struct nvmap_client *client = filp->private_data;
@@ -547,17 +666,32 @@ static bool fast_cache_maint(struct nvmap_client *client, struct nvmap_handle *h
 		inner_clean_cache_all();
 	}
 
-	if (h->heap_pgalloc && (h->flags != NVMAP_HANDLE_INNER_CACHEABLE)) {
+	outer_handle_cache_maint(client, h, start, end, op);
+	ret = true;
+out:
+	return ret;
+}
+
+/* outer cache maintenance for a range of a handle whose inner cache
+ * maintenance has already been done by set/way */
+static void outer_handle_cache_maint(struct nvmap_client *client,
+	struct nvmap_handle *h, unsigned long start, unsigned long end,
+	unsigned int op)
+{
+	if (h->flags == NVMAP_HANDLE_INNER_CACHEABLE)
+		return;
+
+	if (h->heap_pgalloc) {
 		heap_page_cache_maint(client, h, start, end, op,
 				false, true, NULL, 0, 0);
-	} else if (h->flags != NVMAP_HANDLE_INNER_CACHEABLE) {
+	} else {
+		/* lock carveout from relocation by mapcount */
+		nvmap_usecount_inc(h);
 		start += h->carveout->base;
 		end += h->carveout->base;
 		outer_cache_maint(op, start, end - start);
+		nvmap_usecount_dec(h);
 	}
-	ret = true;
-out:
-	return ret;
 }
 
 static int cache_maint(struct nvmap_client *client, struct nvmap_handle *h,
@@ -95,6 +95,21 @@ struct nvmap_cache_op {
 	__s32 op;
 };
 
+/* one entry of an NVMAP_IOC_CACHE_LIST request; unlike nvmap_cache_op,
+ * the range is given as an offset into the handle so that the handle
+ * does not have to be mapped into the caller */
+struct nvmap_cache_op_elem {
+	__u32 handle;
+	__u32 offset;
+	__u32 len;
+	__s32 op;
+};
+
+struct nvmap_cache_op_list {
+	unsigned long ops;	/* array of nvmap_cache_op_elem */
+	__u32 count;		/* number of entries in ops */
+};
+
 #define NVMAP_IOC_MAGIC 'N'
 
 /* Creates a new memory handle. On input, the argument is the size of the new
@@ -134,7 +149,12 @@ struct nvmap_cache_op {
  * reference to the same handle */
 #define NVMAP_IOC_GET_ID  _IOWR(NVMAP_IOC_MAGIC, 13, struct nvmap_create_handle)
 
-#define NVMAP_IOC_MAXNR (_IOC_NR(NVMAP_IOC_GET_ID))
+/* Performs cache maintenance on a list of handle ranges. If the ranges
+ * which need to be written back add up to more than the set/way threshold,
+ * the inner cache is cleaned once for the whole list */
+#define NVMAP_IOC_CACHE_LIST _IOW(NVMAP_IOC_MAGIC, 14, struct nvmap_cache_op_list)
+
+#define NVMAP_IOC_MAXNR (_IOC_NR(NVMAP_IOC_CACHE_LIST))
 
 int nvmap_ioctl_pinop(struct file *filp, bool is_pin, void __user *arg);
 
@@ -152,6 +172,8 @@ int nvmap_map_into_caller_ptr(struct file *filp, void __user *arg);
 
 int nvmap_ioctl_cache_maint(struct file *filp, void __user *arg);
 
+int nvmap_ioctl_cache_maint_list(struct file *filp, void __user *arg);
+
 int nvmap_ioctl_rw_handle(struct file *filp, int is_read, void __user* arg);
 
 
@@ -20,7 +20,9 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  */
 
+#include <linux/debugfs.h>
 #include <linux/list.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
 
 #include <asm/pgtable.h>
@@ -31,29 +33,55 @@
 #include "nvmap_mru.h"
 
 /* if IOVMM reclamation is enabled (CONFIG_NVMAP_RECLAIM_UNPINNED_VM),
- * unpinned handles are placed onto a most-recently-used eviction list;
- * multiple lists are maintained, segmented by size (sizes were chosen to
- * roughly correspond with common sizes for graphics surfaces).
+ * unpinned handles keep their IOVMM area and are placed onto a single
+ * least-recently-used list, oldest first.
  *
- * if a handle is located on the MRU list, then the code below may
+ * if a handle is located on the LRU list, then the code below may
  * steal its IOVMM area at any time to satisfy a pin operation if no
- * free IOVMM space is available
+ * free IOVMM space is available.
+ *
+ * every handle counts how often it was re-pinned while its area was still
+ * intact. the count decays by half for every NVMAP_LRU_AGE_PERIOD unpins
+ * which happen after the handle was put on the list, so a buffer which
+ * was hot a long time ago is not protected forever. the value of an area
+ * is its decayed reuse count; when space is needed, the areas with the
+ * lowest value per byte are evicted first, oldest first among equals.
  */
 
-static const size_t mru_cutoff[] = {
-	262144, 393216, 786432, 1048576, 1572864
-};
+#define NVMAP_LRU_AGE_PERIOD	16
+#define NVMAP_LRU_MAX_REUSE	255
 
-static inline struct list_head *mru_list(struct nvmap_share *share, size_t size)
+static unsigned int lru_aged_reuse(struct nvmap_share *share,
+				   struct nvmap_handle *h)
 {
-	unsigned int i;
+	unsigned int shift;
 
-	BUG_ON(!share->mru_lists);
-	for (i = 0; i < ARRAY_SIZE(mru_cutoff); i++)
-		if (size <= mru_cutoff[i])
-			break;
+	shift = (share->lru_clock - h->pgalloc.lru_stamp) /
+		NVMAP_LRU_AGE_PERIOD;
+	if (shift >= 8)	/* reuse never exceeds NVMAP_LRU_MAX_REUSE */
+		return 0;
+	return h->pgalloc.reuse >> shift;
+}
+
+/* true if evicting a costs less per byte of IOVMM space than evicting b */
+static bool lru_cheaper(struct nvmap_share *share,
+			struct nvmap_handle *a, struct nvmap_handle *b)
+{
+	u64 cost_a = lru_aged_reuse(share, a) + 1;
+	u64 cost_b = lru_aged_reuse(share, b) + 1;
+
+	return cost_a * b->pgalloc.area->iovm_length <
+		cost_b * a->pgalloc.area->iovm_length;
+}
+
+static void lru_evict_locked(struct nvmap_share *share, struct nvmap_handle *h)
+{
+	BUG_ON(atomic_read(&h->pin) != 0);
+	BUG_ON(!h->pgalloc.area);
 
-	return &share->mru_lists[i];
+	list_del_init(&h->pgalloc.mru_list);
+	share->lru_evictions++;
+	share->lru_evicted_bytes += h->pgalloc.area->iovm_length;
 }
 
 size_t nvmap_mru_vm_size(struct tegra_iovmm_client *iovmm)
@@ -65,8 +93,8 @@ size_t nvmap_mru_vm_size(struct tegra_iovmm_client *iovmm)
 /*  nvmap_mru_vma_lock should be acquired by the caller before calling this */
 void nvmap_mru_insert_locked(struct nvmap_share *share, struct nvmap_handle *h)
 {
-	size_t len = h->pgalloc.area->iovm_length;
-	list_add(&h->pgalloc.mru_list, mru_list(share, len));
+	h->pgalloc.lru_stamp = ++share->lru_clock;
+	list_add_tail(&h->pgalloc.mru_list, &share->lru_list);
 }
 
 void nvmap_mru_remove(struct nvmap_share *s, struct nvmap_handle *h)
@@ -79,105 +107,143 @@ void nvmap_mru_remove(struct nvmap_share *s, struct nvmap_handle *h)
 }
 
 /* returns a tegra_iovmm_area for a handle. if the handle already has
- * an iovmm_area allocated, the handle is simply removed from its MRU list
+ * an iovmm_area allocated, the handle is simply removed from the LRU list
  * and the existing iovmm_area is returned.
  *
  * if no existing allocation exists, try to allocate a new IOVMM area.
  *
- * if a new area can not be allocated, try to re-use the most-recently-unpinned
- * handle's allocation.
+ * if a new area can not be allocated, steal the area of an unpinned handle
+ * which is large enough (but not wastefully so), provided that no other
+ * area on the list is cheaper to evict.
  *
- * and if that fails, iteratively evict handles from the MRU lists and free
- * their allocations, until the new allocation succeeds.
+ * and if that fails, evict handles from the LRU list cheapest first and
+ * free their allocations, until the new allocation succeeds.
  */
 struct tegra_iovmm_area *nvmap_handle_iovmm_locked(struct nvmap_client *c,
 					    struct nvmap_handle *h)
 {
-	struct list_head *mru;
-	struct nvmap_handle *evict = NULL;
+	struct nvmap_share *share = c->share;
+	struct nvmap_handle *evict, *cheapest, *fit;
 	struct tegra_iovmm_area *vm = NULL;
-	unsigned int i, idx;
+	unsigned int cost, fit_cost, min_cost;
+	size_t len;
 	pgprot_t prot;
 
-	BUG_ON(!h || !c || !c->share);
+	BUG_ON(!h || !c || !share);
 
 	prot = nvmap_pgprot(h, pgprot_kernel);
 
 	if (h->pgalloc.area) {
 		BUG_ON(list_empty(&h->pgalloc.mru_list));
-		list_del(&h->pgalloc.mru_list);
-		INIT_LIST_HEAD(&h->pgalloc.mru_list);
+		list_del_init(&h->pgalloc.mru_list);
+		h->pgalloc.reuse = min(lru_aged_reuse(share, h) + 1,
+				       (unsigned int)NVMAP_LRU_MAX_REUSE);
+		share->lru_hits++;
 		return h->pgalloc.area;
 	}
 
-	vm = tegra_iovmm_create_vm(c->share->iovmm, NULL, h->size, prot);
+	share->lru_remaps++;
+	vm = tegra_iovmm_create_vm(share->iovmm, NULL, h->size, prot);
 
 	if (vm) {
 		INIT_LIST_HEAD(&h->pgalloc.mru_list);
 		return vm;
 	}
-	/* attempt to re-use the most recently unpinned IOVMM area in the
-	 * same size bin as the current handle. If that fails, iteratively
-	 * evict handles (starting from the current bin) until an allocation
-	 * succeeds or no more areas can be evicted */
-	mru = mru_list(c->share, h->size);
-	if (!list_empty(mru))
-		evict = list_first_entry(mru, struct nvmap_handle,
-					 pgalloc.mru_list);
-
-	if (evict && evict->pgalloc.area->iovm_length >= h->size) {
-		list_del(&evict->pgalloc.mru_list);
-		vm = evict->pgalloc.area;
-		evict->pgalloc.area = NULL;
-		INIT_LIST_HEAD(&evict->pgalloc.mru_list);
+
+	/* look for a single area which can be re-used as is */
+	fit = NULL;
+	fit_cost = min_cost = UINT_MAX;
+	list_for_each_entry(evict, &share->lru_list, pgalloc.mru_list) {
+		len = evict->pgalloc.area->iovm_length;
+		cost = lru_aged_reuse(share, evict);
+		min_cost = min(min_cost, cost);
+		if (len >= h->size && len < h->size * 2 && cost < fit_cost) {
+			fit = evict;
+			fit_cost = cost;
+		}
+	}
+
+	if (fit && fit_cost <= min_cost) {
+		lru_evict_locked(share, fit);
+		share->lru_steals++;
+		vm = fit->pgalloc.area;
+		fit->pgalloc.area = NULL;
 		return vm;
 	}
 
-	idx = mru - c->share->mru_lists;
-
-	for (i = 0; i < c->share->nr_mru && !vm; i++, idx++) {
-		if (idx >= c->share->nr_mru)
-			idx = 0;
-		mru = &c->share->mru_lists[idx];
-		while (!list_empty(mru) && !vm) {
-			evict = list_first_entry(mru, struct nvmap_handle,
-						 pgalloc.mru_list);
-
-			BUG_ON(atomic_read(&evict->pin) != 0);
-			BUG_ON(!evict->pgalloc.area);
-			list_del(&evict->pgalloc.mru_list);
-			INIT_LIST_HEAD(&evict->pgalloc.mru_list);
-			tegra_iovmm_free_vm(evict->pgalloc.area);
-			evict->pgalloc.area = NULL;
-			vm = tegra_iovmm_create_vm(c->share->iovmm,
-						   NULL, h->size, prot);
-		}
+	while (!vm && !list_empty(&share->lru_list)) {
+		cheapest = NULL;
+		list_for_each_entry(evict, &share->lru_list, pgalloc.mru_list)
+			if (!cheapest || lru_cheaper(share, evict, cheapest))
+				cheapest = evict;
+
+		lru_evict_locked(share, cheapest);
+		tegra_iovmm_free_vm(cheapest->pgalloc.area);
+		cheapest->pgalloc.area = NULL;
+		vm = tegra_iovmm_create_vm(share->iovmm, NULL, h->size, prot);
 	}
 	return vm;
 }
 
-int nvmap_mru_init(struct nvmap_share *share)
+static int nvmap_mru_stats_show(struct seq_file *s, void *unused)
 {
-	int i;
-	mutex_init(&share->mru_lock);
-	share->nr_mru = ARRAY_SIZE(mru_cutoff) + 1;
+	struct nvmap_share *share = s->private;
+	struct nvmap_handle *h;
+	unsigned long count = 0;
+	unsigned long bytes = 0;
+
+	nvmap_mru_lock(share);
+	list_for_each_entry(h, &share->lru_list, pgalloc.mru_list) {
+		count++;
+		bytes += h->pgalloc.area->iovm_length;
+	}
 
-	share->mru_lists = kzalloc(sizeof(struct list_head) * share->nr_mru,
-				   GFP_KERNEL);
+	seq_printf(s, "lru areas:       %lu\n", count);
+	seq_printf(s, "lru bytes:       %lu\n", bytes);
+	seq_printf(s, "reuse hits:      %lu\n", share->lru_hits);
+	seq_printf(s, "remaps:          %lu\n", share->lru_remaps);
+	seq_printf(s, "steals:          %lu\n", share->lru_steals);
+	seq_printf(s, "evictions:       %lu\n", share->lru_evictions);
+	seq_printf(s, "evicted bytes:   %llu\n", share->lru_evicted_bytes);
+	nvmap_mru_unlock(share);
 
-	if (!share->mru_lists)
-		return -ENOMEM;
+	return 0;
+}
 
-	for (i = 0; i <= share->nr_mru; i++)
-		INIT_LIST_HEAD(&share->mru_lists[i]);
+static int nvmap_mru_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, nvmap_mru_stats_show, inode->i_private);
+}
+
+static const struct file_operations debug_mru_stats_fops = {
+	.open = nvmap_mru_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+void nvmap_mru_debugfs_init(struct nvmap_share *share, struct dentry *root)
+{
+	if (!IS_ERR_OR_NULL(root))
+		debugfs_create_file("iovmm_lru", 0444, root, share,
+				    &debug_mru_stats_fops);
+}
+
+int nvmap_mru_init(struct nvmap_share *share)
+{
+	mutex_init(&share->mru_lock);
+	INIT_LIST_HEAD(&share->lru_list);
+	share->lru_clock = 0;
+	share->lru_hits = 0;
+	share->lru_remaps = 0;
+	share->lru_steals = 0;
+	share->lru_evictions = 0;
+	share->lru_evicted_bytes = 0;
 
 	return 0;
 }
 
 void nvmap_mru_destroy(struct nvmap_share *share)
 {
-	if (share->mru_lists)
-		kfree(share->mru_lists);
-
-	share->mru_lists = NULL;
+	WARN_ON(!list_empty(&share->lru_list));
 }
@@ -28,6 +28,7 @@
 
 #include "nvmap.h"
 
+struct dentry;
 struct tegra_iovmm_area;
 struct tegra_iovmm_client;
 
@@ -56,6 +57,8 @@ void nvmap_mru_remove(struct nvmap_share *s, struct nvmap_handle *h);
 struct tegra_iovmm_area *nvmap_handle_iovmm_locked(struct nvmap_client *c,
 					    struct nvmap_handle *h);
 
+void nvmap_mru_debugfs_init(struct nvmap_share *share, struct dentry *root);
+
 #else
 
 #define nvmap_mru_lock(_s)	do { } while (0)
@@ -63,6 +66,7 @@ struct tegra_iovmm_area *nvmap_handle_iovmm_locked(struct nvmap_client *c,
 #define nvmap_mru_init(_s)	0
 #define nvmap_mru_destroy(_s)	do { } while (0)
 #define nvmap_mru_vm_size(_a)	tegra_iovmm_get_vm_size(_a)
+#define nvmap_mru_debugfs_init(_s, _r)	do { } while (0)
 
 static inline void nvmap_mru_insert_locked(struct nvmap_share *share,
                                            struct nvmap_handle *h)
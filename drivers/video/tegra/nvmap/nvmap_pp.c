@@ -0,0 +1,305 @@
+/*
+ * drivers/video/tegra/nvmap/nvmap_pp.c
+ *
+ * pools of pre-cleaned pages for nvmap system memory handles
+ *
+ * Copyright (c) 2011, NVIDIA Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <linux/debugfs.h>
+#include <linux/highmem.h>
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/mm.h>
+#include <linux/moduleparam.h>
+#include <linux/seq_file.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+
+#include <asm/cacheflush.h>
+#include <asm/outercache.h>
+
+#include <mach/nvmap.h>
+
+#include "nvmap.h"
+#include "nvmap_pp.h"
+#include "nvmap_common.h"
+
+/* allocating pages for a sysmem or IOVMM handle is dominated by cleaning
+ * them out of the inner and outer caches, since the handle will be mapped
+ * with a different cache attribute than the kernel's linear mapping. to
+ * take that cost off the allocation path, a pool of pages which have
+ * already been zeroed and cleaned is kept for each non-cacheable attribute
+ * and topped up from a work item whenever it drops below half full.
+ * pages in the pools are given back to the system under memory pressure
+ * by a shrinker. */
+
+#define NVMAP_NUM_PAGE_POOLS	3	/* uncached, write-combined, inner */
+#define NVMAP_PP_REFILL_BATCH	32
+
+struct nvmap_page_pool {
+	spinlock_t lock;
+	struct list_head pages;
+	unsigned int count;
+	/* statistics, protected by lock */
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long filled;
+	unsigned long shrunk;
+};
+
+static const char *const pool_names[NVMAP_NUM_PAGE_POOLS] = {
+	"uncacheable", "writecombine", "inner_cacheable",
+};
+
+static struct nvmap_page_pool pools[NVMAP_NUM_PAGE_POOLS];
+static bool pools_enabled;
+
+static unsigned int pagepool_size = CONFIG_NVMAP_PAGE_POOL_SIZE;
+module_param(pagepool_size, uint, 0644);
+
+static void pool_refill_work(struct work_struct *work);
+static DECLARE_WORK(refill_work, pool_refill_work);
+
+static struct nvmap_page_pool *pool_for(unsigned int flags)
+{
+	switch (flags & NVMAP_HANDLE_CACHE_FLAG) {
+	case NVMAP_HANDLE_UNCACHEABLE:
+		return &pools[0];
+	case NVMAP_HANDLE_WRITE_COMBINE:
+		return &pools[1];
+	case NVMAP_HANDLE_INNER_CACHEABLE:
+		return &pools[2];
+	default:
+		return NULL;
+	}
+}
+
+/* zeroes the pages and writes them back out of the inner and outer
+ * caches, exactly as handle_page_alloc would have done */
+static void pool_clean_pages(struct page **pages, unsigned int nr)
+{
+	unsigned long base;
+	unsigned int i;
+
+	for (i = 0; i < nr; i++)
+		clear_highpage(pages[i]);
+
+	if (nr * PAGE_SIZE >= FLUSH_CLEAN_BY_SET_WAY_THRESHOLD) {
+		inner_flush_cache_all();
+	} else {
+		for (i = 0; i < nr; i++)
+			__flush_dcache_page(page_mapping(pages[i]), pages[i]);
+	}
+
+	for (i = 0; i < nr; i++) {
+		base = page_to_phys(pages[i]);
+		outer_flush_range(base, base + PAGE_SIZE);
+	}
+}
+
+static void pool_refill_work(struct work_struct *work)
+{
+	struct page *batch[NVMAP_PP_REFILL_BATCH];
+	struct nvmap_page_pool *pool;
+	unsigned int i, nr, got, want;
+
+	for (i = 0; i < NVMAP_NUM_PAGE_POOLS; i++) {
+		pool = &pools[i];
+
+		for (;;) {
+			spin_lock(&pool->lock);
+			want = (pool->count < pagepool_size) ?
+				pagepool_size - pool->count : 0;
+			spin_unlock(&pool->lock);
+
+			want = min_t(unsigned int, want, NVMAP_PP_REFILL_BATCH);
+			if (!want)
+				break;
+
+			/* don't push the system into reclaim just to keep
+			 * the pools full */
+			for (nr = 0; nr < want; nr++) {
+				batch[nr] = alloc_page(GFP_NVMAP | __GFP_NORETRY);
+				if (!batch[nr])
+					break;
+			}
+
+			if (nr)
+				pool_clean_pages(batch, nr);
+
+			got = nr;
+			spin_lock(&pool->lock);
+			while (nr--) {
+				list_add_tail(&batch[nr]->lru, &pool->pages);
+				pool->count++;
+				pool->filled++;
+			}
+			spin_unlock(&pool->lock);
+
+			if (got < want || !pools_enabled)
+				return;
+		}
+	}
+}
+
+/* returns a zeroed, cache-clean page for a handle with the given cache
+ * attribute, or NULL if the pool for that attribute is empty */
+struct page *nvmap_page_pool_alloc(unsigned int flags)
+{
+	struct nvmap_page_pool *pool = pool_for(flags);
+	struct page *page = NULL;
+	bool refill;
+
+	if (!pool || !pools_enabled)
+		return NULL;
+
+	spin_lock(&pool->lock);
+	if (!list_empty(&pool->pages)) {
+		page = list_first_entry(&pool->pages, struct page, lru);
+		list_del(&page->lru);
+		pool->count--;
+		pool->hits++;
+	} else {
+		pool->misses++;
+	}
+	refill = pool->count < pagepool_size / 2;
+	spin_unlock(&pool->lock);
+
+	if (refill)
+		schedule_work(&refill_work);
+
+	return page;
+}
+
+/* releases up to nr pages from the pools back to the system, most
+ * recently filled first; returns the number of pages released */
+static unsigned int pool_drain(unsigned int nr)
+{
+	struct nvmap_page_pool *pool;
+	struct page *page, *tmp;
+	LIST_HEAD(victims);
+	unsigned int freed = 0;
+	unsigned int i;
+
+	for (i = 0; i < NVMAP_NUM_PAGE_POOLS && freed < nr; i++) {
+		pool = &pools[i];
+		spin_lock(&pool->lock);
+		while (pool->count && freed < nr) {
+			page = list_entry(pool->pages.prev, struct page, lru);
+			list_move(&page->lru, &victims);
+			pool->count--;
+			pool->shrunk++;
+			freed++;
+		}
+		spin_unlock(&pool->lock);
+	}
+
+	list_for_each_entry_safe(page, tmp, &victims, lru) {
+		list_del(&page->lru);
+		__free_page(page);
+	}
+
+	return freed;
+}
+
+static int pool_total(void)
+{
+	unsigned int i;
+	int total = 0;
+
+	for (i = 0; i < NVMAP_NUM_PAGE_POOLS; i++)
+		total += pools[i].count;
+
+	return total;
+}
+
+static int nvmap_page_pool_shrink(struct shrinker *shrinker, int nr_to_scan,
+				  gfp_t gfp_mask)
+{
+	if (nr_to_scan)
+		pool_drain(nr_to_scan);
+
+	return pool_total();
+}
+
+static struct shrinker nvmap_page_pool_shrinker = {
+	.shrink = nvmap_page_pool_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
+
+static int nvmap_page_pool_show(struct seq_file *s, void *unused)
+{
+	struct nvmap_page_pool *pool;
+	unsigned int i;
+
+	seq_printf(s, "%-16s %8s %10s %10s %10s %10s\n", "pool", "pages",
+		   "hits", "misses", "filled", "shrunk");
+
+	for (i = 0; i < NVMAP_NUM_PAGE_POOLS; i++) {
+		pool = &pools[i];
+		spin_lock(&pool->lock);
+		seq_printf(s, "%-16s %8u %10lu %10lu %10lu %10lu\n",
+			   pool_names[i], pool->count, pool->hits,
+			   pool->misses, pool->filled, pool->shrunk);
+		spin_unlock(&pool->lock);
+	}
+
+	return 0;
+}
+
+static int nvmap_page_pool_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, nvmap_page_pool_show, inode->i_private);
+}
+
+static struct file_operations debug_page_pool_fops = {
+	.open = nvmap_page_pool_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+void nvmap_page_pool_debugfs_init(struct dentry *nvmap_root)
+{
+	if (!IS_ERR_OR_NULL(nvmap_root))
+		debugfs_create_file("pagepool", 0444, nvmap_root, NULL,
+				    &debug_page_pool_fops);
+}
+
+int nvmap_page_pool_init(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < NVMAP_NUM_PAGE_POOLS; i++) {
+		spin_lock_init(&pools[i].lock);
+		INIT_LIST_HEAD(&pools[i].pages);
+	}
+
+	register_shrinker(&nvmap_page_pool_shrinker);
+	pools_enabled = true;
+	schedule_work(&refill_work);
+	return 0;
+}
+
+void nvmap_page_pool_deinit(void)
+{
+	pools_enabled = false;
+	cancel_work_sync(&refill_work);
+	unregister_shrinker(&nvmap_page_pool_shrinker);
+	pool_drain(UINT_MAX);
+}
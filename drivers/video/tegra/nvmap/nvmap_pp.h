@@ -0,0 +1,52 @@
+/*
+ * drivers/video/tegra/nvmap/nvmap_pp.h
+ *
+ * pools of pre-cleaned pages for nvmap system memory handles
+ *
+ * Copyright (c) 2011, NVIDIA Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef __VIDEO_TEGRA_NVMAP_PP_H
+#define __VIDEO_TEGRA_NVMAP_PP_H
+
+struct dentry;
+struct page;
+
+#ifdef CONFIG_NVMAP_PAGE_POOLS
+
+int nvmap_page_pool_init(void);
+
+void nvmap_page_pool_deinit(void);
+
+void nvmap_page_pool_debugfs_init(struct dentry *nvmap_root);
+
+struct page *nvmap_page_pool_alloc(unsigned int flags);
+
+#else
+
+#define nvmap_page_pool_init()			0
+#define nvmap_page_pool_deinit()		do { } while (0)
+#define nvmap_page_pool_debugfs_init(_root)	do { } while (0)
+
+static inline struct page *nvmap_page_pool_alloc(unsigned int flags)
+{
+	return NULL;
+}
+
+#endif
+
+#endif
@@ -69,6 +69,19 @@
 #include <linux/freezer.h>
 #endif
 
+#if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 22))
+#include <linux/writeback.h>
+#endif
+
+#if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 19)) && defined(CONFIG_SMP)
+#define YAFFS_USE_PARALLEL_SCAN 1
+#include <linux/workqueue.h>
+#include <linux/completion.h>
+#include <linux/cpu.h>
+#else
+#define YAFFS_USE_PARALLEL_SCAN 0
+#endif
+
 #include <asm/div64.h>
 
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 5, 0))
@@ -114,6 +127,18 @@
 #define YAFFS_USE_WRITE_BEGIN_END 0
 #endif
 
+#if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 22))
+#define YAFFS_USE_MULTI_PAGE_IO 1
+#else
+#define YAFFS_USE_MULTI_PAGE_IO 0
+#endif
+
+/* Max pages handled under one lock hold by readpages/writepages */
+#define YAFFS_PAGE_BATCH 16
+
+/* Seconds of writing that background gc tries to keep erased space for */
+#define YAFFS_BG_GC_HORIZON 2
+
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 28))
 static uint32_t YCALCBLOCKS(uint64_t partition_size, uint32_t block_size)
 {
@@ -142,6 +167,7 @@ unsigned int yaffs_traceMask = YAFFS_TRACE_BAD_BLOCKS | YAFFS_TRACE_ALWAYS;
 unsigned int yaffs_wr_attempts = YAFFS_WR_ATTEMPTS;
 unsigned int yaffs_auto_checkpoint = 1;
 unsigned int yaffs_gc_control = 1;
+unsigned int yaffs_bg_checkpoint_idle = 10;
 
 /* Module Parameters */
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 5, 0))
@@ -149,11 +175,13 @@ module_param(yaffs_traceMask, uint, 0644);
 module_param(yaffs_wr_attempts, uint, 0644);
 module_param(yaffs_auto_checkpoint, uint, 0644);
 module_param(yaffs_gc_control, uint, 0644);
+module_param(yaffs_bg_checkpoint_idle, uint, 0644);
 #else
 MODULE_PARM(yaffs_traceMask, "i");
 MODULE_PARM(yaffs_wr_attempts, "i");
 MODULE_PARM(yaffs_auto_checkpoint, "i");
 MODULE_PARM(yaffs_gc_control, "i");
+MODULE_PARM(yaffs_bg_checkpoint_idle, "i");
 #endif
 
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 25))
@@ -268,6 +296,12 @@ static int yaffs_writepage(struct page *page, struct writeback_control *wbc);
 static int yaffs_writepage(struct page *page);
 #endif
 
+#if (YAFFS_USE_MULTI_PAGE_IO > 0)
+static int yaffs_readpages(struct file *file, struct address_space *mapping,
+				struct list_head *pages, unsigned nr_pages);
+static int yaffs_writepages(struct address_space *mapping,
+				struct writeback_control *wbc);
+#endif
 
 #if (YAFFS_USE_WRITE_BEGIN_END != 0)
 static int yaffs_write_begin(struct file *filp, struct address_space *mapping,
@@ -296,6 +330,10 @@ static loff_t yaffs_dir_llseek(struct file *file, loff_t offset, int origin);
 static struct address_space_operations yaffs_file_address_operations = {
 	.readpage = yaffs_readpage,
 	.writepage = yaffs_writepage,
+#if (YAFFS_USE_MULTI_PAGE_IO > 0)
+	.readpages = yaffs_readpages,
+	.writepages = yaffs_writepages,
+#endif
 #if (YAFFS_USE_WRITE_BEGIN_END > 0)
 	.write_begin = yaffs_write_begin,
 	.write_end = yaffs_write_end,
@@ -408,19 +446,177 @@ static unsigned yaffs_gc_control_callback(yaffs_Device *dev)
 	return yaffs_gc_control;
 }
                 	                                                                                          	
+/*
+ * The gross lock is held exclusively by anything that can change the
+ * file system (including gc and checkpointing) and shared by operations
+ * that only read it. The few bits of device state that reads do touch
+ * are covered by the readStateLock, via the lockReadState callbacks.
+ */
 static void yaffs_GrossLock(yaffs_Device *dev)
 {
 	T(YAFFS_TRACE_LOCK, (TSTR("yaffs locking %p\n"), current));
-	down(&(yaffs_DeviceToContext(dev)->grossLock));
+	down_write(&(yaffs_DeviceToContext(dev)->grossLock));
 	T(YAFFS_TRACE_LOCK, (TSTR("yaffs locked %p\n"), current));
 }
 
 static void yaffs_GrossUnlock(yaffs_Device *dev)
 {
 	T(YAFFS_TRACE_LOCK, (TSTR("yaffs unlocking %p\n"), current));
-	up(&(yaffs_DeviceToContext(dev)->grossLock));
+	up_write(&(yaffs_DeviceToContext(dev)->grossLock));
+}
+
+static void yaffs_GrossLockShared(yaffs_Device *dev)
+{
+	T(YAFFS_TRACE_LOCK, (TSTR("yaffs locking shared %p\n"), current));
+	down_read(&(yaffs_DeviceToContext(dev)->grossLock));
+	T(YAFFS_TRACE_LOCK, (TSTR("yaffs locked shared %p\n"), current));
+}
+
+static void yaffs_GrossUnlockShared(yaffs_Device *dev)
+{
+	T(YAFFS_TRACE_LOCK, (TSTR("yaffs unlocking shared %p\n"), current));
+	up_read(&(yaffs_DeviceToContext(dev)->grossLock));
+}
+
+static void yaffs_LockReadStateCallback(yaffs_Device *dev)
+{
+	mutex_lock(&(yaffs_DeviceToContext(dev)->readStateLock));
+}
+
+static void yaffs_UnlockReadStateCallback(yaffs_Device *dev)
+{
+	mutex_unlock(&(yaffs_DeviceToContext(dev)->readStateLock));
 }
 
+#if YAFFS_USE_PARALLEL_SCAN
+/*
+ * Mount-time scanning only needs the tags of each chunk. On SMP we split
+ * each batch of blocks across the online cpus so that tag unpacking and
+ * ECC checking on one cpu overlap with NAND reads on another. This only
+ * calls the low level MTD read, which doesn't touch shared device state
+ * when inband tags are off.
+ */
+struct yaffs_ScanWork {
+	struct work_struct work;
+	yaffs_Device *dev;
+	const int *blocks;
+	int nBlocks;
+	yaffs_ExtendedTags *tags;
+	int result;
+	atomic_t *pending;
+	struct completion *done;
+};
+
+static int yaffs_ReadBlockRangeTags(yaffs_Device *dev,
+				const int *blocks, int nBlocks,
+				yaffs_ExtendedTags *tags)
+{
+	int nChunks = dev->param.nChunksPerBlock;
+	int result = YAFFS_OK;
+	int chunk;
+	int i;
+	int c;
+
+	for (i = 0; i < nBlocks; i++) {
+		for (c = 0; c < nChunks; c++) {
+			chunk = blocks[i] * nChunks + c - dev->chunkOffset;
+			if (dev->param.readChunkWithTagsFromNAND(dev, chunk,
+					NULL, &tags[i * nChunks + c]) != YAFFS_OK)
+				result = YAFFS_FAIL;
+		}
+	}
+	return result;
+}
+
+static void yaffs_ScanWorker(struct work_struct *work)
+{
+	struct yaffs_ScanWork *sw =
+		container_of(work, struct yaffs_ScanWork, work);
+
+	sw->result = yaffs_ReadBlockRangeTags(sw->dev, sw->blocks,
+						sw->nBlocks, sw->tags);
+	if (atomic_dec_and_test(sw->pending))
+		complete(sw->done);
+}
+
+static int yaffs_ReadBlocksTagsCallback(yaffs_Device *dev,
+				const int *blocks, int nBlocks,
+				yaffs_ExtendedTags *tags)
+{
+	int nChunks = dev->param.nChunksPerBlock;
+	struct yaffs_ScanWork *sw;
+	struct completion done;
+	atomic_t pending;
+	int nWorkers;
+	int perWorker;
+	int result;
+	int first;
+	int cpu;
+	int i;
+
+	get_online_cpus();
+
+	nWorkers = num_online_cpus();
+	if (nWorkers > nBlocks)
+		nWorkers = nBlocks;
+	perWorker = (nBlocks + nWorkers - 1) / nWorkers;
+	nWorkers = (nBlocks + perWorker - 1) / perWorker;
+
+	sw = (nWorkers > 1) ? kmalloc(nWorkers * sizeof(*sw), GFP_NOFS) : NULL;
+	if (!sw) {
+		put_online_cpus();
+		return yaffs_ReadBlockRangeTags(dev, blocks, nBlocks, tags);
+	}
+
+	init_completion(&done);
+	atomic_set(&pending, nWorkers - 1);
+
+	/* Share 0 is done by this thread, the rest go to the other cpus */
+	i = 1;
+	for_each_online_cpu(cpu) {
+		if (i >= nWorkers)
+			break;
+		if (cpu == raw_smp_processor_id())
+			continue;
+
+		first = i * perWorker;
+		sw[i].dev = dev;
+		sw[i].blocks = &blocks[first];
+		sw[i].nBlocks = min(perWorker, nBlocks - first);
+		sw[i].tags = &tags[first * nChunks];
+		sw[i].pending = &pending;
+		sw[i].done = &done;
+		INIT_WORK(&sw[i].work, yaffs_ScanWorker);
+		schedule_work_on(cpu, &sw[i].work);
+		i++;
+	}
+
+	/* If a cpu went away under us, do the leftover shares here */
+	for (; i < nWorkers; i++) {
+		first = i * perWorker;
+		sw[i].result = yaffs_ReadBlockRangeTags(dev, &blocks[first],
+					min(perWorker, nBlocks - first),
+					&tags[first * nChunks]);
+		if (atomic_dec_and_test(&pending))
+			complete(&done);
+	}
+
+	result = yaffs_ReadBlockRangeTags(dev, blocks, perWorker, tags);
+
+	wait_for_completion(&done);
+
+	put_online_cpus();
+
+	for (i = 1; i < nWorkers; i++)
+		if (sw[i].result != YAFFS_OK)
+			result = YAFFS_FAIL;
+
+	kfree(sw);
+
+	return result;
+}
+#endif
+
 #ifdef YAFFS_COMPILE_EXPORTFS
 
 static struct inode *
@@ -503,7 +699,9 @@ static struct export_operations yaffs_export_ops =
  *
  * A seach context lives for the duration of a readdir.
  *
- * All these functions must be called while yaffs is locked.
+ * All these functions must be called while yaffs is locked. Since readdirs
+ * only hold the lock shared, the list itself is also covered by
+ * searchContextsLock.
  */
 
 struct yaffs_SearchContext {
@@ -533,7 +731,9 @@ static struct yaffs_SearchContext * yaffs_NewSearch(yaffs_Object *dir)
                                 dir->variant.directoryVariant.children.next,
 				yaffs_Object,siblings);
 		YINIT_LIST_HEAD(&sc->others);
+		spin_lock(&(yaffs_DeviceToContext(dev)->searchContextsLock));
 		ylist_add(&sc->others,&(yaffs_DeviceToContext(dev)->searchContexts));
+		spin_unlock(&(yaffs_DeviceToContext(dev)->searchContextsLock));
 	}
 	return sc;
 }
@@ -544,7 +744,9 @@ static struct yaffs_SearchContext * yaffs_NewSearch(yaffs_Object *dir)
 static void yaffs_EndSearch(struct yaffs_SearchContext * sc)
 {
 	if(sc){
+		spin_lock(&(yaffs_DeviceToContext(sc->dev)->searchContextsLock));
 		ylist_del(&sc->others);
+		spin_unlock(&(yaffs_DeviceToContext(sc->dev)->searchContextsLock));
 		YFREE(sc);
 	}
 }
@@ -589,6 +791,7 @@ static void yaffs_RemoveObjectCallback(yaffs_Object *obj)
          * If any are currently on the object being removed, then advance
          * the search context to the next object to prevent a hanging pointer.
          */
+	spin_lock(&(yaffs_DeviceToContext(obj->myDev)->searchContextsLock));
          ylist_for_each(i, search_contexts) {
                 if (i) {
                         sc = ylist_entry(i, struct yaffs_SearchContext,others);
@@ -596,6 +799,7 @@ static void yaffs_RemoveObjectCallback(yaffs_Object *obj)
                                 yaffs_SearchAdvance(sc);
                 }
 	}
+	spin_unlock(&(yaffs_DeviceToContext(obj->myDev)->searchContextsLock));
 
 }
 
@@ -610,11 +814,11 @@ static int yaffs_readlink(struct dentry *dentry, char __user *buffer,
 
 	yaffs_Device *dev = yaffs_DentryToObject(dentry)->myDev;
 
-	yaffs_GrossLock(dev);
+	yaffs_GrossLockShared(dev);
 
 	alias = yaffs_GetSymlinkAlias(yaffs_DentryToObject(dentry));
 
-	yaffs_GrossUnlock(dev);
+	yaffs_GrossUnlockShared(dev);
 
 	if (!alias)
 		return -ENOMEM;
@@ -634,11 +838,11 @@ static int yaffs_follow_link(struct dentry *dentry, struct nameidata *nd)
 	int ret;
 	yaffs_Device *dev = yaffs_DentryToObject(dentry)->myDev;
 
-	yaffs_GrossLock(dev);
+	yaffs_GrossLockShared(dev);
 
 	alias = yaffs_GetSymlinkAlias(yaffs_DentryToObject(dentry));
 
-	yaffs_GrossUnlock(dev);
+	yaffs_GrossUnlockShared(dev);
 
 	if (!alias) {
 		ret = -ENOMEM;
@@ -674,8 +878,7 @@ static struct dentry *yaffs_lookup(struct inode *dir, struct dentry *dentry)
 
 	yaffs_Device *dev = yaffs_InodeToObject(dir)->myDev;
 
-	if(current != yaffs_DeviceToContext(dev)->readdirProcess)
-		yaffs_GrossLock(dev);
+	yaffs_GrossLockShared(dev);
 
 	T(YAFFS_TRACE_OS,
 		(TSTR("yaffs_lookup for %d:%s\n"),
@@ -687,8 +890,7 @@ static struct dentry *yaffs_lookup(struct inode *dir, struct dentry *dentry)
 	obj = yaffs_GetEquivalentObject(obj);	/* in case it was a hardlink */
 
 	/* Can't hold gross lock when calling yaffs_get_inode() */
-	if(current != yaffs_DeviceToContext(dev)->readdirProcess)
-		yaffs_GrossUnlock(dev);
+	yaffs_GrossUnlockShared(dev);
 
 	if (obj) {
 		T(YAFFS_TRACE_OS,
@@ -851,13 +1053,13 @@ static int yaffs_readpage_nolock(struct file *f, struct page *pg)
 	pg_buf = kmap(pg);
 	/* FIXME: Can kmap fail? */
 
-	yaffs_GrossLock(dev);
+	yaffs_GrossLockShared(dev);
 
 	ret = yaffs_ReadDataFromFile(obj, pg_buf,
 				pg->index << PAGE_CACHE_SHIFT,
 				PAGE_CACHE_SIZE);
 
-	yaffs_GrossUnlock(dev);
+	yaffs_GrossUnlockShared(dev);
 
 	if (ret >= 0)
 		ret = 0;
@@ -976,6 +1178,201 @@ static int yaffs_writepage(struct page *page)
 	return (nWritten == nBytes) ? 0 : -ENOSPC;
 }
 
+#if (YAFFS_USE_MULTI_PAGE_IO > 0)
+
+/*
+ * Multi-page I/O.
+ * Runs of contiguous pages are handed to yaffs in one go so that each run
+ * costs one lock hold and, for reads, one pass over the tnode tree instead
+ * of one of each per page.
+ */
+
+static void yaffs_readpages_batch(yaffs_Object *obj, struct page **pgs,
+				int nPages)
+{
+	yaffs_Device *dev = obj->myDev;
+	__u8 *bufs[YAFFS_PAGE_BATCH];
+	int nRead;
+	int i;
+
+	T(YAFFS_TRACE_OS,
+		(TSTR("yaffs_readpages at %08x, %d pages\n"),
+		(unsigned)(pgs[0]->index << PAGE_CACHE_SHIFT), nPages));
+
+	for (i = 0; i < nPages; i++)
+		bufs[i] = kmap(pgs[i]);
+
+	yaffs_GrossLockShared(dev);
+
+	nRead = yaffs_ReadPagesFromFile(obj, bufs, nPages, PAGE_CACHE_SIZE,
+				(loff_t)pgs[0]->index << PAGE_CACHE_SHIFT);
+
+	yaffs_GrossUnlockShared(dev);
+
+	for (i = 0; i < nPages; i++) {
+		if (nRead >= 0) {
+			SetPageUptodate(pgs[i]);
+			ClearPageError(pgs[i]);
+		} else {
+			ClearPageUptodate(pgs[i]);
+			SetPageError(pgs[i]);
+		}
+		flush_dcache_page(pgs[i]);
+		kunmap(pgs[i]);
+		unlock_page(pgs[i]);
+	}
+}
+
+static int yaffs_readpages(struct file *f, struct address_space *mapping,
+				struct list_head *pages, unsigned nr_pages)
+{
+	yaffs_Object *obj = yaffs_DentryToObject(f->f_dentry);
+	struct page *batch[YAFFS_PAGE_BATCH];
+	struct page *pg;
+	int nBatch = 0;
+	unsigned i;
+
+	for (i = 0; i < nr_pages; i++) {
+		pg = list_entry(pages->prev, struct page, lru);
+		list_del(&pg->lru);
+
+		if (add_to_page_cache_lru(pg, mapping, pg->index,
+					GFP_KERNEL)) {
+			page_cache_release(pg);
+			continue;
+		}
+		/* The page cache now holds a reference and the page lock */
+		page_cache_release(pg);
+
+		if (nBatch > 0 && (nBatch == YAFFS_PAGE_BATCH ||
+				batch[nBatch - 1]->index + 1 != pg->index)) {
+			yaffs_readpages_batch(obj, batch, nBatch);
+			nBatch = 0;
+		}
+		batch[nBatch++] = pg;
+	}
+
+	if (nBatch > 0)
+		yaffs_readpages_batch(obj, batch, nBatch);
+
+	return 0;
+}
+
+struct yaffs_WritepagesContext {
+	struct inode *inode;
+	struct page *pages[YAFFS_PAGE_BATCH];
+	unsigned nBytes[YAFFS_PAGE_BATCH];
+	int nPages;
+};
+
+/*
+ * Write out the collected pages under one lock hold, so that their chunks
+ * go to NAND back to back.
+ */
+static int yaffs_writepages_flush(struct yaffs_WritepagesContext *wc)
+{
+	yaffs_Object *obj = yaffs_InodeToObject(wc->inode);
+	yaffs_Device *dev = obj->myDev;
+	__u8 *bufs[YAFFS_PAGE_BATCH];
+	int ret = 0;
+	int nWritten;
+	int i;
+
+	if (!wc->nPages)
+		return 0;
+
+	T(YAFFS_TRACE_OS,
+		(TSTR("yaffs_writepages at %08x, %d pages\n"),
+		(unsigned)(wc->pages[0]->index << PAGE_CACHE_SHIFT),
+		wc->nPages));
+
+	for (i = 0; i < wc->nPages; i++)
+		bufs[i] = kmap(wc->pages[i]);
+
+	yaffs_GrossLock(dev);
+
+	for (i = 0; i < wc->nPages; i++) {
+		nWritten = yaffs_WriteDataToFile(obj, bufs[i],
+				(loff_t)wc->pages[i]->index << PAGE_CACHE_SHIFT,
+				wc->nBytes[i], 0);
+		if (nWritten != wc->nBytes[i])
+			ret = -ENOSPC;
+	}
+
+	yaffs_GrossUnlock(dev);
+
+	for (i = 0; i < wc->nPages; i++) {
+		kunmap(wc->pages[i]);
+		set_page_writeback(wc->pages[i]);
+		unlock_page(wc->pages[i]);
+		end_page_writeback(wc->pages[i]);
+	}
+
+	wc->nPages = 0;
+
+	return ret;
+}
+
+static int yaffs_writepages_collect(struct page *page,
+				struct writeback_control *wbc, void *data)
+{
+	struct yaffs_WritepagesContext *wc = data;
+	unsigned long end_index;
+	unsigned nBytes;
+	loff_t i_size;
+	int ret = 0;
+
+	i_size = i_size_read(wc->inode);
+	end_index = i_size >> PAGE_CACHE_SHIFT;
+
+	if (page->index < end_index)
+		nBytes = PAGE_CACHE_SIZE;
+	else {
+		nBytes = i_size & (PAGE_CACHE_SIZE - 1);
+
+		if (page->index > end_index || !nBytes) {
+			/* Beyond EOF, see yaffs_writepage() */
+			zero_user_segment(page, 0, PAGE_CACHE_SIZE);
+			set_page_writeback(page);
+			unlock_page(page);
+			end_page_writeback(page);
+			return 0;
+		}
+		zero_user_segment(page, nBytes, PAGE_CACHE_SIZE);
+	}
+
+	if (wc->nPages > 0 && (wc->nPages == YAFFS_PAGE_BATCH ||
+			wc->pages[wc->nPages - 1]->index + 1 != page->index))
+		ret = yaffs_writepages_flush(wc);
+
+	wc->pages[wc->nPages] = page;
+	wc->nBytes[wc->nPages] = nBytes;
+	wc->nPages++;
+
+	return ret;
+}
+
+static int yaffs_writepages(struct address_space *mapping,
+				struct writeback_control *wbc)
+{
+	struct yaffs_WritepagesContext wc;
+	int ret;
+	int flushRet;
+
+	wc.inode = mapping->host;
+	wc.nPages = 0;
+
+	ret = write_cache_pages(mapping, wbc, yaffs_writepages_collect, &wc);
+
+	flushRet = yaffs_writepages_flush(&wc);
+	if (!ret)
+		ret = flushRet;
+
+	return ret;
+}
+
+#endif
+
 
 #if (YAFFS_USE_WRITE_BEGIN_END > 0)
 static int yaffs_write_begin(struct file *filp, struct address_space *mapping,
@@ -1406,9 +1803,7 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 	obj = yaffs_DentryToObject(f->f_dentry);
 	dev = obj->myDev;
 
-	yaffs_GrossLock(dev);
-
-	yaffs_DeviceToContext(dev)->readdirProcess = current;
+	yaffs_GrossLockShared(dev);
 
 	offset = f->f_pos;
 
@@ -1424,10 +1819,10 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 		T(YAFFS_TRACE_OS,
 			(TSTR("yaffs_readdir: entry . ino %d \n"),
 			(int)inode->i_ino));
-		yaffs_GrossUnlock(dev);
+		yaffs_GrossUnlockShared(dev);
 		if (filldir(dirent, ".", 1, offset, inode->i_ino, DT_DIR) < 0)
 			goto out;
-		yaffs_GrossLock(dev);
+		yaffs_GrossLockShared(dev);
 		offset++;
 		f->f_pos++;
 	}
@@ -1435,11 +1830,11 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 		T(YAFFS_TRACE_OS,
 			(TSTR("yaffs_readdir: entry .. ino %d \n"),
 			(int)f->f_dentry->d_parent->d_inode->i_ino));
-		yaffs_GrossUnlock(dev);
+		yaffs_GrossUnlockShared(dev);
 		if (filldir(dirent, "..", 2, offset,
 			f->f_dentry->d_parent->d_inode->i_ino, DT_DIR) < 0)
 			goto out;
-		yaffs_GrossLock(dev);
+		yaffs_GrossLockShared(dev);
 		offset++;
 		f->f_pos++;
 	}
@@ -1467,7 +1862,7 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 			  (TSTR("yaffs_readdir: %s inode %d\n"),
 			  name, yaffs_GetObjectInode(l)));
 
-                        yaffs_GrossUnlock(dev);
+                        yaffs_GrossUnlockShared(dev);
 
 			if (filldir(dirent,
 					name,
@@ -1477,7 +1872,7 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 					this_type) < 0)
 				goto out;
 
-                        yaffs_GrossLock(dev);
+                        yaffs_GrossLockShared(dev);
 
 			offset++;
 			f->f_pos++;
@@ -1486,9 +1881,7 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 	}
 
 unlock_out:
-	yaffs_DeviceToContext(dev)->readdirProcess = NULL;
-
-	yaffs_GrossUnlock(dev);
+	yaffs_GrossUnlockShared(dev);
 out:
         yaffs_EndSearch(sc);
 
@@ -1949,11 +2342,40 @@ static void yaffs_FlushSuperBlock(struct super_block *sb, int do_checkpoint)
 }
 
 
+/*
+ * Track the rate at which chunks are being written, not counting the
+ * copies gc makes. Called from the background thread, which runs at least
+ * once a second while the device is mounted.
+ */
+static void yaffs_UpdateWriteRate(yaffs_Device *dev, unsigned long now)
+{
+	struct yaffs_LinuxContext *context = yaffs_DeviceToContext(dev);
+	__u32 writes = dev->nPageWrites - dev->nGCCopies;
+	unsigned long elapsed = now - context->rateStamp;
+	unsigned sample;
+
+	if(elapsed < HZ)
+		return;
+
+	sample = (unsigned)((writes - context->rateWrites) * HZ / elapsed);
+	context->writeRate = (context->writeRate * 3 + sample) / 4;
+	context->rateWrites = writes;
+	context->rateStamp = now;
+}
+
+/*
+ * How hard the background gc should work: 0 (idle), 1 or 2 (urgent).
+ * We want enough erased chunks in hand to absorb the next
+ * YAFFS_BG_GC_HORIZON seconds of writing at the recent rate, so that
+ * writers don't end up doing gc themselves. While things are quiet we
+ * still clean ahead until half the free space is erased.
+ */
 static unsigned yaffs_bg_gc_urgency(yaffs_Device *dev)
 {
 	unsigned erasedChunks = dev->nErasedBlocks * dev->param.nChunksPerBlock;
 	struct yaffs_LinuxContext *context = yaffs_DeviceToContext(dev);
 	unsigned scatteredFree = 0; /* Free chunks not in an erased block */
+	unsigned wanted = context->writeRate * YAFFS_BG_GC_HORIZON;
 
 	if(erasedChunks < dev->nFreeChunks)
 		scatteredFree = (dev->nFreeChunks - erasedChunks);
@@ -1962,12 +2384,14 @@ static unsigned yaffs_bg_gc_urgency(yaffs_Device *dev)
 		return 0;
 	else if(scatteredFree < (dev->param.nChunksPerBlock * 2))
 		return 0;
-	else if(erasedChunks > dev->nFreeChunks/2)
-		return 0;
-	else if(erasedChunks > dev->nFreeChunks/4)
+	else if(erasedChunks < wanted / 2 ||
+		erasedChunks <= dev->nFreeChunks/4)
+		return 2;
+	else if(erasedChunks < wanted ||
+		erasedChunks <= dev->nFreeChunks/2)
 		return 1;
 	else
-		return 2;
+		return 0;
 }
 
 static int yaffs_do_sync_fs(struct super_block *sb,
@@ -2021,6 +2445,32 @@ void yaffs_background_waker(unsigned long data)
 	wake_up_process((struct task_struct *)data);
 }
 
+/*
+ * Save a checkpoint once writing has stopped for a while so that a valid
+ * checkpoint is nearly always on the device, even if we are never cleanly
+ * unmounted or synced. Skipped if gc has work to do: the checkpoint would
+ * just be invalidated again by the gc writes.
+ */
+static void yaffs_BackgroundCheckpoint(yaffs_Device *dev)
+{
+	struct super_block *sb = yaffs_DeviceToContext(dev)->superBlock;
+
+	yaffs_GrossLock(dev);
+	if(!dev->isCheckpointed &&
+	   !dev->readOnly &&
+	   !(sb->s_flags & MS_RDONLY) &&
+	   !dev->param.skipCheckpointWrite &&
+	   yaffs_bg_gc_urgency(dev) < 2){
+		T(YAFFS_TRACE_BACKGROUND | YAFFS_TRACE_CHECKPOINT,
+			(TSTR("yaffs_background checkpointing idle device\n")));
+		yaffs_FlushSuperBlock(sb, 1);
+		sb->s_dirt = 0;
+		if(dev->isCheckpointed)
+			dev->nBackgroundCheckpoints++;
+	}
+	yaffs_GrossUnlock(dev);
+}
+
 static int yaffs_BackgroundThread(void *data)
 {
 	yaffs_Device *dev = (yaffs_Device *)data;
@@ -2028,6 +2478,8 @@ static int yaffs_BackgroundThread(void *data)
 	unsigned long now = jiffies;
 	unsigned long next_dir_update = now;
 	unsigned long next_gc = now;
+	unsigned long last_write = now;
+	__u32 last_page_writes = dev->nPageWrites;
 	unsigned long expires;
 	unsigned int urgency;
 
@@ -2050,16 +2502,23 @@ static int yaffs_BackgroundThread(void *data)
 		if(try_to_freeze())
 			continue;
 
-		yaffs_GrossLock(dev);
-
 		now = jiffies;
 
+		yaffs_UpdateWriteRate(dev, now);
+
+		/*
+		 * Take the lock separately for the directory update and the
+		 * gc step so that waiting readers get in between the two.
+		 */
 		if(time_after(now, next_dir_update)){
+			yaffs_GrossLock(dev);
 			yaffs_UpdateDirtyDirectories(dev);
+			yaffs_GrossUnlock(dev);
 			next_dir_update = now + HZ;
 		}
 
 		if(time_after(now,next_gc)){
+			yaffs_GrossLock(dev);
 			if(!dev->isCheckpointed){
 				urgency = yaffs_bg_gc_urgency(dev);
 				gcResult = yaffs_BackgroundGarbageCollect(dev, urgency);
@@ -2074,8 +2533,22 @@ static int yaffs_BackgroundThread(void *data)
 				* to cut down on wake ups
 				*/
 				next_gc = next_dir_update;
+			yaffs_GrossUnlock(dev);
+		}
+
+		if(dev->nPageWrites != last_page_writes){
+			last_page_writes = dev->nPageWrites;
+			last_write = now;
+		} else if(yaffs_bg_checkpoint_idle &&
+			  !dev->isCheckpointed &&
+			  time_after(now, last_write +
+					yaffs_bg_checkpoint_idle * HZ)){
+			yaffs_BackgroundCheckpoint(dev);
+			/* Don't count our own writes, and don't retry
+			 * straight away if we could not checkpoint. */
+			last_page_writes = dev->nPageWrites;
+			last_write = now;
 		}
-		yaffs_GrossUnlock(dev);
 #if 1
 		expires = next_dir_update;
 		if (time_before(next_gc,expires))
@@ -2106,6 +2579,9 @@ static int yaffs_BackgroundStart(yaffs_Device *dev)
 	struct yaffs_LinuxContext *context = yaffs_DeviceToContext(dev);
 
 	context->bgRunning = 1;
+	context->writeRate = 0;
+	context->rateStamp = jiffies;
+	context->rateWrites = dev->nPageWrites - dev->nGCCopies;
 
 	context->bgThread = kthread_run(yaffs_BackgroundThread,
 	                        (void *)dev,"yaffs-bg");
@@ -2232,15 +2708,13 @@ static void yaffs_read_inode(struct inode *inode)
 	T(YAFFS_TRACE_OS,
 		(TSTR("yaffs_read_inode for %d\n"), (int)inode->i_ino));
 
-	if(current != yaffs_DeviceToContext(dev)->readdirProcess)
-		yaffs_GrossLock(dev);
+	yaffs_GrossLock(dev);
 
 	obj = yaffs_FindObjectByNumber(dev, inode->i_ino);
 
 	yaffs_FillInodeFromObject(inode, obj);
 
-	if(current != yaffs_DeviceToContext(dev)->readdirProcess)
-		yaffs_GrossUnlock(dev);
+	yaffs_GrossUnlock(dev);
 }
 
 #endif
@@ -2673,6 +3147,11 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 		    nandmtd2_ReadChunkWithTagsFromNAND;
 		param->markNANDBlockBad = nandmtd2_MarkNANDBlockBad;
 		param->queryNANDBlock = nandmtd2_QueryNANDBlock;
+#if YAFFS_USE_PARALLEL_SCAN
+		if (!param->inbandTags)
+			param->readBlocksTagsFromNAND =
+				yaffs_ReadBlocksTagsCallback;
+#endif
 		yaffs_DeviceToContext(dev)->spareBuffer = YMALLOC(mtd->oobsize);
 		param->isYaffs2 = 1;
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 17))
@@ -2731,9 +3210,14 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 
         /* Directory search handling...*/
         YINIT_LIST_HEAD(&(yaffs_DeviceToContext(dev)->searchContexts));
+	spin_lock_init(&(yaffs_DeviceToContext(dev)->searchContextsLock));
         param->removeObjectCallback = yaffs_RemoveObjectCallback;
 
-	init_MUTEX(&(yaffs_DeviceToContext(dev)->grossLock));
+	/* Read-only operations run concurrently under a shared gross lock */
+	init_rwsem(&(yaffs_DeviceToContext(dev)->grossLock));
+	mutex_init(&(yaffs_DeviceToContext(dev)->readStateLock));
+	param->lockReadState = yaffs_LockReadStateCallback;
+	param->unlockReadState = yaffs_UnlockReadStateCallback;
 
 	yaffs_GrossLock(dev);
 
@@ -2925,6 +3409,15 @@ static char *yaffs_dump_dev_part1(char *buf, yaffs_Device * dev)
 	buf += sprintf(buf, "passiveGCs......... %u\n", dev->passiveGCs);
 	buf += sprintf(buf, "oldestDirtyGCs..... %u\n", dev->oldestDirtyGCs);
 	buf += sprintf(buf, "backgroundGCs...... %u\n", dev->backgroundGCs);
+	buf += sprintf(buf, "foregroundGCs...... %u\n", dev->foregroundGCs);
+	buf += sprintf(buf, "fgGCTimeUs......... %llu\n",
+		(unsigned long long)dev->fgGCTimeUs);
+	buf += sprintf(buf, "fgGCMaxUs.......... %u\n", dev->fgGCMaxUs);
+	buf += sprintf(buf, "bgGCTimeUs......... %llu\n",
+		(unsigned long long)dev->bgGCTimeUs);
+	buf += sprintf(buf, "writeRate.......... %u\n",
+		yaffs_DeviceToContext(dev)->writeRate);
+	buf += sprintf(buf, "bgCheckpoints...... %u\n", dev->nBackgroundCheckpoints);
 	buf += sprintf(buf, "nRetriedWrites..... %u\n", dev->nRetriedWrites);
 	buf += sprintf(buf, "nRetireBlocks...... %u\n", dev->nRetiredBlocks);
 	buf += sprintf(buf, "eccFixed........... %u\n", dev->eccFixed);
@@ -2932,6 +3425,12 @@ static char *yaffs_dump_dev_part1(char *buf, yaffs_Device * dev)
 	buf += sprintf(buf, "tagsEccFixed....... %u\n", dev->tagsEccFixed);
 	buf += sprintf(buf, "tagsEccUnfixed..... %u\n", dev->tagsEccUnfixed);
 	buf += sprintf(buf, "cacheHits.......... %u\n", dev->cacheHits);
+	buf += sprintf(buf, "nObjectBuckets..... %u\n", dev->nObjectBuckets);
+	buf += sprintf(buf, "nHashedObjects..... %u\n", dev->nHashedObjects);
+	buf += sprintf(buf, "objectHashBytes.... %u\n",
+		(unsigned)(dev->nObjectBuckets * sizeof(yaffs_ObjectBucket)));
+	buf += sprintf(buf, "nDirIndexes........ %u\n", dev->nDirIndexes);
+	buf += sprintf(buf, "dirIndexBytes...... %u\n", dev->dirIndexBytes);
 	buf += sprintf(buf, "nDeletedFiles...... %u\n", dev->nDeletedFiles);
 	buf += sprintf(buf, "nUnlinkedFiles..... %u\n", dev->nUnlinkedFiles);
 	buf += sprintf(buf, "refreshCount....... %u\n", dev->refreshCount);
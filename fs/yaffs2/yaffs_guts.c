@@ -34,6 +34,9 @@
 #define YAFFS_GC_GOOD_ENOUGH 2
 #define YAFFS_GC_PASSIVE_THRESHOLD 4
 
+/* Cap on the block age used by the background gc cost-benefit */
+#define YAFFS_GC_MAX_AGE 1024
+
 #define YAFFS_SMALL_HOLE_THRESHOLD 3
 
 /*
@@ -78,6 +81,7 @@ static void yaffs_AddObjectToDirectory(yaffs_Object *directory,
 static int yaffs_UpdateObjectHeader(yaffs_Object *in, const YCHAR *name,
 				int force, int isShrink, int shadows);
 static void yaffs_RemoveObjectFromDirectory(yaffs_Object *obj);
+static void yaffs_FreeDirectoryIndex(yaffs_Object *dir);
 static int yaffs_CheckStructures(void);
 static int yaffs_DoGenericObjectDeletion(yaffs_Object *in);
 
@@ -223,10 +227,30 @@ static int yaffs_InitialiseTempBuffers(yaffs_Device *dev)
 	return buf ? YAFFS_OK : YAFFS_FAIL;
 }
 
+/*
+ * Read state locking.
+ * Read-only operations may run concurrently if the OS flavour says so.
+ * The little bits of device state they touch are serialised here.
+ * Nothing that takes this lock may call anything else that takes it.
+ */
+static void yaffs_LockReadState(yaffs_Device *dev)
+{
+	if (dev->param.lockReadState)
+		dev->param.lockReadState(dev);
+}
+
+static void yaffs_UnlockReadState(yaffs_Device *dev)
+{
+	if (dev->param.unlockReadState)
+		dev->param.unlockReadState(dev);
+}
+
 __u8 *yaffs_GetTempBuffer(yaffs_Device *dev, int lineNo)
 {
 	int i, j;
 
+	yaffs_LockReadState(dev);
+
 	dev->tempInUse++;
 	if (dev->tempInUse > dev->maxTemp)
 		dev->maxTemp = dev->tempInUse;
@@ -241,6 +265,7 @@ __u8 *yaffs_GetTempBuffer(yaffs_Device *dev, int lineNo)
 					    dev->tempBuffer[j].line;
 			}
 
+			yaffs_UnlockReadState(dev);
 			return dev->tempBuffer[i].buffer;
 		}
 	}
@@ -259,6 +284,7 @@ __u8 *yaffs_GetTempBuffer(yaffs_Device *dev, int lineNo)
 	 */
 
 	dev->unmanagedTempAllocations++;
+	yaffs_UnlockReadState(dev);
 	return YMALLOC(dev->nDataBytesPerChunk);
 
 }
@@ -268,15 +294,20 @@ void yaffs_ReleaseTempBuffer(yaffs_Device *dev, __u8 *buffer,
 {
 	int i;
 
+	yaffs_LockReadState(dev);
+
 	dev->tempInUse--;
 
 	for (i = 0; i < YAFFS_N_TEMP_BUFFERS; i++) {
 		if (dev->tempBuffer[i].buffer == buffer) {
 			dev->tempBuffer[i].line = 0;
+			yaffs_UnlockReadState(dev);
 			return;
 		}
 	}
 
+	yaffs_UnlockReadState(dev);
+
 	if (buffer) {
 		/* assume it is an unmanaged one. */
 		T(YAFFS_TRACE_BUFFERS,
@@ -854,7 +885,7 @@ static void yaffs_VerifyObjects(yaffs_Device *dev)
 
 	/* Iterate through the objects in each hash entry */
 
-	for (i = 0; i <  YAFFS_NOBJECT_BUCKETS; i++) {
+	for (i = 0; i < dev->nObjectBuckets; i++) {
 		ylist_for_each(lh, &dev->objectBucket[i].list) {
 			if (lh) {
 				obj = ylist_entry(lh, yaffs_Object, hashLink);
@@ -869,10 +900,10 @@ static void yaffs_VerifyObjects(yaffs_Device *dev)
  *  Simple hash function. Needs to have a reasonable spread
  */
 
-static Y_INLINE int yaffs_HashFunction(int n)
+static Y_INLINE int yaffs_HashFunction(yaffs_Device *dev, int n)
 {
 	n = abs(n);
-	return n % YAFFS_NOBJECT_BUCKETS;
+	return n & (dev->nObjectBuckets - 1);
 }
 
 /*
@@ -1203,6 +1234,8 @@ static void yaffs_HandleUpdateChunk(yaffs_Device *dev, int chunkInNAND,
 
 void yaffs_HandleChunkError(yaffs_Device *dev, yaffs_BlockInfo *bi)
 {
+	/* Also called from the read path */
+	yaffs_LockReadState(dev);
 	if (!bi->gcPrioritise) {
 		bi->gcPrioritise = 1;
 		dev->hasPendingPrioritisedGCs = 1;
@@ -1214,6 +1247,7 @@ void yaffs_HandleChunkError(yaffs_Device *dev, yaffs_BlockInfo *bi)
 
 		}
 	}
+	yaffs_UnlockReadState(dev);
 }
 
 static void yaffs_HandleWriteChunkError(yaffs_Device *dev, int chunkInNAND,
@@ -2099,6 +2133,7 @@ static yaffs_Object *yaffs_AllocateEmptyObject(yaffs_Device *dev)
 		YINIT_LIST_HEAD(&(tn->hardLinks));
 		YINIT_LIST_HEAD(&(tn->hashLink));
 		YINIT_LIST_HEAD(&tn->siblings);
+		YINIT_LIST_HEAD(&tn->nameLink);
 
 
 		/* Now make the directory sane */
@@ -2151,8 +2186,9 @@ static void yaffs_UnhashObject(yaffs_Object *tn)
 	/* If it is still linked into the bucket list, free from the list */
 	if (!ylist_empty(&tn->hashLink)) {
 		ylist_del_init(&tn->hashLink);
-		bucket = yaffs_HashFunction(tn->objectId);
+		bucket = yaffs_HashFunction(dev, tn->objectId);
 		dev->objectBucket[bucket].count--;
+		dev->nHashedObjects--;
 	}
 }
 
@@ -2170,6 +2206,8 @@ static void yaffs_FreeObject(yaffs_Object *tn)
 	if (!ylist_empty(&tn->siblings))
 		YBUG();
 
+	if (tn->variantType == YAFFS_OBJECT_TYPE_DIRECTORY)
+		yaffs_FreeDirectoryIndex(tn);
 
 	if (tn->myInode) {
 		/* We're still hooked up to a cached inode.
@@ -2207,6 +2245,23 @@ static void yaffs_DeinitialiseObjects(yaffs_Device *dev)
 	/* Free the list of allocated Objects */
 
 	yaffs_ObjectList *tmp;
+	struct ylist_head *lh;
+	yaffs_Object *obj;
+	int i;
+
+	/* Directory indexes and a grown hash table live outside the lists */
+	for (i = 0; i < dev->nObjectBuckets; i++) {
+		ylist_for_each(lh, &dev->objectBucket[i].list) {
+			obj = ylist_entry(lh, yaffs_Object, hashLink);
+			if (obj->variantType == YAFFS_OBJECT_TYPE_DIRECTORY)
+				yaffs_FreeDirectoryIndex(obj);
+		}
+	}
+
+	if (dev->objectBucket != dev->initialObjectBucket)
+		YFREE_ALT(dev->objectBucket);
+	dev->objectBucket = dev->initialObjectBucket;
+	dev->nObjectBuckets = YAFFS_NOBJECT_BUCKETS;
 
 	while (dev->allocatedObjectList) {
 		tmp = dev->allocatedObjectList->next;
@@ -2229,12 +2284,64 @@ static void yaffs_InitialiseObjects(yaffs_Device *dev)
 	dev->freeObjects = NULL;
 	dev->nFreeObjects = 0;
 
-	for (i = 0; i < YAFFS_NOBJECT_BUCKETS; i++) {
+	dev->objectBucket = dev->initialObjectBucket;
+	dev->nObjectBuckets = YAFFS_NOBJECT_BUCKETS;
+	dev->nHashedObjects = 0;
+
+	for (i = 0; i < dev->nObjectBuckets; i++) {
 		YINIT_LIST_HEAD(&dev->objectBucket[i].list);
 		dev->objectBucket[i].count = 0;
 	}
 }
 
+/*
+ * Double the number of object hash buckets, rehashing everything.
+ * If the bigger table can't be had we just live with longer chains.
+ */
+static void yaffs_GrowObjectHash(yaffs_Device *dev)
+{
+	yaffs_ObjectBucket *oldBucket = dev->objectBucket;
+	yaffs_ObjectBucket *newBucket;
+	__u32 oldN = dev->nObjectBuckets;
+	__u32 newN = oldN * 2;
+	struct ylist_head *lh;
+	struct ylist_head *n;
+	yaffs_Object *obj;
+	int bucket;
+	int i;
+
+	if (newN > YAFFS_MAX_OBJECT_BUCKETS)
+		return;
+
+	newBucket = YMALLOC_ALT(newN * sizeof(yaffs_ObjectBucket));
+	if (!newBucket)
+		return;
+
+	for (i = 0; i < newN; i++) {
+		YINIT_LIST_HEAD(&newBucket[i].list);
+		newBucket[i].count = 0;
+	}
+
+	dev->objectBucket = newBucket;
+	dev->nObjectBuckets = newN;
+
+	for (i = 0; i < oldN; i++) {
+		ylist_for_each_safe(lh, n, &oldBucket[i].list) {
+			obj = ylist_entry(lh, yaffs_Object, hashLink);
+			bucket = yaffs_HashFunction(dev, obj->objectId);
+			ylist_del(lh);
+			ylist_add(lh, &newBucket[bucket].list);
+			newBucket[bucket].count++;
+		}
+	}
+
+	if (oldBucket != dev->initialObjectBucket)
+		YFREE_ALT(oldBucket);
+
+	T(YAFFS_TRACE_OS, (TSTR("yaffs: object hash grown to %d buckets" TENDSTR),
+		newN));
+}
+
 static int yaffs_FindNiceObjectBucket(yaffs_Device *dev)
 {
 	int i;
@@ -2248,7 +2355,7 @@ static int yaffs_FindNiceObjectBucket(yaffs_Device *dev)
 
 	for (i = 0; i < 10 && lowest > 4; i++) {
 		dev->bucketFinder++;
-		dev->bucketFinder %= YAFFS_NOBJECT_BUCKETS;
+		dev->bucketFinder %= dev->nObjectBuckets;
 		if (dev->objectBucket[dev->bucketFinder].count < lowest) {
 			lowest = dev->objectBucket[dev->bucketFinder].count;
 			l = dev->bucketFinder;
@@ -2276,7 +2383,7 @@ static int yaffs_CreateNewObjectNumber(yaffs_Device *dev)
 
 	while (!found) {
 		found = 1;
-		n += YAFFS_NOBJECT_BUCKETS;
+		n += dev->nObjectBuckets;
 		if (1 || dev->objectBucket[bucket].count > 0) {
 			ylist_for_each(i, &dev->objectBucket[bucket].list) {
 				/* If there is already one in the list */
@@ -2293,16 +2400,22 @@ static int yaffs_CreateNewObjectNumber(yaffs_Device *dev)
 
 static void yaffs_HashObject(yaffs_Object *in)
 {
-	int bucket = yaffs_HashFunction(in->objectId);
 	yaffs_Device *dev = in->myDev;
+	int bucket;
+
+	if (dev->nHashedObjects >= dev->nObjectBuckets * YAFFS_OBJECT_BUCKET_LOAD)
+		yaffs_GrowObjectHash(dev);
+
+	bucket = yaffs_HashFunction(dev, in->objectId);
 
 	ylist_add(&in->hashLink, &dev->objectBucket[bucket].list);
 	dev->objectBucket[bucket].count++;
+	dev->nHashedObjects++;
 }
 
 yaffs_Object *yaffs_FindObjectByNumber(yaffs_Device *dev, __u32 number)
 {
-	int bucket = yaffs_HashFunction(number);
+	int bucket = yaffs_HashFunction(dev, number);
 	struct ylist_head *i;
 	yaffs_Object *in;
 
@@ -3376,14 +3489,39 @@ static int yaffs_GarbageCollectBlock(yaffs_Device *dev, int block,
 	return retVal;
 }
 
+/*
+ * Background gc is not in a hurry, so it chooses victims by cost-benefit
+ * rather than by dirtiness alone: the space gained times the age of the
+ * block, over the cost of copying out its live chunks. Old blocks hold
+ * cold data that is unlikely to be rewritten soon, so they are worth
+ * collecting even when a little less dirty than a young block.
+ */
+static __u32 yaffs_GCCostBenefit(yaffs_Device *dev, yaffs_BlockInfo *bi)
+{
+	__u32 nChunks = dev->param.nChunksPerBlock;
+	__u32 used = bi->pagesInUse - bi->softDeletions;
+	__u32 age = 1;
+
+	if (used > nChunks)
+		used = nChunks;
+	if (dev->param.isYaffs2 && dev->sequenceNumber > bi->sequenceNumber)
+		age += dev->sequenceNumber - bi->sequenceNumber;
+	if (age > YAFFS_GC_MAX_AGE)
+		age = YAFFS_GC_MAX_AGE;
+
+	return ((nChunks - used) * age * 64) / (nChunks + used);
+}
+
 /*
  * FindBlockForgarbageCollection is used to select the dirtiest block (or close enough)
- * for garbage collection.
+ * for garbage collection. Background gc uses cost-benefit instead and
+ * accepts less dirty blocks as the urgency rises.
  */
 
 static unsigned yaffs_FindBlockForGarbageCollection(yaffs_Device *dev,
 					int aggressive,
-					int background)
+					int background,
+					unsigned urgency)
 {
 	int i;
 	int iterations;
@@ -3442,7 +3580,7 @@ static unsigned yaffs_FindBlockForGarbageCollection(yaffs_Device *dev,
 		} else {
 			int maxThreshold = dev->param.nChunksPerBlock/2;
 			threshold = background ?
-				(dev->gcNotDone + 2) * 2 : 0;
+				(dev->gcNotDone + 2) * 2 * (urgency + 1) : 0;
 			if(threshold <YAFFS_GC_PASSIVE_THRESHOLD)
 				threshold = YAFFS_GC_PASSIVE_THRESHOLD;
 			if(threshold > maxThreshold)
@@ -3467,10 +3605,23 @@ static unsigned yaffs_FindBlockForGarbageCollection(yaffs_Device *dev,
 
 			pagesUsed = bi->pagesInUse - bi->softDeletions;
 
-			if (bi->blockState == YAFFS_BLOCK_STATE_FULL &&
-				pagesUsed < dev->param.nChunksPerBlock &&
-				(dev->gcDirtiest < 1 || pagesUsed < dev->gcPagesInUse) &&
-				yaffs_BlockNotDisqualifiedFromGC(dev, bi)) {
+			if (bi->blockState != YAFFS_BLOCK_STATE_FULL ||
+				pagesUsed >= dev->param.nChunksPerBlock)
+				continue;
+
+			if (background && !aggressive) {
+				if (pagesUsed > threshold ||
+					(dev->gcDirtiest > 0 &&
+					 dev->gcPagesInUse <= threshold &&
+					 yaffs_GCCostBenefit(dev, bi) <=
+					 yaffs_GCCostBenefit(dev,
+						yaffs_GetBlockInfo(dev, dev->gcDirtiest))))
+					continue;
+			} else if (dev->gcDirtiest > 0 &&
+					pagesUsed >= dev->gcPagesInUse)
+				continue;
+
+			if (yaffs_BlockNotDisqualifiedFromGC(dev, bi)) {
 				dev->gcDirtiest = dev->gcBlockFinder;
 				dev->gcPagesInUse = pagesUsed;
 			}
@@ -3507,6 +3658,8 @@ static unsigned yaffs_FindBlockForGarbageCollection(yaffs_Device *dev,
 
 		if(background)
 			dev->backgroundGCs++;
+		else
+			dev->foregroundGCs++;
 		dev->gcDirtiest = 0;
 		dev->gcPagesInUse = 0;
 		dev->gcNotDone = 0;
@@ -3535,11 +3688,15 @@ static unsigned yaffs_FindBlockForGarbageCollection(yaffs_Device *dev,
  * The idea is to help clear out space in a more spread-out manner.
  * Dunno if it really does anything useful.
  */
-static int yaffs_CheckGarbageCollection(yaffs_Device *dev, int background)
+static int yaffs_CheckGarbageCollection(yaffs_Device *dev, int background,
+					unsigned urgency)
 {
 	int aggressive = 0;
 	int gcOk = YAFFS_OK;
 	int maxTries = 0;
+	int gcDone = 0;
+	__u32 gcStart = 0;
+	__u32 gcTime;
 
 	int minErased;
 	int erasedChunks;
@@ -3594,11 +3751,15 @@ static int yaffs_CheckGarbageCollection(yaffs_Device *dev, int background)
 			dev->gcChunk = 0;
 		}
 		if (dev->gcBlock < 1) {
-			dev->gcBlock = yaffs_FindBlockForGarbageCollection(dev, aggressive, background);
+			dev->gcBlock = yaffs_FindBlockForGarbageCollection(dev,
+						aggressive, background, urgency);
 			dev->gcChunk = 0;
 		}
 
 		if (dev->gcBlock > 0) {
+			if (!gcDone)
+				gcStart = Y_TIME_US();
+			gcDone = 1;
 			dev->allGCs++;
 			if (!aggressive)
 				dev->passiveGCs++;
@@ -3621,6 +3782,18 @@ static int yaffs_CheckGarbageCollection(yaffs_Device *dev, int background)
 		 (dev->gcBlock > 0) &&
 		 (maxTries < 2));
 
+	/* Account for the time that gc held up the caller */
+	if (gcDone) {
+		gcTime = Y_TIME_US() - gcStart;
+		if (background) {
+			dev->bgGCTimeUs += gcTime;
+		} else {
+			dev->fgGCTimeUs += gcTime;
+			if (gcTime > dev->fgGCMaxUs)
+				dev->fgGCMaxUs = gcTime;
+		}
+	}
+
 	return aggressive ? gcOk : YAFFS_OK;
 }
 
@@ -3635,7 +3808,7 @@ int yaffs_BackgroundGarbageCollect(yaffs_Device *dev, unsigned urgency)
 
 	T(YAFFS_TRACE_BACKGROUND, (TSTR("Background gc %u" TENDSTR),urgency));
 
-	yaffs_CheckGarbageCollection(dev, 1);
+	yaffs_CheckGarbageCollection(dev, 1, urgency);
 	return erasedChunks > dev->nFreeChunks/2;
 }
 
@@ -4001,7 +4174,7 @@ static int yaffs_WriteChunkDataToObject(yaffs_Object *in, int chunkInInode,
 
 	yaffs_Device *dev = in->myDev;
 
-	yaffs_CheckGarbageCollection(dev,0);
+	yaffs_CheckGarbageCollection(dev, 0, 0);
 
 	/* Get the previous chunk at this location in the file if it exists.
 	 * If it does not exist then put a zero into the tree. This creates
@@ -4076,7 +4249,7 @@ int yaffs_UpdateObjectHeader(yaffs_Object *in, const YCHAR *name, int force,
 		in == dev->rootDir || /* The rootDir should also be saved */
 		force) {
 
-		yaffs_CheckGarbageCollection(dev,0);
+		yaffs_CheckGarbageCollection(dev, 0, 0);
 		yaffs_CheckObjectDetailsLoaded(in);
 
 		buffer = yaffs_GetTempBuffer(in->myDev, __LINE__);
@@ -4780,7 +4953,7 @@ static int yaffs_WriteCheckpointObjects(yaffs_Device *dev)
 	 * dumping them to the checkpointing stream.
 	 */
 
-	for (i = 0; ok &&  i <  YAFFS_NOBJECT_BUCKETS; i++) {
+	for (i = 0; ok && i < dev->nObjectBuckets; i++) {
 		ylist_for_each(lh, &dev->objectBucket[i].list) {
 			if (lh) {
 				obj = ylist_entry(lh, yaffs_Object, hashLink);
@@ -5029,6 +5202,41 @@ int yaffs_CheckpointRestore(yaffs_Device *dev)
 	return retval;
 }
 
+/*
+ * Read part or all of a chunk when other reads may be running at the same
+ * time. A cache hit is copied out, but the cache is never filled since that
+ * could mean flushing dirty data, which is a write.
+ */
+static void yaffs_ReadChunkShared(yaffs_Object *in, int chunk, __u32 start,
+				int nToCopy, __u8 *buffer)
+{
+	yaffs_Device *dev = in->myDev;
+	yaffs_ChunkCache *cache;
+	__u8 *localBuffer;
+
+	yaffs_LockReadState(dev);
+	cache = yaffs_FindChunkCache(in, chunk);
+	if (cache) {
+		yaffs_UseChunkCache(dev, cache, 0);
+		memcpy(buffer, &cache->data[start], nToCopy);
+	}
+	yaffs_UnlockReadState(dev);
+
+	if (cache)
+		return;
+
+	if (nToCopy == dev->nDataBytesPerChunk && !dev->param.inbandTags) {
+		/* A full chunk. Read directly into the supplied buffer. */
+		yaffs_ReadChunkDataFromObject(in, chunk, buffer);
+		return;
+	}
+
+	localBuffer = yaffs_GetTempBuffer(dev, __LINE__);
+	yaffs_ReadChunkDataFromObject(in, chunk, localBuffer);
+	memcpy(buffer, &localBuffer[start], nToCopy);
+	yaffs_ReleaseTempBuffer(dev, localBuffer, __LINE__);
+}
+
 /*--------------------- File read/write ------------------------
  * Read and write have very similar structures.
  * In general the read/write has three parts to it
@@ -5068,57 +5276,61 @@ int yaffs_ReadDataFromFile(yaffs_Object *in, __u8 *buffer, loff_t offset,
 		else
 			nToCopy = dev->nDataBytesPerChunk - start;
 
-		cache = yaffs_FindChunkCache(in, chunk);
+		if (dev->param.lockReadState) {
+			yaffs_ReadChunkShared(in, chunk, start, nToCopy, buffer);
+		} else {
+			cache = yaffs_FindChunkCache(in, chunk);
 
-		/* If the chunk is already in the cache or it is less than a whole chunk
-		 * or we're using inband tags then use the cache (if there is caching)
-		 * else bypass the cache.
-		 */
-		if (cache || nToCopy != dev->nDataBytesPerChunk || dev->param.inbandTags) {
-			if (dev->param.nShortOpCaches > 0) {
+			/* If the chunk is already in the cache or it is less than a whole chunk
+			 * or we're using inband tags then use the cache (if there is caching)
+			 * else bypass the cache.
+			 */
+			if (cache || nToCopy != dev->nDataBytesPerChunk || dev->param.inbandTags) {
+				if (dev->param.nShortOpCaches > 0) {
 
-				/* If we can't find the data in the cache, then load it up. */
+					/* If we can't find the data in the cache, then load it up. */
 
-				if (!cache) {
-					cache = yaffs_GrabChunkCache(in->myDev);
-					cache->object = in;
-					cache->chunkId = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
-					yaffs_ReadChunkDataFromObject(in, chunk,
-								      cache->
-								      data);
-					cache->nBytes = 0;
-				}
+					if (!cache) {
+						cache = yaffs_GrabChunkCache(in->myDev);
+						cache->object = in;
+						cache->chunkId = chunk;
+						cache->dirty = 0;
+						cache->locked = 0;
+						yaffs_ReadChunkDataFromObject(in, chunk,
+									      cache->
+									      data);
+						cache->nBytes = 0;
+					}
 
-				yaffs_UseChunkCache(dev, cache, 0);
+					yaffs_UseChunkCache(dev, cache, 0);
 
-				cache->locked = 1;
+					cache->locked = 1;
 
 
-				memcpy(buffer, &cache->data[start], nToCopy);
+					memcpy(buffer, &cache->data[start], nToCopy);
 
-				cache->locked = 0;
-			} else {
-				/* Read into the local buffer then copy..*/
+					cache->locked = 0;
+				} else {
+					/* Read into the local buffer then copy..*/
 
-				__u8 *localBuffer =
-				    yaffs_GetTempBuffer(dev, __LINE__);
-				yaffs_ReadChunkDataFromObject(in, chunk,
-							      localBuffer);
+					__u8 *localBuffer =
+					    yaffs_GetTempBuffer(dev, __LINE__);
+					yaffs_ReadChunkDataFromObject(in, chunk,
+								      localBuffer);
 
-				memcpy(buffer, &localBuffer[start], nToCopy);
+					memcpy(buffer, &localBuffer[start], nToCopy);
 
 
-				yaffs_ReleaseTempBuffer(dev, localBuffer,
-							__LINE__);
-			}
+					yaffs_ReleaseTempBuffer(dev, localBuffer,
+								__LINE__);
+				}
 
-		} else {
+			} else {
 
-			/* A full chunk. Read directly into the supplied buffer. */
-			yaffs_ReadChunkDataFromObject(in, chunk, buffer);
+				/* A full chunk. Read directly into the supplied buffer. */
+				yaffs_ReadChunkDataFromObject(in, chunk, buffer);
 
+			}
 		}
 
 		n -= nToCopy;
@@ -5131,6 +5343,122 @@ int yaffs_ReadDataFromFile(yaffs_Object *in, __u8 *buffer, loff_t offset,
 	return nDone;
 }
 
+/*
+ * yaffs_FindChunksInFile() resolves nChunks consecutive chunks of a file,
+ * starting at chunkInInode, to their NAND chunks (-1 for a hole).
+ * The tree is only walked once for each level 0 tnode, rather than once
+ * for every chunk.
+ */
+static void yaffs_FindChunksInFile(yaffs_Object *in, int chunkInInode,
+				int nChunks, int *chunks)
+{
+	yaffs_Device *dev = in->myDev;
+	yaffs_ExtendedTags tags;
+	yaffs_Tnode *tn = NULL;
+	int lastGroup = -1;
+	int chunkId;
+	int i;
+
+	for (i = 0; i < nChunks; i++) {
+		chunkId = chunkInInode + i;
+
+		if ((chunkId >> YAFFS_TNODES_LEVEL0_BITS) != lastGroup) {
+			lastGroup = chunkId >> YAFFS_TNODES_LEVEL0_BITS;
+			tn = yaffs_FindLevel0Tnode(dev,
+						&in->variant.fileVariant,
+						chunkId);
+		}
+
+		if (tn)
+			chunks[i] = yaffs_FindChunkInGroup(dev,
+					yaffs_GetChunkGroupBase(dev, tn, chunkId),
+					&tags, in->objectId, chunkId);
+		else
+			chunks[i] = -1;
+	}
+}
+
+/*
+ * yaffs_ReadPagesFromFile() reads nBuffers consecutive pieces of a file,
+ * each bufferSize bytes long, starting at offset.
+ *
+ * When the pieces are whole chunks the chunk locations for a run are
+ * resolved in one pass over the tnode tree and then read back to back
+ * without going through the short op cache (a cache hit still wins since
+ * it may hold data not yet written out). Anything else falls back to
+ * yaffs_ReadDataFromFile() one buffer at a time.
+ *
+ * Returns the number of bytes read.
+ */
+int yaffs_ReadPagesFromFile(yaffs_Object *in, __u8 **buffers, int nBuffers,
+			int bufferSize, loff_t offset)
+{
+	yaffs_Device *dev = in->myDev;
+	int chunks[YAFFS_READ_BATCH_CHUNKS];
+	yaffs_ChunkCache *cache;
+	int chunksPerBuffer;
+	int nChunks;
+	int chunk;
+	__u32 start;
+	__u8 *dest;
+	int nDone = 0;
+	int done;
+	int n;
+	int i;
+
+	yaffs_AddrToChunk(dev, offset, &chunk, &start);
+
+	if (start || dev->param.inbandTags ||
+	    bufferSize < dev->nDataBytesPerChunk ||
+	    bufferSize % dev->nDataBytesPerChunk) {
+		for (i = 0; i < nBuffers; i++) {
+			nDone += yaffs_ReadDataFromFile(in, buffers[i],
+					offset, bufferSize);
+			offset += bufferSize;
+		}
+		return nDone;
+	}
+
+	chunk++;
+	chunksPerBuffer = bufferSize / dev->nDataBytesPerChunk;
+	nChunks = nBuffers * chunksPerBuffer;
+
+	for (done = 0; done < nChunks; done += n) {
+		n = nChunks - done;
+		if (n > YAFFS_READ_BATCH_CHUNKS)
+			n = YAFFS_READ_BATCH_CHUNKS;
+
+		yaffs_FindChunksInFile(in, chunk + done, n, chunks);
+
+		for (i = 0; i < n; i++) {
+			dest = buffers[(done + i) / chunksPerBuffer] +
+				((done + i) % chunksPerBuffer) *
+				dev->nDataBytesPerChunk;
+
+			yaffs_LockReadState(dev);
+			cache = yaffs_FindChunkCache(in, chunk + done + i);
+			if (cache) {
+				yaffs_UseChunkCache(dev, cache, 0);
+				memcpy(dest, cache->data,
+					dev->nDataBytesPerChunk);
+			}
+			yaffs_UnlockReadState(dev);
+
+			if (!cache) {
+				if (chunks[i] >= 0)
+					yaffs_ReadChunkWithTagsFromNAND(dev,
+						chunks[i], dest, NULL);
+				else /* a hole reads as zeros */
+					memset(dest, 0, dev->nDataBytesPerChunk);
+			}
+
+			nDone += dev->nDataBytesPerChunk;
+		}
+	}
+
+	return nDone;
+}
+
 int yaffs_DoWriteDataToFile(yaffs_Object *in, const __u8 *buffer, loff_t offset,
 			int nBytes, int writeThrough)
 {
@@ -5484,7 +5812,7 @@ int yaffs_ResizeFile(yaffs_Object *in, loff_t newSize)
 	yaffs_FlushFilesChunkCache(in);
 	yaffs_InvalidateWholeChunkCache(in);
 
-	yaffs_CheckGarbageCollection(dev,0);
+	yaffs_CheckGarbageCollection(dev, 0, 0);
 
 	if (in->variantType != YAFFS_OBJECT_TYPE_FILE)
 		return YAFFS_FAIL;
@@ -5976,7 +6304,7 @@ static void yaffs_FixHangingObjects(yaffs_Device *dev)
 	 * Make sure it is rooted.
 	 */
 
-	for (i = 0; i <  YAFFS_NOBJECT_BUCKETS; i++) {
+	for (i = 0; i < dev->nObjectBuckets; i++) {
 		ylist_for_each_safe(lh, n, &dev->objectBucket[i].list) {
 			if (lh) {
 				obj = ylist_entry(lh, yaffs_Object, hashLink);
@@ -6503,6 +6831,7 @@ static void yaffs_CheckObjectDetailsLoaded(yaffs_Object *in)
 	yaffs_ExtendedTags tags;
 	int result;
 	int alloc_failed = 0;
+	int needLoad;
 
 	if (!in)
 		return;
@@ -6515,13 +6844,22 @@ static void yaffs_CheckObjectDetailsLoaded(yaffs_Object *in)
 		in->lazyLoaded ? "not yet" : "already"));
 #endif
 
-	if (in->lazyLoaded && in->hdrChunk > 0) {
-		in->lazyLoaded = 0;
+	yaffs_LockReadState(dev);
+	needLoad = (in->lazyLoaded && in->hdrChunk > 0);
+	yaffs_UnlockReadState(dev);
+
+	if (needLoad) {
 		chunkData = yaffs_GetTempBuffer(dev, __LINE__);
 
 		result = yaffs_ReadChunkWithTagsFromNAND(dev, in->hdrChunk, chunkData, &tags);
 		oh = (yaffs_ObjectHeader *) chunkData;
 
+		/* Concurrent readers may have raced us to load this one */
+		yaffs_LockReadState(dev);
+		if (!in->lazyLoaded)
+			goto unlock;
+		in->lazyLoaded = 0;
+
 		in->yst_mode = oh->yst_mode;
 #ifdef CONFIG_YAFFS_WINCE
 		in->win_atime[0] = oh->win_atime[0];
@@ -6547,6 +6885,8 @@ static void yaffs_CheckObjectDetailsLoaded(yaffs_Object *in)
 			if (!in->variant.symLinkVariant.alias)
 				alloc_failed = 1; /* Not returned to caller */
 		}
+unlock:
+		yaffs_UnlockReadState(dev);
 
 		yaffs_ReleaseTempBuffer(dev, chunkData, __LINE__);
 	}
@@ -6586,6 +6926,15 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 	yaffs_BlockIndex *blockIndex = NULL;
 	int altBlockIndex = 0;
 
+	/* Tags are read a batch of blocks at a time, ahead of processing */
+	yaffs_ExtendedTags *batchTags = NULL;
+	yaffs_ExtendedTags *blockTags = NULL;
+	int batchBlocks[YAFFS_SCAN_BATCH_BLOCKS];
+	int batchFirst = 0;
+	int batchEnd;
+	int nBatch;
+	int i;
+
 	if (!dev->param.isYaffs2) {
 		T(YAFFS_TRACE_SCAN,
 		  (TSTR("yaffs_ScanBackwards is only for YAFFS2!" TENDSTR)));
@@ -6716,6 +7065,11 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 	T(YAFFS_TRACE_SCAN_DEBUG,
 	  (TSTR("%d blocks to be scanned" TENDSTR), nBlocksToScan));
 
+	batchTags = YMALLOC_ALT(YAFFS_SCAN_BATCH_BLOCKS *
+				dev->param.nChunksPerBlock *
+				sizeof(yaffs_ExtendedTags));
+	batchEnd = endIterator + 1;
+
 	/* For each block.... backwards */
 	for (blockIterator = endIterator; !alloc_failed && blockIterator >= startIterator;
 			blockIterator--) {
@@ -6726,6 +7080,25 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 		/* get the block to scan in the correct order */
 		blk = blockIndex[blockIterator].block;
 
+		/* Fetch the tags for the next batch of blocks.
+		 * Without a batch buffer we read them a chunk at a time.
+		 */
+		if (batchTags && blockIterator < batchEnd) {
+			nBatch = blockIterator - startIterator + 1;
+			if (nBatch > YAFFS_SCAN_BATCH_BLOCKS)
+				nBatch = YAFFS_SCAN_BATCH_BLOCKS;
+			for (i = 0; i < nBatch; i++)
+				batchBlocks[i] =
+					blockIndex[blockIterator - i].block;
+			yaffs_ReadBlocksTagsFromNAND(dev, batchBlocks, nBatch,
+							batchTags);
+			batchFirst = blockIterator;
+			batchEnd = blockIterator - nBatch + 1;
+		}
+		if (batchTags)
+			blockTags = &batchTags[(batchFirst - blockIterator) *
+						dev->param.nChunksPerBlock];
+
 		bi = yaffs_GetBlockInfo(dev, blk);
 
 
@@ -6745,8 +7118,11 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 
 			chunk = blk * dev->param.nChunksPerBlock + c;
 
-			result = yaffs_ReadChunkWithTagsFromNAND(dev, chunk, NULL,
-							&tags);
+			if (blockTags)
+				tags = blockTags[c];
+			else
+				result = yaffs_ReadChunkWithTagsFromNAND(dev,
+							chunk, NULL, &tags);
 
 			/* Let's have a good look at this chunk... */
 
@@ -7177,6 +7553,9 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 	
 	yaffs_SkipRestOfBlock(dev);
 
+	if (batchTags)
+		YFREE_ALT(batchTags);
+
 	if (altBlockIndex)
 		YFREE_ALT(blockIndex);
 	else
@@ -7339,6 +7718,96 @@ void yaffs_UpdateDirtyDirectories(yaffs_Device *dev)
 	}
 }
 
+/*
+ * Directory name indexes.
+ * Without one, yaffs_FindObjectByName() compares against every child.
+ * Directories with more than YAFFS_DIR_INDEX_THRESHOLD children get their
+ * children hashed by name sum the first time they are searched. The index
+ * is kept up to date as children come and go, and is simply thrown away
+ * when that can't be done cheaply; the next search rebuilds it.
+ *
+ * Only exclusive operations modify an index. The one exception is
+ * building it, which readers may do, so building and publishing the
+ * index pointer happen under the read state lock.
+ */
+
+static int yaffs_DirectoryIndexSize(int nBuckets)
+{
+	return sizeof(yaffs_DirectoryIndex) +
+		(nBuckets - 1) * sizeof(struct ylist_head);
+}
+
+static void yaffs_IndexObject(yaffs_DirectoryIndex *index, yaffs_Object *obj)
+{
+	ylist_add(&obj->nameLink, &index->bucket[obj->sum & (index->nBuckets - 1)]);
+	index->nEntries++;
+}
+
+static void yaffs_FreeDirectoryIndex(yaffs_Object *dir)
+{
+	yaffs_Device *dev = dir->myDev;
+	yaffs_DirectoryIndex *index = dir->variant.directoryVariant.index;
+	int i;
+
+	if (!index)
+		return;
+
+	for (i = 0; i < index->nBuckets; i++)
+		while (!ylist_empty(&index->bucket[i]))
+			ylist_del_init(index->bucket[i].next);
+
+	dir->variant.directoryVariant.index = NULL;
+	dev->nDirIndexes--;
+	dev->dirIndexBytes -= yaffs_DirectoryIndexSize(index->nBuckets);
+	YFREE(index);
+}
+
+static void yaffs_BuildDirectoryIndex(yaffs_Object *dir, int nChildren)
+{
+	yaffs_Device *dev = dir->myDev;
+	yaffs_DirectoryIndex *index;
+	struct ylist_head *i;
+	yaffs_Object *l;
+	int nBuckets = 1;
+	int b;
+
+	while (nBuckets < nChildren && nBuckets < YAFFS_DIR_INDEX_MAX_BUCKETS)
+		nBuckets <<= 1;
+
+	/* Every child needs a valid name sum */
+	ylist_for_each(i, &dir->variant.directoryVariant.children)
+		yaffs_CheckObjectDetailsLoaded(ylist_entry(i, yaffs_Object, siblings));
+
+	yaffs_LockReadState(dev);
+
+	if (dir->variant.directoryVariant.index)
+		goto out; /* Someone else got there first */
+
+	index = YMALLOC(yaffs_DirectoryIndexSize(nBuckets));
+	if (!index)
+		goto out;
+
+	index->nBuckets = nBuckets;
+	index->nEntries = 0;
+	for (b = 0; b < nBuckets; b++)
+		YINIT_LIST_HEAD(&index->bucket[b]);
+
+	ylist_for_each(i, &dir->variant.directoryVariant.children) {
+		l = ylist_entry(i, yaffs_Object, siblings);
+		yaffs_IndexObject(index, l);
+	}
+
+	dir->variant.directoryVariant.index = index;
+	dev->nDirIndexes++;
+	dev->dirIndexBytes += yaffs_DirectoryIndexSize(nBuckets);
+
+	T(YAFFS_TRACE_OS,
+	  (TSTR("yaffs: indexed directory %d, %d children %d buckets" TENDSTR),
+	   dir->objectId, nChildren, nBuckets));
+out:
+	yaffs_UnlockReadState(dev);
+}
+
 static void yaffs_RemoveObjectFromDirectory(yaffs_Object *obj)
 {
 	yaffs_Device *dev = obj->myDev;
@@ -7355,6 +7824,11 @@ static void yaffs_RemoveObjectFromDirectory(yaffs_Object *obj)
 
 	ylist_del_init(&obj->siblings);
 	obj->parent = NULL;
+
+	if (!ylist_empty(&obj->nameLink)) {
+		ylist_del_init(&obj->nameLink);
+		parent->variant.directoryVariant.index->nEntries--;
+	}
 	
 	yaffs_VerifyDirectory(parent);
 }
@@ -7362,6 +7836,8 @@ static void yaffs_RemoveObjectFromDirectory(yaffs_Object *obj)
 static void yaffs_AddObjectToDirectory(yaffs_Object *directory,
 					yaffs_Object *obj)
 {
+	yaffs_DirectoryIndex *index;
+
 	if (!directory) {
 		T(YAFFS_TRACE_ALWAYS,
 		  (TSTR
@@ -7393,6 +7869,17 @@ static void yaffs_AddObjectToDirectory(yaffs_Object *directory,
 	ylist_add(&obj->siblings, &directory->variant.directoryVariant.children);
 	obj->parent = directory;
 
+	index = directory->variant.directoryVariant.index;
+	if (index) {
+		/* Can't index a name we don't know yet, or an overloaded index */
+		if (obj->lazyLoaded ||
+		    (index->nBuckets < YAFFS_DIR_INDEX_MAX_BUCKETS &&
+		     index->nEntries >= index->nBuckets * YAFFS_OBJECT_BUCKET_LOAD))
+			yaffs_FreeDirectoryIndex(directory);
+		else
+			yaffs_IndexObject(index, obj);
+	}
+
 	if (directory == obj->myDev->unlinkedDir
 			|| directory == obj->myDev->deletedDir) {
 		obj->unlinked = 1;
@@ -7413,6 +7900,9 @@ yaffs_Object *yaffs_FindObjectByName(yaffs_Object *directory,
 	YCHAR buffer[YAFFS_MAX_NAME_LENGTH + 1];
 
 	yaffs_Object *l;
+	yaffs_Object *found = NULL;
+	yaffs_DirectoryIndex *index;
+	int nSearched = 0;
 
 	if (!name)
 		return NULL;
@@ -7434,10 +7924,37 @@ yaffs_Object *yaffs_FindObjectByName(yaffs_Object *directory,
 
 	sum = yaffs_CalcNameSum(name);
 
+	yaffs_LockReadState(directory->myDev);
+	index = directory->variant.directoryVariant.index;
+	yaffs_UnlockReadState(directory->myDev);
+
+	/* Objects without a header answer to a made up name that isn't
+	 * covered by its sum, so those names always take the long way.
+	 */
+	if (index &&
+	    yaffs_strcmp(name, YAFFS_LOSTNFOUND_NAME) != 0 &&
+	    yaffs_strncmp(name, YAFFS_LOSTNFOUND_PREFIX,
+			yaffs_strnlen(YAFFS_LOSTNFOUND_PREFIX,
+				YAFFS_MAX_NAME_LENGTH)) != 0) {
+		ylist_for_each(i, &index->bucket[sum & (index->nBuckets - 1)]) {
+			l = ylist_entry(i, yaffs_Object, nameLink);
+			if (yaffs_SumCompare(l->sum, sum) &&
+			    l->objectId != YAFFS_OBJECTID_LOSTNFOUND) {
+				yaffs_GetObjectName(l, buffer,
+						    YAFFS_MAX_NAME_LENGTH + 1);
+				if (yaffs_strncmp(name, buffer, YAFFS_MAX_NAME_LENGTH) == 0)
+					return l;
+			}
+		}
+		return NULL;
+	}
+
 	ylist_for_each(i, &directory->variant.directoryVariant.children) {
 		if (i) {
 			l = ylist_entry(i, yaffs_Object, siblings);
 
+			nSearched++;
+
 			if (l->parent != directory)
 				YBUG();
 
@@ -7445,21 +7962,28 @@ yaffs_Object *yaffs_FindObjectByName(yaffs_Object *directory,
 
 			/* Special case for lost-n-found */
 			if (l->objectId == YAFFS_OBJECTID_LOSTNFOUND) {
-				if (yaffs_strcmp(name, YAFFS_LOSTNFOUND_NAME) == 0)
-					return l;
+				if (yaffs_strcmp(name, YAFFS_LOSTNFOUND_NAME) == 0) {
+					found = l;
+					break;
+				}
 			} else if (yaffs_SumCompare(l->sum, sum) || l->hdrChunk <= 0) {
 				/* LostnFound chunk called Objxxx
 				 * Do a real check
 				 */
 				yaffs_GetObjectName(l, buffer,
 						    YAFFS_MAX_NAME_LENGTH + 1);
-				if (yaffs_strncmp(name, buffer, YAFFS_MAX_NAME_LENGTH) == 0)
-					return l;
+				if (yaffs_strncmp(name, buffer, YAFFS_MAX_NAME_LENGTH) == 0) {
+					found = l;
+					break;
+				}
 			}
 		}
 	}
 
-	return NULL;
+	if (!index && nSearched > YAFFS_DIR_INDEX_THRESHOLD)
+		yaffs_BuildDirectoryIndex(directory, nSearched);
+
+	return found;
 }
 
 
@@ -7935,6 +8459,11 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 	dev->passiveGCs = 0;
 	dev->oldestDirtyGCs = 0;
 	dev->backgroundGCs = 0;
+	dev->foregroundGCs = 0;
+	dev->fgGCTimeUs = 0;
+	dev->fgGCMaxUs = 0;
+	dev->bgGCTimeUs = 0;
+	dev->nBackgroundCheckpoints = 0;
 	dev->gcBlockFinder = 0;
 	dev->bufferedBlock = -1;
 	dev->doingBufferedBlockRewrite = 0;
@@ -58,8 +58,20 @@
 #define YAFFS_ALLOCATION_NTNODES	100
 #define YAFFS_ALLOCATION_NLINKS		100
 
+/* The object hash starts with YAFFS_NOBJECT_BUCKETS buckets and doubles,
+ * up to YAFFS_MAX_OBJECT_BUCKETS, whenever the average chain gets longer
+ * than YAFFS_OBJECT_BUCKET_LOAD. Bucket counts must be powers of 2.
+ */
 #define YAFFS_NOBJECT_BUCKETS		256
+#define YAFFS_MAX_OBJECT_BUCKETS	16384
+#define YAFFS_OBJECT_BUCKET_LOAD	4
 
+/* Directories with more children than this get a name index on lookup.
+ * The index is dropped when it holds more than YAFFS_OBJECT_BUCKET_LOAD
+ * entries per bucket and is rebuilt, bigger, on the next lookup.
+ */
+#define YAFFS_DIR_INDEX_THRESHOLD	64
+#define YAFFS_DIR_INDEX_MAX_BUCKETS	4096
 
 #define YAFFS_OBJECT_SPACE		0x40000
 
@@ -91,6 +103,12 @@
 
 #define YAFFS_N_TEMP_BUFFERS		6
 
+/* Chunks resolved per tnode walk by yaffs_ReadPagesFromFile() */
+#define YAFFS_READ_BATCH_CHUNKS		32
+
+/* Blocks whose tags are fetched together by yaffs_ScanBackwards() */
+#define YAFFS_SCAN_BATCH_BLOCKS		16
+
 /* We limit the number attempts at sucessfully saving a chunk of data.
  * Small-page devices have 32 pages per block; large-page devices have 64.
  * Default to something in the order of 5 to 10 blocks worth of chunks.
@@ -384,9 +402,17 @@ typedef struct {
 	yaffs_Tnode *top;
 } yaffs_FileStructure;
 
+/* Children of a large directory hashed by name sum */
+typedef struct {
+	int nBuckets;
+	int nEntries;
+	struct ylist_head bucket[1];	/* nBuckets of these */
+} yaffs_DirectoryIndex;
+
 typedef struct {
 	struct ylist_head children;     /* list of child links */
 	struct ylist_head dirty;	/* Entry for list of dirty directories */
+	yaffs_DirectoryIndex *index;	/* NULL until built by a lookup */
 } yaffs_DirectoryStructure;
 
 typedef struct {
@@ -441,6 +467,7 @@ struct yaffs_ObjectStruct {
 	/* also used for linking up the free list */
 	struct yaffs_ObjectStruct *parent;
 	struct ylist_head siblings;
+	struct ylist_head nameLink;	/* entry in the parent's name index */
 
 	/* Where's my object header in NAND? */
 	int hdrChunk;
@@ -587,6 +614,16 @@ struct yaffs_DeviceParamStruct {
 	int (*markNANDBlockBad) (struct yaffs_DeviceStruct *dev, int blockNo);
 	int (*queryNANDBlock) (struct yaffs_DeviceStruct *dev, int blockNo,
 			       yaffs_BlockState *state, __u32 *sequenceNumber);
+
+	/* Optional: read the tags of every chunk in a set of blocks, eg.
+	 * spread across cpus. tags holds nChunksPerBlock entries per block,
+	 * in the order the blocks are given. Blocks are yaffs block numbers,
+	 * so subtract chunkOffset before going to the NAND. Page read
+	 * accounting and ECC error handling are done by the caller.
+	 */
+	int (*readBlocksTagsFromNAND) (struct yaffs_DeviceStruct *dev,
+				       const int *blocks, int nBlocks,
+				       yaffs_ExtendedTags *tags);
 #endif
 
 	/* The removeObjectCallback function must be supplied by OS flavours that
@@ -602,6 +639,15 @@ struct yaffs_DeviceParamStruct {
 	/*  Callback to control garbage collection. */
 	unsigned (*gcControl)(struct yaffs_DeviceStruct *dev);
 
+	/* Callbacks to serialise the small amount of device state that
+	 * read-only operations touch (temp buffers, short op cache LRU,
+	 * chunk error marking and lazy loading). OS flavours that run
+	 * read-only operations concurrently must supply these. When they
+	 * are supplied, reads never fill the short op cache.
+	 */
+	void (*lockReadState)(struct yaffs_DeviceStruct *dev);
+	void (*unlockReadState)(struct yaffs_DeviceStruct *dev);
+
         /* Debug control flags. Don't use unless you know what you're doing */
 	int useHeaderFileSize;	/* Flag to determine if we should use file sizes from the header */
 	int disableLazyLoad;	/* Disable lazy loading on this device */
@@ -697,7 +743,10 @@ struct yaffs_DeviceStruct {
 
 	yaffs_ObjectList *allocatedObjectList;
 
-	yaffs_ObjectBucket objectBucket[YAFFS_NOBJECT_BUCKETS];
+	yaffs_ObjectBucket *objectBucket;
+	yaffs_ObjectBucket initialObjectBucket[YAFFS_NOBJECT_BUCKETS];
+	__u32 nObjectBuckets;
+	__u32 nHashedObjects;
 	__u32 bucketFinder;
 
 	int nFreeChunks;
@@ -767,6 +816,11 @@ struct yaffs_DeviceStruct {
 	__u32 passiveGCs;
 	__u32 oldestDirtyGCs;
 	__u32 backgroundGCs;
+	__u32 foregroundGCs;
+	__u64 fgGCTimeUs;	/* Time writers spent in gc */
+	__u32 fgGCMaxUs;	/* Longest single foreground gc */
+	__u64 bgGCTimeUs;	/* Time spent in background gc */
+	__u32 nBackgroundCheckpoints;
 	__u32 nRetriedWrites;
 	__u32 nRetiredBlocks;
 	__u32 eccFixed;
@@ -777,6 +831,8 @@ struct yaffs_DeviceStruct {
 	__u32 nUnmarkedDeletions;
 	__u32 refreshCount;
 	__u32 cacheHits;
+	__u32 nDirIndexes;
+	__u32 dirIndexBytes;
 
 };
 
@@ -846,6 +902,8 @@ int yaffs_GetAttributes(yaffs_Object *obj, struct iattr *attr);
 /* File operations */
 int yaffs_ReadDataFromFile(yaffs_Object *obj, __u8 *buffer, loff_t offset,
 				int nBytes);
+int yaffs_ReadPagesFromFile(yaffs_Object *obj, __u8 **buffers, int nBuffers,
+				int bufferSize, loff_t offset);
 int yaffs_WriteDataToFile(yaffs_Object *obj, const __u8 *buffer, loff_t offset,
 				int nBytes, int writeThrough);
 int yaffs_ResizeFile(yaffs_Object *obj, loff_t newSize);
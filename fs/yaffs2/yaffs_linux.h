@@ -25,15 +25,18 @@ struct yaffs_LinuxContext {
 	struct super_block * superBlock;
 	struct task_struct *bgThread; /* Background thread for this device */
 	int bgRunning;
-        struct semaphore grossLock;     /* Gross locking semaphore */
+	unsigned writeRate;	/* Recent user chunk writes per second */
+	unsigned long rateStamp;
+	__u32 rateWrites;
+	struct rw_semaphore grossLock;	/* Gross lock: shared for reads */
+	struct mutex readStateLock;	/* Device state touched by reads */
 	__u8 *spareBuffer;      /* For mtdif2 use. Don't know the size of the buffer
 				 * at compile time so we have to allocate it.
 				 */
 	struct mtd_info *mtd;
 	struct ylist_head searchContexts;
+	spinlock_t searchContextsLock;
 	void (*putSuperFunc)(struct super_block *sb);
-
-	struct task_struct *readdirProcess;
 };
 
 #define yaffs_DeviceToContext(dev) ((struct yaffs_LinuxContext *)((dev)->context))
@@ -51,6 +51,46 @@ int yaffs_ReadChunkWithTagsFromNAND(yaffs_Device *dev, int chunkInNAND,
 	return result;
 }
 
+/*
+ * Read the tags of all the chunks in a set of blocks. Used by the scanner,
+ * which only wants tags, so the reads can be handed to the OS flavour to
+ * overlap. Anything that touches device state is done here afterwards.
+ */
+int yaffs_ReadBlocksTagsFromNAND(yaffs_Device *dev,
+					const int *blocks, int nBlocks,
+					yaffs_ExtendedTags *tags)
+{
+	int nChunks = dev->param.nChunksPerBlock;
+	int result = YAFFS_OK;
+	yaffs_BlockInfo *bi;
+	int i;
+	int c;
+
+	if (!dev->param.readBlocksTagsFromNAND) {
+		for (i = 0; i < nBlocks; i++)
+			for (c = 0; c < nChunks; c++)
+				if (yaffs_ReadChunkWithTagsFromNAND(dev,
+						blocks[i] * nChunks + c, NULL,
+						&tags[i * nChunks + c]) != YAFFS_OK)
+					result = YAFFS_FAIL;
+		return result;
+	}
+
+	result = dev->param.readBlocksTagsFromNAND(dev, blocks, nBlocks, tags);
+
+	for (i = 0; i < nBlocks; i++) {
+		bi = yaffs_GetBlockInfo(dev, blocks[i]);
+		for (c = 0; c < nChunks; c++) {
+			dev->nPageReads++;
+			if (tags[i * nChunks + c].eccResult >
+				YAFFS_ECC_RESULT_NO_ERROR)
+				yaffs_HandleChunkError(dev, bi);
+		}
+	}
+
+	return result;
+}
+
 int yaffs_WriteChunkWithTagsToNAND(yaffs_Device *dev,
 						   int chunkInNAND,
 						   const __u8 *buffer,
@@ -23,6 +23,10 @@ int yaffs_ReadChunkWithTagsFromNAND(yaffs_Device *dev, int chunkInNAND,
 					__u8 *buffer,
 					yaffs_ExtendedTags *tags);
 
+int yaffs_ReadBlocksTagsFromNAND(yaffs_Device *dev,
+					const int *blocks, int nBlocks,
+					yaffs_ExtendedTags *tags);
+
 int yaffs_WriteChunkWithTagsToNAND(yaffs_Device *dev,
 						int chunkInNAND,
 						const __u8 *buffer,
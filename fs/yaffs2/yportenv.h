@@ -85,6 +85,13 @@
 #define Y_TIME_CONVERT(x) (x)
 #endif
 
+/* Microsecond clock, only used for differences */
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 22))
+#define Y_TIME_US() ((__u32)ktime_to_us(ktime_get()))
+#else
+#define Y_TIME_US() ((__u32)jiffies_to_usecs(jiffies))
+#endif
+
 #define yaffs_SumCompare(x, y) ((x) == (y))
 #define yaffs_strcmp(a, b) strcmp(a, b)
 
@@ -153,6 +160,10 @@
 
 #endif
 
+#ifndef Y_TIME_US
+#define Y_TIME_US() 0
+#endif
+
 #ifndef Y_DUMP_STACK
 #define Y_DUMP_STACK() do { } while (0)
 #endif
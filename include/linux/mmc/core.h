@@ -10,6 +10,7 @@
 
 #include <linux/interrupt.h>
 #include <linux/device.h>
+#include <linux/completion.h>
 
 struct request;
 struct mmc_data;
@@ -117,6 +118,7 @@ struct mmc_data {
 
 	unsigned int		sg_len;		/* size of scatter list */
 	struct scatterlist	*sg;		/* I/O scatter list */
+	s32			host_cookie;	/* host private data */
 };
 
 struct mmc_request {
@@ -130,7 +132,23 @@ struct mmc_request {
 
 struct mmc_host;
 struct mmc_card;
+struct mmc_async_req;
 
+/*
+ * A request started with mmc_start_req(). The completion is signalled
+ * by the core when the host is done with it; err_check is then run by
+ * the submitter to decide whether the transfer succeeded.
+ */
+struct mmc_async_req {
+	/* active mmc request */
+	struct mmc_request	*mrq;
+	struct completion	complete;
+	/* returns 0 on success, a caller specific status otherwise */
+	int (*err_check)(struct mmc_card *, struct mmc_async_req *);
+};
+
+extern struct mmc_async_req *mmc_start_req(struct mmc_host *,
+					   struct mmc_async_req *, int *);
 extern void mmc_wait_for_req(struct mmc_host *, struct mmc_request *);
 extern int mmc_wait_for_cmd(struct mmc_host *, struct mmc_command *, int);
 extern int mmc_wait_for_app_cmd(struct mmc_host *, struct mmc_card *,